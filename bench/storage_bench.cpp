@@ -0,0 +1,426 @@
+#include "auction_service.hpp"
+#include "storage.hpp"
+#include "temp_database.hpp"
+#include "user_service.hpp"
+
+#include <benchmark/benchmark.h>
+#include <fmt/format.h>
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::shared_ptr<Storage> open_storage(benchmark::State & state, bool cache_statements) {
+  auto storage = Storage::open(":memory:", cache_statements);
+  if (!storage) {
+    state.SkipWithError(storage.error().c_str());
+    return nullptr;
+  }
+  return std::make_shared<Storage>(std::move(*storage));
+}
+
+void report_statement_cache(benchmark::State & state, Storage const & storage) {
+  auto const stats = storage.statement_cache_stats();
+  state.counters["cache_hits"] = static_cast<double>(stats.hits);
+  state.counters["cache_misses"] = static_cast<double>(stats.misses);
+}
+
+// `Storage::add_user_item` is called at least once by deposit, buy and expired orders processing
+void BM_add_user_item(benchmark::State & state) {
+  auto storage = open_storage(state, state.range(0) != 0);
+  if (!storage) {
+    return;
+  }
+  auto user = UserService(storage).login("user");
+  if (!user) {
+    state.SkipWithError(user.error().c_str());
+    return;
+  }
+
+  for (auto _ : state) {
+    auto result = storage->add_user_item(user->id, storage->funds_item_id(), 1);
+    benchmark::DoNotOptimize(result);
+  }
+  report_statement_cache(state, *storage);
+}
+BENCHMARK(BM_add_user_item)->ArgName("cache_statements")->Arg(0)->Arg(1);
+
+// `Storage::get_sell_order_info` is the first thing both buy and bid do
+void BM_get_sell_order_info(benchmark::State & state) {
+  auto storage = open_storage(state, state.range(0) != 0);
+  if (!storage) {
+    return;
+  }
+  auto auction_service = AuctionService(storage);
+  auto seller = UserService(storage).login("seller");
+  if (!seller || !auction_service.deposit(seller->id, "funds", 100) ||
+      !auction_service.deposit(seller->id, "Sword", 1) ||
+      !auction_service.place_sell_order(SellOrderType::Immediate, seller->id, "Sword", 1, 10, 0)) {
+    state.SkipWithError("Failed to place a sell order");
+    return;
+  }
+
+  for (auto _ : state) {
+    auto result = storage->get_sell_order_info(1);
+    benchmark::DoNotOptimize(result);
+  }
+  report_statement_cache(state, *storage);
+}
+BENCHMARK(BM_get_sell_order_info)->ArgName("cache_statements")->Arg(0)->Arg(1);
+
+// SQLite work per trade: a seller places an immediate sell order (debiting the item and the fee) and a buyer executes
+// it (debiting the price). `vm_steps` and `statements` per trade are counted by the SQL profiler, so unlike time they
+// don't depend on the machine
+void BM_trade_vm_steps(benchmark::State & state) {
+  auto storage = open_storage(state, true);
+  if (!storage) {
+    return;
+  }
+  if (auto enabled = storage->enable_sql_profiling({}); !enabled) {
+    state.SkipWithError(enabled.error().c_str());
+    return;
+  }
+  auto auction_service = AuctionService(storage);
+  auto seller = UserService(storage).login("seller");
+  auto buyer = UserService(storage).login("buyer");
+  if (!seller || !buyer || !auction_service.deposit(seller->id, "funds", 1'000'000'000) ||
+      !auction_service.deposit(seller->id, "Sword", 1'000'000'000) ||
+      !auction_service.deposit(buyer->id, "funds", 1'000'000'000)) {
+    state.SkipWithError("Failed to create users");
+    return;
+  }
+
+  auto const totals = [&]() {
+    std::pair<uint64_t, uint64_t> steps_and_statements{ 0, 0 };
+    for (auto const & profile : storage->sql_profiles()) {
+      steps_and_statements.first += profile.vm_steps;
+      steps_and_statements.second += profile.calls;
+    }
+    return steps_and_statements;
+  };
+  auto const [steps_before, statements_before] = totals();
+  // No other orders are placed, so ids go one by one
+  int order_id = 0;
+  for (auto _ : state) {
+    auto placed = auction_service.place_sell_order(SellOrderType::Immediate, seller->id, "Sword", 1, 10, 0);
+    auto executed = auction_service.execute_immediate_sell_order(buyer->id, ++order_id);
+    if (!placed || !executed) {
+      state.SkipWithError("Failed to trade");
+      break;
+    }
+  }
+  auto const [steps_after, statements_after] = totals();
+  state.counters["vm_steps"] =
+      benchmark::Counter(static_cast<double>(steps_after - steps_before), benchmark::Counter::kAvgIterations);
+  state.counters["statements"] =
+      benchmark::Counter(static_cast<double>(statements_after - statements_before), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_trade_vm_steps);
+
+// Hot path benchmarks below run against a prepopulated database of the given size, in memory and on disk.
+// Besides the time per operation Google Benchmark reports, they report `ops` per second and `latency` per operation
+// as counters, so results of different releases can be compared with `compare.py` from Google Benchmark
+
+// Expiration time of the prepopulated orders, so they never expire during a benchmark
+constexpr int64_t kFarFuture = 4'000'000'000;
+constexpr int kInitialFunds = 1'000'000'000;
+constexpr int kInitialItems = 1'000'000;
+
+struct Dataset {
+  int users;
+  int items;
+  // Active sell orders, every other one is an auction
+  int orders;
+  bool on_disk;
+
+  static Dataset from(benchmark::State const & state) {
+    return Dataset{
+      .users = static_cast<int>(state.range(0)),
+      .items = static_cast<int>(state.range(1)),
+      .orders = static_cast<int>(state.range(2)),
+      .on_disk = state.range(3) != 0,
+    };
+  }
+};
+
+// Small, medium and large datasets, each in memory and on disk. Rates are measured in wall time, as for the on-disk
+// database it's what matters
+void datasets(benchmark::internal::Benchmark * b) {
+  b->ArgNames({ "users", "items", "orders", "on_disk" });
+  b->UseRealTime();
+  for (int64_t on_disk : { 0, 1 }) {
+    b->Args({ 100, 10, 100, on_disk });
+    b->Args({ 10'000, 1'000, 10'000, on_disk });
+    b->Args({ 100'000, 10'000, 100'000, on_disk });
+  }
+}
+
+// Storage with `Dataset::users` users, each of them has plenty of funds and of one item, see `item_index`
+class Fixture final {
+  std::optional<TempDatabase> database;
+
+public:
+  std::shared_ptr<Storage> storage;
+  std::optional<AuctionService> auction_service;
+  std::vector<UserId> user_ids;
+  std::vector<int> item_ids;
+  std::vector<std::string> item_names;
+  std::vector<int> auction_order_ids;
+  std::mt19937 random{ 42 };
+
+  Fixture(benchmark::State & state, Dataset const & dataset) {
+    std::string db_path = ":memory:";
+    if (dataset.on_disk) {
+      database.emplace("auction_house_bench.sqlite");
+      db_path = database->path;
+    }
+    auto opened = Storage::open(db_path);
+    if (!opened) {
+      state.SkipWithError(opened.error().c_str());
+      return;
+    }
+    storage = std::make_shared<Storage>(std::move(*opened));
+    auction_service.emplace(storage);
+
+    // Everything goes in one transaction, otherwise large on-disk datasets take ages to create
+    auto populated = populate(dataset);
+    if (!populated) {
+      state.SkipWithError(populated.error().c_str());
+      storage = nullptr;
+    }
+  }
+
+  ~Fixture() {
+    storage = nullptr;
+    auction_service.reset();
+    database.reset();
+  }
+
+  Fixture(Fixture const &) = delete;
+  Fixture & operator=(Fixture const &) = delete;
+
+  UserId random_user() { return user_ids[random() % user_ids.size()]; }
+  // Any user but the given ones
+  UserId other_user(UserId user_id, std::optional<UserId> another = std::nullopt) {
+    UserId other = random_user();
+    while (other == user_id || other == another) {
+      other = random_user();
+    }
+    return other;
+  }
+  // The item the user has plenty of
+  std::size_t item_index(UserId user_id) const {
+    return static_cast<std::size_t>(user_id - user_ids.front()) % item_ids.size();
+  }
+
+private:
+  tl::expected<void, std::string> populate(Dataset const & dataset) {
+    auto transaction = storage->begin_transaction();
+    if (!transaction) {
+      return tl::make_unexpected(transaction.error());
+    }
+    for (int i = 0; i < dataset.items; ++i) {
+      item_names.push_back(fmt::format("item{}", i));
+      auto item_id = storage->create_item(item_names.back());
+      if (!item_id) {
+        return tl::make_unexpected(item_id.error());
+      }
+      item_ids.push_back(*item_id);
+    }
+    for (int i = 0; i < dataset.users; ++i) {
+      auto user_id = storage->create_user(fmt::format("user{}", i));
+      if (!user_id) {
+        return tl::make_unexpected(user_id.error());
+      }
+      user_ids.push_back(*user_id);
+      auto result = storage->add_user_item(*user_id, storage->funds_item_id(), kInitialFunds).and_then([&]() {
+        return storage->add_user_item(*user_id, item_ids[item_index(*user_id)], kInitialItems);
+      });
+      if (!result) {
+        return result;
+      }
+    }
+    for (int i = 0; i < dataset.orders; ++i) {
+      UserId const seller_id = user_ids[static_cast<std::size_t>(i) % user_ids.size()];
+      bool const auction = i % 2 == 1;
+      auto order_id = storage->create_sell_order(Storage::SellOrder{
+          .seller_id = seller_id,
+          .item_id = item_ids[item_index(seller_id)],
+          .quantity = 1,
+          .price = 10,
+          .unix_expiration_time = kFarFuture,
+          .buyer_id = auction ? std::nullopt : std::optional(seller_id),
+      });
+      if (!order_id) {
+        return tl::make_unexpected(order_id.error());
+      }
+      if (auction) {
+        auction_order_ids.push_back(*order_id);
+      }
+    }
+    return transaction->commit();
+  }
+};
+
+void report_rate(benchmark::State & state, int64_t ops_per_iteration = 1) {
+  auto const ops = static_cast<double>(state.iterations() * ops_per_iteration);
+  state.counters["ops"] = benchmark::Counter(ops, benchmark::Counter::kIsRate);
+  state.counters["latency"] = benchmark::Counter(ops, benchmark::Counter::kIsRate | benchmark::Counter::kInvert);
+}
+
+void BM_deposit(benchmark::State & state) {
+  Fixture fixture(state, Dataset::from(state));
+  if (!fixture.storage) {
+    return;
+  }
+  for (auto _ : state) {
+    UserId const user_id = fixture.random_user();
+    auto result = fixture.auction_service->deposit(user_id, "funds", 1);
+    benchmark::DoNotOptimize(result);
+  }
+  report_rate(state);
+}
+BENCHMARK(BM_deposit)->Apply(datasets);
+
+// Deposits committed `batch` at a time, each in its own nested transaction, the way `GroupCommit` runs them.
+// `ops` are deposits per second, so it shows how much of the deposit cost is the commit
+void BM_deposit_batch(benchmark::State & state) {
+  Fixture fixture(state, Dataset::from(state));
+  if (!fixture.storage) {
+    return;
+  }
+  int64_t const batch = state.range(4);
+  for (auto _ : state) {
+    auto transaction = fixture.storage->begin_transaction();
+    for (int64_t i = 0; i < batch; ++i) {
+      auto result = fixture.auction_service->deposit(fixture.random_user(), "funds", 1);
+      benchmark::DoNotOptimize(result);
+    }
+    auto committed = transaction->commit();
+    benchmark::DoNotOptimize(committed);
+  }
+  report_rate(state, batch);
+}
+BENCHMARK(BM_deposit_batch)
+    ->ArgNames({ "users", "items", "orders", "on_disk", "batch" })
+    ->UseRealTime()
+    ->ArgsProduct({ { 10'000 }, { 1'000 }, { 10'000 }, { 1 }, { 1, 8, 64 } });
+
+void BM_place_sell_order(benchmark::State & state) {
+  Fixture fixture(state, Dataset::from(state));
+  if (!fixture.storage) {
+    return;
+  }
+  for (auto _ : state) {
+    UserId const seller_id = fixture.random_user();
+    auto const & item_name = fixture.item_names[fixture.item_index(seller_id)];
+    auto result =
+        fixture.auction_service->place_sell_order(SellOrderType::Immediate, seller_id, item_name, 1, 10, kFarFuture);
+    if (!result) {
+      state.SkipWithError(result.error().c_str());
+      break;
+    }
+  }
+  report_rate(state);
+}
+BENCHMARK(BM_place_sell_order)->Apply(datasets);
+
+void BM_execute_immediate_sell_order(benchmark::State & state) {
+  Fixture fixture(state, Dataset::from(state));
+  if (!fixture.storage) {
+    return;
+  }
+  // Orders to buy are placed in batches outside of the measured time
+  std::vector<int> order_ids;
+  for (auto _ : state) {
+    if (order_ids.empty()) {
+      state.PauseTiming();
+      for (int i = 0; i < 1000; ++i) {
+        UserId const seller_id = fixture.random_user();
+        auto order_id = fixture.storage->create_sell_order(Storage::SellOrder{
+            .seller_id = seller_id,
+            .item_id = fixture.item_ids[fixture.item_index(seller_id)],
+            .quantity = 1,
+            .price = 10,
+            .unix_expiration_time = kFarFuture,
+            .buyer_id = seller_id,
+        });
+        if (order_id) {
+          order_ids.push_back(*order_id);
+        }
+      }
+      state.ResumeTiming();
+    }
+    int const order_id = order_ids.back();
+    order_ids.pop_back();
+    UserId const buyer_id = fixture.other_user(fixture.storage->get_sell_order_info(order_id)->seller_id);
+    auto result = fixture.auction_service->execute_immediate_sell_order(buyer_id, order_id);
+    if (!result) {
+      state.SkipWithError(result.error().c_str());
+      break;
+    }
+  }
+  report_rate(state);
+}
+BENCHMARK(BM_execute_immediate_sell_order)->Apply(datasets);
+
+// Every bid outbids the previous one, so the previous bidder gets the funds back
+void BM_place_bid_on_auction_sell_order(benchmark::State & state) {
+  Fixture fixture(state, Dataset::from(state));
+  if (!fixture.storage) {
+    return;
+  }
+  for (auto _ : state) {
+    int const order_id = fixture.auction_order_ids[fixture.random() % fixture.auction_order_ids.size()];
+    auto const order = fixture.storage->get_sell_order_info(order_id);
+    UserId const bidder_id = fixture.other_user(order->seller_id, order->buyer_id);
+    auto result = fixture.auction_service->place_bid_on_auction_sell_order(bidder_id, order_id, order->price + 1);
+    if (!result) {
+      state.SkipWithError(result.error().c_str());
+      break;
+    }
+  }
+  report_rate(state);
+}
+BENCHMARK(BM_place_bid_on_auction_sell_order)->Apply(datasets);
+
+// Each iteration settles a batch of orders that expire at once, half of them auctions with a bid
+void BM_process_expired_sell_orders(benchmark::State & state) {
+  constexpr int kBatch = 100;
+  Fixture fixture(state, Dataset::from(state));
+  if (!fixture.storage) {
+    return;
+  }
+  int64_t expiration_time = 1;
+  for (auto _ : state) {
+    state.PauseTiming();
+    for (int i = 0; i < kBatch; ++i) {
+      UserId const seller_id = fixture.random_user();
+      bool const with_bid = i % 2 == 1;
+      fixture.storage->create_sell_order(Storage::SellOrder{
+          .seller_id = seller_id,
+          .item_id = fixture.item_ids[fixture.item_index(seller_id)],
+          .quantity = 1,
+          .price = 10,
+          .unix_expiration_time = expiration_time,
+          .buyer_id = with_bid ? fixture.other_user(seller_id) : seller_id,
+      });
+    }
+    state.ResumeTiming();
+    auto result = fixture.storage->process_expired_sell_orders(expiration_time++);
+    if (!result) {
+      state.SkipWithError(result.error().c_str());
+      break;
+    }
+  }
+  report_rate(state, kBatch);
+}
+BENCHMARK(BM_process_expired_sell_orders)->Apply(datasets);
+
+}  // namespace
@@ -46,6 +46,8 @@ void spawn_cli_handler(tcp::socket & socket) {
     while (true) {
       std::string cmd;
       std::getline(std::cin, cmd);
+      // The server expects each command on its own line
+      cmd += '\n';
       asio::write(socket, asio::buffer(cmd));
     }
   }).detach();
@@ -58,6 +60,9 @@ awaitable<void> socket_task(asio::io_context & context, tcp::socket & socket) {
       char data[2048];
       size_t n = co_await socket.async_read_some(asio::buffer(data), use_awaitable);
       std::string_view response(data, n);
+      if (response.ends_with('\n')) {
+        response.remove_suffix(1);
+      }
       std::cout << "> " << response << std::endl;
     }
   } catch (std::exception & e) {
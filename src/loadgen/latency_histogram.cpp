@@ -0,0 +1,42 @@
+#include "latency_histogram.hpp"
+#include "log_linear_buckets.hpp"
+
+#include <algorithm>
+
+namespace {
+using Buckets = LogLinearBuckets<7>;
+constexpr std::size_t kBuckets = Buckets::kCount;
+}  // namespace
+
+LatencyHistogram::LatencyHistogram() : counts(kBuckets, 0) {}
+
+void LatencyHistogram::record(std::chrono::nanoseconds latency) {
+  uint64_t const value = static_cast<uint64_t>(std::max(latency.count(), int64_t(0)));
+  counts[Buckets::bucket_of(value)]++;
+  total++;
+  sum_ns += value;
+  min_ns = std::min(min_ns, value);
+  max_ns = std::max(max_ns, value);
+}
+
+void LatencyHistogram::merge(LatencyHistogram const & other) {
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    counts[i] += other.counts[i];
+  }
+  total += other.total;
+  sum_ns += other.sum_ns;
+  min_ns = std::min(min_ns, other.min_ns);
+  max_ns = std::max(max_ns, other.max_ns);
+}
+
+std::chrono::nanoseconds LatencyHistogram::min() const {
+  return std::chrono::nanoseconds(total > 0 ? min_ns : 0);
+}
+
+std::chrono::nanoseconds LatencyHistogram::mean() const {
+  return std::chrono::nanoseconds(total > 0 ? sum_ns / total : 0);
+}
+
+std::chrono::nanoseconds LatencyHistogram::percentile(double quantile) const {
+  return std::chrono::nanoseconds(Buckets::percentile(counts, total, quantile, max_ns));
+}
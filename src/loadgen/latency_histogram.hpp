@@ -0,0 +1,31 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+// Histogram of latencies with a bounded relative error, similar to HdrHistogram. Values below 256ns are counted
+// exactly, larger ones fall into buckets that are 1/128 of their power of two wide, so any percentile is reported
+// with less than 1% error, while the whole range of `uint64_t` nanoseconds takes ~60KiB
+class LatencyHistogram final {
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t sum_ns = 0;
+  uint64_t min_ns = UINT64_MAX;
+  uint64_t max_ns = 0;
+
+public:
+  LatencyHistogram();
+
+  void record(std::chrono::nanoseconds latency);
+  // Adds all values recorded by `other`, so histograms of different threads can be combined
+  void merge(LatencyHistogram const & other);
+
+  uint64_t count() const { return total; }
+  std::chrono::nanoseconds min() const;
+  std::chrono::nanoseconds max() const { return std::chrono::nanoseconds(max_ns); }
+  std::chrono::nanoseconds mean() const;
+  // The smallest value that is greater or equal to `quantile` (in [0, 1]) of all recorded values, rounded up to
+  // the bucket boundary. Zero if nothing was recorded
+  std::chrono::nanoseconds percentile(double quantile) const;
+};
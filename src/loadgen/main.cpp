@@ -0,0 +1,733 @@
+#include "latency_histogram.hpp"
+
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/connect.hpp>
+#include <asio/detached.hpp>
+#include <asio/error_code.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/read_until.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/write.hpp>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+using asio::awaitable;
+using asio::co_spawn;
+using asio::detached;
+using asio::use_awaitable;
+using asio::ip::tcp;
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+enum class Operation {
+  Deposit,
+  Sell,
+  Buy,
+  Bid,
+  View,
+};
+constexpr std::size_t kOperations = 5;
+constexpr std::array<std::string_view, kOperations> kOperationNames = { "deposit", "sell", "buy", "bid", "view" };
+
+enum class Mode {
+  // Each connection sends the next command as soon as it gets the response to the previous one
+  Closed,
+  // Commands arrive at a fixed rate regardless of how fast the server responds
+  Open,
+};
+
+// Every user gets these on login, so sells and buys don't fail because of an empty account
+constexpr int kInitialFunds = 1'000'000;
+constexpr int kInitialItems = 1'000;
+constexpr int kDepositQuantity = 10;
+constexpr int kMaxPrice = 100;
+// How often arrivals are generated in the open-loop mode
+constexpr auto kArrivalTick = std::chrono::milliseconds(1);
+// How long to wait for the responses to the commands sent before the end of the run
+constexpr auto kShutdownGracePeriod = std::chrono::seconds(5);
+
+constexpr std::string_view kUsage =
+    "Usage: loadgen <addr:port> [options]\n"
+    "Options:\n"
+    "  --connections=<n>  number of concurrent connections (users), 1000 by default\n"
+    "  --threads=<n>  number of threads that drive the connections, 1 by default\n"
+    "  --mode=<closed|open>  closed (default): each connection sends the next command once it gets a response,\n"
+    "                        open: commands are sent at `--rate` per second regardless of the response time\n"
+    "  --rate=<ops/s>  total arrival rate for the open mode\n"
+    "  --duration=<seconds>  how long to measure, 10 by default\n"
+    "  --warmup=<seconds>  how long to run before measuring, 1 by default\n"
+    "  --mix=<op:weight,...>  command mix, deposit:30,sell:30,buy:20,bid:15,view:5 by default. `view` is\n"
+    "                         `view_sell_orders`, the listed orders are the targets of `buy` and `bid`\n"
+    "  --items=<n>  number of different items to trade, 16 by default\n"
+    "  --user-prefix=<name>  users are called <name>-<n>, `loadgen` by default\n"
+    "  --report=<path>  write the report as JSON\n"
+    "  --seed=<n>  seed of the command mix, 42 by default\n"
+    "Example: loadgen localhost:3000 --connections=5000 --mode=open --rate=20000 --report=report.json";
+
+struct Args {
+  std::string host;
+  std::string port;
+  unsigned connections = 1000;
+  unsigned threads = 1;
+  Mode mode = Mode::Closed;
+  double rate = 0;
+  std::chrono::seconds duration{ 10 };
+  std::chrono::seconds warmup{ 1 };
+  std::array<double, kOperations> mix = { 30, 30, 20, 15, 5 };
+  unsigned items = 16;
+  std::string_view user_prefix = "loadgen";
+  std::optional<std::string_view> report_path;
+  uint32_t seed = 42;
+};
+
+template <typename T>
+std::optional<T> parse_number(std::string_view str) {
+  T value;
+  auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc() || ptr != str.data() + str.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+// Parses "deposit:30,sell:20,...", operations that are not listed get zero weight
+std::optional<std::array<double, kOperations>> parse_mix(std::string_view str) {
+  std::array<double, kOperations> mix{};
+  while (!str.empty()) {
+    std::size_t const comma = std::min(str.find(','), str.size());
+    std::string_view const entry = str.substr(0, comma);
+    str.remove_prefix(std::min(comma + 1, str.size()));
+
+    std::size_t const colon = entry.find(':');
+    if (colon == std::string_view::npos) {
+      return std::nullopt;
+    }
+    auto const it = std::find(kOperationNames.begin(), kOperationNames.end(), entry.substr(0, colon));
+    auto const weight = parse_number<unsigned>(entry.substr(colon + 1));
+    if (it == kOperationNames.end() || !weight) {
+      return std::nullopt;
+    }
+    mix[static_cast<std::size_t>(it - kOperationNames.begin())] = *weight;
+  }
+  if (std::all_of(mix.begin(), mix.end(), [](double weight) { return weight <= 0; })) {
+    return std::nullopt;
+  }
+  return mix;
+}
+
+std::optional<Args> parse_args(int argc, char * argv[]) {
+  if (argc < 2) {
+    return std::nullopt;
+  }
+  Args args;
+  std::string_view const address = argv[1];
+  std::size_t const colon = address.rfind(':');
+  if (colon == std::string_view::npos) {
+    return std::nullopt;
+  }
+  args.host = address.substr(0, colon);
+  args.port = address.substr(colon + 1);
+
+  for (int i = 2; i < argc; ++i) {
+    std::string_view const arg = argv[i];
+    if (arg.starts_with("--connections=")) {
+      auto const value = parse_number<unsigned>(arg.substr(14));
+      if (!value || *value == 0) {
+        return std::nullopt;
+      }
+      args.connections = *value;
+    } else if (arg.starts_with("--threads=")) {
+      auto const value = parse_number<unsigned>(arg.substr(10));
+      if (!value || *value == 0) {
+        return std::nullopt;
+      }
+      args.threads = *value;
+    } else if (arg == "--mode=closed") {
+      args.mode = Mode::Closed;
+    } else if (arg == "--mode=open") {
+      args.mode = Mode::Open;
+    } else if (arg.starts_with("--rate=")) {
+      auto const value = parse_number<double>(arg.substr(7));
+      if (!value || *value <= 0) {
+        return std::nullopt;
+      }
+      args.rate = *value;
+    } else if (arg.starts_with("--duration=")) {
+      auto const value = parse_number<unsigned>(arg.substr(11));
+      if (!value || *value == 0) {
+        return std::nullopt;
+      }
+      args.duration = std::chrono::seconds(*value);
+    } else if (arg.starts_with("--warmup=")) {
+      auto const value = parse_number<unsigned>(arg.substr(9));
+      if (!value) {
+        return std::nullopt;
+      }
+      args.warmup = std::chrono::seconds(*value);
+    } else if (arg.starts_with("--mix=")) {
+      auto const mix = parse_mix(arg.substr(6));
+      if (!mix) {
+        return std::nullopt;
+      }
+      args.mix = *mix;
+    } else if (arg.starts_with("--items=")) {
+      auto const value = parse_number<unsigned>(arg.substr(8));
+      if (!value || *value == 0) {
+        return std::nullopt;
+      }
+      args.items = *value;
+    } else if (arg.starts_with("--user-prefix=") && arg.size() > 14) {
+      args.user_prefix = arg.substr(14);
+    } else if (arg.starts_with("--report=") && arg.size() > 9) {
+      args.report_path = arg.substr(9);
+    } else if (arg.starts_with("--seed=")) {
+      auto const value = parse_number<uint32_t>(arg.substr(7));
+      if (!value) {
+        return std::nullopt;
+      }
+      args.seed = *value;
+    } else {
+      return std::nullopt;
+    }
+  }
+  if (args.mode == Mode::Open && args.rate <= 0) {
+    return std::nullopt;
+  }
+  args.threads = std::min(args.threads, args.connections);
+  return args;
+}
+
+// What one worker has measured. Workers are merged into the report once they are done
+struct Results {
+  std::array<LatencyHistogram, kOperations> latencies;
+  std::array<uint64_t, kOperations> failed{};
+  // From the start of the connection till the server confirms the login
+  LatencyHistogram login;
+  uint64_t connected = 0;
+  uint64_t connect_errors = 0;
+  // Connections that were closed by the server during the run
+  uint64_t disconnected = 0;
+  // Buys and bids that were replaced by a view, as no matching orders were known
+  uint64_t fallback_views = 0;
+  // Commands of the open-loop mode that were still waiting for a free connection at the end of the run
+  uint64_t unsent = 0;
+  std::size_t max_backlog = 0;
+
+  void merge(Results const & other) {
+    for (std::size_t i = 0; i < kOperations; ++i) {
+      latencies[i].merge(other.latencies[i]);
+      failed[i] += other.failed[i];
+    }
+    login.merge(other.login);
+    connected += other.connected;
+    connect_errors += other.connect_errors;
+    disconnected += other.disconnected;
+    fallback_views += other.fallback_views;
+    unsent += other.unsent;
+    max_backlog = std::max(max_backlog, other.max_backlog);
+  }
+};
+
+// Drives a share of the connections on its own thread and `io_context`, so nothing is shared between workers
+// until the results are merged
+class Worker final {
+  // A command to send. Latency is counted from the time it was scheduled, so in the open-loop mode the time
+  // spent waiting for a free connection is included, and a slow server can't hide behind a slow client
+  struct Job {
+    Operation operation;
+    Clock::time_point scheduled;
+  };
+
+  struct Client {
+    tcp::socket socket;
+    // Cancelled to wake up the client when there is a job for it
+    asio::steady_timer wakeup;
+    std::string input;
+    std::string username;
+    bool set_up = false;
+    bool next_sell_is_auction = false;
+  };
+
+  // Order ids from the latest `view_sell_orders`
+  struct AuctionOrder {
+    int id;
+    int price;
+  };
+
+  Args const & args;
+  tcp::resolver::results_type endpoints;
+  asio::io_context context{ 1 };
+  std::mt19937 random;
+  std::discrete_distribution<int> operations;
+  std::vector<std::string> item_names;
+
+  std::vector<std::unique_ptr<Client>> clients;
+  std::vector<Client *> idle;
+  std::deque<Job> backlog;
+  std::vector<int> immediate_orders;
+  std::vector<AuctionOrder> auction_orders;
+
+  std::size_t pending_setups = 0;
+  std::size_t active_clients = 0;
+  bool started = false;
+  bool stopping = false;
+  Clock::time_point load_start;
+  Clock::time_point measure_from;
+  Clock::time_point stop_at;
+  asio::steady_timer deadline{ context };
+
+  Results results;
+
+public:
+  Worker(Args const & args, unsigned index, tcp::resolver::results_type endpoints)
+      : args(args), endpoints(std::move(endpoints)), random(args.seed + index),
+        operations(args.mix.begin(), args.mix.end()) {
+    for (unsigned i = 0; i < args.items; ++i) {
+      item_names.push_back(fmt::format("{}-item-{}", args.user_prefix, i));
+    }
+    for (unsigned i = index; i < args.connections; i += args.threads) {
+      clients.push_back(std::make_unique<Client>(Client{
+          .socket = tcp::socket(context),
+          .wakeup = asio::steady_timer(context),
+          .input = {},
+          .username = fmt::format("{}-{}", args.user_prefix, i),
+      }));
+    }
+  }
+
+  Worker(Worker const &) = delete;
+  Worker & operator=(Worker const &) = delete;
+
+  void run() {
+    pending_setups = clients.size();
+    active_clients = clients.size();
+    for (auto & client : clients) {
+      co_spawn(context, run_client(*client), detached);
+    }
+    context.run();
+  }
+
+  Results const & get_results() const { return results; }
+
+private:
+  awaitable<void> run_client(Client & client) {
+    try {
+      auto const connect_start = Clock::now();
+      co_await asio::async_connect(client.socket, endpoints, use_awaitable);
+      co_await read_response(client);  // greeting
+      co_await write(client, client.username + '\n');
+      std::string const reply = co_await read_response(client);
+      if (!reply.starts_with("Successfully logged in")) {
+        throw std::runtime_error(reply);
+      }
+      results.login.record(Clock::now() - connect_start);
+      results.connected++;
+
+      // Pipelined, as only the responses matter
+      std::string setup = fmt::format("deposit funds {}\n", kInitialFunds);
+      for (auto const & item_name : item_names) {
+        setup += fmt::format("deposit {} {}\n", item_name, kInitialItems);
+      }
+      co_await write(client, setup);
+      for (std::size_t i = 0; i <= item_names.size(); ++i) {
+        co_await read_response(client);
+      }
+      finish_setup(client);
+
+      while (auto job = co_await next_job(client)) {
+        co_await execute(client, *job);
+      }
+    } catch (std::exception & e) {
+      if (!client.set_up) {
+        if (results.connect_errors++ == 0) {
+          fmt::println("Failed to connect as {}: {}", client.username, e.what());
+        }
+        finish_setup(client);
+      } else if (!stopping) {
+        results.disconnected++;
+      }
+    }
+
+    asio::error_code ignored;
+    client.socket.close(ignored);
+    if (--active_clients == 0 && stopping) {
+      deadline.cancel();  // no need to wait for the grace period
+    }
+  }
+
+  void finish_setup(Client & client) {
+    client.set_up = true;
+    if (--pending_setups == 0) {
+      start();
+    }
+  }
+
+  // Starts the load once all connections are either logged in or failed
+  void start() {
+    if (results.connected == 0) {
+      return;  // nothing to load
+    }
+    started = true;
+    load_start = Clock::now();
+    measure_from = load_start + args.warmup;
+    stop_at = measure_from + args.duration;
+    if (args.mode == Mode::Open) {
+      co_spawn(context, generate_arrivals(), detached);
+    }
+    co_spawn(context, stop_after_duration(), detached);
+    wake_all();
+  }
+
+  awaitable<void> stop_after_duration() {
+    deadline.expires_at(stop_at);
+    try {
+      co_await deadline.async_wait(use_awaitable);
+    } catch (std::exception &) {
+    }
+    stopping = true;
+    results.unsent = backlog.size();
+    backlog.clear();
+    wake_all();
+    if (active_clients == 0) {
+      co_return;
+    }
+
+    deadline.expires_after(kShutdownGracePeriod);
+    try {
+      co_await deadline.async_wait(use_awaitable);
+    } catch (std::exception &) {
+      co_return;  // all clients are done
+    }
+    // Clients that still wait for a response are closed, so the run ends
+    for (auto & client : clients) {
+      asio::error_code ignored;
+      client->socket.close(ignored);
+    }
+  }
+
+  // Schedules commands at the fixed rate. Arrivals are generated in batches every tick, but each of them gets
+  // its exact scheduled time
+  awaitable<void> generate_arrivals() {
+    asio::steady_timer timer(context);
+    double const rate = args.rate / args.threads;
+    uint64_t scheduled = 0;
+    while (!stopping) {
+      timer.expires_after(kArrivalTick);
+      co_await timer.async_wait(use_awaitable);
+
+      auto const elapsed = std::chrono::duration<double>(Clock::now() - load_start);
+      auto const due = static_cast<uint64_t>(elapsed.count() * rate);
+      for (; scheduled < due; ++scheduled) {
+        auto const time = load_start + std::chrono::duration_cast<Clock::duration>(
+                                           std::chrono::duration<double>(static_cast<double>(scheduled) / rate));
+        if (time >= stop_at) {
+          co_return;
+        }
+        backlog.push_back(Job{ .operation = next_operation(), .scheduled = time });
+        wake_one();
+      }
+      results.max_backlog = std::max(results.max_backlog, backlog.size());
+    }
+  }
+
+  Operation next_operation() { return static_cast<Operation>(operations(random)); }
+
+  void wake_one() {
+    if (!idle.empty()) {
+      idle.back()->wakeup.cancel();
+      idle.pop_back();
+    }
+  }
+
+  void wake_all() {
+    for (Client * client : idle) {
+      client->wakeup.cancel();
+    }
+    idle.clear();
+  }
+
+  // Waits for the next command to send, std::nullopt once the run is over
+  awaitable<std::optional<Job>> next_job(Client & client) {
+    for (;;) {
+      if (stopping) {
+        co_return std::nullopt;
+      }
+      if (started) {
+        if (!backlog.empty()) {
+          Job const job = backlog.front();
+          backlog.pop_front();
+          co_return job;
+        }
+        if (args.mode == Mode::Closed) {
+          co_return Job{ .operation = next_operation(), .scheduled = Clock::now() };
+        }
+      }
+
+      idle.push_back(&client);
+      client.wakeup.expires_at(Clock::time_point::max());
+      try {
+        co_await client.wakeup.async_wait(use_awaitable);
+      } catch (std::exception &) {
+        // Woken up by `wake_one()` or `wake_all()`
+      }
+    }
+  }
+
+  awaitable<void> execute(Client & client, Job job) {
+    Operation operation = job.operation;
+    if ((operation == Operation::Buy && immediate_orders.empty()) ||
+        (operation == Operation::Bid && auction_orders.empty())) {
+      operation = Operation::View;
+      results.fallback_views++;
+    }
+
+    std::string const & item_name = item_names[random() % item_names.size()];
+    int const price = static_cast<int>(random() % kMaxPrice) + 1;
+    std::string response;
+    switch (operation) {
+    case Operation::Deposit:
+      co_await write(client, fmt::format("deposit {} {}\n", item_name, kDepositQuantity));
+      response = co_await read_response(client);
+      break;
+    case Operation::Sell: {
+      std::string_view const type = client.next_sell_is_auction ? "auction" : "immediate";
+      client.next_sell_is_auction = !client.next_sell_is_auction;
+      co_await write(client, fmt::format("sell {} {} 1 {}\n", type, item_name, price));
+      response = co_await read_response(client);
+      break;
+    }
+    case Operation::Buy: {
+      // Each order can be bought only once, so it is forgotten right away
+      std::size_t const index = random() % immediate_orders.size();
+      int const order_id = immediate_orders[index];
+      immediate_orders[index] = immediate_orders.back();
+      immediate_orders.pop_back();
+      co_await write(client, fmt::format("buy {}\n", order_id));
+      response = co_await read_response(client);
+      break;
+    }
+    case Operation::Bid: {
+      AuctionOrder & order = auction_orders[random() % auction_orders.size()];
+      order.price += static_cast<int>(random() % 10) + 1;
+      co_await write(client, fmt::format("buy {} {}\n", order.id, order.price));
+      response = co_await read_response(client);
+      break;
+    }
+    case Operation::View:
+      // The list spans many lines, so `ping` marks its end
+      co_await write(client, "view_sell_orders\nping\n");
+      response = co_await read_sell_orders(client);
+      break;
+    }
+
+    if (job.scheduled >= measure_from) {
+      auto const index = static_cast<std::size_t>(operation);
+      results.latencies[index].record(Clock::now() - job.scheduled);
+      if (response.starts_with("Failed")) {
+        results.failed[index]++;
+      }
+    }
+  }
+
+  awaitable<void> write(Client & client, std::string data) {
+    co_await asio::async_write(client.socket, asio::buffer(data), use_awaitable);
+  }
+
+  awaitable<std::string> read_line(Client & client) {
+    std::size_t const n = co_await asio::async_read_until(client.socket, asio::dynamic_buffer(client.input), '\n',
+                                                          use_awaitable);
+    std::string line = client.input.substr(0, n - 1);
+    client.input.erase(0, n);
+    if (line.ends_with('\r')) {
+      line.pop_back();
+    }
+    co_return line;
+  }
+
+  // Reads a single-line response, skipping notifications about executed sell orders
+  awaitable<std::string> read_response(Client & client) {
+    for (;;) {
+      std::string line = co_await read_line(client);
+      if (!line.starts_with("Your sell order #")) {
+        co_return line;
+      }
+    }
+  }
+
+  // Reads the response to `view_sell_orders` up to the `pong` and remembers the listed orders
+  awaitable<std::string> read_sell_orders(Client & client) {
+    std::string first_line;
+    immediate_orders.clear();
+    auction_orders.clear();
+    for (;;) {
+      std::string line = co_await read_response(client);
+      if (line == "pong") {
+        co_return first_line;
+      }
+      if (first_line.empty()) {
+        first_line = std::move(line);
+      } else {
+        remember_order(line);
+      }
+    }
+  }
+
+  // Parses "- #<id>: <seller> is selling ... for <price> funds [on auction ]until <time>"
+  void remember_order(std::string_view line) {
+    std::size_t const hash = line.find('#');
+    std::size_t const colon = line.find(':');
+    std::size_t const funds = line.rfind(" funds ");
+    if (hash == std::string_view::npos || colon == std::string_view::npos || funds == std::string_view::npos) {
+      return;
+    }
+    std::size_t const price_start = line.rfind(' ', funds - 1) + 1;
+    auto const id = parse_number<int>(line.substr(hash + 1, colon - hash - 1));
+    auto const price = parse_number<int>(line.substr(price_start, funds - price_start));
+    if (!id || !price) {
+      return;
+    }
+    if (line.substr(funds + 7).starts_with("on auction")) {
+      auction_orders.push_back(AuctionOrder{ .id = *id, .price = *price });
+    } else {
+      immediate_orders.push_back(*id);
+    }
+  }
+};
+
+double to_us(std::chrono::nanoseconds value) {
+  return static_cast<double>(value.count()) / 1000.0;
+}
+
+void format_histogram(fmt::memory_buffer & buffer, LatencyHistogram const & histogram) {
+  fmt::format_to(std::back_inserter(buffer),
+                 "\"count\": {}, \"mean_us\": {:.1f}, \"min_us\": {:.1f}, \"p50_us\": {:.1f}, \"p90_us\": {:.1f}, "
+                 "\"p99_us\": {:.1f}, \"p999_us\": {:.1f}, \"max_us\": {:.1f}",
+                 histogram.count(), to_us(histogram.mean()), to_us(histogram.min()),
+                 to_us(histogram.percentile(0.5)), to_us(histogram.percentile(0.9)),
+                 to_us(histogram.percentile(0.99)), to_us(histogram.percentile(0.999)), to_us(histogram.max()));
+}
+
+std::string format_report(Args const & args, Results const & results) {
+  double const seconds = static_cast<double>(args.duration.count());
+  uint64_t total = 0;
+  for (auto const & histogram : results.latencies) {
+    total += histogram.count();
+  }
+
+  fmt::memory_buffer buffer;
+  auto const out = std::back_inserter(buffer);
+  fmt::format_to(out, "{{\n  \"mode\": \"{}\", \"connections\": {}, \"threads\": {}, \"rate\": {}, ",
+                 args.mode == Mode::Closed ? "closed" : "open", args.connections, args.threads, args.rate);
+  fmt::format_to(out, "\"duration_s\": {}, \"warmup_s\": {},\n", args.duration.count(), args.warmup.count());
+  fmt::format_to(out,
+                 "  \"connected\": {}, \"connect_errors\": {}, \"disconnected\": {}, \"fallback_views\": {}, "
+                 "\"unsent\": {}, \"max_backlog\": {},\n",
+                 results.connected, results.connect_errors, results.disconnected, results.fallback_views,
+                 results.unsent, results.max_backlog);
+  fmt::format_to(out, "  \"throughput\": {:.1f},\n  \"login\": {{ ", static_cast<double>(total) / seconds);
+  format_histogram(buffer, results.login);
+  fmt::format_to(out, " }},\n  \"operations\": {{\n");
+  for (std::size_t i = 0; i < kOperations; ++i) {
+    fmt::format_to(out, "    \"{}\": {{ \"failed\": {}, \"throughput\": {:.1f}, ", kOperationNames[i],
+                   results.failed[i], static_cast<double>(results.latencies[i].count()) / seconds);
+    format_histogram(buffer, results.latencies[i]);
+    fmt::format_to(out, " }}{}\n", i + 1 < kOperations ? "," : "");
+  }
+  fmt::format_to(out, "  }}\n}}\n");
+  return fmt::to_string(buffer);
+}
+
+void print_summary(Args const & args, Results const & results) {
+  double const seconds = static_cast<double>(args.duration.count());
+  fmt::println("Connected {} of {} users ({} failed, {} disconnected during the run)", results.connected,
+               args.connections, results.connect_errors, results.disconnected);
+  if (args.mode == Mode::Open) {
+    fmt::println("Max backlog {} commands, {} commands were not sent in time", results.max_backlog, results.unsent);
+  }
+  fmt::println("{:<8} {:>10} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10}", "command", "count", "failed",
+               "ops/s", "mean,us", "p50,us", "p99,us", "p999,us", "max,us");
+  auto const print_row = [&](std::string_view name, LatencyHistogram const & histogram, uint64_t failed) {
+    fmt::println("{:<8} {:>10} {:>8} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}", name,
+                 histogram.count(), failed, static_cast<double>(histogram.count()) / seconds,
+                 to_us(histogram.mean()), to_us(histogram.percentile(0.5)), to_us(histogram.percentile(0.99)),
+                 to_us(histogram.percentile(0.999)), to_us(histogram.max()));
+  };
+  LatencyHistogram all;
+  uint64_t all_failed = 0;
+  for (std::size_t i = 0; i < kOperations; ++i) {
+    print_row(kOperationNames[i], results.latencies[i], results.failed[i]);
+    all.merge(results.latencies[i]);
+    all_failed += results.failed[i];
+  }
+  print_row("total", all, all_failed);
+  if (results.fallback_views > 0) {
+    fmt::println("{} buys and bids were sent as views, as there were no matching sell orders", results.fallback_views);
+  }
+}
+}  // namespace
+
+int main(int argc, char * argv[]) {
+  auto const args = parse_args(argc, argv);
+  if (!args) {
+    fmt::println("{}", kUsage);
+    return 1;
+  }
+
+  try {
+    asio::io_context io_context;
+    tcp::resolver resolver(io_context);
+    auto const endpoints = resolver.resolve(args->host, args->port);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    for (unsigned i = 0; i < args->threads; ++i) {
+      workers.push_back(std::make_unique<Worker>(*args, i, endpoints));
+    }
+    std::vector<std::thread> threads;
+    for (auto & worker : workers) {
+      threads.emplace_back([&worker]() { worker->run(); });
+    }
+    for (auto & thread : threads) {
+      thread.join();
+    }
+
+    Results results;
+    for (auto const & worker : workers) {
+      results.merge(worker->get_results());
+    }
+    print_summary(*args, results);
+
+    if (args->report_path) {
+      std::string const path(*args->report_path);
+      std::FILE * file = std::fopen(path.c_str(), "w");
+      if (!file) {
+        fmt::println("Failed to open '{}' for writing", path);
+        return 1;
+      }
+      std::string const report = format_report(*args, results);
+      std::fwrite(report.data(), 1, report.size(), file);
+      std::fclose(file);
+    }
+  } catch (std::exception & e) {
+    fmt::println("Exception: {}", e.what());
+    return 1;
+  }
+  return 0;
+}
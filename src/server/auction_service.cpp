@@ -14,12 +14,29 @@ tl::expected<ItemOperationInfo, std::string> AuctionService::deposit(UserId user
     return tl::make_unexpected("Cannot deposit negative amount");
   }
 
+  // The change and its log record are committed together
+  auto transaction_guard = storage->begin_transaction();
+  if (!transaction_guard) {
+    return tl::make_unexpected(fmt::format("Failed to start transaction: {}", transaction_guard.error()));
+  }
+
   return storage->get_item_id(item_name)
       .or_else([&](auto &&) { return storage->create_item(item_name); })
       .and_then([&](int item_id) {
         return storage->add_user_item(user_id, item_id, quantity).map([&]() {
           return ItemOperationInfo{ .item_id = item_id, .quantity = quantity };
         });
+      })
+      .and_then([&](ItemOperationInfo info) {
+        return storage
+            ->log(LogRecord{
+                .kind = LogRecord::Kind::Deposited,
+                .user_id = user_id,
+                .item_id = info.item_id,
+                .quantity = info.quantity,
+            })
+            .and_then([&]() { return transaction_guard->commit(); })
+            .map([&]() { return info; });
       });
 }
 
@@ -29,13 +46,30 @@ tl::expected<ItemOperationInfo, std::string> AuctionService::withdraw(UserId use
     return tl::make_unexpected("Cannot withdraw negative amount");
   }
 
+  // The change and its log record are committed together
+  auto transaction_guard = storage->begin_transaction();
+  if (!transaction_guard) {
+    return tl::make_unexpected(fmt::format("Failed to start transaction: {}", transaction_guard.error()));
+  }
+
   return storage->get_item_id(item_name)
       .and_then([&](int item_id) {
         return storage->sub_user_item(user_id, item_id, quantity).map([&]() {
           return ItemOperationInfo{ .item_id = item_id, .quantity = quantity };
         });
       })
-      .map_error([&](auto &&) { return fmt::format("Not enough {}(s) to withdraw", item_name); });
+      .map_error([&](auto &&) { return fmt::format("Not enough {}(s) to withdraw", item_name); })
+      .and_then([&](ItemOperationInfo info) {
+        return storage
+            ->log(LogRecord{
+                .kind = LogRecord::Kind::Withdrawn,
+                .user_id = user_id,
+                .item_id = info.item_id,
+                .quantity = info.quantity,
+            })
+            .and_then([&]() { return transaction_guard->commit(); })
+            .map([&]() { return info; });
+      });
 }
 
 tl::expected<ItemOperationInfo, std::string> AuctionService::place_sell_order(SellOrderType order_type,
@@ -84,13 +118,33 @@ tl::expected<ItemOperationInfo, std::string> AuctionService::place_sell_order(Se
 
       // Second, insert the order
       .and_then([&](int item_id) {
-        return storage->create_sell_order(Storage::SellOrder{
-            .seller_id = seller_id,
-            .item_id = item_id,
-            .quantity = quantity,
-            .price = price,
-            .unix_expiration_time = unix_expiration_time,
-            .buyer_id = buyer_id,
+        return storage
+            ->create_sell_order(Storage::SellOrder{
+                .seller_id = seller_id,
+                .item_id = item_id,
+                .quantity = quantity,
+                .price = price,
+                .unix_expiration_time = unix_expiration_time,
+                .buyer_id = buyer_id,
+            })
+            .and_then([&](int order_id) {
+              return storage->log(LogRecord{
+                  .kind = LogRecord::Kind::SellOrderPlaced,
+                  .user_id = seller_id,
+                  .item_id = item_id,
+                  .quantity = quantity,
+                  .price = price,
+                  .order_id = order_id,
+              }).map([&]() { return order_id; });
+            });
+      })
+      .and_then([&](int order_id) {
+        return storage->log(LogRecord{
+            .kind = LogRecord::Kind::PayedFee,
+            .user_id = seller_id,
+            .item_id = storage->funds_item_id(),
+            .quantity = fee,
+            .order_id = order_id,
         });
       })
       .and_then([&]() { return transaction_guard->commit(); })
@@ -134,6 +188,17 @@ tl::expected<SellOrderExecutionInfo, std::string> AuctionService::execute_immedi
       .and_then([&]() { return storage->add_user_item(buyer_id, order->item_id, order->quantity); })
       // Finally, delete the order
       .and_then([&]() { return storage->delete_sell_order(sell_order_id); })
+      .and_then([&]() {
+        return storage->log(LogRecord{
+            .kind = LogRecord::Kind::SellOrderExecuted,
+            .user_id = order->seller_id,
+            .buyer_id = buyer_id,
+            .item_id = order->item_id,
+            .quantity = order->quantity,
+            .price = order->price,
+            .order_id = sell_order_id,
+        });
+      })
       // And of course, commit the transaction
       .and_then([&]() { return transaction_guard->commit(); })
       // And return the execution info
@@ -163,7 +228,14 @@ tl::expected<void, std::string> AuctionService::place_bid_on_auction_sell_order(
 
   if (order->buyer_id) {
     // If there is already a bid, then we should return funds to the previous buyer
-    auto return_funds_result = add_funds(*order->buyer_id, order->price);
+    auto return_funds_result = add_funds(*order->buyer_id, order->price).and_then([&]() {
+      return storage->log(LogRecord{
+          .kind = LogRecord::Kind::BidRefunded,
+          .user_id = *order->buyer_id,
+          .price = order->price,
+          .order_id = sell_order_id,
+      });
+    });
     if (!return_funds_result) {
       return tl::make_unexpected(
           fmt::format("Failed to return funds to the previous buyer: {}", return_funds_result.error()));
@@ -175,6 +247,14 @@ tl::expected<void, std::string> AuctionService::place_bid_on_auction_sell_order(
       .map_error([&](auto &&) { return fmt::format("Not enough funds to buy"); })
       // Second, update order price and buyer_id
       .and_then([&]() { return storage->update_sell_order_buyer(sell_order_id, buyer_id, bid); })
+      .and_then([&]() {
+        return storage->log(LogRecord{
+            .kind = LogRecord::Kind::BidPlaced,
+            .user_id = buyer_id,
+            .price = bid,
+            .order_id = sell_order_id,
+        });
+      })
       // And of course, commit the transaction
       .and_then([&]() { return transaction_guard->commit(); });
 }
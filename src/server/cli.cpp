@@ -2,14 +2,67 @@
 
 #include <fmt/format.h>
 
+#include <algorithm>
 #include <charconv>
+#include <chrono>
+#include <cstring>
+#include <optional>
+#include <thread>
+
+namespace {
+constexpr std::string_view kUsage =
+    "Usage: server <port> <path_to_db> <path_to_transaction_log> [options]\n"
+    "Options:\n"
+    "  --network-threads=<n>  number of threads that handle connections, defaults to the number of CPU cores\n"
+    "  --read-threads=<n>  number of threads with read-only database connections that serve `view_items`, defaults to\n"
+    "                      the number of CPU cores. 0 serves it on the storage thread\n"
+    "  --shards=<n>  number of databases (each with its own storage thread and transaction log) users are split\n"
+    "                between, defaults to 1. Shards after the first one are `<path>.shard<k>`, and trades between\n"
+    "                them are coordinated via `<path_to_db>.coordinator`. Can't be changed for existing databases\n"
+    "  --write-high-water-mark=<bytes>  max amount of unsent data per connection before the server stops reading\n"
+    "                                   commands from it, defaults to 1 MiB\n"
+    "  --group-commit-size=<n>  max number of commands that change items committed in a single transaction,\n"
+    "                           defaults to 64. 1 commits every command on its own\n"
+    "  --group-commit-window=<microseconds>  how long the first command of a batch waits for others, defaults to 0:\n"
+    "                                        only the commands that are already queued join the batch\n"
+    "  --expiry-chunk-size=<n>  max number of expired sell orders settled in a single transaction, defaults to 1000\n"
+    "  --expiry-chunk-budget=<microseconds>  max time of settling a single chunk of expired sell orders, defaults\n"
+    "                                        to 5000. Other commands run between the chunks\n"
+    "  --log-format=<text|binary>  format of the transaction log, text by default. See `txlog-dump` for binary\n"
+    "  --log-durability=<none|flush|fsync>  when transaction log entries are considered written: left in the stdio\n"
+    "                                       buffer, flushed (default) or fsynced after each batch of entries\n"
+    "  --log-queue-capacity=<n>  max number of transaction log entries waiting to be written, defaults to 65536\n"
+    "  --log-segment-size=<bytes>, --log-segment-duration=<seconds>  rotate the transaction log into numbered\n"
+    "                                   segments once it reaches the size or age, disabled by default\n"
+    "  --sql-profile  aggregate time and rows of every SQL statement, see the `sql_stats` command\n"
+    "  --sql-slow-log=<path>  profile SQL statements and append the ones slower than `--sql-slow-threshold` and\n"
+    "                         query plans of all statements to the file\n"
+    "  --sql-slow-threshold=<microseconds>  defaults to 10000\n"
+    "Example: server 3000 db.sqlite transaction.log --network-threads=4";
+
+// Returns the value of `--<name>=<value>` option if `arg` is this option
+std::optional<std::string_view> option_value(std::string_view arg, std::string_view name) {
+  if (arg.size() <= name.size() + 3 || !arg.starts_with("--") || arg.substr(2, name.size()) != name ||
+      arg[name.size() + 2] != '=') {
+    return std::nullopt;
+  }
+  return arg.substr(name.size() + 3);
+}
+
+template <typename T>
+std::optional<T> parse_number(std::string_view str) {
+  T value;
+  auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc() || ptr != str.data() + str.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+}  // namespace
 
 tl::expected<Cli, std::string> Cli::parse(int argc, char * argv[]) {
-  if (argc != 4) {
-    return tl::make_unexpected(
-        "Invalid number of arguments\n"
-        "Usage: server <port> <path_to_db> <path_to_transaction_log>\n"
-        "Example: server 3000 db.sqlite transaction.log");
+  if (argc < 4) {
+    return tl::make_unexpected(fmt::format("Invalid number of arguments\n{}", kUsage));
   }
 
   uint16_t port;
@@ -18,9 +71,116 @@ tl::expected<Cli, std::string> Cli::parse(int argc, char * argv[]) {
     return tl::make_unexpected(fmt::format("Invalid port '{}'. Port must be in range [1, 65535]", argv[1]));
   }
 
-  return Cli{
+  auto cli = Cli{
     .port = port,
     .db_path = argv[2],
     .transaction_log_path = argv[3],
+    .network_threads = std::max(std::thread::hardware_concurrency(), 1u),
+    .read_threads = std::max(std::thread::hardware_concurrency(), 1u),
+    .shards = 1,
+    .write_high_water_mark = 1024 * 1024,
+    .group_commit = {},
+    .expiry_chunk_size = 1000,
+    .expiry_chunk_budget = std::chrono::milliseconds(5),
+    .log_options = {},
+    .sql_profiling = std::nullopt,
   };
+
+  for (int i = 4; i < argc; ++i) {
+    std::string_view const arg = argv[i];
+    if (auto const value = option_value(arg, "network-threads")) {
+      auto const threads = parse_number<unsigned>(*value);
+      if (!threads || *threads == 0) {
+        return tl::make_unexpected(fmt::format("Invalid number of network threads '{}'", *value));
+      }
+      cli.network_threads = *threads;
+    } else if (auto const value = option_value(arg, "read-threads")) {
+      auto const threads = parse_number<unsigned>(*value);
+      if (!threads) {
+        return tl::make_unexpected(fmt::format("Invalid number of read threads '{}'", *value));
+      }
+      cli.read_threads = *threads;
+    } else if (auto const value = option_value(arg, "shards")) {
+      auto const shards = parse_number<unsigned>(*value);
+      if (!shards || *shards == 0) {
+        return tl::make_unexpected(fmt::format("Invalid number of shards '{}'", *value));
+      }
+      cli.shards = *shards;
+    } else if (auto const value = option_value(arg, "write-high-water-mark")) {
+      auto const bytes = parse_number<std::size_t>(*value);
+      if (!bytes) {
+        return tl::make_unexpected(fmt::format("Invalid write high-water mark '{}'", *value));
+      }
+      cli.write_high_water_mark = *bytes;
+    } else if (auto const value = option_value(arg, "group-commit-size")) {
+      auto const size = parse_number<std::size_t>(*value);
+      if (!size || *size == 0) {
+        return tl::make_unexpected(fmt::format("Invalid group commit size '{}'", *value));
+      }
+      cli.group_commit.max_batch_size = *size;
+    } else if (auto const value = option_value(arg, "group-commit-window")) {
+      auto const microseconds = parse_number<int64_t>(*value);
+      if (!microseconds || *microseconds < 0) {
+        return tl::make_unexpected(fmt::format("Invalid group commit window '{}'", *value));
+      }
+      cli.group_commit.window = std::chrono::microseconds(*microseconds);
+    } else if (auto const value = option_value(arg, "expiry-chunk-size")) {
+      auto const size = parse_number<std::size_t>(*value);
+      if (!size || *size == 0) {
+        return tl::make_unexpected(fmt::format("Invalid expiry chunk size '{}'", *value));
+      }
+      cli.expiry_chunk_size = *size;
+    } else if (auto const value = option_value(arg, "expiry-chunk-budget")) {
+      auto const microseconds = parse_number<int64_t>(*value);
+      if (!microseconds || *microseconds <= 0) {
+        return tl::make_unexpected(fmt::format("Invalid expiry chunk budget '{}'", *value));
+      }
+      cli.expiry_chunk_budget = std::chrono::microseconds(*microseconds);
+    } else if (auto const value = option_value(arg, "log-format")) {
+      auto const format = parse_LogFormat(*value);
+      if (!format) {
+        return tl::make_unexpected(fmt::format("Invalid log format '{}'", *value));
+      }
+      cli.log_options.format = *format;
+    } else if (auto const value = option_value(arg, "log-durability")) {
+      auto const durability = parse_LogDurability(*value);
+      if (!durability) {
+        return tl::make_unexpected(fmt::format("Invalid log durability '{}'", *value));
+      }
+      cli.log_options.durability = *durability;
+    } else if (auto const value = option_value(arg, "log-queue-capacity")) {
+      auto const capacity = parse_number<std::size_t>(*value);
+      if (!capacity || *capacity == 0) {
+        return tl::make_unexpected(fmt::format("Invalid log queue capacity '{}'", *value));
+      }
+      cli.log_options.queue_capacity = *capacity;
+    } else if (auto const value = option_value(arg, "log-segment-size")) {
+      auto const bytes = parse_number<std::size_t>(*value);
+      if (!bytes) {
+        return tl::make_unexpected(fmt::format("Invalid log segment size '{}'", *value));
+      }
+      cli.log_options.segment_size = *bytes;
+    } else if (auto const value = option_value(arg, "log-segment-duration")) {
+      auto const seconds = parse_number<int64_t>(*value);
+      if (!seconds || *seconds < 0) {
+        return tl::make_unexpected(fmt::format("Invalid log segment duration '{}'", *value));
+      }
+      cli.log_options.segment_duration = std::chrono::seconds(*seconds);
+    } else if (arg == "--sql-profile") {
+      cli.sql_profiling = cli.sql_profiling.value_or(Sqlite3::ProfilingOptions{});
+    } else if (auto const value = option_value(arg, "sql-slow-log")) {
+      cli.sql_profiling = cli.sql_profiling.value_or(Sqlite3::ProfilingOptions{});
+      cli.sql_profiling->slow_log_path = *value;
+    } else if (auto const value = option_value(arg, "sql-slow-threshold")) {
+      auto const microseconds = parse_number<int64_t>(*value);
+      if (!microseconds || *microseconds < 0) {
+        return tl::make_unexpected(fmt::format("Invalid slow SQL threshold '{}'", *value));
+      }
+      cli.sql_profiling = cli.sql_profiling.value_or(Sqlite3::ProfilingOptions{});
+      cli.sql_profiling->slow_threshold = std::chrono::microseconds(*microseconds);
+    } else {
+      return tl::make_unexpected(fmt::format("Unknown option '{}'\n{}", arg, kUsage));
+    }
+  }
+  return cli;
 }
@@ -1,8 +1,15 @@
 #pragma once
 
+#include "group_commit.hpp"
+#include "sqlite3.hpp"
+#include "transaction_log.hpp"
+
 #include <tl/expected.hpp>
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
+#include <optional>
 #include <string_view>
 
 // Command line arguments for the server
@@ -13,6 +20,24 @@ struct Cli {
   std::string_view db_path;
   // path to the transaction log file
   std::string_view transaction_log_path;
+  // number of threads that handle network connections
+  unsigned network_threads;
+  // number of threads (each with its own read-only database connection) that serve listings, 0 to serve them on the
+  // storage thread
+  unsigned read_threads;
+  // number of databases users are split between, see `Shard`
+  unsigned shards;
+  // max amount of unsent data per connection before the server stops reading commands from it
+  std::size_t write_high_water_mark;
+  // how commands that change items are batched into transactions
+  GroupCommit::Options group_commit;
+  // max number of expired sell orders and time settled in a single transaction, see `process_expired_sell_orders`
+  std::size_t expiry_chunk_size;
+  std::chrono::microseconds expiry_chunk_budget;
+  // format, durability and rotation of the transaction log
+  TransactionLogOptions log_options;
+  // SQL statements profiling, disabled if std::nullopt
+  std::optional<Sqlite3::ProfilingOptions> sql_profiling;
 
   static tl::expected<Cli, std::string> parse(int argc, char * argv[]);
 };
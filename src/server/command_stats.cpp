@@ -0,0 +1,98 @@
+#include "command_stats.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+double to_us(std::chrono::nanoseconds value) {
+  return static_cast<double>(value.count()) / 1000.0;
+}
+}  // namespace
+
+void AtomicHistogram::record(std::chrono::nanoseconds latency) noexcept {
+  uint64_t const value = static_cast<uint64_t>(std::max(latency.count(), int64_t(0)));
+  counts[Buckets::bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+  total.fetch_add(1, std::memory_order_relaxed);
+  sum_ns.fetch_add(value, std::memory_order_relaxed);
+  uint64_t max = max_ns.load(std::memory_order_relaxed);
+  while (value > max && !max_ns.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+  }
+}
+
+std::chrono::nanoseconds AtomicHistogram::mean() const {
+  uint64_t const n = count();
+  return std::chrono::nanoseconds(n > 0 ? sum_ns.load(std::memory_order_relaxed) / n : 0);
+}
+
+std::vector<std::chrono::nanoseconds> AtomicHistogram::percentiles(std::vector<double> const & quantiles) const {
+  // Buckets are updated concurrently, so the total is taken from the same snapshot
+  std::vector<uint64_t> snapshot(kBuckets);
+  uint64_t snapshot_total = 0;
+  for (std::size_t i = 0; i < kBuckets; ++i) {
+    snapshot[i] = counts[i].load(std::memory_order_relaxed);
+    snapshot_total += snapshot[i];
+  }
+  uint64_t const max_value = static_cast<uint64_t>(max().count());
+
+  std::vector<std::chrono::nanoseconds> result;
+  for (double const quantile : quantiles) {
+    result.emplace_back(Buckets::percentile(snapshot, snapshot_total, quantile, max_value));
+  }
+  return result;
+}
+
+CommandStats::CommandStats(std::vector<std::string_view> const & names)
+    : commands(std::make_unique<Command[]>(names.size() + 1)), size(names.size() + 1) {
+  if (size > kMaxCommands) {
+    throw std::invalid_argument("Too many commands for CommandStats");
+  }
+  for (std::size_t i = 0; i < names.size(); ++i) {
+    commands[i].name = names[i];
+  }
+  commands[unknown_command()].name = "<unknown>";
+}
+
+void CommandStats::record_write(uint32_t commands_mask, std::chrono::nanoseconds latency) noexcept {
+  while (commands_mask != 0) {
+    auto const command = static_cast<std::size_t>(std::countr_zero(commands_mask));
+    commands_mask &= commands_mask - 1;
+    if (command < size) {
+      record(command, Stage::Write, latency);
+    }
+  }
+}
+
+std::string CommandStats::format() const {
+  namespace ch = std::chrono;
+  constexpr std::array<std::string_view, kStages> kStageNames = { "parse", "queue", "execute", "write" };
+
+  std::string output;
+  auto out = std::back_inserter(output);
+  auto const uptime = ch::duration_cast<ch::seconds>(ch::system_clock::now() - started_at);
+  fmt::format_to(out, "Command stats for the last {}s, latencies in microseconds as p50/p99/p999/max:\n",
+                 uptime.count());
+  for (std::size_t i = 0; i < size; ++i) {
+    Command const & command = commands[i];
+    uint64_t const requests = command.requests.load(std::memory_order_relaxed);
+    if (requests == 0) {
+      continue;
+    }
+    fmt::format_to(out, "- {}: {} requests, {} errors", command.name, requests,
+                   command.errors.load(std::memory_order_relaxed));
+    for (std::size_t stage = 0; stage < kStages; ++stage) {
+      AtomicHistogram const & histogram = command.latencies[stage];
+      if (histogram.count() == 0) {
+        continue;
+      }
+      auto const values = histogram.percentiles({ 0.5, 0.99, 0.999 });
+      fmt::format_to(out, ", {} {:.1f}/{:.1f}/{:.1f}/{:.1f}", kStageNames[stage], to_us(values[0]), to_us(values[1]),
+                     to_us(values[2]), to_us(histogram.max()));
+    }
+    output += '\n';
+  }
+  return output;
+}
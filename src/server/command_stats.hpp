@@ -0,0 +1,91 @@
+#pragma once
+
+#include "log_linear_buckets.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Log-linear histogram of latencies that any thread can update without locks or allocations. Values below 64ns are
+// counted exactly, larger ones fall into buckets 1/32 of their power of two wide (~3% error), up to ~68s
+class AtomicHistogram final {
+public:
+  using Buckets = LogLinearBuckets<5, 36>;
+  static constexpr std::size_t kBuckets = Buckets::kCount;
+
+private:
+  std::array<std::atomic<uint64_t>, kBuckets> counts{};
+  std::atomic<uint64_t> total = 0;
+  std::atomic<uint64_t> sum_ns = 0;
+  std::atomic<uint64_t> max_ns = 0;
+
+public:
+  void record(std::chrono::nanoseconds latency) noexcept;
+
+  uint64_t count() const { return total.load(std::memory_order_relaxed); }
+  std::chrono::nanoseconds mean() const;
+  std::chrono::nanoseconds max() const { return std::chrono::nanoseconds(max_ns.load(std::memory_order_relaxed)); }
+  // Values at the given quantiles (in [0, 1]), rounded up to the bucket boundary. Reads all buckets once, so
+  // request all quantiles at once
+  std::vector<std::chrono::nanoseconds> percentiles(std::vector<double> const & quantiles) const;
+};
+
+// Counters and latency histograms of every command. Updated from the network, storage and read pool threads with
+// relaxed atomics only, so recording costs a few uncontended increments and never allocates
+class CommandStats final {
+public:
+  enum class Stage {
+    // From the request line till the parsed command
+    Parse,
+    // Waiting for the storage thread (or the read pool) and getting back to the connection, only for commands that
+    // run there
+    Queue,
+    Execute,
+    // From queueing the response till it is written to the socket
+    Write,
+  };
+  static constexpr std::size_t kStages = 4;
+  // Commands are passed around as bits of a `uint32_t` mask
+  static constexpr std::size_t kMaxCommands = 32;
+
+private:
+  struct Command {
+    std::string_view name;
+    std::atomic<uint64_t> requests = 0;
+    std::atomic<uint64_t> errors = 0;
+    std::array<AtomicHistogram, kStages> latencies;
+  };
+
+  std::unique_ptr<Command[]> commands;
+  std::size_t size;
+  std::chrono::system_clock::time_point started_at = std::chrono::system_clock::now();
+
+public:
+  // Index of a command is its position in `names`. One more slot is added for unknown commands
+  explicit CommandStats(std::vector<std::string_view> const & names);
+
+  std::size_t unknown_command() const { return size - 1; }
+
+  void record(std::size_t command, Stage stage, std::chrono::nanoseconds latency) noexcept {
+    commands[command].latencies[static_cast<std::size_t>(stage)].record(latency);
+  }
+  void count(std::size_t command, bool failed) noexcept {
+    commands[command].requests.fetch_add(1, std::memory_order_relaxed);
+    if (failed) {
+      commands[command].errors.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  // Records the write latency once for every command set in the mask
+  void record_write(uint32_t commands_mask, std::chrono::nanoseconds latency) noexcept;
+
+  static uint32_t mask(std::size_t command) { return uint32_t(1) << command; }
+
+  // Human-readable dump of all commands that were requested at least once
+  std::string format() const;
+};
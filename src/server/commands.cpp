@@ -2,24 +2,18 @@
 #include "shared_state.hpp"
 #include "types.hpp"
 
-#include <fmt/ranges.h>
+#include <fmt/format.h>
 
+#include <algorithm>
 #include <charconv>
+#include <chrono>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace fmt {
-template <>
-struct formatter<UserItemInfo> {
-  template <typename ParseContext>
-  constexpr auto parse(ParseContext & ctx) {
-    return ctx.begin();
-  }
-
-  template <typename FormatContext>
-  auto format(UserItemInfo const & item_info, FormatContext & ctx) const {
-    return ::fmt::format_to(ctx.out(), "(\"{}\", {})", item_info.item_name, item_info.quantity);
-  }
-};
-
 template <>
 struct formatter<SellOrderType> {
   template <typename ParseContext>
@@ -76,10 +70,23 @@ std::pair<std::string_view, int> parse_item_name_and_count(std::string_view args
   return { args, quantity };
 }
 
+// Parses the whole string as a number
+template <typename T>
+std::optional<T> parse_number(std::string_view str) noexcept {
+  T value{};
+  auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc() || ptr != str.data() + str.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
 constexpr std::string_view kHelpString = R"(Available commands:
 - whoami: Displays the username of the current user
 - ping: Replies 'pong'
 - help: Prints this help message about all available commands
+- stats: Prints the number of requests, errors and latencies of every command
+- sql_stats: Prints the most time-consuming SQL statements, if the server runs with `--sql-profile`
 - quit: Ask the server to close the connection. Alternatively, the client can just close the connection (e.g. Ctrl+C)
 
 - deposit: Deposits a specified amount into the user's account. Format: 'deposit <item name> [<quantity>]'.
@@ -89,7 +96,11 @@ constexpr std::string_view kHelpString = R"(Available commands:
   Example: 'withdraw arrow 5' - withdraws 5 arrows, 'withdraw Sword' - withdraws 1 Sword
 - view_items: Displays a list items for the current user
 
-- view_sell_orders: Displays a list of all sell orders from all users
+- view_sell_orders: Displays sell orders from all users, 50 at a time.
+  Format: 'view_sell_orders [item=<name>] [seller=<name>] [type=immediate|auction] [min_price=<price>]
+  [max_price=<price>] [sort=id|price|expiration] [limit=<1..1000>] [after=<cursor>]'
+  Example: 'view_sell_orders item=Sword sort=price limit=10' - the 10 cheapest Swords. The last line of a page
+  contains the cursor of the next one
 - sell: Places an item for sale at a specified price. Format: 'sell [immediate|auction] <item_name> [<quantity>] <price>'
   - immediate sell order - will be executed immediately once someone buys it. Otherwise it will expire in 5 minutes
     and items will be returned to the seller, but not the fee, which is `5% of the price + 1` funds
@@ -99,6 +110,49 @@ constexpr std::string_view kHelpString = R"(Available commands:
   - bid - places a bid on a auction sell order
   
 Usage: <command> [<args>], where `[]` annotates optional argumet(s))";
+
+// Responses of `Buy`, the same with and without shards
+std::string bid_response(int sell_order_id, tl::expected<void, std::string> const & result) {
+  if (!result) {
+    return fmt::format("Failed to place a bid on #{} auction sell order with error: {}", sell_order_id,
+                       result.error());
+  }
+  return fmt::format("Successfully placed a bid on #{} auction sell order", sell_order_id);
+}
+std::string buy_response(int sell_order_id, tl::expected<SellOrderExecutionInfo, std::string> const & result) {
+  if (!result) {
+    return fmt::format("Failed to execute #{} sell order with error: {}", sell_order_id, result.error());
+  }
+  return fmt::format("Successfully executed #{} sell order", sell_order_id);
+}
+
+// Response of `SqlStats`, the most time-consuming statements first
+std::string format_sql_profiles(std::vector<Sqlite3::StatementProfile> const & profiles) {
+  constexpr std::size_t kMaxStatements = 20;
+  if (profiles.empty()) {
+    return "No SQL statements were profiled. Start the server with --sql-profile to enable profiling";
+  }
+
+  auto const to_ms = [](std::chrono::nanoseconds time) { return static_cast<double>(time.count()) / 1e6; };
+  std::string output = "SQL statements by total time:\n";
+  for (std::size_t i = 0; i < std::min(profiles.size(), kMaxStatements); ++i) {
+    auto const & profile = profiles[i];
+    fmt::format_to(std::back_inserter(output),
+                   "- {} calls, total {:.3f}ms, max {:.3f}ms, {} rows, {} VM steps, {} full scan steps: {}\n",
+                   profile.calls, to_ms(profile.total_time), to_ms(profile.max_time), profile.rows, profile.vm_steps,
+                   profile.fullscan_steps, profile.sql);
+    if (!profile.query_plan.empty()) {
+      // Plan steps are already indented by their depth
+      std::string_view plan = profile.query_plan;
+      while (!plan.empty()) {
+        std::size_t const end = std::min(plan.find('\n'), plan.size());
+        fmt::format_to(std::back_inserter(output), "    {}\n", plan.substr(0, end));
+        plan.remove_prefix(std::min(end + 1, plan.size()));
+      }
+    }
+  }
+  return output;
+}
 }  // namespace
 
 namespace commands {
@@ -113,12 +167,11 @@ std::optional<Deposit> Deposit::parse(std::string_view args) {
 }
 
 std::string Deposit::execute(User const & user, std::shared_ptr<SharedState> const & shared_state) {
-  auto result = shared_state->auction_service.deposit(user.id, item_name, quantity);
+  auto result = shared_state->shard_of(user.id).auction_service.deposit(user.id, item_name, quantity);
   if (!result) {
     return fmt::format("Failed to deposit {} {}(s) with error: {}", quantity, item_name, result.error());
   }
 
-  shared_state->transaction_log.save(user.id, "deposited", *result);
   return fmt::format("Successfully deposited {} {}(s)", quantity, item_name);
 }
 
@@ -128,21 +181,36 @@ std::optional<Withdraw> Withdraw::parse(std::string_view args) {
 }
 
 std::string Withdraw::execute(User const & user, std::shared_ptr<SharedState> const & shared_state) {
-  auto result = shared_state->auction_service.withdraw(user.id, item_name, quantity);
+  auto result = shared_state->shard_of(user.id).auction_service.withdraw(user.id, item_name, quantity);
   if (!result) {
     return fmt::format("Failed to withdraw {} {}(s) with error: {}", quantity, item_name, result.error());
   }
 
-  shared_state->transaction_log.save(user.id, "withdrawn", *result);
   return fmt::format("Successfully withdrawn {} {}(s)", quantity, item_name);
 }
 
-std::string ViewItems::execute(User const & user, std::shared_ptr<SharedState> const & shared_state) {
-  auto result = shared_state->storage->view_user_items(user.id);
+std::string ViewItems::execute(User const & user, std::shared_ptr<SharedState> const & shared_state,
+                               ResponseWriter & output) {
+  output.write("Items: [");
+  bool first = true;
+  auto const print_item = [&](std::string_view item_name, int quantity) {
+    output.print("{}(\"{}\", {})", first ? "" : ", ", item_name, quantity);
+    first = false;
+  };
+  // Runs on a read pool thread if there is a pool, see `CommandsProcessor::process_request`
+  Shard & shard = shared_state->shard_of(user.id);
+  tl::expected<void, std::string> result;
+  if (shard.read_pool) {
+    result = shard.read_pool->with_connection(
+        [&](Sqlite3 & db) { return Storage::view_user_items(db, user.id, print_item); });
+  } else {
+    result = shard.storage->view_user_items(user.id, print_item);
+  }
   if (!result) {
     return fmt::format("Failed to view items with error: {}", result.error());
   }
-  return fmt::format("Items: [{}]", fmt::join(result.value(), ", "));
+  output.write("]");
+  return {};
 }
 
 std::optional<Sell> Sell::parse(std::string_view args) {
@@ -179,14 +247,15 @@ std::string Sell::execute(User const & user, std::shared_ptr<SharedState> const
   constexpr auto const order_lifetime = std::chrono::minutes(5);
   int64_t const unix_expiration_time = (std::chrono::seconds(std::time(NULL)) + order_lifetime).count();
 
-  auto result = shared_state->auction_service.place_sell_order(order_type, user.id, item_name, quantity, price,
-                                                               unix_expiration_time);
+  Shard & shard = shared_state->shard_of(user.id);
+  auto result =
+      shard.auction_service.place_sell_order(order_type, user.id, item_name, quantity, price, unix_expiration_time);
   if (!result) {
     return fmt::format("Failed to place {} sell order for {} {}(s) with error: {}", order_type, quantity, item_name,
                        result.error());
   }
 
-  shared_state->transaction_log.save(user.id, "payed fee", *result);
+  shard.expiry_timer.schedule(unix_expiration_time);
   return fmt::format("Successfully placed {} sell order for {} {}(s)", order_type, quantity, item_name);
 }
 
@@ -214,36 +283,205 @@ std::optional<Buy> Buy::parse(std::string_view args) {
 }
 
 std::string Buy::execute(User const & user, std::shared_ptr<SharedState> const & shared_state) {
+  Shard & shard = shared_state->shard_of(user.id);
   if (bid) {
-    auto result = shared_state->auction_service.place_bid_on_auction_sell_order(user.id, sell_order_id, *bid);
-    if (!result) {
-      return fmt::format("Failed to place a bid on #{} auction sell order with error: {}", sell_order_id,
-                         result.error());
-    }
-    return fmt::format("Successfully placed a bid on #{} auction sell order", sell_order_id);
-  } else {
-    auto result = shared_state->auction_service.execute_immediate_sell_order(user.id, sell_order_id);
-    if (!result) {
-      return fmt::format("Failed to execute #{} sell order with error: {}", sell_order_id, result.error());
-    }
-    shared_state->transaction_log.save(*result);
+    return bid_response(sell_order_id,
+                        shard.auction_service.place_bid_on_auction_sell_order(user.id, sell_order_id, *bid));
+  }
+  auto result = shard.auction_service.execute_immediate_sell_order(user.id, sell_order_id);
+  if (result) {
+    // The order may be executed within a batch, that isn't committed yet
+    shard.storage->after_commit([&notifications = shared_state->notifications, order = *result]() {
+      notifications.push(order.seller_id, ExecutedSellOrder{ .order_id = order.id, .price = order.price });
+    });
+  }
+  return buy_response(sell_order_id, result);
+}
+
+asio::awaitable<std::string> Buy::execute_across_shards(User const & user,
+                                                        std::shared_ptr<SharedState> const & shared_state) {
+  if (bid) {
+    co_return bid_response(sell_order_id, co_await shared_state->coordinator->bid(user, sell_order_id, *bid));
+  }
+  auto result = co_await shared_state->coordinator->buy(user.id, sell_order_id);
+  if (result) {
+    // Already committed by all shards
     shared_state->notifications.push(result->seller_id,
                                      ExecutedSellOrder{ .order_id = result->id, .price = result->price });
+  }
+  co_return buy_response(sell_order_id, result);
+}
 
-    return fmt::format("Successfully executed #{} sell order", sell_order_id);
+std::optional<ViewSellOrders> ViewSellOrders::parse(std::string_view args) {
+  ViewSellOrders result{ .query = { .limit = kDefaultPageSize } };
+
+  // Split into `key=value` pairs first, as values may contain spaces
+  std::vector<std::pair<std::string_view, std::string_view>> pairs;
+  std::size_t value_start = 0;
+  std::size_t pos = 0;
+  while (pos < args.size()) {
+    std::size_t const token_end = std::min(args.find(' ', pos), args.size());
+    std::string_view const token = args.substr(pos, token_end - pos);
+    if (std::size_t const eq_pos = token.find('='); eq_pos != std::string_view::npos) {
+      pairs.emplace_back(token.substr(0, eq_pos), token.substr(eq_pos + 1));
+      value_start = pos + eq_pos + 1;
+    } else if (!token.empty()) {
+      if (pairs.empty()) {
+        return std::nullopt;
+      }
+      pairs.back().second = args.substr(value_start, token_end - value_start);
+    }
+    pos = token_end + 1;
   }
+
+  for (auto const & [key, value] : pairs) {
+    if (key == "item") {
+      result.query.item_name = value;
+    } else if (key == "seller") {
+      result.query.seller_name = value;
+    } else if (key == "type") {
+      result.query.type = parse_SellOrderType(value);
+      if (!result.query.type) {
+        return std::nullopt;
+      }
+    } else if (key == "min_price") {
+      result.query.min_price = parse_number<int>(value);
+      if (!result.query.min_price) {
+        return std::nullopt;
+      }
+    } else if (key == "max_price") {
+      result.query.max_price = parse_number<int>(value);
+      if (!result.query.max_price) {
+        return std::nullopt;
+      }
+    } else if (key == "sort") {
+      if (value == "id") {
+        result.query.sort_by = SellOrdersSortKey::Id;
+      } else if (value == "price") {
+        result.query.sort_by = SellOrdersSortKey::Price;
+      } else if (value == "expiration") {
+        result.query.sort_by = SellOrdersSortKey::ExpirationTime;
+      } else {
+        return std::nullopt;
+      }
+    } else if (key == "limit") {
+      auto const limit = parse_number<std::size_t>(value);
+      if (!limit || *limit == 0 || *limit > kMaxPageSize) {
+        return std::nullopt;
+      }
+      result.query.limit = *limit;
+    } else if (key == "after") {
+      // "<sort key>:<id>", as printed by `execute`
+      std::size_t const colon_pos = value.find(':');
+      if (colon_pos == std::string_view::npos) {
+        return std::nullopt;
+      }
+      auto const sort_key = parse_number<int64_t>(value.substr(0, colon_pos));
+      auto const id = parse_number<int>(value.substr(colon_pos + 1));
+      if (!sort_key || !id) {
+        return std::nullopt;
+      }
+      result.query.after = SellOrdersCursor{ .key = *sort_key, .id = *id };
+    } else {
+      return std::nullopt;
+    }
+  }
+  return result;
 }
 
-std::string ViewSellOrders::execute(User const &, std::shared_ptr<SharedState> const & shared_state) {
-  auto result = shared_state->storage->view_sell_orders();
-  if (!result) {
-    return fmt::format("Failed to view sell orders with error: {}", result.error());
+std::string ViewSellOrders::execute(User const &, std::shared_ptr<SharedState> const & shared_state,
+                                    ResponseWriter & output) {
+  output.write("Sell orders:\n");
+  auto next = shared_state->shards.front()->storage->view_sell_orders(
+      query, [&](SellOrderInfo const & order) { output.print("- {}\n", order); });
+  if (!next) {
+    return fmt::format("Failed to view sell orders with error: {}", next.error());
   }
-  std::string output = "Sell orders:\n";
-  for (auto const & item : result.value()) {
-    output += fmt::format("- {}\n", item);
+  if (*next) {
+    output.print("More orders: repeat with after={}:{}\n", (*next)->key, (*next)->id);
   }
-  return output;
+  return {};
+}
+
+asio::awaitable<std::string> ViewSellOrders::execute_across_shards(User const &,
+                                                                   std::shared_ptr<SharedState> const & shared_state,
+                                                                   ResponseWriter & output) {
+  // Each shard has a page of its own orders, and the first `limit` of all of them make the page
+  std::vector<SellOrderInfo> orders;
+  bool more = false;
+  for (auto const & shard : shared_state->shards) {
+    auto page = co_await shard->storage_executor.run([&]() { return shard->storage->view_sell_orders(query); });
+    if (!page) {
+      co_return fmt::format("Failed to view sell orders with error: {}", page.error());
+    }
+    more = more || page->next.has_value();
+    std::move(page->orders.begin(), page->orders.end(), std::back_inserter(orders));
+  }
+  auto const cursor_of = [this](SellOrderInfo const & order) {
+    switch (query.sort_by) {
+    case SellOrdersSortKey::Price: return SellOrdersCursor{ order.price, order.id };
+    case SellOrdersSortKey::ExpirationTime: return SellOrdersCursor{ order.unix_expiration_time, order.id };
+    case SellOrdersSortKey::Id: break;
+    }
+    return SellOrdersCursor{ order.id, order.id };
+  };
+  std::sort(orders.begin(), orders.end(), [&](auto const & lhs, auto const & rhs) {
+    return cursor_of(lhs) < cursor_of(rhs);
+  });
+  if (orders.size() > query.limit) {
+    more = true;
+    orders.resize(query.limit);
+  }
+
+  output.write("Sell orders:\n");
+  for (auto const & order : orders) {
+    output.print("- {}\n", order);
+  }
+  if (more) {
+    auto const next = cursor_of(orders.back());
+    output.print("More orders: repeat with after={}:{}\n", next.key, next.id);
+  }
+  co_return std::string();
+}
+
+std::string Stats::execute(User const &, std::shared_ptr<SharedState> const & shared_state) {
+  std::size_t expiry_backlog = 0;
+  for (auto const & shard : shared_state->shards) {
+    expiry_backlog += shard->expiry_backlog.load(std::memory_order_relaxed);
+  }
+  return fmt::format("{}Expired sell orders waiting to be settled: {}\n", shared_state->command_stats->format(),
+                     expiry_backlog);
+}
+
+std::string SqlStats::execute(User const &, std::shared_ptr<SharedState> const & shared_state) {
+  return format_sql_profiles(shared_state->shards.front()->storage->sql_profiles());
+}
+
+asio::awaitable<std::string> SqlStats::execute_across_shards(User const &,
+                                                             std::shared_ptr<SharedState> const & shared_state) {
+  // Shards run the same statements, so they are summed up by SQL text
+  std::vector<Sqlite3::StatementProfile> profiles;
+  std::unordered_map<std::string, std::size_t> indexes;
+  for (auto const & shard : shared_state->shards) {
+    auto shard_profiles = co_await shard->storage_executor.run([&]() { return shard->storage->sql_profiles(); });
+    for (auto & profile : shard_profiles) {
+      auto const [it, inserted] = indexes.emplace(profile.sql, profiles.size());
+      if (inserted) {
+        profiles.push_back(std::move(profile));
+        continue;
+      }
+      auto & total = profiles[it->second];
+      total.calls += profile.calls;
+      total.rows += profile.rows;
+      total.fullscan_steps += profile.fullscan_steps;
+      total.vm_steps += profile.vm_steps;
+      total.total_time += profile.total_time;
+      total.max_time = std::max(total.max_time, profile.max_time);
+    }
+  }
+  std::sort(profiles.begin(), profiles.end(),
+            [](auto const & lhs, auto const & rhs) { return lhs.total_time > rhs.total_time; });
+  co_return format_sql_profiles(profiles);
 }
 
 std::string Quit::execute(User const &, std::shared_ptr<SharedState> const &) {
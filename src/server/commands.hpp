@@ -1,7 +1,11 @@
 #pragma once
 
+#include "response_writer.hpp"
 #include "types.hpp"
 
+#include <asio/awaitable.hpp>
+
+#include <cstddef>
 #include <memory>
 #include <string_view>
 
@@ -48,7 +52,8 @@ struct Withdraw {
 // lists all items in the inventory for the current user
 struct ViewItems {
   static std::optional<ViewItems> parse(std::string_view) { return ViewItems{}; }
-  std::string execute(User const & user, std::shared_ptr<SharedState> const & shared_state);
+  // Listings are written to `output` as they are read, only errors are returned
+  std::string execute(User const & user, std::shared_ptr<SharedState> const & shared_state, ResponseWriter & output);
 };
 
 // places a sell order
@@ -76,13 +81,48 @@ struct Buy {
   std::optional<int> bid;
 
   static std::optional<Buy> parse(std::string_view args);
+  // With a single shard
   std::string execute(User const & user, std::shared_ptr<SharedState> const & shared_state);
+  // The order may be in another shard, so the trade goes through `CrossShardCoordinator`
+  asio::awaitable<std::string> execute_across_shards(User const & user,
+                                                     std::shared_ptr<SharedState> const & shared_state);
 };
 
-// lists all sell orders from all users
+// lists sell orders from all users, a page at a time
 struct ViewSellOrders {
-  static std::optional<ViewSellOrders> parse(std::string_view) { return ViewSellOrders{}; }
+  static constexpr std::size_t kDefaultPageSize = 50;
+  static constexpr std::size_t kMaxPageSize = 1000;
+
+  SellOrdersQuery query;
+
+  // args are optional `key=value` pairs in any order: item, seller, type (immediate|auction), min_price, max_price,
+  // sort (id|price|expiration), limit and after (the cursor printed at the end of the previous page).
+  // Values may contain spaces, the next `key=` ends them.
+  // Examples:
+  // - "" -> the first 50 orders by id
+  // - "item=holy sword sort=price limit=10" -> the 10 cheapest "holy sword" orders
+  // - "sort=price after=150:42" -> orders by price, starting after the order #42 that costs 150
+  static std::optional<ViewSellOrders> parse(std::string_view args);
+  // With a single shard
+  std::string execute(User const &, std::shared_ptr<SharedState> const & shared_state, ResponseWriter & output);
+  // Pages of all shards are merged into one
+  asio::awaitable<std::string> execute_across_shards(User const &, std::shared_ptr<SharedState> const & shared_state,
+                                                     ResponseWriter & output);
+};
+
+// prints counters and latencies of all commands, see `CommandStats`
+struct Stats {
+  static std::optional<Stats> parse(std::string_view) { return Stats{}; }
+  std::string execute(User const &, std::shared_ptr<SharedState> const & shared_state);
+};
+
+// prints time and rows of SQL statements, if the server runs with `--sql-profile`
+struct SqlStats {
+  static std::optional<SqlStats> parse(std::string_view) { return SqlStats{}; }
+  // With a single shard
   std::string execute(User const &, std::shared_ptr<SharedState> const & shared_state);
+  // Statements of all shards are summed up
+  asio::awaitable<std::string> execute_across_shards(User const &, std::shared_ptr<SharedState> const & shared_state);
 };
 
 struct Quit {
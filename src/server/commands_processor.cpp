@@ -1,8 +1,15 @@
 #include "commands_processor.hpp"
 #include "commands.hpp"
 
+#include <asio/post.hpp>
+#include <asio/this_coro.hpp>
 #include <fmt/format.h>
 
+#include <array>
+#include <chrono>
+#include <functional>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 
@@ -17,9 +24,59 @@ std::pair<std::string_view, std::string_view> parse_command_name(std::string_vie
   return { request.substr(0, space_pos), request.substr(space_pos + 1) };
 }
 
-using Command =
-    std::variant<commands::Ping, commands::Whoami, commands::Quit, commands::Help, commands::Deposit,
-                 commands::Withdraw, commands::ViewItems, commands::Sell, commands::Buy, commands::ViewSellOrders>;
+using Command = std::variant<commands::Ping, commands::Whoami, commands::Quit, commands::Help, commands::Deposit,
+                             commands::Withdraw, commands::ViewItems, commands::Sell, commands::Buy,
+                             commands::ViewSellOrders, commands::Stats, commands::SqlStats>;
+
+// Commands that don't touch the storage are cheap, so they are executed right on the network thread
+template <typename T>
+constexpr bool kRunsOnStorageThread =
+    !std::is_same_v<T, commands::Ping> && !std::is_same_v<T, commands::Whoami> &&
+    !std::is_same_v<T, commands::Quit> && !std::is_same_v<T, commands::Help> && !std::is_same_v<T, commands::Stats>;
+
+// Commands that change items share transactions with each other, see `GroupCommit`
+template <typename T>
+constexpr bool kRunsInBatch = std::is_same_v<T, commands::Deposit> || std::is_same_v<T, commands::Withdraw> ||
+                              std::is_same_v<T, commands::Sell> || std::is_same_v<T, commands::Buy>;
+
+// Read-only commands that don't need the latest uncommitted state, so they run on the read pool threads if there is
+// a pool (otherwise on the storage thread) and never wait behind trades
+template <typename T>
+constexpr bool kRunsOnReadPool = std::is_same_v<T, commands::ViewItems>;
+
+// Commands with long responses write them to a `ResponseWriter`, so they are sent in chunks
+template <typename T>
+constexpr bool kStreamsResponse = requires(T & command, User const & user,
+                                           std::shared_ptr<SharedState> const & shared_state, ResponseWriter & output) {
+  command.execute(user, shared_state, output);
+};
+
+// Commands that go to other shards (or to all of them) on their own, if there are several shards
+template <typename T>
+constexpr bool kRunsAcrossShards =
+    requires(T & command, User const & user, std::shared_ptr<SharedState> const & shared_state) {
+      command.execute_across_shards(user, shared_state);
+    } || requires(T & command, User const & user, std::shared_ptr<SharedState> const & shared_state,
+                  ResponseWriter & output) { command.execute_across_shards(user, shared_state, output); };
+
+// Same as `execute` in `CommandsProcessor::process_request`, but for `kRunsAcrossShards` commands. Parameters are
+// references, as a coroutine keeps them instead of copies
+template <typename T>
+asio::awaitable<std::string> execute_across_shards(T & command, User const & user,
+                                                   std::shared_ptr<SharedState> const & shared_state,
+                                                   ResponseWriter & output, bool & failed) {
+  if constexpr (!kRunsAcrossShards<T>) {
+    co_return std::string();  // never called
+  } else if constexpr (kStreamsResponse<T>) {
+    std::string error = co_await command.execute_across_shards(user, shared_state, output);
+    failed = !error.empty();
+    co_return failed ? error : output.take();
+  } else {
+    std::string response = co_await command.execute_across_shards(user, shared_state);
+    failed = response.starts_with("Failed");
+    co_return response;
+  }
+}
 
 template <typename T>
 std::optional<Command> parse(std::string_view args) {
@@ -29,33 +86,145 @@ std::optional<Command> parse(std::string_view args) {
   return std::nullopt;
 }
 
-std::unordered_map<std::string_view, std::optional<Command> (*)(std::string_view)> kCommandParsers{
-  { "ping", parse<commands::Ping> },
-  { "whoami", parse<commands::Whoami> },
-  { "help", parse<commands::Help> },
-  { "quit", parse<commands::Quit> },
-  { "deposit", parse<commands::Deposit> },
-  { "withdraw", parse<commands::Withdraw> },
-  { "view_items", parse<commands::ViewItems> },
-  { "sell", parse<commands::Sell> },
-  { "buy", parse<commands::Buy> },
-  { "view_sell_orders", parse<commands::ViewSellOrders> },
+struct CommandParser {
+  std::string_view name;
+  std::optional<Command> (*parse)(std::string_view);
+};
+
+// Position of a command here is also its index in `CommandStats`
+constexpr std::array kCommandParsers{
+  CommandParser{ "ping", parse<commands::Ping> },
+  CommandParser{ "whoami", parse<commands::Whoami> },
+  CommandParser{ "help", parse<commands::Help> },
+  CommandParser{ "quit", parse<commands::Quit> },
+  CommandParser{ "deposit", parse<commands::Deposit> },
+  CommandParser{ "withdraw", parse<commands::Withdraw> },
+  CommandParser{ "view_items", parse<commands::ViewItems> },
+  CommandParser{ "sell", parse<commands::Sell> },
+  CommandParser{ "buy", parse<commands::Buy> },
+  CommandParser{ "view_sell_orders", parse<commands::ViewSellOrders> },
+  CommandParser{ "stats", parse<commands::Stats> },
+  CommandParser{ "sql_stats", parse<commands::SqlStats> },
 };
 
+std::unordered_map<std::string_view, std::size_t> const kCommandIndexes = []() {
+  std::unordered_map<std::string_view, std::size_t> indexes;
+  for (std::size_t i = 0; i < kCommandParsers.size(); ++i) {
+    indexes.emplace(kCommandParsers[i].name, i);
+  }
+  return indexes;
+}();
+
 }  // namespace
 
-std::string CommandsProcessor::process_request(std::string_view request) {
+std::vector<std::string_view> CommandsProcessor::command_names() {
+  std::vector<std::string_view> names;
+  for (auto const & parser : kCommandParsers) {
+    names.push_back(parser.name);
+  }
+  return names;
+}
+
+asio::awaitable<std::string> CommandsProcessor::process_request(std::string_view request) {
+  using Clock = std::chrono::steady_clock;
+  CommandStats & stats = *shared_state->command_stats;
+  auto const started_at = Clock::now();
+
   auto const [command_name, args] = parse_command_name(request);
-  auto const it = kCommandParsers.find(command_name);
-  if (it == kCommandParsers.end()) {
+  auto const it = kCommandIndexes.find(command_name);
+  if (it == kCommandIndexes.end()) {
+    processed_commands |= CommandStats::mask(stats.unknown_command());
+    stats.count(stats.unknown_command(), true);
     auto const help_str = commands::Help{}.execute(user, shared_state);
-    return fmt::format("Failed to execute unknown command '{}'. {}", command_name, help_str);
+    co_return fmt::format("Failed to execute unknown command '{}'. {}", command_name, help_str);
   }
+  std::size_t const index = it->second;
+  processed_commands |= CommandStats::mask(index);
 
-  auto command = std::invoke(it->second, args);
+  auto command = kCommandParsers[index].parse(args);
+  auto const parsed_at = Clock::now();
+  stats.record(index, CommandStats::Stage::Parse, parsed_at - started_at);
   if (!command) {
-    return fmt::format("Failed to parse arguments for command '{}'", command_name);
+    stats.count(index, true);
+    co_return fmt::format("Failed to parse arguments for command '{}'", command_name);
+  }
+
+  // `std::visit` can't co_await, so it only tells where the command should be executed
+  bool const across_shards =
+      shared_state->shards.size() > 1 &&
+      std::visit([](auto & command) { return kRunsAcrossShards<std::decay_t<decltype(command)>>; }, *command);
+  // Otherwise commands run on the shard of the user
+  Shard & shard = shared_state->shard_of(user.id);
+  bool const on_read_pool =
+      shard.read_pool &&
+      std::visit([](auto & command) { return kRunsOnReadPool<std::decay_t<decltype(command)>>; }, *command);
+  bool const in_batch =
+      std::visit([](auto & command) { return kRunsInBatch<std::decay_t<decltype(command)>>; }, *command);
+  bool const on_storage_thread =
+      !on_read_pool &&
+      std::visit([](auto & command) { return kRunsOnStorageThread<std::decay_t<decltype(command)>>; }, *command);
+  // Full chunks of long responses are handed to the connection's strand right away. They are posted before the
+  // command completes, so they are delivered before the rest of the response
+  std::function<void(std::string)> flush;
+  if (on_partial_response) {
+    auto executor = co_await asio::this_coro::executor;
+    flush = [this, executor = std::move(executor)](std::string chunk) {
+      asio::post(executor, [this, chunk = std::move(chunk)]() mutable { on_partial_response(std::move(chunk)); });
+    };
   }
+  ResponseWriter output(std::move(flush));
+
+  // Measured where the command runs, so the time spent in the storage thread queue is recorded separately
+  Clock::duration execute_time{};
+  bool failed = false;
+  auto execute = [this, &command, &execute_time, &failed, &output]() {
+    auto const start = Clock::now();
+    auto response = std::visit(
+        [&](auto & command) {
+          if constexpr (kStreamsResponse<std::decay_t<decltype(command)>>) {
+            // Only errors are returned, the listing itself is in the output
+            std::string error = command.execute(user, shared_state, output);
+            failed = !error.empty();
+            return failed ? error : output.take();
+          } else {
+            std::string response = command.execute(user, shared_state);
+            // All errors are reported to the user as "Failed to ..."
+            failed = response.starts_with("Failed");
+            return response;
+          }
+        },
+        *command);
+    execute_time = Clock::now() - start;
+    return response;
+  };
 
-  return std::visit([this](auto & command) { return command.execute(user, shared_state); }, *command);
+  std::string response;
+  if (across_shards) {
+    // It waits for the shards on its own, so there is no queue time to tell apart
+    auto const start = Clock::now();
+    response = co_await std::visit(
+        [&](auto & command) { return execute_across_shards(command, user, shared_state, output, failed); }, *command);
+    execute_time = Clock::now() - start;
+  } else if (on_read_pool) {
+    response = co_await shard.read_pool->run(execute);
+    stats.record(index, CommandStats::Stage::Queue, Clock::now() - parsed_at - execute_time);
+  } else if (in_batch) {
+    // The response is ready only once the batch is committed, so the commit is a part of the queue time
+    auto result = co_await shard.group_commit.run(execute);
+    if (result) {
+      response = std::move(*result);
+    } else {
+      failed = true;
+      response = fmt::format("Failed to commit the transaction: {}", result.error());
+    }
+    stats.record(index, CommandStats::Stage::Queue, Clock::now() - parsed_at - execute_time);
+  } else if (on_storage_thread) {
+    response = co_await shard.storage_executor.run(execute);
+    stats.record(index, CommandStats::Stage::Queue, Clock::now() - parsed_at - execute_time);
+  } else {
+    response = execute();
+  }
+  stats.record(index, CommandStats::Stage::Execute, execute_time);
+  stats.count(index, failed);
+  co_return response;
 }
@@ -2,14 +2,37 @@
 
 #include "shared_state.hpp"
 
+#include <asio/awaitable.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
 struct CommandsProcessor final {
   User user;
   std::shared_ptr<SharedState> shared_state;
+  // Called on the connection's strand with full chunks of long responses while the command is still running. The
+  // rest of the response is returned by `process_request`. If not set, the whole response is returned
+  std::function<void(std::string)> on_partial_response;
+
+private:
+  // `CommandStats` mask of the commands processed since the last `take_processed_commands()`
+  uint32_t processed_commands = 0;
 
 public:
   CommandsProcessor(User user, std::shared_ptr<SharedState> shared_state)
       : user(std::move(user)), shared_state(std::move(shared_state)) {}
 
-  // parses and executes a command
-  std::string process_request(std::string_view request);
+  // parses and executes a command. Commands that touch the storage are executed on the storage thread of the user's
+  // shard, read-only listings on the read pool threads
+  asio::awaitable<std::string> process_request(std::string_view request);
+
+  // Commands whose responses are about to be written, so `WriteQueue` can record the write latency for them
+  uint32_t take_processed_commands() { return std::exchange(processed_commands, 0); }
+
+  // Names of all commands in the order of their indexes in `CommandStats`
+  static std::vector<std::string_view> command_names();
 };
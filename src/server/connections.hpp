@@ -0,0 +1,46 @@
+#pragma once
+
+#include "types.hpp"
+#include "write_queue.hpp"
+
+#include <asio/any_io_executor.hpp>
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+// Connection of a logged in user
+struct Connection {
+  std::shared_ptr<WriteQueue> output;
+  // Per-connection strand. All operations with the socket and `output` must be executed on it
+  asio::any_io_executor executor;
+};
+
+// Thread-safe UserId -> Connection map for sending notifications
+class Connections final {
+  std::unordered_map<UserId, Connection> connections;
+  mutable std::mutex mutex;
+
+public:
+  void add(UserId user_id, Connection connection) {
+    std::lock_guard lock(mutex);
+    connections[user_id] = std::move(connection);
+  }
+
+  // Removes the connection, unless the user has already reconnected with another socket
+  void remove(UserId user_id, std::shared_ptr<WriteQueue> const & output) {
+    std::lock_guard lock(mutex);
+    if (auto const it = connections.find(user_id); it != connections.end() && it->second.output == output) {
+      connections.erase(it);
+    }
+  }
+
+  std::optional<Connection> find(UserId user_id) const {
+    std::lock_guard lock(mutex);
+    if (auto const it = connections.find(user_id); it != connections.end()) {
+      return it->second;
+    }
+    return std::nullopt;
+  }
+};
@@ -0,0 +1,479 @@
+#include "coordinator.hpp"
+
+#include <asio/co_spawn.hpp>
+#include <asio/post.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/strand.hpp>
+#include <asio/this_coro.hpp>
+#include <asio/use_awaitable.hpp>
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <optional>
+
+namespace {
+// Result of `GroupCommit::run` for a function that may fail on its own
+template <typename T>
+tl::expected<T, std::string> flatten(tl::expected<tl::expected<T, std::string>, std::string> result) {
+  return std::move(result).and_then([](auto && inner) { return std::move(inner); });
+}
+
+// Step of a transaction on one of the shards, see `run_concurrently`
+using Step = asio::awaitable<tl::expected<void, std::string>>;
+
+// Runs `f` as a part of a batch of the shard, see `GroupCommit::run`
+template <typename F>
+Step run_on(Shard & shard, F f) {
+  co_return flatten(co_await shard.group_commit.run(std::move(f)));
+}
+
+Storage::PreparedChange credit(UserId user_id, std::string_view item_name, int quantity, int order_id) {
+  return Storage::PreparedChange{
+    .kind = Storage::PreparedChange::Kind::Credit,
+    .user_id = user_id,
+    .item_name = std::string(item_name),
+    .quantity = quantity,
+    .order_id = order_id,
+  };
+}
+
+Storage::PreparedChange restore(OrderBook::Order const & order) {
+  return Storage::PreparedChange{
+    .kind = Storage::PreparedChange::Kind::RestoreOrder,
+    .user_id = order.seller_id,
+    .item_name = order.item_name,
+    .quantity = order.quantity,
+    .order_id = order.id,
+    .price = order.price,
+    .unix_expiration_time = order.unix_expiration_time,
+    .buyer_id = order.buyer_id,
+  };
+}
+
+// Takes funds from the buyer and gives them back if the transaction is aborted. Runs within a transaction
+tl::expected<void, std::string> reserve_funds(Storage & storage, int64_t transaction_id, UserId buyer_id, int amount,
+                                              int order_id) {
+  return storage.sub_user_item(buyer_id, storage.funds_item_id(), amount)
+      .map_error([](auto &&) { return std::string("Not enough funds to buy"); })
+      .and_then([&]() {
+        return storage.log(LogRecord{
+            .kind = LogRecord::Kind::TransferredOut,
+            .user_id = buyer_id,
+            .item_id = storage.funds_item_id(),
+            .quantity = amount,
+            .order_id = order_id,
+        });
+      })
+      .and_then([&]() {
+        return storage.prepare(transaction_id, credit(buyer_id, storage.funds_item_name(), amount, order_id), false);
+      });
+}
+
+// Runs `f` in a nested transaction, so whatever a failed prepare has done is rolled back
+template <typename F>
+tl::expected<void, std::string> in_transaction(Storage & storage, F && f) {
+  auto transaction_guard = storage.begin_transaction();
+  if (!transaction_guard) {
+    return tl::make_unexpected(fmt::format("Failed to start transaction: {}", transaction_guard.error()));
+  }
+  return f().and_then([&]() { return transaction_guard->commit(); });
+}
+
+// The seller's part of a sale: takes the order out of the book and gives funds to the seller once committed
+tl::expected<OrderBook::Order, std::string> prepare_sale(Storage & storage, int64_t transaction_id,
+                                                         int sell_order_id) {
+  auto order = storage.get_sell_order_info(sell_order_id);
+  if (!order) {
+    return tl::make_unexpected(fmt::format("Immediate sell order #{} doesn't exist", sell_order_id));
+  }
+  if (order->type() != SellOrderType::Immediate) {
+    return tl::make_unexpected(fmt::format("Sell order #{} is not an immediate sell order", sell_order_id));
+  }
+  // The buyer is from another shard, so they can't be the seller
+  std::optional<OrderBook::Order> taken;
+  auto prepared = in_transaction(storage, [&]() {
+    return storage.take_sell_order(sell_order_id).and_then([&](OrderBook::Order order) {
+      taken = std::move(order);
+      return storage.prepare(transaction_id, restore(*taken), false).and_then([&]() {
+        return storage.prepare(
+            transaction_id, credit(taken->seller_id, storage.funds_item_name(), taken->price, taken->id), true);
+      });
+    });
+  });
+  return prepared.map([&]() { return std::move(*taken); });
+}
+
+// The bid an auction had before a new one, so the previous buyer can be refunded by their shard
+struct PreparedBid {
+  std::optional<UserId> previous_buyer_id;
+  int previous_bid;
+};
+
+// The auction's part of a bid: takes the order out of the book and puts it back with the new bid once committed.
+// The buyer and the previous buyer are handled here too, if they are from the same shard. Places the bid right away
+// (and returns std::nullopt) if all of them are
+tl::expected<std::optional<PreparedBid>, std::string> prepare_bid(Shard & shard, int64_t transaction_id,
+                                                                  User const & buyer, int sell_order_id, int bid) {
+  Storage & storage = *shard.storage;
+  UserId const buyer_id = buyer.id;
+  auto order = storage.get_sell_order_info(sell_order_id);
+  if (!order) {
+    return tl::make_unexpected(fmt::format("Sell order #{} doesn't exist", sell_order_id));
+  }
+  if (order->type() != SellOrderType::Auction) {
+    return tl::make_unexpected(fmt::format("Sell order #{} is not an auction sell order", sell_order_id));
+  }
+  if (buyer_id == order->seller_id) {
+    return tl::make_unexpected("You cannot bid on your own auction orders");
+  }
+  if (bid <= order->price) {
+    return tl::make_unexpected("Bid must be greater than the current price");
+  }
+  if (storage.owns_user(buyer_id) && (!order->buyer_id || storage.owns_user(*order->buyer_id))) {
+    return shard.auction_service.place_bid_on_auction_sell_order(buyer_id, sell_order_id, bid).map([]() {
+      return std::optional<PreparedBid>();
+    });
+  }
+
+  std::optional<PreparedBid> result;
+  auto prepared = in_transaction(storage, [&]() {
+    return storage.take_sell_order(sell_order_id).and_then([&](OrderBook::Order taken) {
+      result = PreparedBid{ .previous_buyer_id = taken.buyer_id, .previous_bid = taken.price };
+      auto with_bid = taken;
+      with_bid.buyer_id = buyer_id;
+      with_bid.price = bid;
+      return storage.prepare(transaction_id, restore(taken), false)
+          .and_then([&]() -> tl::expected<void, std::string> {
+            // The order refers to the buyer
+            if (storage.owns_user(buyer_id)) {
+              return {};
+            }
+            return storage.add_foreign_user(buyer);
+          })
+          .and_then([&]() { return storage.prepare(transaction_id, restore(with_bid), true); })
+          .and_then([&]() -> tl::expected<void, std::string> {
+            if (!taken.buyer_id || !storage.owns_user(*taken.buyer_id)) {
+              return {};
+            }
+            return storage.prepare(transaction_id,
+                                   credit(*taken.buyer_id, storage.funds_item_name(), taken.price, taken.id), true);
+          })
+          .and_then([&]() -> tl::expected<void, std::string> {
+            if (!storage.owns_user(buyer_id)) {
+              return {};
+            }
+            return reserve_funds(storage, transaction_id, buyer_id, bid, taken.id);
+          });
+    });
+  });
+  return prepared.map([&]() { return result; });
+}
+}  // namespace
+
+asio::awaitable<tl::expected<void, std::string>> run_concurrently(std::vector<Step> steps) {
+  if (steps.size() == 1) {
+    co_return co_await std::move(steps.front());
+  }
+
+  // Steps complete on a strand, so they don't race for the state. It outlives them, as this frame waits for all
+  auto strand = asio::make_strand(co_await asio::this_coro::executor);
+  std::size_t pending = steps.size();
+  tl::expected<void, std::string> result;
+  std::exception_ptr exception;
+  // Never expires, cancelled once the last step is done
+  asio::steady_timer done(strand, asio::steady_timer::time_point::max());
+  for (auto & step : steps) {
+    asio::co_spawn(strand, std::move(step), [&](std::exception_ptr e, tl::expected<void, std::string> step_result) {
+      if (e && !exception) {
+        exception = e;
+      } else if (!e && !step_result && result) {
+        result = std::move(step_result);
+      }
+      if (--pending == 0) {
+        done.cancel();
+      }
+    });
+  }
+  co_await asio::co_spawn(
+      strand,
+      [&]() -> asio::awaitable<void> {
+        if (pending > 0) {
+          try {
+            co_await done.async_wait(asio::use_awaitable);
+          } catch (std::exception &) {
+            // Cancelled by the last step
+          }
+        }
+      },
+      asio::use_awaitable);
+  if (exception) {
+    std::rethrow_exception(exception);
+  }
+  co_return result;
+}
+
+tl::expected<std::shared_ptr<CrossShardCoordinator>, std::string> CrossShardCoordinator::open(
+    std::string_view path, std::vector<std::shared_ptr<Shard>> shards, asio::any_io_executor executor) {
+  std::string const path_str(path);
+  auto db = Sqlite3::open(path_str.c_str());
+  if (!db) {
+    return tl::make_unexpected(fmt::format("Failed to open database: {}", db.error()));
+  }
+  // Unlike the shards, every commit is synced: a decision lost in a power loss would abort a transaction that some
+  // shards have already committed, see `Storage::commit_transaction`
+  db->execute("PRAGMA journal_mode=WAL");
+  db->execute("PRAGMA synchronous=FULL");
+
+  auto result = db->execute("CREATE TABLE IF NOT EXISTS committed_transactions (id INTEGER PRIMARY KEY) STRICT");
+  if (!result) {
+    return tl::make_unexpected(fmt::format("Failed to create 'committed_transactions' table: {}", result.error()));
+  }
+
+  int64_t last_transaction_id = 0;
+  result = db->query("SELECT IFNULL(MAX(id), 0) FROM committed_transactions").and_then([&](auto select) {
+    return select.template for_each_row<int64_t>([&](int64_t id) { last_transaction_id = id; });
+  });
+  if (!result) {
+    return tl::make_unexpected(fmt::format("Failed to get the last transaction: {}", result.error()));
+  }
+
+  // Constructed with `new`, as the constructor is private
+  return std::shared_ptr<CrossShardCoordinator>(
+      new CrossShardCoordinator(std::move(shards), std::move(executor), std::move(*db), last_transaction_id));
+}
+
+tl::expected<std::size_t, std::string> CrossShardCoordinator::recover() {
+  std::size_t recovered = 0;
+  for (auto const & shard : shards) {
+    auto ids = shard->storage->prepared_transactions();
+    if (!ids) {
+      return tl::make_unexpected(fmt::format("Failed to get prepared transactions: {}", ids.error()));
+    }
+    for (int64_t const id : *ids) {
+      bool committed = false;
+      auto result =
+          db.query("SELECT COUNT(*) FROM committed_transactions WHERE id = ?1", id)
+              .and_then([&](auto select) {
+                return select.template for_each_row<int>([&](int count) { committed = count > 0; });
+              })
+              .and_then([&]() { return shard->storage->finish_prepared(id, committed); });
+      if (!result) {
+        return tl::make_unexpected(fmt::format("Failed to finish transaction #{}: {}", id, result.error()));
+      }
+      ++recovered;
+    }
+  }
+  // Every shard has finished everything it has prepared
+  auto cleared = db.execute("DELETE FROM committed_transactions");
+  if (!cleared) {
+    return tl::make_unexpected(fmt::format("Failed to clear commit decisions: {}", cleared.error()));
+  }
+  return recovered;
+}
+
+asio::awaitable<tl::expected<SellOrderExecutionInfo, std::string>> CrossShardCoordinator::buy(UserId buyer_id,
+                                                                                              int sell_order_id) {
+  std::size_t const seller_index = shard_index(sell_order_id);
+  std::size_t const buyer_index = shard_index(buyer_id);
+  Shard & seller_shard = *shards[seller_index];
+  Shard & buyer_shard = *shards[buyer_index];
+  if (seller_index == buyer_index) {
+    co_return flatten(co_await seller_shard.group_commit.run(
+        [&]() { return seller_shard.auction_service.execute_immediate_sell_order(buyer_id, sell_order_id); }));
+  }
+
+  int64_t const transaction_id = next_transaction_id();
+  auto order = flatten(co_await seller_shard.group_commit.run(
+      [&]() { return prepare_sale(*seller_shard.storage, transaction_id, sell_order_id); }));
+  if (!order) {
+    co_return tl::make_unexpected(std::move(order.error()));
+  }
+  // Funds are taken from the buyer right away, while items are given once the transaction is committed
+  auto paid = flatten(co_await buyer_shard.group_commit.run([&]() {
+    Storage & storage = *buyer_shard.storage;
+    return in_transaction(storage, [&]() {
+      return reserve_funds(storage, transaction_id, buyer_id, order->price, order->id).and_then([&]() {
+        return storage.prepare(transaction_id, credit(buyer_id, order->item_name, order->quantity, order->id), true);
+      });
+    });
+  }));
+
+  std::vector<std::size_t> participants{ seller_index, buyer_index };
+  auto decided = co_await decide(transaction_id, paid.has_value(), std::move(participants));
+  if (!paid) {
+    co_return tl::make_unexpected(std::move(paid.error()));
+  }
+  co_return decided.map([&]() {
+    return SellOrderExecutionInfo{
+      .id = order->id,
+      .seller_id = order->seller_id,
+      .buyer_id = buyer_id,
+      .item_id = order->item_id,
+      .quantity = order->quantity,
+      .price = order->price,
+    };
+  });
+}
+
+asio::awaitable<tl::expected<void, std::string>> CrossShardCoordinator::bid(User buyer, int sell_order_id, int bid) {
+  UserId const buyer_id = buyer.id;
+  std::size_t const seller_index = shard_index(sell_order_id);
+  std::size_t const buyer_index = shard_index(buyer_id);
+  Shard & seller_shard = *shards[seller_index];
+
+  int64_t const transaction_id = next_transaction_id();
+  auto prepared = flatten(co_await seller_shard.group_commit.run(
+      [&]() { return prepare_bid(seller_shard, transaction_id, buyer, sell_order_id, bid); }));
+  if (!prepared) {
+    co_return tl::make_unexpected(std::move(prepared.error()));
+  }
+  if (!*prepared) {
+    co_return tl::expected<void, std::string>{};  // placed by the shard of the auction alone
+  }
+
+  std::vector<std::size_t> participants{ seller_index };
+  std::optional<UserId> const previous_buyer_id = (*prepared)->previous_buyer_id;
+  int const previous_bid = (*prepared)->previous_bid;
+  std::optional<std::size_t> previous_buyer_index;
+  if (previous_buyer_id && shard_index(*previous_buyer_id) != seller_index) {
+    previous_buyer_index = shard_index(*previous_buyer_id);
+  }
+
+  // The buyer and the previous buyer don't depend on each other
+  std::vector<Step> steps;
+  if (buyer_index != seller_index) {
+    participants.push_back(buyer_index);
+    steps.push_back(run_on(*shards[buyer_index], [&, &storage = *shards[buyer_index]->storage]() {
+      return in_transaction(storage, [&]() {
+        return reserve_funds(storage, transaction_id, buyer_id, bid, sell_order_id)
+            .and_then([&]() -> tl::expected<void, std::string> {
+              if (previous_buyer_index != buyer_index) {
+                return {};
+              }
+              return storage.prepare(
+                  transaction_id, credit(*previous_buyer_id, storage.funds_item_name(), previous_bid, sell_order_id),
+                  true);
+            });
+      });
+    }));
+  }
+  if (previous_buyer_index && previous_buyer_index != buyer_index) {
+    participants.push_back(*previous_buyer_index);
+    steps.push_back(run_on(*shards[*previous_buyer_index], [&, &storage = *shards[*previous_buyer_index]->storage]() {
+      return in_transaction(storage, [&]() {
+        return storage.prepare(transaction_id,
+                               credit(*previous_buyer_id, storage.funds_item_name(), previous_bid, sell_order_id),
+                               true);
+      });
+    }));
+  }
+  tl::expected<void, std::string> result;
+  if (!steps.empty()) {
+    result = co_await run_concurrently(std::move(steps));
+  }
+
+  auto decided = co_await decide(transaction_id, result.has_value(), std::move(participants));
+  if (!result) {
+    co_return result;
+  }
+  co_return decided;
+}
+
+asio::awaitable<tl::expected<void, std::string>> CrossShardCoordinator::settle(int64_t transaction_id,
+                                                                               std::size_t seller_shard,
+                                                                               std::vector<Settlement> settlements) {
+  std::map<std::size_t, std::vector<Settlement>> by_shard;
+  for (auto & settlement : settlements) {
+    by_shard[shard_index(settlement.buyer_id)].push_back(std::move(settlement));
+  }
+
+  std::vector<std::size_t> participants{ seller_shard };
+  std::vector<Step> steps;
+  for (auto const & [index, buyers] : by_shard) {
+    participants.push_back(index);
+    steps.push_back(run_on(*shards[index], [&, &storage = *shards[index]->storage, &buyers = buyers]() {
+      return in_transaction(storage, [&]() -> tl::expected<void, std::string> {
+        for (auto const & settlement : buyers) {
+          auto prepared = storage.prepare(
+              transaction_id,
+              credit(settlement.buyer_id, settlement.item_name, settlement.quantity, settlement.order_id), true);
+          if (!prepared) {
+            return prepared;
+          }
+        }
+        return {};
+      });
+    }));
+  }
+  auto result = co_await run_concurrently(std::move(steps));
+
+  auto decided = co_await decide(transaction_id, result.has_value(), std::move(participants), seller_shard);
+  if (!result) {
+    co_return result;
+  }
+  co_return decided;
+}
+
+asio::awaitable<tl::expected<void, std::string>> CrossShardCoordinator::decide(
+    int64_t transaction_id, bool commit, std::vector<std::size_t> participants,
+    std::optional<std::size_t> expiring_shard) {
+  tl::expected<void, std::string> result;
+  if (commit) {
+    result = co_await executor.run([&]() { return log_commit(transaction_id); });
+    if (!result) {
+      result = tl::make_unexpected(fmt::format("Failed to commit: {}", result.error()));
+    }
+  }
+  bool const committed = commit && result.has_value();
+
+  // Participants finish independently, each as a part of its next batch
+  std::vector<Step> steps;
+  for (std::size_t const index : participants) {
+    steps.push_back(run_on(*shards[index], [&, index, &shard = *shards[index]]() {
+      auto finished = shard.storage->finish_prepared(transaction_id, committed);
+      if (!finished) {
+        // It's still prepared, so it will be finished on the next start
+        fmt::println("Failed to finish cross-shard transaction #{} on shard {}: {}", transaction_id, index,
+                     finished.error());
+      }
+      // Expired orders that are put back would be settled again right away
+      if (!committed && index == expiring_shard) {
+        shard.expiry_timer.retry_later();
+      }
+      // Restored orders may expire before the timer is set to
+      if (auto const next_expiration_time = shard.storage->next_expiration_time()) {
+        shard.expiry_timer.schedule(*next_expiration_time);
+      }
+      return finished;
+    }));
+  }
+  bool const finished_everywhere = (co_await run_concurrently(std::move(steps))).has_value();
+  if (committed && finished_everywhere) {
+    asio::post(executor.get(), [this, transaction_id]() { finished.push_back(transaction_id); });
+  }
+  co_return result;
+}
+
+tl::expected<void, std::string> CrossShardCoordinator::log_commit(int64_t transaction_id) {
+  auto result = db.execute("BEGIN");
+  if (!result) {
+    return result;
+  }
+  for (int64_t const id : finished) {
+    result = db.execute("DELETE FROM committed_transactions WHERE id = ?1", id);
+    if (!result) {
+      break;
+    }
+  }
+  result = result.and_then([&]() {
+    return db.execute("INSERT INTO committed_transactions (id) VALUES (?1)", transaction_id);
+  }).and_then([&]() { return db.execute("COMMIT"); });
+  if (!result) {
+    db.execute("ROLLBACK");
+    return result;
+  }
+  finished.clear();
+  return {};
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "shard.hpp"
+#include "sqlite3.hpp"
+#include "storage_executor.hpp"
+#include "types.hpp"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <tl/expected.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Runs steps of a transaction on different shards at the same time, so it waits for the slowest shard rather than
+// for all of them one after another. Returns the first error once all steps are done. If a step throws, the first
+// exception is rethrown instead, also once all steps are done
+asio::awaitable<tl::expected<void, std::string>> run_concurrently(
+    std::vector<asio::awaitable<tl::expected<void, std::string>>> steps);
+
+// Trades between users of different shards as two-phase commits. First every shard involved prepares its part in a
+// local transaction: makes the changes that may fail (takes funds or a sell order out of the book) and remembers how
+// to complete or undo them, see `Storage::prepare`. Then the transaction is committed only if all shards have
+// succeeded, and each of them finishes its part, see `Storage::finish_prepared`.
+// Only commit decisions are written to the coordinator's own database (a transaction that isn't there is aborted), so
+// transactions interrupted by a crash are finished by `recover` on the next start. Decisions and the parts of the
+// shards are synced to disk on commit, so this holds after a power loss too
+class CrossShardCoordinator final {
+  std::vector<std::shared_ptr<Shard>> shards;
+
+  // Dedicated thread for `db` and `finished`
+  StorageExecutor executor;
+  Sqlite3 db;
+  // Transactions that are finished by all their shards, so their decisions are deleted together with the next one
+  std::vector<int64_t> finished;
+
+  std::atomic<int64_t> last_transaction_id;
+
+  // constructor is private, use `open` instead
+  CrossShardCoordinator(std::vector<std::shared_ptr<Shard>> shards, asio::any_io_executor executor, Sqlite3 && db,
+                        int64_t last_transaction_id)
+      : shards(std::move(shards)),
+        executor(std::move(executor)),
+        db(std::move(db)),
+        last_transaction_id(last_transaction_id) {}
+
+public:
+  // Opens the database of commit decisions. If the file doesn't exist, it will be created.
+  // `executor` is the thread the database is used from
+  static tl::expected<std::shared_ptr<CrossShardCoordinator>, std::string> open(
+      std::string_view path, std::vector<std::shared_ptr<Shard>> shards, asio::any_io_executor executor);
+
+  // Finishes transactions that were prepared, but not finished before the last shutdown: commits the ones with a
+  // commit decision and aborts the rest. Must be called before anything else uses the shards.
+  // Returns the number of finished transactions
+  tl::expected<std::size_t, std::string> recover();
+
+  // Id for a new cross-shard transaction. Thread-safe
+  int64_t next_transaction_id() { return ++last_transaction_id; }
+
+  // Same as `AuctionService::execute_immediate_sell_order`, but the buyer and the order may be in different shards.
+  // While the trade is in progress the order is out of the book
+  asio::awaitable<tl::expected<SellOrderExecutionInfo, std::string>> buy(UserId buyer_id, int sell_order_id);
+
+  // Same as `AuctionService::place_bid_on_auction_sell_order`, but the buyer, the previous buyer and the order may be
+  // in different shards. The buyer's name is needed, as the shard of the order remembers them, see
+  // `Storage::add_foreign_user`
+  asio::awaitable<tl::expected<void, std::string>> bid(User buyer, int sell_order_id, int bid);
+
+  // Items of an auction won by a user from another shard
+  struct Settlement {
+    UserId buyer_id;
+    std::string item_name;
+    int quantity;
+    int order_id;
+  };
+  // Completes settling auctions won by users from other shards, that were prepared by
+  // `Storage::process_expired_sell_orders` of the shard `seller_shard` as the transaction `transaction_id`
+  asio::awaitable<tl::expected<void, std::string>> settle(int64_t transaction_id, std::size_t seller_shard,
+                                                          std::vector<Settlement> settlements);
+
+private:
+  // Index of the shard that allocated the id of a user or a sell order
+  std::size_t shard_index(int id) const { return ShardId::of(id, shards.size()); }
+
+  // The second phase: writes the decision (if it's a commit) and finishes the transaction on all shards that
+  // prepared it, on all of them at the same time. Fails only if the commit can't be written, so the transaction is
+  // aborted instead. `expiring_shard` is the shard whose expired orders are settled by the transaction, so if it's
+  // aborted, the orders are retried after a delay, see `ExpiryTimer::retry_later`
+  asio::awaitable<tl::expected<void, std::string>> decide(int64_t transaction_id, bool commit,
+                                                          std::vector<std::size_t> participants,
+                                                          std::optional<std::size_t> expiring_shard = std::nullopt);
+
+  // Writes the commit decision. Runs on the coordinator thread
+  tl::expected<void, std::string> log_commit(int64_t transaction_id);
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <asio/awaitable.hpp>
+#include <asio/error.hpp>
+#include <asio/system_error.hpp>
+#include <asio/system_timer.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+// Timer that wakes up expired sell orders processing exactly when the earliest sell order expires.
+// If an order that expires earlier is placed in the meantime, the wait is interrupted, so it can be rescheduled
+class ExpiryTimer final {
+  asio::system_timer timer;
+  // Unix time the timer is set to, std::nullopt if there is nothing to wait for
+  std::optional<int64_t> deadline;
+  // Set by `retry_later`, the timer doesn't wake up before it
+  std::chrono::system_clock::time_point retry_at;
+
+public:
+  // How long the processing waits after a failure before the expired orders are tried again
+  static constexpr std::chrono::seconds kRetryDelay{ 1 };
+
+  explicit ExpiryTimer(asio::any_io_executor const & executor) : timer(executor) {}
+
+  // Waits until `unix_time` (or until `schedule` is called if there is nothing to wait for)
+  asio::awaitable<void> wait_until(std::optional<int64_t> unix_time) {
+    namespace ch = std::chrono;
+    deadline = unix_time;
+    timer.expires_at(std::max(unix_time ? ch::system_clock::time_point(ch::seconds(*unix_time))
+                                        : ch::system_clock::time_point::max(),
+                              retry_at));
+    try {
+      co_await timer.async_wait(asio::use_awaitable);
+    } catch (asio::system_error const & e) {
+      // The wait was cancelled by `schedule()`, so the caller will recalculate the deadline
+      if (e.code() != asio::error::operation_aborted) {
+        throw;
+      }
+    }
+  }
+
+  // Notifies the timer about a new order, so it wakes up earlier if needed
+  void schedule(int64_t unix_time) {
+    if (!deadline || unix_time < *deadline) {
+      deadline = unix_time;
+      timer.cancel();
+    }
+  }
+
+  // Processing of the expired orders has failed, so the next waits last at least `kRetryDelay`, even if the orders
+  // are already expired. Otherwise the same failure would be retried in a loop
+  void retry_later() { retry_at = std::chrono::system_clock::now() + kRetryDelay; }
+};
@@ -0,0 +1,70 @@
+#include "group_commit.hpp"
+
+#include <asio/post.hpp>
+#include <fmt/format.h>
+
+std::shared_ptr<GroupCommit::Batch> GroupCommit::join(std::function<void()> command) {
+  if (!open_batch) {
+    auto batch = std::make_shared<Batch>(executor);
+    if (options.window.count() > 0) {
+      batch->window.expires_after(options.window);
+      batch->window.async_wait([this, batch](auto) { flush(batch); });
+    } else {
+      // Handlers are run in order, so the commands that are already queued join the batch before it's flushed
+      asio::post(executor, [this, batch]() { flush(batch); });
+    }
+    open_batch = std::move(batch);
+  }
+
+  auto batch = open_batch;
+  batch->commands.push_back(std::move(command));
+  if (batch->commands.size() >= options.max_batch_size) {
+    open_batch.reset();
+    // Posted, as the command hasn't started to wait for the batch yet
+    asio::post(executor, [this, batch]() { flush(batch); });
+  }
+  return batch;
+}
+
+asio::awaitable<void> GroupCommit::wait(Batch & batch) {
+  if (batch.flushed) {
+    co_return;
+  }
+  try {
+    co_await batch.done.async_wait(asio::use_awaitable);
+  } catch (std::exception &) {
+    // Cancelled by `flush()`
+  }
+}
+
+void GroupCommit::flush(std::shared_ptr<Batch> const & batch) {
+  // A full batch is flushed before its window is over
+  if (batch->flushed) {
+    return;
+  }
+  batch->flushed = true;
+  if (open_batch == batch) {
+    open_batch.reset();
+  }
+
+  if (batch->commands.size() == 1) {
+    // Nothing to share the commit with, so the command commits on its own without a savepoint
+    batch->commands.front()();
+  } else {
+    auto transaction = storage->begin_transaction();
+    if (!transaction) {
+      batch->error = fmt::format("Failed to start transaction: {}", transaction.error());
+    } else {
+      for (auto & command : batch->commands) {
+        command();
+      }
+      // The transaction is rolled back on failure, together with the changes of all commands
+      auto committed = transaction->commit();
+      if (!committed) {
+        batch->error = std::move(committed.error());
+      }
+    }
+  }
+  batch->window.cancel();
+  batch->done.cancel();
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "storage.hpp"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/use_awaitable.hpp>
+#include <tl/expected.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Runs commands that change the storage in batches on the storage thread, each batch in a single transaction, so the
+// commit cost is paid once per batch rather than once per command. Every command runs in its own nested transaction,
+// so a failed one doesn't affect the others, and none of them completes until the whole batch is committed
+class GroupCommit final {
+public:
+  struct Options {
+    // Max number of commands in a single transaction
+    std::size_t max_batch_size = 64;
+    // How long the first command of a batch waits for others to join. With 0 only the commands that are already
+    // queued on the storage thread join it, so a command is never delayed while the storage thread is idle
+    std::chrono::microseconds window{ 0 };
+  };
+
+private:
+  struct Batch {
+    std::vector<std::function<void()>> commands;
+    // Never expires, cancelled once the batch is committed or rolled back
+    asio::steady_timer done;
+    // Expires once the window is over, if there is a window
+    asio::steady_timer window;
+    bool flushed = false;
+    // If set, the batch is rolled back and results of its commands are discarded
+    std::optional<std::string> error;
+
+    explicit Batch(asio::any_io_executor const & executor)
+        : done(executor, asio::steady_timer::time_point::max()), window(executor) {}
+  };
+
+  asio::any_io_executor executor;
+  std::shared_ptr<Storage> storage;
+  Options options;
+  // The batch new commands join, null if there is none
+  std::shared_ptr<Batch> open_batch;
+
+public:
+  GroupCommit(asio::any_io_executor executor, std::shared_ptr<Storage> storage, Options options)
+      : executor(std::move(executor)), storage(std::move(storage)), options(options) {}
+
+  // Runs `f` on the storage thread as a part of a batch and resumes the awaiting coroutine on its own executor once
+  // the batch is committed. If the batch can't be committed, whatever `f` did is rolled back and the commit error
+  // is returned instead of its result. Exceptions thrown by `f` are rethrown in the awaiting coroutine
+  template <typename F>
+  asio::awaitable<tl::expected<std::invoke_result_t<F &>, std::string>> run(F f) {
+    using Result = std::invoke_result_t<F &>;
+    return asio::co_spawn(
+        executor,
+        [this, f = std::move(f)]() mutable -> asio::awaitable<tl::expected<Result, std::string>> {
+          std::optional<Result> result;
+          std::exception_ptr exception;
+          auto batch = join([&]() {
+            try {
+              result.emplace(f());
+            } catch (...) {
+              exception = std::current_exception();
+            }
+          });
+          co_await wait(*batch);
+          if (exception) {
+            std::rethrow_exception(exception);
+          }
+          if (batch->error) {
+            co_return tl::make_unexpected(*batch->error);
+          }
+          co_return std::move(*result);
+        },
+        asio::use_awaitable);
+  }
+
+private:
+  // Adds the command to the open batch, opening a new one if there is none
+  std::shared_ptr<Batch> join(std::function<void()> command);
+  // Waits until the batch is committed or rolled back
+  static asio::awaitable<void> wait(Batch & batch);
+  // Runs all commands of the batch in a single transaction and wakes them up
+  void flush(std::shared_ptr<Batch> const & batch);
+};
@@ -0,0 +1,34 @@
+#include "line_framer.hpp"
+
+#include <cstring>
+
+std::span<char> LineFramer::prepare(std::size_t min_size) {
+  // Move the incomplete line to the front to reuse space of the already consumed lines
+  if (begin > 0) {
+    std::memmove(buffer.data(), buffer.data() + begin, end - begin);
+    end -= begin;
+    scanned -= begin;
+    begin = 0;
+  }
+  if (buffer.size() - end < min_size) {
+    buffer.resize(end + min_size);
+  }
+  return { buffer.data() + end, buffer.size() - end };
+}
+
+std::optional<std::string_view> LineFramer::next_line() {
+  auto const data = std::string_view(buffer).substr(0, end);
+  std::size_t const delimiter_pos = data.find('\n', scanned);
+  if (delimiter_pos == std::string_view::npos) {
+    scanned = end;
+    return std::nullopt;
+  }
+
+  auto line = data.substr(begin, delimiter_pos - begin);
+  if (line.ends_with('\r')) {
+    line.remove_suffix(1);
+  }
+  begin = delimiter_pos + 1;
+  scanned = begin;
+  return line;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+// Growable per-connection buffer that splits incoming bytes into newline-delimited lines.
+// Both "\n" and "\r\n" are accepted as delimiters, so it works with telnet as well
+class LineFramer final {
+  std::string buffer;
+  // Unconsumed data is [begin, end), while [end, buffer.size()) is free space for the next read
+  std::size_t begin = 0;
+  std::size_t end = 0;
+  // Position from which the search for the next delimiter continues, so each byte is scanned once
+  std::size_t scanned = 0;
+  std::size_t max_line_length;
+
+public:
+  explicit LineFramer(std::size_t max_line_length) : max_line_length(max_line_length) {}
+
+  // Returns a writable area of at least `min_size` bytes to read into.
+  // Invalidates all lines previously returned by `next_line`
+  std::span<char> prepare(std::size_t min_size);
+  // Marks `n` bytes of the area returned by `prepare` as received
+  void commit(std::size_t n) { end += n; }
+
+  // Returns the next complete line without the delimiter, or std::nullopt if there is no complete line yet
+  std::optional<std::string_view> next_line();
+
+  // True if the incomplete line is already longer than allowed, so there is no point to read further
+  bool overflowed() const { return end - begin > max_line_length; }
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Bucket math of log-linear histograms, similar to HdrHistogram. Values below `2 << SubBucketBits` get a bucket each,
+// larger ones fall into buckets 1/2^SubBucketBits of their power of two wide. Values wider than `MaxValueBits` bits
+// share the last bucket
+template <int SubBucketBits, int MaxValueBits = 64>
+struct LogLinearBuckets {
+  static_assert(SubBucketBits > 0 && SubBucketBits < MaxValueBits && MaxValueBits <= 64);
+
+  static constexpr uint64_t kSubBuckets = uint64_t(1) << SubBucketBits;
+  // Values below this are counted exactly
+  static constexpr uint64_t kExactValues = kSubBuckets * 2;
+  static constexpr std::size_t kCount = kExactValues + std::size_t(MaxValueBits - SubBucketBits - 1) * kSubBuckets;
+
+  static constexpr std::size_t bucket_of(uint64_t value) {
+    if (value < kExactValues) {
+      return static_cast<std::size_t>(value);
+    }
+    // The top `SubBucketBits + 1` bits of the value select the bucket, the rest is the error
+    int const shift = static_cast<int>(std::bit_width(value)) - SubBucketBits - 1;
+    uint64_t const top = value >> shift;
+    uint64_t const bucket = kExactValues + uint64_t(shift - 1) * kSubBuckets + (top - kSubBuckets);
+    return static_cast<std::size_t>(std::min(bucket, uint64_t(kCount - 1)));
+  }
+
+  // The largest value that falls into the bucket
+  static constexpr uint64_t upper_bound(std::size_t bucket) {
+    if (bucket < kExactValues) {
+      return bucket;
+    }
+    uint64_t const offset = bucket - kExactValues;
+    int const shift = static_cast<int>(offset / kSubBuckets) + 1;
+    uint64_t const top = kSubBuckets + offset % kSubBuckets;
+    return ((top + 1) << shift) - 1;
+  }
+
+  // The smallest value that is greater or equal to `quantile` (in [0, 1]) of the `total` values counted in `counts`,
+  // rounded up to the bucket boundary, but never above `max_value`. Zero if nothing is counted
+  static uint64_t percentile(std::span<uint64_t const> counts, uint64_t total, double quantile, uint64_t max_value) {
+    if (total == 0) {
+      return 0;
+    }
+    auto const rank = std::max(static_cast<uint64_t>(std::ceil(std::clamp(quantile, 0.0, 1.0) * double(total))),
+                               uint64_t(1));
+    uint64_t seen = 0;
+    std::size_t bucket = 0;
+    for (; bucket + 1 < counts.size(); ++bucket) {
+      seen += counts[bucket];
+      if (seen >= rank) {
+        break;
+      }
+    }
+    // The exact maximum is known, so the last bucket doesn't overestimate it
+    return std::min(upper_bound(bucket), max_value);
+  }
+};
@@ -1,18 +1,38 @@
 #include "cli.hpp"
 #include "commands_processor.hpp"
+#include "coordinator.hpp"
+#include "line_framer.hpp"
+#include "read_pool.hpp"
+#include "shard.hpp"
 #include "shared_state.hpp"
 #include "storage.hpp"
+#include "write_queue.hpp"
 
 #include <asio/awaitable.hpp>
 #include <asio/co_spawn.hpp>
 #include <asio/detached.hpp>
+#include <asio/executor_work_guard.hpp>
 #include <asio/io_context.hpp>
 #include <asio/ip/tcp.hpp>
+#include <asio/post.hpp>
 #include <asio/signal_set.hpp>
+#include <asio/strand.hpp>
 #include <asio/write.hpp>
 #include <fmt/format.h>
 
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
 #include <cstring>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 using asio::awaitable;
 using asio::co_spawn;
@@ -20,116 +40,292 @@ using asio::detached;
 using asio::use_awaitable;
 using asio::ip::tcp;
 
-// Coroutine that processes user commands and sends responses back to the user
-awaitable<void> process_user_commands(tcp::socket socket, CommandsProcessor processor) {
-  auto shared_socket = std::make_shared<tcp::socket>(std::move(socket));
-  processor.shared_state->sockets[processor.user.id] = shared_socket;
+// Commands are short, but item names may be long, so the buffer grows when needed up to this limit
+constexpr std::size_t kReadSize = 4096;
+constexpr std::size_t kMaxLineLength = 64 * 1024;
 
-  char buffer[256];
-  try {
-    for (;;) {
-      std::size_t n = co_await shared_socket->async_read_some(asio::buffer(buffer), use_awaitable);
-      auto response = processor.process_request({ buffer, n });
-      co_await async_write(*shared_socket, asio::buffer(response), use_awaitable);
+// Dedicated threads that run their own `io_context`, e.g. the storage thread
+class WorkerThreads final {
+  asio::io_context context;
+  asio::executor_work_guard<asio::io_context::executor_type> work = asio::make_work_guard(context);
+  std::vector<std::thread> threads;
+
+public:
+  explicit WorkerThreads(unsigned count) : context(static_cast<int>(count)) {
+    for (unsigned i = 0; i < count; ++i) {
+      threads.emplace_back([this]() { context.run(); });
+    }
+  }
+  ~WorkerThreads() { stop(); }
+
+  // Stops the threads without destroying pending work, so it can be done after the network `io_context` is gone
+  void stop() {
+    context.stop();
+    for (auto & thread : threads) {
+      if (thread.joinable()) {
+        thread.join();
+      }
     }
-  } catch (std::exception & e) {
-    fmt::println("Connection with user {}, id={} was closed by client: {}", processor.user.username, processor.user.id,
-                 e.what());
-    processor.shared_state->sockets.erase(processor.user.id);
   }
+
+  WorkerThreads(WorkerThreads const &) = delete;
+  WorkerThreads & operator=(WorkerThreads const &) = delete;
+
+  asio::io_context::executor_type get_executor() { return context.get_executor(); }
+};
+
+// Reads more data from the socket into the framer
+awaitable<void> receive(tcp::socket & socket, LineFramer & framer) {
+  auto const area = framer.prepare(kReadSize);
+  std::size_t const n = co_await socket.async_read_some(asio::buffer(area.data(), area.size()), use_awaitable);
+  framer.commit(n);
 }
 
-// Coroutine that periodically sends notifications to users about their sell orders
-awaitable<void> notify_users(std::shared_ptr<SharedState> shared_state) {
-  namespace ch = std::chrono;
-  auto timer = asio::steady_timer(co_await asio::this_coro::executor, std::chrono::seconds(1));
+// Appends the response to the output, so each response ends with a newline and bots can tell them apart
+void append_response(std::string & output, std::string_view response) {
+  output += response;
+  if (!response.ends_with('\n')) {
+    output += '\n';
+  }
+}
 
-  for (;;) {
-    co_await timer.async_wait(use_awaitable);
-    timer.expires_at(timer.expiry() + ch::seconds(1));
+// Coroutine that processes user commands and sends responses back to the user. Runs on the connection's strand.
+// All complete commands received so far are executed in order and their responses are sent with a single write,
+// so clients can pipeline commands instead of waiting for a response to each of them
+awaitable<void> process_user_commands(tcp::socket socket, LineFramer framer, CommandsProcessor processor,
+                                      std::size_t write_high_water_mark) {
+  auto output_queue =
+      std::make_shared<WriteQueue>(std::move(socket), write_high_water_mark, processor.shared_state->command_stats);
+  // Not awaited inside the initializer of `Connection`, as GCC destroys the copy of `output_queue` twice then
+  auto executor = co_await asio::this_coro::executor;
+  processor.shared_state->notifications.connect(processor.user.id,
+                                                Connection{ .output = output_queue, .executor = std::move(executor) });
 
-    while (!shared_state->notifications.empty()) {
-      auto const & [user_id, notification] = shared_state->notifications.pop();
+  // Responses to all commands received so far. Chunks of long responses are pushed right away, after the responses
+  // to the commands before them
+  std::string output;
+  processor.on_partial_response = [&output, &output_queue](std::string chunk) {
+    if (!output.empty()) {
+      output += chunk;
+      chunk = std::exchange(output, {});
+    }
+    output_queue->push(std::move(chunk));
+  };
 
-      if (auto const it = shared_state->sockets.find(user_id); it != shared_state->sockets.end()) {
-        // prevent socket from being destroyed while we are writing to it
-        auto const socket = it->second;
-        auto message =
-            fmt::format("Your sell order #{} was executed for {}\n", notification.order_id, notification.price);
+  try {
+    for (;;) {
+      // Responses to the commands before `quit` (or a failure) should still be delivered
+      std::exception_ptr error;
+      // Lines stay valid until the next `receive()`, so they can be processed without copying
+      while (auto line = framer.next_line()) {
         try {
-          co_await async_write(*socket, asio::buffer(message), use_awaitable);
+          append_response(output, co_await processor.process_request(*line));
         } catch (std::exception &) {
-          // Just do nothing. User might have disconnected but we still have a socket.
-          // `process_user_commands()` will handle this case.
+          error = std::current_exception();
+          break;
         }
       }
+      if (!error && framer.overflowed()) {
+        append_response(output, fmt::format("Command is too long, max length is {}", kMaxLineLength));
+        error = std::make_exception_ptr(std::runtime_error("Command is too long"));
+      }
+      output_queue->push(std::exchange(output, {}), processor.take_processed_commands());
+      if (error) {
+        std::rethrow_exception(error);
+      }
+      // Backpressure: don't read more commands while the client doesn't read responses
+      co_await output_queue->wait_for_space();
+      co_await receive(output_queue->get_socket(), framer);
     }
+  } catch (std::exception & e) {
+    fmt::println("Connection with user {}, id={} was closed by client: {}", processor.user.username, processor.user.id,
+                 e.what());
+    processor.shared_state->notifications.disconnect(processor.user.id, output_queue);
   }
 }
 
-// Coroutine that periodically checks for expired sell orders and cancels them or executes them
-awaitable<void> process_expired_sell_orders(std::shared_ptr<SharedState> shared_state) {
-  namespace ch = std::chrono;
-  auto timer = asio::steady_timer(co_await asio::this_coro::executor, std::chrono::seconds(1));
+// Coroutine that completes settling auctions won by users from other shards and notifies their sellers
+awaitable<void> settle_auctions(std::shared_ptr<SharedState> shared_state, int64_t transaction_id,
+                                std::size_t shard_index, std::vector<CrossShardCoordinator::Settlement> settlements,
+                                std::vector<SellOrderExecutionInfo> orders) {
+  auto result = co_await shared_state->coordinator->settle(transaction_id, shard_index, std::move(settlements));
+  if (!result) {
+    // The orders are back in the book, so they are settled again once the retry delay is over
+    fmt::println("Failed to settle auctions won by users from other shards: {}", result.error());
+    co_return;
+  }
+  for (auto const & order : orders) {
+    shared_state->notifications.push(order.seller_id, ExecutedSellOrder{ .order_id = order.id, .price = order.price });
+  }
+}
 
+// Coroutine that sleeps until the earliest sell order of the shard expires and then cancels or executes all expired
+// orders. Runs on the storage thread of the shard. Orders are settled in chunks of up to `chunk_size` orders or
+// `chunk_budget` time, each in its own transaction, and other work queued on the storage thread runs between the
+// chunks, so settling a large backlog (e.g. after a downtime) never freezes live traffic
+awaitable<void> process_expired_sell_orders(std::shared_ptr<SharedState> shared_state, std::size_t shard_index,
+                                            std::size_t chunk_size, std::chrono::microseconds chunk_budget) {
+  auto executor = co_await asio::this_coro::executor;
+  Shard & shard = *shared_state->shards[shard_index];
   for (;;) {
-    co_await timer.async_wait(use_awaitable);
-    timer.expires_at(timer.expiry() + ch::seconds(1));
+    co_await shard.expiry_timer.wait_until(shard.storage->next_expiration_time());
 
+    // Counted once, then every chunk subtracts the orders it has settled. Orders that expire in the meantime are
+    // settled after the next wait, which completes right away
     int64_t const unix_now = std::chrono::seconds(std::time(NULL)).count();
-    auto result = shared_state->storage->process_expired_sell_orders(unix_now);
-    if (!result) {
-      fmt::println("Failed to cancel expired sell orders at {} unix time: {}", unix_now, result.error());
-    }
-    for (auto const & order : *result) {
-      shared_state->transaction_log.save(order);
-      shared_state->notifications.push(order.seller_id,
-                                       ExecutedSellOrder{ .order_id = order.id, .price = order.price });
+    std::size_t backlog = shard.storage->expired_sell_orders_count(unix_now);
+    while (backlog > 0) {
+      // Auctions won by users from other shards are settled as a cross-shard transaction
+      int64_t const transaction_id = shared_state->coordinator ? shared_state->coordinator->next_transaction_id() : 0;
+      auto result = shard.storage->process_expired_sell_orders(unix_now, chunk_size, chunk_budget, transaction_id);
+      if (!result) {
+        fmt::println("Failed to cancel expired sell orders at {} unix time: {}", unix_now, result.error());
+        shard.expiry_timer.retry_later();
+        break;
+      }
+      std::vector<CrossShardCoordinator::Settlement> settlements;
+      std::vector<SellOrderExecutionInfo> settled_elsewhere;
+      std::optional<int> unnamed_item_id;
+      for (auto const & order : result->executed) {
+        if (shard.storage->owns_user(order.buyer_id)) {
+          shared_state->notifications.push(order.seller_id,
+                                           ExecutedSellOrder{ .order_id = order.id, .price = order.price });
+          continue;
+        }
+        // Items are credited by name in the buyer's shard, see `Storage::finish_prepared`
+        auto const item_name = shard.storage->get_item_name(order.item_id);
+        if (!item_name) {
+          unnamed_item_id = order.item_id;
+          continue;
+        }
+        settlements.push_back(CrossShardCoordinator::Settlement{
+            .buyer_id = order.buyer_id,
+            .item_name = std::string(*item_name),
+            .quantity = order.quantity,
+            .order_id = order.id,
+        });
+        settled_elsewhere.push_back(order);
+      }
+      if (unnamed_item_id) {
+        // Only this shard has prepared the transaction so far, so aborting it puts the orders back to the book
+        auto const aborted = shard.storage->finish_prepared(transaction_id, false);
+        fmt::println("Failed to settle auctions won by users from other shards: item #{} has no name{}",
+                     *unnamed_item_id, aborted ? "" : fmt::format(", failed to abort: {}", aborted.error()));
+        shard.expiry_timer.retry_later();
+        break;
+      }
+      if (!settlements.empty()) {
+        // Not awaited, so the next chunk doesn't wait for other shards
+        co_spawn(executor,
+                 settle_auctions(shared_state, transaction_id, shard_index, std::move(settlements),
+                                 std::move(settled_elsewhere)),
+                 detached);
+      }
+
+      // Orders bought between the chunks leave the count too high, so it's over once a chunk finds nothing to settle
+      backlog = result->settled > 0 ? backlog - std::min(backlog, result->settled) : 0;
+      if (backlog > 0 && shard.expiry_backlog.load(std::memory_order_relaxed) == 0) {
+        fmt::println("Settling a backlog of {} expired sell orders in chunks", backlog);
+      }
+      shard.expiry_backlog.store(backlog, std::memory_order_relaxed);
+      if (backlog == 0) {
+        break;
+      }
+      // Commands queued while the chunk was settled run before the next one
+      co_await asio::post(executor, use_awaitable);
     }
   }
 }
 
 // Coroutine that processes a single client login and if successful, spawns a new coroutine to handle the user
-awaitable<void> process_client_login(tcp::socket socket, std::shared_ptr<SharedState> state) {
+awaitable<void> process_client_login(tcp::socket socket, std::shared_ptr<SharedState> state,
+                                     std::size_t write_high_water_mark) {
   try {
-    std::string_view const greeting = "Welcome to Sundris Auction House, stranger! How can I call you?";
+    std::string_view const greeting = "Welcome to Sundris Auction House, stranger! How can I call you?\n";
     co_await async_write(socket, asio::buffer(greeting), use_awaitable);
 
-    char buffer[256];
-    std::size_t n = co_await socket.async_read_some(asio::buffer(buffer), use_awaitable);
-    std::string_view const username = { buffer, n };
+    // The framer is passed to `process_user_commands` then, as the client might send commands right after the name
+    LineFramer framer(kMaxLineLength);
+    std::optional<std::string_view> line;
+    while (!(line = framer.next_line())) {
+      if (framer.overflowed()) {
+        co_return;  // it's not a name, just close the connection
+      }
+      co_await receive(socket, framer);
+    }
+    // Copied, as the line is invalidated by the next read
+    std::string const username(*line);
 
-    auto user = state->user_service.login(username).map_error(
-        [&](auto && err) { return fmt::format("Failed to login as '{}': {}", username, err); });
+    // New users are created in the shard their name belongs to, so the same name always finds the same user
+    Shard & shard = *state->shards[shard_of_username(username, state->shards.size())];
+    auto user = co_await shard.storage_executor.run([&]() {
+      return shard.user_service.login(username).map_error(
+          [&](auto && err) { return fmt::format("Failed to login as '{}': {}", username, err); });
+    });
     if (!user) {
-      co_await async_write(socket, asio::buffer(user.error()), use_awaitable);
+      std::string response;
+      append_response(response, user.error());
+      co_await async_write(socket, asio::buffer(response), use_awaitable);
       co_return;  // it will close the socket as well
     }
 
-    std::string response = fmt::format("Successfully logged in as {}", user->username);
+    std::string response = fmt::format("Successfully logged in as {}\n", user->username);
     co_await async_write(socket, asio::buffer(response), use_awaitable);
     fmt::println("User {}, id={} successfully logged in", user->username, user->id);
 
     // Spawn a new coroutine to handle the user
     CommandsProcessor processor(std::move(*user), std::move(state));
-    co_spawn(co_await asio::this_coro::executor, process_user_commands(std::move(socket), std::move(processor)),
+    co_spawn(co_await asio::this_coro::executor,
+             process_user_commands(std::move(socket), std::move(framer), std::move(processor), write_high_water_mark),
              detached);
   } catch (std::exception & e) {
     fmt::println("Failed to process client login: {}", e.what());
   }
 }
 
-// Coroutine that listens for incoming connections and spawns a new coroutine for each of them
-awaitable<void> listener(uint16_t port, std::shared_ptr<SharedState> shared_state) {
+// Coroutine that listens for incoming connections and spawns a new coroutine for each of them.
+// Each connection gets its own strand, so connections are processed in parallel by the network threads
+awaitable<void> listener(uint16_t port, std::shared_ptr<SharedState> shared_state, std::size_t write_high_water_mark) {
   auto executor = co_await asio::this_coro::executor;
   tcp::acceptor acceptor(executor, { tcp::v4(), port });
   fmt::println("Listening on port {}", port);
   for (;;) {
-    tcp::socket socket = co_await acceptor.async_accept(use_awaitable);
-    co_spawn(executor, process_client_login(std::move(socket), shared_state), detached);
+    auto strand = asio::make_strand(acceptor.get_executor());
+    tcp::socket socket = co_await acceptor.async_accept(strand, use_awaitable);
+    co_spawn(strand, process_client_login(std::move(socket), shared_state, write_high_water_mark), detached);
   }
 }
 
+// Opens the database of the shard together with its transaction log
+tl::expected<std::shared_ptr<Storage>, std::string> open_shard_storage(Cli const & cli, std::size_t index) {
+  auto storage = Storage::open(shard_path(cli.db_path, index), true,
+                               ShardId{ .index = static_cast<int>(index), .count = static_cast<int>(cli.shards) });
+  if (!storage) {
+    return tl::make_unexpected(fmt::format("Failed to open database: {}", storage.error()));
+  }
+
+  if (cli.sql_profiling) {
+    auto profiling = storage->enable_sql_profiling(*cli.sql_profiling);
+    if (!profiling) {
+      return tl::make_unexpected(fmt::format("Failed to enable SQL profiling: {}", profiling.error()));
+    }
+  }
+
+  auto transaction_log = TransactionLog::open(shard_path(cli.transaction_log_path, index), cli.log_options);
+  if (!transaction_log) {
+    return tl::make_unexpected(fmt::format("Failed to open transaction log: {}", transaction_log.error()));
+  }
+  auto recovered = storage->attach_transaction_log(std::move(*transaction_log));
+  if (!recovered) {
+    return tl::make_unexpected(fmt::format("Failed to recover transaction log: {}", recovered.error()));
+  }
+  if (*recovered > 0) {
+    fmt::println("Recovered {} transaction log records that were committed, but not written before the last shutdown",
+                 *recovered);
+  }
+  return std::make_shared<Storage>(std::move(*storage));
+}
+
 int main(int argc, char * argv[]) {
   auto cli = Cli::parse(argc, argv);
   if (!cli) {
@@ -137,30 +333,80 @@ int main(int argc, char * argv[]) {
     return 1;
   }
 
-  auto storage = Storage::open(cli->db_path);
-  if (!storage) {
-    fmt::println("Failed to open database: {}", storage.error());
-    return 1;
+  std::vector<std::shared_ptr<Storage>> storages;
+  for (std::size_t i = 0; i < cli->shards; ++i) {
+    auto storage = open_shard_storage(*cli, i);
+    if (!storage) {
+      fmt::println("{}", storage.error());
+      return 1;
+    }
+    storages.push_back(std::move(*storage));
   }
 
-  auto transaction_log = TransactionLog::open(cli->transaction_log_path);
-  if (!transaction_log) {
-    fmt::println("Failed to open transaction log: {}", transaction_log.error());
-    return 1;
-  }
-  auto shared_storage = std::make_shared<Storage>(std::move(*storage));
+  try {
+    // All storage work goes to dedicated threads (one per shard), so disk I/O never blocks the network thread.
+    // Each shard runs on its own strand, so its storage is used by one thread at a time, while different shards run
+    // in parallel. They outlive the network `io_context`, as `SharedState` is destroyed together with the last
+    // coroutine that holds it, and `Shard::expiry_timer` belongs to the storage `io_context`
+    WorkerThreads storage_threads(static_cast<unsigned>(cli->shards));
+    // Same for the read pool threads, as `Shard::read_pool` is shared with them
+    WorkerThreads read_threads(cli->read_threads);
+    // And for the coordinator's database, that is used only if there are several shards
+    WorkerThreads coordinator_thread(cli->shards > 1 ? 1 : 0);
 
-  auto shared_state = std::make_shared<SharedState>(SharedState{
-      .storage = shared_storage,
-      .auction_service = AuctionService(shared_storage),
-      .user_service = UserService(shared_storage),
-      .transaction_log = std::move(*transaction_log),
-      .notifications = {},
-      .sockets = {},
-  });
+    std::vector<std::shared_ptr<Shard>> shards;
+    for (std::size_t i = 0; i < storages.size(); ++i) {
+      asio::any_io_executor const storage_executor = asio::make_strand(storage_threads.get_executor());
+      std::shared_ptr<ReadPool> read_pool;
+      if (cli->read_threads > 0) {
+        auto pool = ReadPool::open(shard_path(cli->db_path, i), cli->read_threads, read_threads.get_executor());
+        if (!pool) {
+          fmt::println("Failed to open read pool, listings are served by the storage thread: {}", pool.error());
+        } else {
+          read_pool = std::move(*pool);
+        }
+      }
+      // Constructed in place, as `Shard` can't be moved
+      shards.push_back(std::shared_ptr<Shard>(new Shard{
+          .storage_executor = StorageExecutor(storage_executor),
+          .storage = storages[i],
+          .read_pool = std::move(read_pool),
+          .group_commit = GroupCommit(storage_executor, storages[i], cli->group_commit),
+          .auction_service = AuctionService(storages[i]),
+          .user_service = UserService(storages[i]),
+          .expiry_timer = ExpiryTimer(storage_executor),
+      }));
+    }
 
-  try {
-    asio::io_context io_context(1);
+    std::shared_ptr<CrossShardCoordinator> coordinator;
+    if (shards.size() > 1) {
+      auto opened = CrossShardCoordinator::open(fmt::format("{}.coordinator", cli->db_path), shards,
+                                                coordinator_thread.get_executor());
+      if (!opened) {
+        fmt::println("Failed to open cross-shard coordinator: {}", opened.error());
+        return 1;
+      }
+      // Nothing runs on the shards yet
+      auto recovered = (*opened)->recover();
+      if (!recovered) {
+        fmt::println("Failed to recover cross-shard transactions: {}", recovered.error());
+        return 1;
+      }
+      if (*recovered > 0) {
+        fmt::println("Finished {} cross-shard transactions that were interrupted by the last shutdown", *recovered);
+      }
+      coordinator = std::move(*opened);
+    }
+
+    asio::io_context io_context(static_cast<int>(cli->network_threads));
+
+    // Constructed in place, as `NotificationService` can't be moved
+    auto shared_state = std::shared_ptr<SharedState>(new SharedState{
+        .shards = std::move(shards),
+        .coordinator = std::move(coordinator),
+        .notifications = {},
+        .command_stats = std::make_shared<CommandStats>(CommandsProcessor::command_names()),
+    });
 
     // Graceful shutdown
     asio::signal_set signals(io_context, SIGINT, SIGTERM);
@@ -169,12 +415,26 @@ int main(int argc, char * argv[]) {
       io_context.stop();
     });
 
-    co_spawn(io_context, listener(cli->port, shared_state), detached);
-    co_spawn(io_context, process_expired_sell_orders(shared_state), detached);
-    co_spawn(io_context, notify_users(std::move(shared_state)), detached);
+    co_spawn(io_context, listener(cli->port, shared_state, cli->write_high_water_mark), detached);
+    for (std::size_t i = 0; i < shared_state->shards.size(); ++i) {
+      co_spawn(shared_state->shards[i]->storage_executor.get(),
+               process_expired_sell_orders(shared_state, i, cli->expiry_chunk_size, cli->expiry_chunk_budget),
+               detached);
+    }
+    shared_state.reset();
 
-    // For simplicity, this server is single-threaded. Alternatively, a thread pool can be used here
+    // The main thread is one of the network threads
+    std::vector<std::thread> network_threads;
+    for (unsigned i = 1; i < cli->network_threads; ++i) {
+      network_threads.emplace_back([&]() { io_context.run(); });
+    }
     io_context.run();
+    for (auto & thread : network_threads) {
+      thread.join();
+    }
+    read_threads.stop();
+    coordinator_thread.stop();
+    storage_threads.stop();
   } catch (std::exception & e) {
     fmt::println("Exception: {}", e.what());
   }
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <type_traits>
+
+// Bounded lock-free queue for many producers and a single consumer (D. Vyukov's bounded queue).
+// Each cell has a sequence number that tells whether it is free for the producer with the given position or
+// contains a value for the consumer, so producers only contend on `tail` and the consumer never blocks them
+template <typename T>
+class MpscRing final {
+  static_assert(std::is_trivially_copyable_v<T>, "Values are copied in and out of cells");
+
+  struct Cell {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  std::size_t mask;
+  // Separate cache lines, as `tail` is written by producers and `head` by the consumer
+  alignas(64) std::atomic<std::size_t> tail = 0;
+  alignas(64) std::size_t head = 0;
+
+public:
+  // Capacity is rounded up to a power of two
+  explicit MpscRing(std::size_t capacity)
+      : cells(std::make_unique<Cell[]>(std::bit_ceil(std::max<std::size_t>(capacity, 2)))),
+        mask(std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1) {
+    for (std::size_t i = 0; i <= mask; ++i) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  std::size_t capacity() const { return mask + 1; }
+
+  // Returns false if the queue is full. Can be called from any thread
+  bool try_push(T const & value) {
+    std::size_t pos = tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell & cell = cells[pos & mask];
+      std::size_t const sequence = cell.sequence.load(std::memory_order_acquire);
+      auto const diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+      if (diff == 0) {
+        if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          cell.value = value;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;  // the consumer hasn't freed this cell yet
+      } else {
+        pos = tail.load(std::memory_order_relaxed);  // another producer took this cell
+      }
+    }
+  }
+
+  // Returns std::nullopt if the queue is empty. Consumer only
+  std::optional<T> try_pop() {
+    Cell & cell = cells[head & mask];
+    if (cell.sequence.load(std::memory_order_acquire) != head + 1) {
+      return std::nullopt;
+    }
+    T value = cell.value;
+    // Frees the cell for the producer that is one lap ahead
+    cell.sequence.store(head + mask + 1, std::memory_order_release);
+    ++head;
+    return value;
+  }
+
+  // Consumer only
+  bool empty() const { return cells[head & mask].sequence.load(std::memory_order_acquire) != head + 1; }
+};
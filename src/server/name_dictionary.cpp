@@ -0,0 +1,42 @@
+#include "name_dictionary.hpp"
+
+void NameDictionary::insert(int id, std::string_view name) {
+  if (id < 0) {
+    return;
+  }
+  auto const [it, _] = ids.insert_or_assign(std::string(name), id);
+  auto const index = static_cast<std::size_t>(id);
+  if (index >= names.size()) {
+    names.resize(index + 1, nullptr);
+  }
+  names[index] = &it->first;
+}
+
+void NameDictionary::erase(int id) {
+  auto const index = static_cast<std::size_t>(id);
+  if (id < 0 || index >= names.size() || names[index] == nullptr) {
+    return;
+  }
+  // `find` with the string itself, as erasing by the pointed-to key would destroy it during the lookup
+  ids.erase(ids.find(*names[index]));
+  names[index] = nullptr;
+  while (!names.empty() && names.back() == nullptr) {
+    names.pop_back();
+  }
+}
+
+std::optional<int> NameDictionary::find_id(std::string_view name) const {
+  auto const it = ids.find(name);
+  if (it == ids.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+std::optional<std::string_view> NameDictionary::find_name(int id) const {
+  auto const index = static_cast<std::size_t>(id);
+  if (id < 0 || index >= names.size() || names[index] == nullptr) {
+    return std::nullopt;
+  }
+  return *names[index];
+}
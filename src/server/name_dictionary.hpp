@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// In-memory copy of an append-only `id <-> name` table, like `items` or `users`. Names are interned: each one is
+// stored once, in the hash map, while the reverse index by id points to it. Just like `OrderBook`, it knows nothing
+// about persistence, see `Storage` for how it is kept in sync with the tables
+class NameDictionary final {
+  // Allows lookups by `std::string_view` without creating a `std::string`
+  struct Hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view name) const noexcept { return std::hash<std::string_view>{}(name); }
+  };
+
+  std::unordered_map<std::string, int, Hash, std::equal_to<>> ids;
+  // Indexed by id. Ids come from `INTEGER PRIMARY KEY`, so they are dense (users of a shard get every `count`-th id,
+  // see `ShardId`), and null marks the gaps
+  std::vector<std::string const *> names;
+
+public:
+  NameDictionary() = default;
+
+  // Pointers to the map keys stay valid on move, but not on copy
+  NameDictionary(NameDictionary const &) = delete;
+  NameDictionary & operator=(NameDictionary const &) = delete;
+  NameDictionary(NameDictionary &&) = default;
+  NameDictionary & operator=(NameDictionary &&) = default;
+
+  void insert(int id, std::string_view name);
+  // Forgets the name, used to revert `insert` if the transaction that created the row is rolled back
+  void erase(int id);
+
+  std::optional<int> find_id(std::string_view name) const;
+  std::optional<std::string_view> find_name(int id) const;
+  std::size_t size() const { return ids.size(); }
+};
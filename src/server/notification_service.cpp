@@ -0,0 +1,48 @@
+#include "notification_service.hpp"
+
+#include <asio/post.hpp>
+#include <fmt/format.h>
+
+#include <iterator>
+#include <string>
+#include <utility>
+
+void NotificationService::push(UserId user_id, ExecutedSellOrder notification) {
+  auto connection = connections.find(user_id);
+  if (!connection) {
+    return;
+  }
+
+  {
+    std::lock_guard lock(mutex);
+    auto & user_pending = pending[user_id];
+    user_pending.push_back(notification);
+    if (user_pending.size() > 1) {
+      return;  // the delivery is already scheduled and will pick this one up as well
+    }
+  }
+  // The service lives in `SharedState`, which outlives all handlers of the network `io_context`
+  asio::post(connection->executor, [this, user_id, output = std::move(connection->output)]() {
+    deliver(user_id, *output);
+  });
+}
+
+void NotificationService::deliver(UserId user_id, WriteQueue & output) {
+  std::vector<ExecutedSellOrder> notifications;
+  {
+    std::lock_guard lock(mutex);
+    auto const it = pending.find(user_id);
+    if (it == pending.end()) {
+      return;
+    }
+    notifications = std::move(it->second);
+    pending.erase(it);
+  }
+
+  std::string message;
+  for (auto const & notification : notifications) {
+    fmt::format_to(std::back_inserter(message), "Your sell order #{} was executed for {}\n", notification.order_id,
+                   notification.price);
+  }
+  output.push(std::move(message));
+}
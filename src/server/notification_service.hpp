@@ -1,29 +1,35 @@
 #pragma once
 
+#include "connections.hpp"
 #include "types.hpp"
 
-#include <queue>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 struct ExecutedSellOrder {
   int order_id;
   int price;
 };
 
-// Service for sending notifications about executed sell orders
-class NotificationService {
-  // I wish there was a better way to do this, but asio channels
-  // are not suitable for sending notification from one piece of code
-  // to another, so we have to use a queue and one periodic task that reads it
-  std::queue<std::pair<UserId, ExecutedSellOrder>> notifications;
+// Service for sending notifications about executed sell orders to connected users.
+// Notifications are pushed from any thread (usually the storage one) and are delivered right away on the strand
+// of the user's connection. All notifications pushed before the delivery runs are sent with a single write
+class NotificationService final {
+  // Connections of logged in users. Notifications for users that are not connected are dropped
+  Connections connections;
+  // Notifications waiting for delivery. A user is present here only while a delivery to them is scheduled
+  std::unordered_map<UserId, std::vector<ExecutedSellOrder>> pending;
+  std::mutex mutex;
 
 public:
-  void push(UserId user_id, ExecutedSellOrder notification) { notifications.push({ user_id, notification }); }
+  void connect(UserId user_id, Connection connection) { connections.add(user_id, std::move(connection)); }
+  // Stops delivering notifications to the connection, unless the user has already reconnected with another one
+  void disconnect(UserId user_id, std::shared_ptr<WriteQueue> const & output) { connections.remove(user_id, output); }
 
-  bool empty() const { return notifications.empty(); }
+  void push(UserId user_id, ExecutedSellOrder notification);
 
-  std::pair<UserId, ExecutedSellOrder> pop() {
-    auto notification = std::move(notifications.front());
-    notifications.pop();
-    return notification;
-  }
+private:
+  // Runs on the connection's strand
+  void deliver(UserId user_id, WriteQueue & output);
 };
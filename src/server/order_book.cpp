@@ -0,0 +1,225 @@
+#include "order_book.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+namespace {
+std::set<int> const kNoOrders;
+
+template <typename Key>
+void erase_from_index(std::unordered_map<Key, std::set<int>> & index, Key key, int id) {
+  auto const it = index.find(key);
+  if (it == index.end()) {
+    return;
+  }
+  it->second.erase(id);
+  if (it->second.empty()) {
+    index.erase(it);
+  }
+}
+}  // namespace
+
+int OrderBook::allocate_id() {
+  // The smallest id of this book that is greater than `last_id`
+  last_id = last_id < first_id ? first_id : first_id + ((last_id - first_id) / id_step + 1) * id_step;
+  return last_id;
+}
+
+void OrderBook::reserve_ids_up_to(int id) {
+  last_id = std::max(last_id, id);
+}
+
+void OrderBook::release_id(int id) {
+  if (id == last_id) {
+    last_id -= id_step;
+  }
+}
+
+void OrderBook::insert(Order order) {
+  int const id = order.id;
+  reserve_ids_up_to(id);
+  by_item[order.item_id].insert(id);
+  by_seller[order.seller_id].insert(id);
+  by_expiration.emplace(order.unix_expiration_time, id);
+  by_price.emplace(order.price, id);
+  by_item_price.emplace(order.item_id, order.price, id);
+  orders.insert_or_assign(id, std::move(order));
+}
+
+std::optional<OrderBook::Order> OrderBook::erase(int id) {
+  auto const it = orders.find(id);
+  if (it == orders.end()) {
+    return std::nullopt;
+  }
+  Order order = std::move(it->second);
+  orders.erase(it);
+
+  erase_from_index(by_item, order.item_id, id);
+  erase_from_index(by_seller, order.seller_id, id);
+  by_expiration.erase({ order.unix_expiration_time, id });
+  by_price.erase({ order.price, id });
+  by_item_price.erase({ order.item_id, order.price, id });
+  return order;
+}
+
+bool OrderBook::update_buyer(int id, std::optional<UserId> buyer_id, int price) {
+  auto const it = orders.find(id);
+  if (it == orders.end()) {
+    return false;
+  }
+  Order & order = it->second;
+  by_price.erase({ order.price, id });
+  by_item_price.erase({ order.item_id, order.price, id });
+  by_price.emplace(price, id);
+  by_item_price.emplace(order.item_id, price, id);
+  order.buyer_id = buyer_id;
+  order.price = price;
+  return true;
+}
+
+OrderBook::Order const * OrderBook::find(int id) const {
+  auto const it = orders.find(id);
+  return it != orders.end() ? &it->second : nullptr;
+}
+
+std::set<int> const & OrderBook::ids_by_item(int item_id) const {
+  auto const it = by_item.find(item_id);
+  return it != by_item.end() ? it->second : kNoOrders;
+}
+
+std::set<int> const & OrderBook::ids_by_seller(UserId seller_id) const {
+  auto const it = by_seller.find(seller_id);
+  return it != by_seller.end() ? it->second : kNoOrders;
+}
+
+OrderBook::Page OrderBook::page(Filter const & filter, SellOrdersSortKey sort_by, std::optional<SellOrdersCursor> after,
+                                std::size_t limit) const {
+  Page page;
+  if (limit == 0) {
+    return page;
+  }
+  auto const matches = [&](Order const & order) {
+    return (!filter.item_id || order.item_id == *filter.item_id) &&
+           (!filter.seller_id || order.seller_id == *filter.seller_id) &&
+           (!filter.type || order.type() == *filter.type) && order.price >= filter.min_price &&
+           order.price <= filter.max_price;
+  };
+  // Adds the order to the page if it matches. Returns false once the page is full and the next one is known to exist
+  auto const take = [&](int id) {
+    Order const & order = orders.at(id);
+    if (!matches(order)) {
+      return true;
+    }
+    if (page.orders.size() == limit) {
+      page.next = cursor_of(*page.orders.back(), sort_by);
+      return false;
+    }
+    page.orders.push_back(&order);
+    return true;
+  };
+  // Cursors come from clients, so the key may not fit into the price
+  auto const after_price = [&] {
+    return static_cast<int>(std::clamp<int64_t>(after->key, INT_MIN, INT_MAX));
+  };
+
+  // The smallest set of candidates, if there is an item or seller filter
+  std::set<int> const * candidates = nullptr;
+  if (filter.item_id) {
+    candidates = &ids_by_item(*filter.item_id);
+  }
+  if (filter.seller_id && (!candidates || ids_by_seller(*filter.seller_id).size() < candidates->size())) {
+    candidates = &ids_by_seller(*filter.seller_id);
+  }
+
+  if (sort_by == SellOrdersSortKey::Id) {
+    if (candidates) {
+      for (auto it = after ? candidates->upper_bound(after->id) : candidates->begin();
+           it != candidates->end() && take(*it); ++it) {
+      }
+    } else {
+      for (auto it = after ? orders.upper_bound(after->id) : orders.begin(); it != orders.end() && take(it->first);
+           ++it) {
+      }
+    }
+    return page;
+  }
+
+  if (sort_by == SellOrdersSortKey::Price && filter.item_id) {
+    int const item_id = *filter.item_id;
+    std::tuple<int, int, int> const first{ item_id, filter.min_price, INT_MIN };
+    auto it = by_item_price.lower_bound(first);
+    if (after && std::tuple{ item_id, after_price(), after->id } >= first) {
+      it = by_item_price.upper_bound({ item_id, after_price(), after->id });
+    }
+    for (; it != by_item_price.end() && std::get<0>(*it) == item_id && std::get<1>(*it) <= filter.max_price &&
+           take(std::get<2>(*it));
+         ++it) {
+    }
+    return page;
+  }
+
+  if (!candidates && sort_by == SellOrdersSortKey::Price) {
+    std::pair<int, int> const first{ filter.min_price, INT_MIN };
+    auto it = by_price.lower_bound(first);
+    if (after && std::pair{ after_price(), after->id } >= first) {
+      it = by_price.upper_bound({ after_price(), after->id });
+    }
+    for (; it != by_price.end() && it->first <= filter.max_price && take(it->second); ++it) {
+    }
+    return page;
+  }
+
+  if (!candidates) {
+    for (auto it = after ? by_expiration.upper_bound({ after->key, after->id }) : by_expiration.begin();
+         it != by_expiration.end() && take(it->second); ++it) {
+    }
+    return page;
+  }
+
+  // No index for this order, so all orders of the item or seller are sorted. Only the page and one more order
+  // (to know if there is the next page) have to be in order
+  std::vector<std::pair<SellOrdersCursor, int>> sorted;
+  for (int const id : *candidates) {
+    Order const & order = orders.at(id);
+    SellOrdersCursor const cursor = cursor_of(order, sort_by);
+    if (matches(order) && (!after || cursor > *after)) {
+      sorted.emplace_back(cursor, id);
+    }
+  }
+  auto const sorted_end = sorted.begin() + static_cast<std::ptrdiff_t>(std::min(limit + 1, sorted.size()));
+  std::partial_sort(sorted.begin(), sorted_end, sorted.end());
+  for (auto it = sorted.begin(); it != sorted_end && take(it->second); ++it) {
+  }
+  return page;
+}
+
+SellOrdersCursor OrderBook::cursor_of(Order const & order, SellOrdersSortKey sort_by) {
+  switch (sort_by) {
+  case SellOrdersSortKey::Id: return { order.id, order.id };
+  case SellOrdersSortKey::Price: return { order.price, order.id };
+  case SellOrdersSortKey::ExpirationTime: return { order.unix_expiration_time, order.id };
+  }
+  return { order.id, order.id };
+}
+
+std::vector<int> OrderBook::expired(int64_t unix_now, std::size_t limit) const {
+  std::vector<int> ids;
+  auto const end = by_expiration.upper_bound({ unix_now, std::numeric_limits<int>::max() });
+  for (auto it = by_expiration.begin(); it != end && ids.size() < limit; ++it) {
+    ids.push_back(it->second);
+  }
+  return ids;
+}
+
+std::size_t OrderBook::count_expired(int64_t unix_now) const {
+  auto const end = by_expiration.upper_bound({ unix_now, std::numeric_limits<int>::max() });
+  return static_cast<std::size_t>(std::distance(by_expiration.begin(), end));
+}
+
+std::optional<int64_t> OrderBook::next_expiration_time() const {
+  if (by_expiration.empty()) {
+    return std::nullopt;
+  }
+  return by_expiration.begin()->first;
+}
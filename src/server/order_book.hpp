@@ -0,0 +1,108 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// In-memory copy of all active sell orders, indexed by order id, item id, seller and expiration time.
+// It knows nothing about persistence, see `Storage` for how it is kept in sync with the `sell_orders` table
+class OrderBook final {
+public:
+  struct Order {
+    int id;
+    UserId seller_id;
+    int item_id;
+    int quantity;
+    int price;
+    int64_t unix_expiration_time;
+    // Same semantics as `sell_orders.buyer_id`:
+    // - equal to the seller_id for immediate orders
+    // - std::nullopt for auction orders without bid
+    // - the highest bidder for auction orders with bid
+    std::optional<UserId> buyer_id;
+
+    // Names are denormalized, so views don't need to touch the database
+    std::string seller_name;
+    std::string item_name;
+
+    SellOrderType type() const { return buyer_id == seller_id ? SellOrderType::Immediate : SellOrderType::Auction; }
+  };
+
+  // Filters of `page`, with names already resolved to ids
+  struct Filter {
+    std::optional<int> item_id;
+    std::optional<UserId> seller_id;
+    std::optional<SellOrderType> type;
+    int min_price = INT_MIN;
+    int max_price = INT_MAX;
+  };
+
+  struct Page {
+    std::vector<Order const *> orders;
+    std::optional<SellOrdersCursor> next;
+  };
+
+private:
+  // Ordered by id, so orders are listed in the same order they were placed
+  std::map<int, Order> orders;
+  std::unordered_map<int, std::set<int>> by_item;
+  std::unordered_map<UserId, std::set<int>> by_seller;
+  std::set<std::pair<int64_t, int>> by_expiration;
+  // (price, id) and (item id, price, id), so pages sorted by price are range scans
+  std::set<std::pair<int, int>> by_price;
+  std::set<std::tuple<int, int, int>> by_item_price;
+  int last_id = 0;
+  // Allocated ids are `first_id + k * id_step`, so books of different shards never allocate the same id
+  int first_id = 1;
+  int id_step = 1;
+
+public:
+  OrderBook() = default;
+  explicit OrderBook(ShardId shard) : first_id(shard.first_id()), id_step(shard.count) {}
+
+  // Allocates an id for a new order. Just like AUTOINCREMENT in SQLite, ids are never reused
+  int allocate_id();
+  // Ensures that `allocate_id` returns ids greater than the given one. Used to rebuild the book from the database
+  void reserve_ids_up_to(int id);
+  // Gives the last allocated id back if it wasn't used
+  void release_id(int id);
+
+  void insert(Order order);
+  // Removes the order and returns it, if it existed
+  std::optional<Order> erase(int id);
+  // Returns false if there is no such order
+  bool update_buyer(int id, std::optional<UserId> buyer_id, int price);
+
+  Order const * find(int id) const;
+  std::size_t size() const { return orders.size(); }
+  std::map<int, Order> const & all() const { return orders; }
+
+  // Ids of the orders for the given item or seller, in ascending order
+  std::set<int> const & ids_by_item(int item_id) const;
+  std::set<int> const & ids_by_seller(UserId seller_id) const;
+
+  // Up to `limit` orders that match the filter and come after the cursor in the given order. Pages sorted by id, by
+  // price for a single item or without item and seller filters, and by expiration time without these filters are
+  // served by an index and cost O(log n + page size), unless most of the scanned orders are filtered out by the type
+  // or price. Other combinations sort all orders of the item or seller
+  Page page(Filter const & filter, SellOrdersSortKey sort_by, std::optional<SellOrdersCursor> after,
+            std::size_t limit) const;
+  static SellOrdersCursor cursor_of(Order const & order, SellOrdersSortKey sort_by);
+
+  // Ids of up to `limit` orders with expiration time <= `unix_now`, the earliest first
+  std::vector<int> expired(int64_t unix_now, std::size_t limit = SIZE_MAX) const;
+  // Number of orders with expiration time <= `unix_now`. Costs O(number of such orders)
+  std::size_t count_expired(int64_t unix_now) const;
+  // The earliest expiration time among all orders, std::nullopt if there are no orders
+  std::optional<int64_t> next_expiration_time() const;
+};
@@ -0,0 +1,38 @@
+#include "read_pool.hpp"
+
+#include <fmt/format.h>
+
+tl::expected<std::shared_ptr<ReadPool>, std::string> ReadPool::open(std::string_view path, std::size_t size,
+                                                                    asio::any_io_executor executor) {
+  if (path == ":memory:") {
+    return tl::make_unexpected("In-memory database can't be read from other connections");
+  }
+  std::string const path_str(path);
+  std::vector<Sqlite3> connections;
+  connections.reserve(size);
+  for (std::size_t i = 0; i < size; ++i) {
+    auto db = Sqlite3::open_read_only(path_str.c_str());
+    if (!db) {
+      return tl::make_unexpected(fmt::format("Failed to open read-only connection: {}", db.error()));
+    }
+    connections.push_back(std::move(*db));
+  }
+  // Constructed with `new`, as the constructor is private
+  return std::shared_ptr<ReadPool>(new ReadPool(std::move(executor), std::move(connections)));
+}
+
+Sqlite3 ReadPool::acquire() {
+  std::unique_lock lock(mutex);
+  released.wait(lock, [this]() { return !idle.empty(); });
+  Sqlite3 db = std::move(idle.back());
+  idle.pop_back();
+  return db;
+}
+
+void ReadPool::release(Sqlite3 db) {
+  {
+    std::lock_guard lock(mutex);
+    idle.push_back(std::move(db));
+  }
+  released.notify_one();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "sqlite3.hpp"
+#include "storage_executor.hpp"
+
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <tl/expected.hpp>
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Read-only connections to the database for queries that don't need the storage thread. In WAL mode readers never
+// block the writer and see the last committed transaction, so such queries run on a pool of threads in parallel and
+// never wait behind trades. Thread-safe
+class ReadPool final {
+  // Threads the queries run on. There are as many connections as threads, so a query never waits for a connection
+  StorageExecutor executor;
+
+  std::mutex mutex;
+  std::condition_variable released;
+  std::vector<Sqlite3> idle;
+
+  // constructor is private, use `open` instead
+  ReadPool(asio::any_io_executor executor, std::vector<Sqlite3> connections)
+      : executor(std::move(executor)), idle(std::move(connections)) {}
+
+public:
+  // Opens `size` read-only connections to the database, that must already be created by `Storage::open`.
+  // An in-memory database is private to its connection, so it can't be shared with the pool
+  static tl::expected<std::shared_ptr<ReadPool>, std::string> open(std::string_view path, std::size_t size,
+                                                                   asio::any_io_executor executor);
+
+  // Runs `f` on one of the pool threads, see `StorageExecutor::run`
+  template <typename F>
+  asio::awaitable<std::invoke_result_t<F &>> run(F f) const {
+    return executor.run(std::move(f));
+  }
+
+  // Calls `f` with an idle connection, waiting for one if all of them are busy
+  template <typename F>
+  std::invoke_result_t<F &, Sqlite3 &> with_connection(F && f) {
+    Lease lease(*this);
+    return f(lease.db);
+  }
+
+private:
+  // Connection taken from the pool until the lease is destroyed
+  struct Lease {
+    ReadPool & pool;
+    Sqlite3 db;
+
+    explicit Lease(ReadPool & pool) : pool(pool), db(pool.acquire()) {}
+    ~Lease() { pool.release(std::move(db)); }
+  };
+
+  Sqlite3 acquire();
+  void release(Sqlite3 db);
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <fmt/format.h>
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Output of a command with a long response, like a listing. Text is formatted right into the current chunk, which is
+// handed to `flush` once it's full, so the whole response never has to be held in memory. Without `flush` everything
+// is kept till `take()`
+class ResponseWriter final {
+  std::function<void(std::string)> flush;
+  std::size_t chunk_size;
+  std::string chunk;
+
+public:
+  static constexpr std::size_t kDefaultChunkSize = 16 * 1024;
+
+  explicit ResponseWriter(std::function<void(std::string)> flush = nullptr,
+                          std::size_t chunk_size = kDefaultChunkSize)
+      : flush(std::move(flush)), chunk_size(chunk_size) {
+    chunk.reserve(chunk_size);
+  }
+
+  template <typename... Args>
+  void print(fmt::format_string<Args...> format, Args &&... args) {
+    flush_if_full();
+    fmt::format_to(std::back_inserter(chunk), format, std::forward<Args>(args)...);
+  }
+  void write(std::string_view text) {
+    flush_if_full();
+    chunk += text;
+  }
+
+  // The rest of the response, that wasn't flushed yet. Chunks are flushed only before writing more, so it's never
+  // empty if the last write wasn't
+  std::string take() { return std::exchange(chunk, {}); }
+
+private:
+  void flush_if_full() {
+    if (flush && chunk.size() >= chunk_size) {
+      flush(std::exchange(chunk, {}));
+      chunk.reserve(chunk_size);
+    }
+  }
+};
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "auction_service.hpp"
+#include "expiry_timer.hpp"
+#include "group_commit.hpp"
+#include "read_pool.hpp"
+#include "storage.hpp"
+#include "storage_executor.hpp"
+#include "user_service.hpp"
+
+#include <fmt/format.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// A part of users together with their items and sell orders, with its own database and storage strand, so commands
+// of users from different shards never wait for each other. Trades between shards go through `CrossShardCoordinator`
+struct Shard {
+  // Strand of the storage threads for `storage` (together with its transaction log), `auction_service` and
+  // `user_service`. They must be used only from there, see `StorageExecutor::run`
+  StorageExecutor storage_executor;
+
+  // Persistent storage for users of the shard and their items. Writes the transaction log of the shard
+  std::shared_ptr<Storage> storage;
+
+  // Read-only connections for listings, that run on the pool threads instead of the storage thread.
+  // Null if there is no pool, e.g. for an in-memory database
+  std::shared_ptr<ReadPool> read_pool;
+
+  // Commands that change items run in batches, each batch in a single transaction. Runs on the storage thread
+  GroupCommit group_commit;
+
+  // Core logic for all operations with items
+  AuctionService auction_service;
+
+  // Core logic for all operations with users
+  UserService user_service;
+
+  // Wakes up expired sell orders processing when the earliest sell order expires. Runs on the storage thread
+  ExpiryTimer expiry_timer;
+
+  // Expired sell orders that are not settled yet, as they are settled in chunks. Updated from the storage thread
+  std::atomic<std::size_t> expiry_backlog = 0;
+};
+
+// Shard a new user is created in. Users are assigned by name, as there is no id before the first login.
+// FNV-1a rather than `std::hash`, as the assignment must never change between builds
+inline std::size_t shard_of_username(std::string_view username, std::size_t shard_count) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char const c : username) {
+    hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+  }
+  return static_cast<std::size_t>(hash % shard_count);
+}
+
+// Path of a file (database or transaction log) of the shard. The first shard uses the path as is, so a server with a
+// single shard keeps using the files it had before
+inline std::string shard_path(std::string_view path, std::size_t index) {
+  return index == 0 ? std::string(path) : fmt::format("{}.shard{}", path, index);
+}
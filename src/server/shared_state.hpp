@@ -1,32 +1,28 @@
 #pragma once
 
-#include "auction_service.hpp"
+#include "command_stats.hpp"
+#include "coordinator.hpp"
 #include "notification_service.hpp"
-#include "storage.hpp"
-#include "transaction_log.hpp"
-#include "user_service.hpp"
-
-#include <asio/ip/tcp.hpp>
+#include "shard.hpp"
+#include "types.hpp"
 
 #include <memory>
+#include <vector>
 
 // Shared state between all users and items
 struct SharedState {
-  // Persistent storage for users and items
-  std::shared_ptr<Storage> storage;
-
-  // Core logic for all operations with items
-  AuctionService auction_service;
+  // Users with their items and sell orders, split by `ShardId`. Usually there is only one
+  std::vector<std::shared_ptr<Shard>> shards;
 
-  // Core logic for all operations with users
-  UserService user_service;
+  // Trades between users of different shards. Null if there is only one shard
+  std::shared_ptr<CrossShardCoordinator> coordinator;
 
-  // Transaction log for all operations with items
-  TransactionLog transaction_log;
-
-  // Service for sending notifications about executed sell orders
+  // Connections of logged in users and notifications about executed sell orders for them
   NotificationService notifications;
 
-  // UserId -> Socket map for sending notifications
-  std::unordered_map<UserId, std::shared_ptr<asio::ip::tcp::socket>> sockets;
+  // Counters and latencies of all commands. Shared with the write queues, which record the write latency
+  std::shared_ptr<CommandStats> command_stats;
+
+  // Shard of the user, together with their items and sell orders
+  Shard & shard_of(UserId user_id) const { return *shards[ShardId::of(user_id, shards.size())]; }
 };
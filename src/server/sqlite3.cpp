@@ -3,12 +3,190 @@
 #include <fmt/format.h>
 #include <sqlite3.h>
 
-Sqlite3::Sqlite3(sqlite3 * db) : db(db) {}
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <unordered_map>
+
+struct Sqlite3::StatementCache {
+  struct Entry {
+    sqlite3_stmt * stmt;
+    // Set while the statement is borrowed, so the same SQL used recursively gets its own one-off statement
+    bool in_use;
+  };
+
+  // Transparent hash to look up by `std::string_view` without allocating a key
+  struct Hash {
+    using is_transparent = void;
+    std::size_t operator()(std::string_view sql) const noexcept { return std::hash<std::string_view>{}(sql); }
+  };
+
+  bool enabled = true;
+  // Node-based map keeps `Entry` addresses stable, so borrowed statements can point to their `in_use` flag
+  std::unordered_map<std::string, Entry, Hash, std::equal_to<>> statements;
+  StatementCacheStats stats;
+};
+
+struct Sqlite3::Profiler {
+  struct Entry {
+    uint64_t calls = 0;
+    uint64_t rows = 0;
+    uint64_t fullscan_steps = 0;
+    uint64_t vm_steps = 0;
+    int64_t total_ns = 0;
+    int64_t max_ns = 0;
+    std::string query_plan;
+    bool explained = false;
+  };
+
+  int64_t slow_threshold_ns;
+  std::FILE * slow_log = nullptr;
+  // Keyed by SQL text, so all statements compiled from the same SQL share the entry
+  std::unordered_map<std::string, Entry, StatementCache::Hash, std::equal_to<>> entries;
+  // Rows of a statement come one by one, so its entry is remembered until the statement finishes
+  sqlite3_stmt * running_stmt = nullptr;
+  Entry * running_entry = nullptr;
+  // Set while `EXPLAIN QUERY PLAN` runs, so it doesn't show up in the profiles
+  bool explaining = false;
+
+  ~Profiler() {
+    if (slow_log) {
+      std::fclose(slow_log);
+    }
+  }
+
+  Entry & entry(sqlite3_stmt * stmt) {
+    if (stmt == running_stmt) {
+      return *running_entry;
+    }
+    std::string_view const sql = sqlite3_sql(stmt);
+    auto it = entries.find(sql);
+    if (it == entries.end()) {
+      it = entries.emplace(std::string(sql), Entry{}).first;
+    }
+    running_stmt = stmt;
+    running_entry = &it->second;
+    return it->second;
+  }
+
+  void on_profile(sqlite3_stmt * stmt, int64_t elapsed_ns) {
+    Entry & entry = this->entry(stmt);
+    running_stmt = nullptr;
+    entry.calls++;
+    entry.total_ns += elapsed_ns;
+    entry.max_ns = std::max(entry.max_ns, elapsed_ns);
+    entry.fullscan_steps += static_cast<uint64_t>(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1));
+    entry.vm_steps += static_cast<uint64_t>(sqlite3_stmt_status(stmt, SQLITE_STMTSTATUS_VM_STEP, 1));
+
+    if (slow_log && elapsed_ns >= slow_threshold_ns) {
+      // Parameters are still bound, as the statement is being reset right now
+      char * expanded = sqlite3_expanded_sql(stmt);
+      fmt::print(slow_log, "{:.3f}: slow statement took {:.3f}ms: {}\n", unix_now(),
+                 static_cast<double>(elapsed_ns) / 1e6, one_line(expanded ? expanded : sqlite3_sql(stmt)));
+      sqlite3_free(expanded);
+      std::fflush(slow_log);
+    }
+  }
+
+  // Runs `EXPLAIN QUERY PLAN` once for every SQL text
+  void explain(sqlite3 * db, std::string_view sql) {
+    auto it = entries.find(sql);
+    if (it == entries.end()) {
+      it = entries.emplace(std::string(sql), Entry{}).first;
+    } else if (it->second.explained) {
+      return;
+    }
+    Entry & entry = it->second;
+    entry.explained = true;
+
+    std::string const explain_sql = fmt::format("EXPLAIN QUERY PLAN {}", sql);
+    sqlite3_stmt * stmt;
+    if (sqlite3_prepare_v2(db, explain_sql.c_str(), static_cast<int>(explain_sql.size()), &stmt, nullptr) !=
+        SQLITE_OK) {
+      return;
+    }
+    explaining = true;
+    // Each row is (id, parent id, unused, detail), children follow their parents
+    std::unordered_map<int, int> depths;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      int const id = sqlite3_column_int(stmt, 0);
+      int const parent = sqlite3_column_int(stmt, 1);
+      int const depth = parent == 0 ? 0 : depths[parent] + 1;
+      depths[id] = depth;
+      auto const detail = reinterpret_cast<char const *>(sqlite3_column_text(stmt, 3));
+      if (!entry.query_plan.empty()) {
+        entry.query_plan += '\n';
+      }
+      entry.query_plan.append(std::size_t(depth) * 2, ' ');
+      entry.query_plan += detail ? detail : "";
+    }
+    sqlite3_finalize(stmt);
+    explaining = false;
+
+    if (slow_log) {
+      fmt::print(slow_log, "{:.3f}: query plan of {}\n{}\n", unix_now(), one_line(sql), entry.query_plan);
+      std::fflush(slow_log);
+    }
+  }
+
+  static double unix_now() {
+    namespace ch = std::chrono;
+    return ch::duration<double>(ch::system_clock::now().time_since_epoch()).count();
+  }
+
+  // SQL in storage.cpp spans many indented lines, which is hard to read in a log
+  static std::string one_line(std::string_view sql) {
+    std::string result;
+    bool space = false;
+    for (char const c : sql) {
+      if (std::isspace(static_cast<unsigned char>(c))) {
+        space = !result.empty();
+        continue;
+      }
+      if (space) {
+        result += ' ';
+        space = false;
+      }
+      result += c;
+    }
+    return result;
+  }
+
+  static int trace_callback(unsigned type, void * context, void * p, void * x) {
+    auto & profiler = *static_cast<Profiler *>(context);
+    if (profiler.explaining) {
+      return 0;
+    }
+    auto * stmt = static_cast<sqlite3_stmt *>(p);
+    if (type == SQLITE_TRACE_ROW) {
+      profiler.entry(stmt).rows++;
+    } else if (type == SQLITE_TRACE_PROFILE) {
+      profiler.on_profile(stmt, *static_cast<int64_t *>(x));
+    }
+    return 0;
+  }
+};
+
+Sqlite3::Sqlite3(sqlite3 * db, bool cache_statements) : db(db), cache(std::make_unique<StatementCache>()) {
+  cache->enabled = cache_statements;
+}
+// Defined here, where `StatementCache` is a complete type
+Sqlite3::Sqlite3(Sqlite3 && other) noexcept
+    : db(other.db), cache(std::move(other.cache)), profiler(std::move(other.profiler)) {
+  other.db = nullptr;
+}
 Sqlite3::~Sqlite3() {
+  if (cache) {
+    for (auto const & [_, entry] : cache->statements) {
+      sqlite3_finalize(entry.stmt);
+    }
+  }
   sqlite3_close_v2(db);
 }
 
-tl::expected<Sqlite3, std::string> Sqlite3::open(char const * path) {
+tl::expected<Sqlite3, std::string> Sqlite3::open(char const * path, bool cache_statements) {
   sqlite3_initialize();
 
   sqlite3 * db;
@@ -16,7 +194,20 @@ tl::expected<Sqlite3, std::string> Sqlite3::open(char const * path) {
   if (rc != SQLITE_OK) {
     return tl::make_unexpected(fmt::format("Failed to open database: {}", sqlite3_errstr(rc)));
   }
-  return Sqlite3(db);
+  return Sqlite3(db, cache_statements);
+}
+
+tl::expected<Sqlite3, std::string> Sqlite3::open_read_only(char const * path) {
+  sqlite3_initialize();
+
+  sqlite3 * db;
+  int rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, nullptr);
+  if (rc != SQLITE_OK) {
+    // A handle is allocated even if the database can't be opened
+    sqlite3_close(db);
+    return tl::make_unexpected(fmt::format("Failed to open database: {}", sqlite3_errstr(rc)));
+  }
+  return Sqlite3(db, true);
 }
 
 tl::expected<void, std::string> Sqlite3::execute(std::string_view sql) {
@@ -31,12 +222,44 @@ tl::expected<void, std::string> Sqlite3::execute(std::string_view sql) {
 }
 
 tl::expected<Sqlite3::Statement, std::string> Sqlite3::prepare(std::string_view sql) {
+  auto const it = cache->enabled ? cache->statements.find(sql) : cache->statements.end();
+  if (it != cache->statements.end() && !it->second.in_use) {
+    cache->stats.hits++;
+    it->second.in_use = true;
+    return Statement(it->second.stmt, &it->second.in_use);
+  }
+  cache->stats.misses++;
+
+  // Only the first statement for the given SQL text goes to the cache, so hint SQLite that it will live long
+  bool const to_cache = cache->enabled && it == cache->statements.end();
+  unsigned int const flags = to_cache ? SQLITE_PREPARE_PERSISTENT : 0;
+
   sqlite3_stmt * stmt;
-  int rc = sqlite3_prepare_v2(this->db, sql.data(), static_cast<int>(sql.size()), &stmt, nullptr);
+  int rc = sqlite3_prepare_v3(this->db, sql.data(), static_cast<int>(sql.size()), flags, &stmt, nullptr);
   if (rc != SQLITE_OK) {
     return tl::make_unexpected(fmt::format("Failed to prepare SQL statement: {}", sqlite3_errmsg(this->db)));
   }
-  return Statement(stmt);
+  if (profiler) {
+    profiler->explain(this->db, sql);
+  }
+  if (!to_cache) {
+    return Statement(stmt);
+  }
+  auto & entry = cache->statements.emplace(std::string(sql), StatementCache::Entry{ .stmt = stmt, .in_use = true })
+                     .first->second;
+  return Statement(stmt, &entry.in_use);
+}
+
+tl::expected<void, std::string> Sqlite3::sync_wal() {
+  sqlite3_file * file = nullptr;
+  int rc = sqlite3_file_control(this->db, "main", SQLITE_FCNTL_JOURNAL_POINTER, &file);
+  if (rc == SQLITE_OK && file && file->pMethods) {
+    rc = file->pMethods->xSync(file, SQLITE_SYNC_NORMAL);
+  }
+  if (rc != SQLITE_OK) {
+    return tl::make_unexpected(fmt::format("Failed to sync the write-ahead log: {}", sqlite3_errstr(rc)));
+  }
+  return {};
 }
 
 int Sqlite3::last_insert_rowid() const {
@@ -44,8 +267,71 @@ int Sqlite3::last_insert_rowid() const {
   return static_cast<int>(sqlite3_last_insert_rowid(this->db));
 }
 
+int Sqlite3::changes() const {
+  return sqlite3_changes(this->db);
+}
+
+Sqlite3::StatementCacheStats Sqlite3::statement_cache_stats() const {
+  return cache ? cache->stats : StatementCacheStats{};
+}
+
+tl::expected<void, std::string> Sqlite3::enable_profiling(ProfilingOptions options) {
+  auto new_profiler = std::make_unique<Profiler>();
+  new_profiler->slow_threshold_ns = std::chrono::nanoseconds(options.slow_threshold).count();
+  if (!options.slow_log_path.empty()) {
+    new_profiler->slow_log = std::fopen(options.slow_log_path.c_str(), "a");
+    if (!new_profiler->slow_log) {
+      return tl::make_unexpected(fmt::format("Failed to open slow query log '{}'", options.slow_log_path));
+    }
+  }
+  unsigned const events = SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW;
+  int rc = sqlite3_trace_v2(this->db, events, &Profiler::trace_callback, new_profiler.get());
+  if (rc != SQLITE_OK) {
+    return tl::make_unexpected(fmt::format("Failed to enable profiling: {}", sqlite3_errstr(rc)));
+  }
+  profiler = std::move(new_profiler);
+
+  // Statements compiled so far won't be prepared again
+  for (auto const & [sql, _] : cache->statements) {
+    profiler->explain(this->db, sql);
+  }
+  return {};
+}
+
+std::vector<Sqlite3::StatementProfile> Sqlite3::statement_profiles() const {
+  std::vector<StatementProfile> profiles;
+  if (!profiler) {
+    return profiles;
+  }
+  for (auto const & [sql, entry] : profiler->entries) {
+    if (entry.calls == 0) {
+      continue;  // prepared, but never executed
+    }
+    profiles.push_back(StatementProfile{
+        .sql = Profiler::one_line(sql),
+        .calls = entry.calls,
+        .rows = entry.rows,
+        .fullscan_steps = entry.fullscan_steps,
+        .vm_steps = entry.vm_steps,
+        .total_time = std::chrono::nanoseconds(entry.total_ns),
+        .max_time = std::chrono::nanoseconds(entry.max_ns),
+        .query_plan = entry.query_plan,
+    });
+  }
+  std::sort(profiles.begin(), profiles.end(),
+            [](auto const & lhs, auto const & rhs) { return lhs.total_time > rhs.total_time; });
+  return profiles;
+}
+
 Sqlite3::Statement::~Statement() {
-  sqlite3_finalize(this->inner);
+  if (this->cached_in_use) {
+    // Keep the compiled statement, but make it ready for the next user and release bound `SQLITE_STATIC` strings
+    sqlite3_reset(this->inner);
+    sqlite3_clear_bindings(this->inner);
+    *this->cached_in_use = false;
+  } else {
+    sqlite3_finalize(this->inner);
+  }
 }
 
 tl::expected<void, std::string> Sqlite3::Statement::execute() {
@@ -56,6 +342,31 @@ tl::expected<void, std::string> Sqlite3::Statement::execute() {
   return {};
 }
 
+tl::expected<bool, std::string> Sqlite3::Statement::step() {
+  int rc = sqlite3_step(this->inner);
+  if (rc == SQLITE_ROW) {
+    return true;
+  }
+  if (rc != SQLITE_DONE) {
+    return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
+  }
+  return false;
+}
+
+int Sqlite3::Statement::column_int(int index) const {
+  return sqlite3_column_int(this->inner, index);
+}
+
+int64_t Sqlite3::Statement::column_int64(int index) const {
+  return sqlite3_column_int64(this->inner, index);
+}
+
+std::string_view Sqlite3::Statement::column_text(int index) const {
+  // The size must be taken after the text, as it may be converted to UTF-8 first
+  auto const * text = reinterpret_cast<char const *>(sqlite3_column_text(this->inner, index));
+  return { text != nullptr ? text : "", static_cast<std::size_t>(sqlite3_column_bytes(this->inner, index)) };
+}
+
 tl::expected<void, std::string> Sqlite3::Statement::bind(int index, std::string_view value) {
   int rc = sqlite3_bind_text(this->inner, index, value.data(), static_cast<int>(value.size()), SQLITE_STATIC);
   if (rc != SQLITE_OK) {
@@ -64,6 +375,14 @@ tl::expected<void, std::string> Sqlite3::Statement::bind(int index, std::string_
   return {};
 }
 
+tl::expected<void, std::string> Sqlite3::Statement::bind(int index, std::span<char const> value) {
+  int rc = sqlite3_bind_blob(this->inner, index, value.data(), static_cast<int>(value.size()), SQLITE_STATIC);
+  if (rc != SQLITE_OK) {
+    return tl::make_unexpected(fmt::format("Failed to bind SQL parameters: {}", sqlite3_errstr(rc)));
+  }
+  return {};
+}
+
 tl::expected<void, std::string> Sqlite3::Statement::bind(int index, int64_t value) {
   int rc = sqlite3_bind_int64(this->inner, index, value);
   if (rc != SQLITE_OK) {
@@ -2,9 +2,16 @@
 
 #include <tl/expected.hpp>
 
+#include <chrono>
+#include <cstdint>
+#include <memory>
 #include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 struct sqlite3;
 struct sqlite3_stmt;
@@ -13,22 +20,37 @@ struct sqlite3_stmt;
 class Sqlite3 final {
   sqlite3 * db;
 
+  // Prepared statements cache, keyed by SQL text. It lives on the heap, so statements handed out by `query` and
+  // `execute` keep pointing to valid cache entries even if this object is moved
+  struct StatementCache;
+  std::unique_ptr<StatementCache> cache;
+
+  // Statement profiles and the slow query log, null until `enable_profiling` is called. On the heap for the same
+  // reason, as SQLite keeps a pointer to it for the trace callback
+  struct Profiler;
+  std::unique_ptr<Profiler> profiler;
+
   // constructor is private, use `open` instead
-  Sqlite3(sqlite3 * db);
+  Sqlite3(sqlite3 * db, bool cache_statements);
 
 public:
-  // Opens a database file. If the file doesn't exist, it will be created
-  tl::expected<Sqlite3, std::string> static open(char const * path);
+  // Opens a database file. If the file doesn't exist, it will be created.
+  // With `cache_statements` all statements are compiled once and then reused, otherwise each call compiles SQL again
+  tl::expected<Sqlite3, std::string> static open(char const * path, bool cache_statements = true);
+  // Opens an existing database file for reading only. Any attempt to write fails
+  tl::expected<Sqlite3, std::string> static open_read_only(char const * path);
   ~Sqlite3();
 
   // This class cannot be copied, but can be moved
   Sqlite3(Sqlite3 const &) = delete;
   Sqlite3 & operator=(Sqlite3 const &) = delete;
-  Sqlite3(Sqlite3 && other) noexcept : db(other.db) { other.db = nullptr; }
+  Sqlite3(Sqlite3 && other) noexcept;
   Sqlite3 & operator=(Sqlite3 && other) noexcept {
     // move and swap idiom via local varialbe
     Sqlite3 local = std::move(other);
     std::swap(db, local.db);
+    std::swap(cache, local.cache);
+    std::swap(profiler, local.profiler);
     return *this;
   }
 
@@ -36,16 +58,23 @@ public:
   struct Statement final {
     sqlite3_stmt * inner;
 
-    Statement(sqlite3_stmt * inner) : inner(inner) {}
+    // Owning statement, that is finalized on destruction
+    Statement(sqlite3_stmt * inner) : inner(inner), cached_in_use(nullptr) {}
+    // Statement borrowed from the cache. On destruction it is reset and returned back to the cache
+    Statement(sqlite3_stmt * inner, bool * cached_in_use) : inner(inner), cached_in_use(cached_in_use) {}
     ~Statement();
 
     Statement(Statement const &) = delete;
     Statement & operator=(Statement const &) = delete;
-    Statement(Statement && other) noexcept : inner(other.inner) { other.inner = nullptr; }
+    Statement(Statement && other) noexcept : inner(other.inner), cached_in_use(other.cached_in_use) {
+      other.inner = nullptr;
+      other.cached_in_use = nullptr;
+    }
     Statement & operator=(Statement && other) noexcept {
       // move and swap idiom via local varialbe
       Statement local = std::move(other);
       std::swap(inner, local.inner);
+      std::swap(cached_in_use, local.cached_in_use);
       return *this;
     }
 
@@ -58,7 +87,46 @@ public:
       return bind_all_impl(1, std::forward<Args>(args)...);
     }
 
+    // Steps through all rows and calls `f` with the columns of each row as `Columns...` (`int`, `int64_t` or
+    // `std::string_view`). Text is not copied, so the views are valid only until `f` returns
+    template <typename... Columns, typename F>
+    tl::expected<void, std::string> for_each_row(F && f) {
+      for (;;) {
+        auto has_row = step();
+        if (!has_row) {
+          return tl::make_unexpected(std::move(has_row.error()));
+        }
+        if (!*has_row) {
+          return {};
+        }
+        [&]<std::size_t... I>(std::index_sequence<I...>) {
+          f(column<Columns>(static_cast<int>(I))...);
+        }(std::index_sequence_for<Columns...>{});
+      }
+    }
+
   private:
+    // Points to the `in_use` flag of the cache entry if this statement is borrowed from the cache
+    bool * cached_in_use;
+
+    // Moves to the next row, returns false once there are no more rows
+    tl::expected<bool, std::string> step();
+
+    template <typename T>
+    T column(int index) const {
+      if constexpr (std::is_same_v<T, std::string_view>) {
+        return column_text(index);
+      } else if constexpr (std::is_same_v<T, int64_t>) {
+        return column_int64(index);
+      } else {
+        static_assert(std::is_same_v<T, int>, "Unsupported column type");
+        return column_int(index);
+      }
+    }
+    int column_int(int index) const;
+    int64_t column_int64(int index) const;
+    std::string_view column_text(int index) const;
+
     tl::expected<void, std::string> bind_all_impl(int) { return {}; }
     template <typename T, typename... Args>
     tl::expected<void, std::string> bind_all_impl(int index, T && value, Args &&... args) {
@@ -71,6 +139,8 @@ public:
 
     // Internal implementation of bind for different types
     tl::expected<void, std::string> bind(int index, std::string_view value);
+    // binds a BLOB
+    tl::expected<void, std::string> bind(int index, std::span<char const> value);
     tl::expected<void, std::string> bind(int index, int64_t value);
     tl::expected<void, std::string> bind(int index, std::nullopt_t);
 
@@ -115,10 +185,53 @@ public:
     return stmt;
   }
 
+  // Syncs the write-ahead log, so transactions committed with synchronous=NORMAL survive a power loss, as they would
+  // with synchronous=FULL. Does nothing if there is no log file, e.g. for an in-memory database
+  tl::expected<void, std::string> sync_wal();
+
   // Returns the last inserted row id. Suitable to get the id after INSERT query
   int last_insert_rowid() const;
+  // Returns the number of rows changed by the last INSERT, UPDATE or DELETE
+  int changes() const;
+
+  // Prepared statements cache statistics. Each `query` or `execute` with parameters is either a hit or a miss
+  struct StatementCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+  StatementCacheStats statement_cache_stats() const;
+
+  struct ProfilingOptions {
+    // Statements that take at least this long are written to the slow query log. SQLite measures them with its VFS
+    // clock, which usually has a millisecond resolution
+    std::chrono::microseconds slow_threshold{ 10'000 };
+    // Slow statements (with bound parameters) and `EXPLAIN QUERY PLAN` of every prepared statement are appended
+    // there. No log if empty
+    std::string slow_log_path;
+  };
+  // Hooks `sqlite3_trace_v2` to aggregate execution time and rows of every statement
+  tl::expected<void, std::string> enable_profiling(ProfilingOptions options);
+
+  // Aggregated executions of a single SQL text
+  struct StatementProfile {
+    std::string sql;
+    uint64_t calls = 0;
+    // Rows returned to the caller
+    uint64_t rows = 0;
+    // Rows visited by full table scans, which usually means a missing index
+    uint64_t fullscan_steps = 0;
+    // Virtual machine instructions, the closest thing to the CPU cost of the statement that doesn't depend on timers
+    uint64_t vm_steps = 0;
+    std::chrono::nanoseconds total_time{ 0 };
+    std::chrono::nanoseconds max_time{ 0 };
+    // `EXPLAIN QUERY PLAN` output, one line per step. Empty for SQL that doesn't go through `query` or `execute`
+    // with parameters, e.g. BEGIN and COMMIT
+    std::string query_plan;
+  };
+  // Profiles of all statements executed since `enable_profiling`, the most time-consuming first
+  std::vector<StatementProfile> statement_profiles() const;
 
 private:
-  // Prepares SQL statement for execution. Use `query` instead
+  // Prepares SQL statement for execution or takes it from the cache. Use `query` instead
   tl::expected<Statement, std::string> prepare(std::string_view sql);
 };
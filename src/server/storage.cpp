@@ -3,9 +3,113 @@
 #include <fmt/format.h>
 #include <sqlite3.h>
 
-tl::expected<Storage, std::string> Storage::open(std::string_view path) {
+#include <chrono>
+#include <cstddef>
+#include <iterator>
+#include <map>
+#include <span>
+#include <utility>
+
+namespace {
+// The outbox is trimmed once per this many records, so it costs one DELETE per batch of commits
+constexpr uint64_t kLogOutboxTrimInterval = 4096;
+
+int64_t unix_now_ms() {
+  namespace ch = std::chrono;
+  return ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+}
+
+// Formats unix time the same way as `DATETIME(unix_time, 'unixepoch')` does in SQLite and appends it to `output`
+void format_unix_time_to(std::string & output, int64_t unix_time) {
+  namespace ch = std::chrono;
+  auto const time = ch::sys_seconds(ch::seconds(unix_time));
+  auto const days = ch::floor<ch::days>(time);
+  auto const date = ch::year_month_day(days);
+  auto const time_of_day = ch::hh_mm_ss(time - days);
+  fmt::format_to(std::back_inserter(output), "{:04}-{:02}-{:02} {:02}:{:02}:{:02}", static_cast<int>(date.year()),
+                 static_cast<unsigned>(date.month()), static_cast<unsigned>(date.day()), time_of_day.hours().count(),
+                 time_of_day.minutes().count(), time_of_day.seconds().count());
+}
+
+// Loads all `id, name` rows returned by the query into a dictionary
+tl::expected<NameDictionary, std::string> load_names(Sqlite3 & db, std::string_view sql) {
+  NameDictionary names;
+  return db.query(sql)
+      .and_then([&](auto select) {
+        return select.template for_each_row<int, std::string_view>(
+            [&](int id, std::string_view name) { names.insert(id, name); });
+      })
+      .map([&]() { return std::move(names); });
+}
+
+// Loads all active sell orders into a freshly created order book
+tl::expected<OrderBook, std::string> load_order_book(Sqlite3 & db, ShardId shard) {
+  OrderBook book(shard);
+  auto loaded =
+      db.query(
+            "SELECT"
+            "  sell_orders.id,"
+            "  sell_orders.seller_id,"
+            "  sell_orders.item_id,"
+            "  sell_orders.quantity,"
+            "  sell_orders.price,"
+            "  sell_orders.expiration_time,"
+            "  sell_orders.buyer_id,"
+            "  users.username,"
+            "  items.name "
+            "FROM sell_orders "
+            "INNER JOIN users ON sell_orders.seller_id = users.id "
+            "INNER JOIN items ON sell_orders.item_id = items.id")
+          .and_then([&](auto select) -> tl::expected<void, std::string> {
+            int rc;
+            while ((rc = sqlite3_step(select.inner)) == SQLITE_ROW) {
+              std::optional<UserId> buyer_id;
+              if (sqlite3_column_type(select.inner, 6) == SQLITE_INTEGER) {
+                buyer_id = sqlite3_column_int(select.inner, 6);
+              }
+              book.insert(OrderBook::Order{
+                  .id = sqlite3_column_int(select.inner, 0),
+                  .seller_id = sqlite3_column_int(select.inner, 1),
+                  .item_id = sqlite3_column_int(select.inner, 2),
+                  .quantity = sqlite3_column_int(select.inner, 3),
+                  .price = sqlite3_column_int(select.inner, 4),
+                  .unix_expiration_time = sqlite3_column_int64(select.inner, 5),
+                  .buyer_id = buyer_id,
+                  .seller_name = reinterpret_cast<char const *>(sqlite3_column_text(select.inner, 7)),
+                  .item_name = reinterpret_cast<char const *>(sqlite3_column_text(select.inner, 8)),
+              });
+            }
+            if (rc != SQLITE_DONE) {
+              return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
+            }
+            return {};
+          });
+  if (!loaded) {
+    return tl::make_unexpected(std::move(loaded.error()));
+  }
+
+  // AUTOINCREMENT never reuses ids of deleted orders, so neither should the book
+  auto last_id =
+      db.query("SELECT IFNULL(MAX(seq), 0) FROM sqlite_sequence WHERE name = 'sell_orders'")
+          .and_then([&](auto select) -> tl::expected<int, std::string> {
+            int rc = sqlite3_step(select.inner);
+            if (rc != SQLITE_ROW) {
+              return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
+            }
+            return sqlite3_column_int(select.inner, 0);
+          });
+  if (!last_id) {
+    return tl::make_unexpected(std::move(last_id.error()));
+  }
+  book.reserve_ids_up_to(*last_id);
+  return book;
+}
+}  // namespace
+
+tl::expected<Storage, std::string> Storage::open(std::string_view path, bool cache_statements,
+                                                 std::optional<ShardId> shard) {
   // todo: ensure that there is a `\0` at the end of the string
-  auto db = Sqlite3::open(path.data());
+  auto db = Sqlite3::open(path.data(), cache_statements);
   if (!db) {
     return tl::make_unexpected(fmt::format("Failed to open database: {}", db.error()));
   }
@@ -29,7 +133,43 @@ tl::expected<Storage, std::string> Storage::open(std::string_view path) {
   // See https://www.sqlite.org/pragma.html#pragma_synchronous for more details
   db->execute("PRAGMA synchronous=NORMAL");
 
+  // The shard the database was created for, as ids it allocates depend on it. A single row
   auto result = db->execute(
+      "CREATE TABLE IF NOT EXISTS shard ("
+      "shard_index INTEGER NOT NULL,"
+      "shard_count INTEGER NOT NULL"
+      ") STRICT");
+  if (!result) {
+    return tl::make_unexpected(fmt::format("Failed to create 'shard' table: {}", result.error()));
+  }
+  ShardId const new_shard = shard.value_or(ShardId{});
+  result = db->execute(
+      "INSERT INTO shard (shard_index, shard_count) SELECT ?1, ?2 WHERE NOT EXISTS (SELECT 1 FROM shard)",
+      new_shard.index, new_shard.count);
+  if (!result) {
+    return tl::make_unexpected(fmt::format("Failed to insert the shard: {}", result.error()));
+  }
+  auto stored_shard =
+      db->query("SELECT shard_index, shard_count FROM shard")
+          .and_then([&](auto select) -> tl::expected<ShardId, std::string> {
+            int rc = sqlite3_step(select.inner);
+            if (rc != SQLITE_ROW) {
+              return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
+            }
+            return ShardId{
+              .index = sqlite3_column_int(select.inner, 0),
+              .count = sqlite3_column_int(select.inner, 1),
+            };
+          });
+  if (!stored_shard) {
+    return tl::make_unexpected(fmt::format("Failed to get the shard: {}", stored_shard.error()));
+  }
+  if (shard && *shard != *stored_shard) {
+    return tl::make_unexpected(fmt::format("The database is shard {} of {}, but it's opened as shard {} of {}",
+                                           stored_shard->index, stored_shard->count, shard->index, shard->count));
+  }
+
+  result = db->execute(
       "CREATE TABLE IF NOT EXISTS users ("
       "id INTEGER PRIMARY KEY,"
       "username TEXT NOT NULL UNIQUE"
@@ -102,53 +242,226 @@ tl::expected<Storage, std::string> Storage::open(std::string_view path) {
   if (!result) {
     return tl::make_unexpected(fmt::format("Failed to create 'sell_orders' table: {}", result.error()));
   }
-  // Create an index to speed up cancel_expired_sell_orders()
-  result = db->execute("CREATE INDEX IF NOT EXISTS sell_orders_expiration_time ON sell_orders (expiration_time)");
+  // Expired orders are found via the order book and settled by id, so the index that was used for range scans
+  // over expiration time only slows down inserts and deletes
+  result = db->execute("DROP INDEX IF EXISTS sell_orders_expiration_time");
   if (!result) {
-    return tl::make_unexpected(fmt::format("Failed to create 'sell_orders_expiration_time' index: {}", result.error()));
+    return tl::make_unexpected(fmt::format("Failed to drop 'sell_orders_expiration_time' index: {}", result.error()));
   }
 
-  return Storage(std::move(*db), *funds_item_id);
-}
-
-std::optional<UserId> Storage::get_user_id(std::string_view username) {
-  auto user_id =
-      this->_db.query("SELECT id FROM users WHERE username = ?1", username)
-          .and_then([&](auto select) -> tl::expected<UserId, std::string> {
+  // Log records of the recent transactions, which the transaction log may still miss.
+  // The last record is never trimmed, so the sequence continues after a restart
+  result = db->execute(
+      "CREATE TABLE IF NOT EXISTS transaction_log_outbox ("
+      "seq INTEGER PRIMARY KEY,"
+      // Encoded the same way as in the binary log, see `encode_record`
+      "record BLOB NOT NULL"
+      ") STRICT");
+  if (!result) {
+    return tl::make_unexpected(fmt::format("Failed to create 'transaction_log_outbox' table: {}", result.error()));
+  }
+  auto last_log_seq =
+      db->query("SELECT IFNULL(MAX(seq), 0) FROM transaction_log_outbox")
+          .and_then([&](auto select) -> tl::expected<uint64_t, std::string> {
             int rc = sqlite3_step(select.inner);
             if (rc != SQLITE_ROW) {
               return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
             }
-            return sqlite3_column_int(select.inner, 0);
+            return static_cast<uint64_t>(sqlite3_column_int64(select.inner, 0));
           });
-  if (!user_id) {
-    return std::nullopt;
+  if (!last_log_seq) {
+    return tl::make_unexpected(fmt::format("Failed to get the last log record: {}", last_log_seq.error()));
   }
-  return *user_id;
+
+  // Changes of cross-shard transactions that are prepared, but not finished yet, see `Storage::prepare`
+  result = db->execute(
+      "CREATE TABLE IF NOT EXISTS prepared_changes ("
+      "transaction_id INTEGER NOT NULL,"
+      // 1 if the change is applied once the transaction commits, 0 - once it's aborted
+      "on_commit INTEGER NOT NULL,"
+      // See `Storage::PreparedChange` for the meaning of the rest
+      "kind INTEGER NOT NULL,"
+      "user_id INTEGER NOT NULL,"
+      "item_name TEXT NOT NULL,"
+      "quantity INTEGER NOT NULL,"
+      "order_id INTEGER NOT NULL,"
+      "price INTEGER NOT NULL,"
+      "expiration_time INTEGER NOT NULL,"
+      "buyer_id INTEGER"
+      ") STRICT");
+  if (!result) {
+    return tl::make_unexpected(fmt::format("Failed to create 'prepared_changes' table: {}", result.error()));
+  }
+  result = db->execute(
+      "CREATE INDEX IF NOT EXISTS prepared_changes_transaction_id ON prepared_changes (transaction_id)");
+  if (!result) {
+    return tl::make_unexpected(
+        fmt::format("Failed to create 'prepared_changes_transaction_id' index: {}", result.error()));
+  }
+
+  auto book = load_order_book(*db, *stored_shard);
+  if (!book) {
+    return tl::make_unexpected(fmt::format("Failed to load sell orders: {}", book.error()));
+  }
+  auto items = load_names(*db, "SELECT id, name FROM items");
+  if (!items) {
+    return tl::make_unexpected(fmt::format("Failed to load items: {}", items.error()));
+  }
+  auto users = load_names(*db, "SELECT id, username FROM users");
+  if (!users) {
+    return tl::make_unexpected(fmt::format("Failed to load users: {}", users.error()));
+  }
+
+  return Storage(std::move(*db), *funds_item_id, *stored_shard, std::move(*book), std::move(*items),
+                 std::move(*users), *last_log_seq);
+}
+
+tl::expected<std::size_t, std::string> Storage::attach_transaction_log(TransactionLog log) {
+  // A dropped record is skipped over by `TransactionLog::last_seq`, so it would be trimmed from the outbox too, and
+  // after a restart the gap couldn't be told from records that are written
+  if (log.overflow() == LogOverflowPolicy::Drop) {
+    return tl::make_unexpected("the transaction log drops records if it can't keep up, so committed records would be "
+                               "lost, use the 'block' overflow policy");
+  }
+  uint64_t const log_seq = log.last_seq();
+  if (log_seq > _last_log_seq) {
+    return tl::make_unexpected(fmt::format(
+        "the transaction log ends with record #{}, but the database with #{}, so the database lost transactions",
+        log_seq, _last_log_seq));
+  }
+
+  auto records = log_records_after(log_seq);
+  if (!records) {
+    return tl::make_unexpected(std::move(records.error()));
+  }
+  if (!records->empty() && records->front().seq != log_seq + 1) {
+    return tl::make_unexpected(
+        fmt::format("records #{}-#{} are missing both in the transaction log and in the database", log_seq + 1,
+                    records->front().seq - 1));
+  }
+  for (auto const & record : *records) {
+    log.save(record);
+  }
+  _transaction_log = std::move(log);
+  return records->size();
+}
+
+tl::expected<void, std::string> Storage::log(LogRecord record) {
+  if (!_in_transaction) {
+    return tl::make_unexpected("Log records can be written only within a transaction");
+  }
+  record.seq = _last_log_seq + 1;
+  record.unix_time_ms = unix_now_ms();
+  char data[kBinaryLogRecordSize];
+  encode_record(record, data);
+  auto result = _db.execute("INSERT INTO transaction_log_outbox (seq, record) VALUES (?1, ?2)",
+                            static_cast<int64_t>(record.seq), std::span<char const>(data));
+  if (!result) {
+    return result;
+  }
+  _last_log_seq = record.seq;
+  _pending_log_records.push_back(record);
+  return {};
+}
+
+tl::expected<std::vector<LogRecord>, std::string> Storage::log_records_after(uint64_t seq) {
+  return _db.query("SELECT record FROM transaction_log_outbox WHERE seq > ?1 ORDER BY seq", static_cast<int64_t>(seq))
+      .and_then([&](auto select) -> tl::expected<std::vector<LogRecord>, std::string> {
+        std::vector<LogRecord> records;
+        int rc;
+        while ((rc = sqlite3_step(select.inner)) == SQLITE_ROW) {
+          auto const * data = static_cast<char const *>(sqlite3_column_blob(select.inner, 0));
+          auto const record = sqlite3_column_bytes(select.inner, 0) == static_cast<int>(kBinaryLogRecordSize)
+                                  ? decode_record(data)
+                                  : std::nullopt;
+          if (!record) {
+            return tl::make_unexpected("Failed to decode a log record from the outbox");
+          }
+          records.push_back(*record);
+        }
+        if (rc != SQLITE_DONE) {
+          return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
+        }
+        return records;
+      });
+}
+
+std::optional<UserId> Storage::get_user_id(std::string_view username) {
+  return _users.find_id(username);
 }
 
 tl::expected<UserId, std::string> Storage::create_user(std::string_view username) {
-  auto user_inserted = this->_db.execute("INSERT INTO users (username) VALUES (?1)", username);
+  // The next id of the shard follows its last one. Users from other shards are rare, so they are skipped quickly
+  auto user_inserted = this->_db.execute(
+      "INSERT INTO users (id, username) VALUES (IFNULL((SELECT id FROM users WHERE id % ?2 = ?3 % ?2 "
+      "ORDER BY id DESC LIMIT 1) + ?2, ?3), ?1)",
+      username, _shard.count, _shard.first_id());
   if (!user_inserted) {
     return tl::make_unexpected(std::move(user_inserted.error()));
   }
-  return this->_db.last_insert_rowid();
+  auto const user_id = this->_db.last_insert_rowid();
+  _users.insert(user_id, username);
+  if (_in_transaction) {
+    _pending_user_ids.push_back(user_id);
+  }
+  return user_id;
+}
+
+tl::expected<void, std::string> Storage::add_foreign_user(User const & user) {
+  if (owns_user(user.id)) {
+    return tl::make_unexpected(fmt::format("User {} is not from another shard", user.id));
+  }
+  if (_users.find_name(user.id)) {
+    return {};
+  }
+  auto user_inserted =
+      _db.execute("INSERT INTO users (id, username) VALUES (?1, ?2)", user.id, std::string_view(user.username));
+  if (!user_inserted) {
+    return user_inserted;
+  }
+  _users.insert(user.id, user.username);
+  if (_in_transaction) {
+    _pending_user_ids.push_back(user.id);
+  }
+  return {};
 }
 
 tl::expected<std::vector<UserItemInfo>, std::string> Storage::view_user_items(UserId user_id) {
-  return this->_db
+  std::vector<UserItemInfo> items;
+  return view_user_items(user_id,
+                         [&](std::string_view item_name, int quantity) {
+                           items.push_back(UserItemInfo{ .item_name = std::string(item_name), .quantity = quantity });
+                         })
+      .map([&]() { return std::move(items); });
+}
+
+tl::expected<void, std::string> Storage::view_user_items(
+    UserId user_id, std::function<void(std::string_view item_name, int quantity)> const & callback) {
+  return view_user_items(this->_db, user_id, callback);
+}
+
+tl::expected<void, std::string> Storage::view_user_items(
+    Sqlite3 & db, UserId user_id, std::function<void(std::string_view item_name, int quantity)> const & callback) {
+  return db
       .query(
           "SELECT items.name, user_items.quantity FROM user_items "
           "INNER JOIN items ON user_items.item_id = items.id "
           "WHERE user_items.user_id = ?1",
           user_id)
-      .and_then([&](auto select) -> tl::expected<std::vector<UserItemInfo>, std::string> {
-        std::vector<UserItemInfo> items;
+      .and_then([&](auto select) { return select.template for_each_row<std::string_view, int>(callback); });
+}
+
+tl::expected<std::vector<Storage::UserItem>, std::string> Storage::all_user_items() {
+  return this->_db.query("SELECT user_id, item_id, quantity FROM user_items")
+      .and_then([&](auto select) -> tl::expected<std::vector<UserItem>, std::string> {
+        std::vector<UserItem> items;
         int rc;
         while ((rc = sqlite3_step(select.inner)) == SQLITE_ROW) {
-          std::string item_name = reinterpret_cast<char const *>(sqlite3_column_text(select.inner, 0));
-          int quantity = sqlite3_column_int(select.inner, 1);
-          items.push_back(UserItemInfo{ .item_name = std::move(item_name), .quantity = quantity });
+          items.push_back(UserItem{
+              .user_id = sqlite3_column_int(select.inner, 0),
+              .item_id = sqlite3_column_int(select.inner, 1),
+              .quantity = sqlite3_column_int(select.inner, 2),
+          });
         }
         if (rc != SQLITE_DONE) {
           return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
@@ -157,169 +470,411 @@ tl::expected<std::vector<UserItemInfo>, std::string> Storage::view_user_items(Us
       });
 }
 
-tl::expected<void, std::string> Storage::create_sell_order(SellOrder order) {
-  return _db.execute(
-      "INSERT INTO sell_orders (seller_id, item_id, quantity, price, expiration_time, buyer_id)"
-      "VALUES (?1, ?2, ?3, ?4, ?5, ?6)",
-      order.seller_id, order.item_id, order.quantity, order.price, order.unix_expiration_time, order.buyer_id);
+tl::expected<int, std::string> Storage::create_sell_order(SellOrder order) {
+  // Names are resolved once here, so views can be served from the order book without joins
+  auto const seller_name = _users.find_name(order.seller_id);
+  if (!seller_name) {
+    return tl::make_unexpected(fmt::format("User with id {} doesn't exist", order.seller_id));
+  }
+  auto const item_name = _items.find_name(order.item_id);
+  if (!item_name) {
+    return tl::make_unexpected(fmt::format("Item with id {} doesn't exist", order.item_id));
+  }
+
+  auto book_order = OrderBook::Order{
+    .id = _book.allocate_id(),
+    .seller_id = order.seller_id,
+    .item_id = order.item_id,
+    .quantity = order.quantity,
+    .price = order.price,
+    .unix_expiration_time = order.unix_expiration_time,
+    .buyer_id = order.buyer_id,
+    .seller_name = std::string(*seller_name),
+    .item_name = std::string(*item_name),
+  };
+  int const order_id = book_order.id;
+  _book.insert(book_order);
+  return record_order_write(std::nullopt, std::move(book_order)).map([&]() { return order_id; });
 }
 
 tl::expected<void, std::string> Storage::delete_sell_order(int order_id) {
-  return _db.execute("DELETE FROM sell_orders WHERE id = ?1", order_id);
+  return take_sell_order(order_id).map([](auto &&) {});
+}
+
+tl::expected<OrderBook::Order, std::string> Storage::take_sell_order(int order_id) {
+  auto order = _book.erase(order_id);
+  if (!order) {
+    return tl::make_unexpected(fmt::format("Sell order #{} doesn't exist", order_id));
+  }
+  return record_order_write(order, std::nullopt).map([&]() { return std::move(*order); });
 }
 
 tl::expected<void, std::string> Storage::update_sell_order_buyer(int order_id, UserId buyer_id, int price) {
-  return _db.execute("UPDATE sell_orders SET buyer_id = ?1, price = ?2 WHERE id = ?3", buyer_id, price, order_id);
+  auto const * order = _book.find(order_id);
+  if (!order) {
+    return tl::make_unexpected(fmt::format("Sell order #{} doesn't exist", order_id));
+  }
+  auto before = *order;
+  _book.update_buyer(order_id, buyer_id, price);
+  return record_order_write(std::move(before), *_book.find(order_id));
 }
 
-tl::expected<std::vector<SellOrderInfo>, std::string> Storage::view_sell_orders() {
-  return this->_db
-      .query(
-          "SELECT"
-          "  sell_orders.id,"
-          "  users.username,"
-          "  items.name,"
-          "  sell_orders.quantity,"
-          "  sell_orders.price,"
-          "  DATETIME(sell_orders.expiration_time, 'unixepoch'),"
-          "  sell_orders.seller_id,"
-          "  sell_orders.buyer_id "
-          "FROM sell_orders "
-          "INNER JOIN users ON sell_orders.seller_id = users.id "
-          "INNER JOIN items ON sell_orders.item_id = items.id")
-      .and_then([&](auto select) -> tl::expected<std::vector<SellOrderInfo>, std::string> {
-        std::vector<SellOrderInfo> orders;
-        int rc;
-        while ((rc = sqlite3_step(select.inner)) == SQLITE_ROW) {
-          int const id = sqlite3_column_int(select.inner, 0);
-          std::string user_name = reinterpret_cast<char const *>(sqlite3_column_text(select.inner, 1));
-          std::string item_name = reinterpret_cast<char const *>(sqlite3_column_text(select.inner, 2));
-          int const quantity = sqlite3_column_int(select.inner, 3);
-          int const price = sqlite3_column_int(select.inner, 4);
-          std::string expiration_time = reinterpret_cast<char const *>(sqlite3_column_text(select.inner, 5));
-
-          int const seller_id = sqlite3_column_int(select.inner, 6);
-          int const buyer_id = sqlite3_column_int(select.inner, 7);
-          SellOrderType const type = (seller_id == buyer_id) ? SellOrderType::Immediate : SellOrderType::Auction;
-
-          orders.emplace_back(SellOrderInfo{ .id = id,
-                                             .seller_name = std::move(user_name),
-                                             .item_name = std::move(item_name),
-                                             .quantity = quantity,
-                                             .price = price,
-                                             .expiration_time = std::move(expiration_time),
-                                             .type = type });
-        }
-        if (rc != SQLITE_DONE) {
-          return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
-        }
-        return orders;
+tl::expected<void, std::string> Storage::record_order_write(std::optional<OrderBook::Order> before,
+                                                            std::optional<OrderBook::Order> after) {
+  _pending_order_writes.push_back(PendingOrderWrite{ .before = std::move(before), .after = std::move(after) });
+  if (_in_transaction) {
+    return {};
+  }
+
+  auto result = flush_order_writes();
+  if (!result) {
+    undo_order_writes();
+  }
+  _pending_order_writes.clear();
+  return result;
+}
+
+tl::expected<void, std::string> Storage::flush_order_writes() {
+  for (auto const & write : _pending_order_writes) {
+    tl::expected<void, std::string> result;
+    if (!write.before) {
+      auto const & order = *write.after;
+      result = _db.execute(
+          "INSERT INTO sell_orders (id, seller_id, item_id, quantity, price, expiration_time, buyer_id)"
+          "VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7)",
+          order.id, order.seller_id, order.item_id, order.quantity, order.price, order.unix_expiration_time,
+          order.buyer_id);
+    } else if (!write.after) {
+      result = _db.execute("DELETE FROM sell_orders WHERE id = ?1", write.before->id);
+    } else {
+      auto const & order = *write.after;
+      result = _db.execute("UPDATE sell_orders SET buyer_id = ?1, price = ?2 WHERE id = ?3", order.buyer_id,
+                           order.price, order.id);
+    }
+    if (!result) {
+      return result;
+    }
+  }
+  return {};
+}
+
+void Storage::undo_order_writes(std::size_t from) {
+  for (auto it = _pending_order_writes.rbegin(); it != _pending_order_writes.rend() - static_cast<std::ptrdiff_t>(from);
+       ++it) {
+    if (it->after) {
+      _book.erase(it->after->id);
+      if (!it->before) {
+        _book.release_id(it->after->id);
+      }
+    }
+    if (it->before) {
+      _book.insert(*it->before);
+    }
+  }
+}
+
+tl::expected<SellOrdersPage, std::string> Storage::view_sell_orders(SellOrdersQuery const & query) {
+  SellOrdersPage page;
+  return view_sell_orders(query, [&](SellOrderInfo const & order) { page.orders.push_back(order); })
+      .map([&](std::optional<SellOrdersCursor> next) {
+        page.next = next;
+        return std::move(page);
       });
 }
 
-tl::expected<std::vector<SellOrderExecutionInfo>, std::string> Storage::process_expired_sell_orders(int64_t unix_now) {
+tl::expected<std::optional<SellOrdersCursor>, std::string> Storage::view_sell_orders(
+    SellOrdersQuery const & query, std::function<void(SellOrderInfo const &)> const & callback) {
+  OrderBook::Filter filter;
+  filter.type = query.type;
+  if (query.item_name) {
+    auto item_id = get_item_id(*query.item_name);
+    if (!item_id) {
+      // Unknown item has no orders
+      return std::nullopt;
+    }
+    filter.item_id = *item_id;
+  }
+  if (query.seller_name) {
+    auto seller_id = get_user_id(*query.seller_name);
+    if (!seller_id) {
+      return std::nullopt;
+    }
+    filter.seller_id = *seller_id;
+  }
+  filter.min_price = query.min_price.value_or(filter.min_price);
+  filter.max_price = query.max_price.value_or(filter.max_price);
+
+  auto const page = _book.page(filter, query.sort_by, query.after, query.limit);
+  // Reused for all orders, so strings are allocated only when they outgrow the previous ones
+  SellOrderInfo info;
+  for (OrderBook::Order const * order : page.orders) {
+    info.id = order->id;
+    info.seller_name = order->seller_name;
+    info.item_name = order->item_name;
+    info.quantity = order->quantity;
+    info.price = order->price;
+    info.expiration_time.clear();
+    format_unix_time_to(info.expiration_time, order->unix_expiration_time);
+    info.type = order->type();
+    info.unix_expiration_time = order->unix_expiration_time;
+    callback(info);
+  }
+  return page.next;
+}
+
+tl::expected<Storage::ExpiredSellOrders, std::string> Storage::process_expired_sell_orders(
+    int64_t unix_now, std::size_t max_orders, std::chrono::microseconds time_budget,
+    int64_t cross_shard_transaction_id) {
+  namespace ch = std::chrono;
+  auto const started_at = ch::steady_clock::now();
+  auto const expired_ids = _book.expired(unix_now, max_orders);
+  ExpiredSellOrders result;
+  if (expired_ids.empty()) {
+    return result;
+  }
+
   // Start transaction
   auto transaction_guard = begin_transaction();
   if (!transaction_guard) {
     return tl::make_unexpected(fmt::format("Failed to start transaction: {}", transaction_guard.error()));
   }
 
-  // get all executed auction orders
-  auto executed_auction_orders =
+  // Combine similar (by user_id and item_id) settlements, so each user gets each item with a single statement
+  std::map<std::pair<UserId, int>, int> settlements;
+  for (int id : expired_ids) {
+    // The rest is left for the next chunk, which will be a separate transaction. Compared in microseconds, as the
+    // default budget overflows in nanoseconds
+    auto const elapsed = ch::duration_cast<ch::microseconds>(ch::steady_clock::now() - started_at);
+    if (result.settled > 0 && elapsed >= time_budget) {
+      break;
+    }
+
+    auto order = _book.erase(id);
+    // Recorded first, so the order is restored in the book if anything below fails
+    auto delete_result = record_order_write(order, std::nullopt);
+    if (!delete_result) {
+      return tl::make_unexpected(fmt::format("Failed to delete expired sell order #{}: {}", id, delete_result.error()));
+    }
+
+    tl::expected<void, std::string> log_result;
+    if (order->buyer_id && *order->buyer_id != order->seller_id && !owns_user(*order->buyer_id)) {
+      // The buyer is in another shard, so the seller gets funds only once the buyer's shard is ready to give them
+      // items. Until then the order is taken out of the book
+      if (cross_shard_transaction_id == 0) {
+        return tl::make_unexpected(fmt::format("Sell order #{} is won by a user from another shard", id));
+      }
+      log_result =
+          prepare(cross_shard_transaction_id,
+                  PreparedChange{
+                      .kind = PreparedChange::Kind::RestoreOrder,
+                      .user_id = order->seller_id,
+                      .item_name = order->item_name,
+                      .quantity = order->quantity,
+                      .order_id = order->id,
+                      .price = order->price,
+                      .unix_expiration_time = order->unix_expiration_time,
+                      .buyer_id = order->buyer_id,
+                  },
+                  false)
+              .and_then([&]() {
+                return prepare(cross_shard_transaction_id,
+                               PreparedChange{
+                                   .kind = PreparedChange::Kind::Credit,
+                                   .user_id = order->seller_id,
+                                   .item_name = std::string(FUNDS_ITEM_NAME),
+                                   .quantity = order->price,
+                                   .order_id = order->id,
+                               },
+                               true);
+              });
+      result.executed.emplace_back(SellOrderExecutionInfo{
+          .id = order->id,
+          .seller_id = order->seller_id,
+          .buyer_id = *order->buyer_id,
+          .item_id = order->item_id,
+          .quantity = order->quantity,
+          .price = order->price,
+      });
+    } else if (order->buyer_id && *order->buyer_id != order->seller_id) {
+      // auction order with a bid - items go to the buyer and funds go to the seller
+      settlements[{ *order->buyer_id, order->item_id }] += order->quantity;
+      settlements[{ order->seller_id, _funds_item_id }] += order->price;
+      result.executed.emplace_back(SellOrderExecutionInfo{
+          .id = order->id,
+          .seller_id = order->seller_id,
+          .buyer_id = *order->buyer_id,
+          .item_id = order->item_id,
+          .quantity = order->quantity,
+          .price = order->price,
+      });
+      log_result = log(LogRecord{
+          .kind = LogRecord::Kind::AuctionSettled,
+          .user_id = order->seller_id,
+          .buyer_id = *order->buyer_id,
+          .item_id = order->item_id,
+          .quantity = order->quantity,
+          .price = order->price,
+          .order_id = order->id,
+      });
+    } else {
+      // immediate order or auction order without bid - items are returned to the seller
+      settlements[{ order->seller_id, order->item_id }] += order->quantity;
+      log_result = log(LogRecord{
+          .kind = LogRecord::Kind::SellOrderExpired,
+          .user_id = order->seller_id,
+          .item_id = order->item_id,
+          .quantity = order->quantity,
+          .order_id = order->id,
+      });
+    }
+    if (!log_result) {
+      return tl::make_unexpected(fmt::format("Failed to log expired sell order #{}: {}", id, log_result.error()));
+    }
+    result.settled++;
+  }
+
+  for (auto const & [user_item, quantity] : settlements) {
+    auto const [user_id, item_id] = user_item;
+    auto add_result = add_user_item(user_id, item_id, quantity);
+    if (!add_result) {
+      return tl::make_unexpected(fmt::format("Failed to settle expired sell orders: {}", add_result.error()));
+    }
+  }
+
+  return transaction_guard->commit().map([&]() { return std::move(result); });
+}
+
+tl::expected<void, std::string> Storage::prepare(int64_t transaction_id, PreparedChange change, bool on_commit) {
+  if (!_in_transaction) {
+    return tl::make_unexpected("Cross-shard transactions can be prepared only within a transaction");
+  }
+  _durable_commit = true;
+  return _db.execute(
+      "INSERT INTO prepared_changes (transaction_id, on_commit, kind, user_id, item_name, quantity, order_id, price, "
+      "expiration_time, buyer_id) VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10)",
+      transaction_id, on_commit, static_cast<int>(change.kind), change.user_id, std::string_view(change.item_name),
+      change.quantity, change.order_id, change.price, change.unix_expiration_time, change.buyer_id);
+}
+
+tl::expected<void, std::string> Storage::finish_prepared(int64_t transaction_id, bool committed) {
+  // Read first, as applying the changes runs other statements
+  std::vector<PreparedChange> changes;
+  auto loaded =
       _db.query(
-             "SELECT "
-             "  id, "
-             "  seller_id, "
-             "  buyer_id, "
-             "  item_id, "
-             "  quantity, "
-             "  price "
-             "FROM sell_orders "
-             "WHERE sell_orders.expiration_time <= ?1 AND buyer_id IS NOT NULL AND buyer_id != seller_id",
-             unix_now)
-          .and_then([&](auto select) -> tl::expected<std::vector<SellOrderExecutionInfo>, std::string> {
-            std::vector<SellOrderExecutionInfo> orders;
+             "SELECT kind, user_id, item_name, quantity, order_id, price, expiration_time, buyer_id "
+             "FROM prepared_changes WHERE transaction_id = ?1 AND on_commit = ?2 ORDER BY rowid",
+             transaction_id, committed)
+          .and_then([&](auto select) -> tl::expected<void, std::string> {
             int rc;
             while ((rc = sqlite3_step(select.inner)) == SQLITE_ROW) {
-              orders.emplace_back(SellOrderExecutionInfo{
-                  .id = sqlite3_column_int(select.inner, 0),
-                  .seller_id = sqlite3_column_int(select.inner, 1),
-                  .buyer_id = sqlite3_column_int(select.inner, 2),
-                  .item_id = sqlite3_column_int(select.inner, 3),
-                  .quantity = sqlite3_column_int(select.inner, 4),
+              std::optional<UserId> buyer_id;
+              if (sqlite3_column_type(select.inner, 7) == SQLITE_INTEGER) {
+                buyer_id = sqlite3_column_int(select.inner, 7);
+              }
+              changes.push_back(PreparedChange{
+                  .kind = static_cast<PreparedChange::Kind>(sqlite3_column_int(select.inner, 0)),
+                  .user_id = sqlite3_column_int(select.inner, 1),
+                  .item_name = reinterpret_cast<char const *>(sqlite3_column_text(select.inner, 2)),
+                  .quantity = sqlite3_column_int(select.inner, 3),
+                  .order_id = sqlite3_column_int(select.inner, 4),
                   .price = sqlite3_column_int(select.inner, 5),
+                  .unix_expiration_time = sqlite3_column_int64(select.inner, 6),
+                  .buyer_id = buyer_id,
               });
             }
             if (rc != SQLITE_DONE) {
               return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
             }
-            return orders;
+            return {};
           });
+  if (!loaded) {
+    return loaded;
+  }
+
+  auto transaction_guard = begin_transaction();
+  if (!transaction_guard) {
+    return tl::make_unexpected(fmt::format("Failed to start transaction: {}", transaction_guard.error()));
+  }
+  _durable_commit = true;
+  for (auto const & change : changes) {
+    tl::expected<void, std::string> result;
+    switch (change.kind) {
+    case PreparedChange::Kind::Credit:
+      // Item ids are local to the shard, so the item may be new here
+      result = get_item_id(change.item_name)
+                   .or_else([&](auto &&) { return create_item(change.item_name); })
+                   .and_then([&](int item_id) {
+                     return add_user_item(change.user_id, item_id, change.quantity).and_then([&]() {
+                       return log(LogRecord{
+                           .kind = LogRecord::Kind::TransferredIn,
+                           .user_id = change.user_id,
+                           .item_id = item_id,
+                           .quantity = change.quantity,
+                           .order_id = change.order_id,
+                       });
+                     });
+                   });
+      break;
+    case PreparedChange::Kind::RestoreOrder: {
+      auto const seller_name = _users.find_name(change.user_id);
+      auto const item_id = _items.find_id(change.item_name);
+      if (!seller_name || !item_id) {
+        result = tl::make_unexpected(fmt::format("Failed to restore sell order #{}: its seller or item doesn't exist",
+                                                 change.order_id));
+        break;
+      }
+      auto order = OrderBook::Order{
+        .id = change.order_id,
+        .seller_id = change.user_id,
+        .item_id = *item_id,
+        .quantity = change.quantity,
+        .price = change.price,
+        .unix_expiration_time = change.unix_expiration_time,
+        .buyer_id = change.buyer_id,
+        .seller_name = std::string(*seller_name),
+        .item_name = change.item_name,
+      };
+      _book.insert(order);
+      result = record_order_write(std::nullopt, std::move(order));
+      break;
+    }
+    }
+    if (!result) {
+      return result;
+    }
+  }
+  return _db.execute("DELETE FROM prepared_changes WHERE transaction_id = ?1", transaction_id).and_then([&]() {
+    return transaction_guard->commit();
+  });
+}
 
-  // Combine similar (by user_id and item_id) orders and add them to user_items
-  auto update_result = _db.execute(
-      // Aggregate orders that sells the same item to the same user
-      "WITH aggregated_orders AS ("
-      // this select combines items from all orders that are expired to the same user
-      "  SELECT "
-      // for immediate order and auction order without bid we return items to the seller
-      // for auction order with bid we move items to the buyer
-      "    CASE "
-      "      WHEN buyer_id IS NULL OR buyer_id = seller_id THEN seller_id "
-      "      ELSE buyer_id "
-      "    END as user_id, "
-      "    item_id, "
-      "    SUM(quantity) as total_quantity "
-      "  FROM sell_orders "
-      "  WHERE sell_orders.expiration_time <= ?1 "
-      "  GROUP BY user_id, item_id "
-      // and for auction orders with bid we also add funds to the seller
-      "  UNION ALL "
-      "  SELECT "
-      "    seller_id as user_id, "
-      "    ?2 as item_id, "
-      "    SUM(price) as total_quantity "
-      "  FROM sell_orders "
-      "  WHERE sell_orders.expiration_time <= ?1 AND buyer_id IS NOT NULL AND buyer_id != seller_id "
-      "  GROUP BY seller_id "
-      ") "
-      "INSERT OR REPLACE INTO user_items (user_id, item_id, quantity) "
-      // Combine aggregated orders with user_items
-      "SELECT "
-      "  aggregated_orders.user_id, "
-      "  aggregated_orders.item_id, "
-      "  IFNULL(user_items.quantity, 0) + aggregated_orders.total_quantity "
-      "FROM aggregated_orders "
-      "LEFT JOIN user_items ON user_items.user_id = aggregated_orders.user_id "
-      "  AND user_items.item_id = aggregated_orders.item_id",
-      unix_now, _funds_item_id);
-  if (!update_result) {
-    return tl::make_unexpected(fmt::format("Failed to cancel expired sell orders: {}", update_result.error()));
-  }
-
-  // Delete expired orders
-  auto delete_result = _db.execute("DELETE FROM sell_orders WHERE expiration_time <= ?1", unix_now);
-  if (!delete_result) {
-    return tl::make_unexpected(fmt::format("Failed to delete expired sell orders: {}", delete_result.error()));
-  }
-
-  return transaction_guard->commit().and_then([executed = std::move(executed_auction_orders)]() { return executed; });
+tl::expected<std::vector<int64_t>, std::string> Storage::prepared_transactions() {
+  std::vector<int64_t> ids;
+  return _db.query("SELECT DISTINCT transaction_id FROM prepared_changes ORDER BY transaction_id")
+      .and_then([&](auto select) {
+        return select.template for_each_row<int64_t>([&](int64_t id) { ids.push_back(id); });
+      })
+      .map([&]() { return std::move(ids); });
 }
 
 tl::expected<int, std::string> Storage::create_item(std::string_view item_name) {
-  return this->_db.execute("INSERT INTO items (name) VALUES (?1)", item_name)
-      .and_then([&]() -> tl::expected<int, std::string> { return this->_db.last_insert_rowid(); });
+  auto item_inserted = this->_db.execute("INSERT INTO items (name) VALUES (?1)", item_name);
+  if (!item_inserted) {
+    return tl::make_unexpected(std::move(item_inserted.error()));
+  }
+  auto const item_id = this->_db.last_insert_rowid();
+  _items.insert(item_id, item_name);
+  if (_in_transaction) {
+    _pending_item_ids.push_back(item_id);
+  }
+  return item_id;
 }
 
 tl::expected<int, std::string> Storage::get_item_id(std::string_view item_name) {
-  return this->_db.query("SELECT id FROM items WHERE name = ?1", item_name)
-      .and_then([&](auto select) -> tl::expected<int, std::string> {
-        int rc = sqlite3_step(select.inner);
-        if (rc != SQLITE_ROW) {
-          return tl::make_unexpected(fmt::format("Failed to execute SQL statement: {}", sqlite3_errstr(rc)));
-        }
-        return sqlite3_column_int(select.inner, 0);
-      });
+  if (auto const item_id = _items.find_id(item_name)) {
+    return *item_id;
+  }
+  return tl::make_unexpected(fmt::format("Item '{}' doesn't exist", item_name));
 }
 
 std::optional<int> Storage::get_user_items_quantity(UserId user_id, int item_id) {
@@ -342,66 +897,183 @@ tl::expected<void, std::string> Storage::add_user_item(UserId user_id, int item_
 }
 
 tl::expected<void, std::string> Storage::sub_user_item(UserId user_id, int item_id, int quantity) {
-  auto const user_item_quantity = get_user_items_quantity(user_id, item_id);
-  if (!user_item_quantity || *user_item_quantity < quantity) {
+  // The check and the change are one statement, so there is no window between reading the quantity and writing it
+  if (item_id == _funds_item_id) {
+    // Users always have a funds row, so the rest doesn't matter. It's the most frequent debit (every fee, buy and bid)
+    // and `RETURNING` costs more VM steps than the `SELECT` it replaces, so the number of changed rows is checked
+    auto result = _db.execute(
+        "UPDATE user_items SET quantity = quantity - ?3 WHERE user_id = ?1 AND item_id = ?2 AND quantity >= ?3",
+        user_id, item_id, quantity);
+    if (result && _db.changes() == 0) {
+      return tl::make_unexpected(fmt::format("Failed to withdraw {} items.", quantity));
+    }
+    return result;
+  }
+
+  std::optional<int> remaining;
+  auto result =
+      _db.query(
+             "UPDATE user_items SET quantity = quantity - ?3 "
+             "WHERE user_id = ?1 AND item_id = ?2 AND quantity >= ?3 RETURNING quantity",
+             user_id, item_id, quantity)
+          .and_then([&](auto update) {
+            return update.template for_each_row<int>([&](int left) { remaining = left; });
+          });
+  if (!result) {
+    return result;
+  }
+  if (!remaining) {
     return tl::make_unexpected(fmt::format("Failed to withdraw {} items.", quantity));
   }
 
-  tl::expected<void, std::string> reduce_result;
-  if (item_id == _funds_item_id || user_item_quantity > quantity) {
-    reduce_result = _db.execute("UPDATE user_items SET quantity = quantity - ?3 WHERE user_id = ?1 AND item_id = ?2",
-                                user_id, item_id, quantity);
-  } else {
-    reduce_result = _db.execute("DELETE FROM user_items WHERE user_id = ?1 AND item_id = ?2", user_id, item_id);
+  // Other items are listed only while the user has some
+  if (*remaining == 0) {
+    if (!_in_transaction) {
+      return _db.execute("DELETE FROM user_items WHERE user_id = ?1 AND item_id = ?2 AND quantity = 0", user_id,
+                         item_id);
+    }
+    _emptied_user_items.emplace_back(user_id, item_id);
   }
-  return reduce_result;
+  return {};
 }
 
-std::optional<Storage::SellOrderInnerInfo> Storage::get_sell_order_info(int sell_order_id) {
-  auto stmt = this->_db.query(
-      "SELECT"
-      "  sell_orders.seller_id,"
-      "  sell_orders.item_id,"
-      "  sell_orders.quantity,"
-      "  sell_orders.price,"
-      "  sell_orders.buyer_id "
-      "FROM sell_orders "
-      "WHERE sell_orders.id = ?1",
-      sell_order_id);
-  if (!stmt) {
-    return std::nullopt;
-  }
-  int rc = sqlite3_step(stmt->inner);
-  if (rc != SQLITE_ROW) {
-    return std::nullopt;
+tl::expected<void, std::string> Storage::delete_emptied_user_items() {
+  for (auto const & [user_id, item_id] : _emptied_user_items) {
+    auto result =
+        _db.execute("DELETE FROM user_items WHERE user_id = ?1 AND item_id = ?2 AND quantity = 0", user_id, item_id);
+    if (!result) {
+      return result;
+    }
   }
+  _emptied_user_items.clear();
+  return {};
+}
 
-  std::optional<int> buyer_id;
-  if (sqlite3_column_type(stmt->inner, 4) == SQLITE_INTEGER) {
-    buyer_id = sqlite3_column_int(stmt->inner, 4);
+std::optional<Storage::SellOrderInnerInfo> Storage::get_sell_order_info(int sell_order_id) {
+  auto const * order = _book.find(sell_order_id);
+  if (!order) {
+    return std::nullopt;
   }
-
   return Storage::SellOrderInnerInfo{
-    .seller_id = sqlite3_column_int(stmt->inner, 0),
-    .item_id = sqlite3_column_int(stmt->inner, 1),
-    .quantity = sqlite3_column_int(stmt->inner, 2),
-    .price = sqlite3_column_int(stmt->inner, 3),
-    .buyer_id = buyer_id,
+    .seller_id = order->seller_id,
+    .item_id = order->item_id,
+    .quantity = order->quantity,
+    .price = order->price,
+    .buyer_id = order->buyer_id,
   };
 }
 
 tl::expected<Storage::TransactionGuard, std::string> Storage::begin_transaction() {
+  if (_in_transaction) {
+    auto result = _db.execute("SAVEPOINT nested");
+    if (!result) {
+      return tl::make_unexpected(std::move(result.error()));
+    }
+    _savepoints.push_back(Savepoint{
+        .order_writes = _pending_order_writes.size(),
+        .item_ids = _pending_item_ids.size(),
+        .user_ids = _pending_user_ids.size(),
+        .emptied_user_items = _emptied_user_items.size(),
+        .log_records = _pending_log_records.size(),
+        .after_commit = _after_commit.size(),
+    });
+    return TransactionGuard(this);
+  }
+
   auto result = _db.execute("BEGIN");
   if (!result) {
     return tl::make_unexpected(std::move(result.error()));
   }
+  _in_transaction = true;
   return TransactionGuard(this);
 }
 
+void Storage::after_commit(std::function<void()> f) {
+  if (_in_transaction) {
+    _after_commit.push_back(std::move(f));
+  } else {
+    f();
+  }
+}
+
 void Storage::rollback_transaction() {
-  _db.execute("ROLLBACK");
+  // Everything made since the savepoint is reverted, the outer transaction goes on
+  Savepoint savepoint{};
+  if (!_savepoints.empty()) {
+    savepoint = _savepoints.back();
+    _savepoints.pop_back();
+    _db.execute("ROLLBACK TO nested");
+    _db.execute("RELEASE nested");
+  } else {
+    _db.execute("ROLLBACK");
+    _in_transaction = false;
+    _durable_commit = false;
+  }
+
+  undo_order_writes(savepoint.order_writes);
+  _pending_order_writes.resize(savepoint.order_writes);
+  for (std::size_t i = savepoint.item_ids; i < _pending_item_ids.size(); ++i) {
+    _items.erase(_pending_item_ids[i]);
+  }
+  _pending_item_ids.resize(savepoint.item_ids);
+  for (std::size_t i = savepoint.user_ids; i < _pending_user_ids.size(); ++i) {
+    _users.erase(_pending_user_ids[i]);
+  }
+  _pending_user_ids.resize(savepoint.user_ids);
+  _emptied_user_items.resize(savepoint.emptied_user_items);
+  _last_log_seq -= _pending_log_records.size() - savepoint.log_records;
+  _pending_log_records.resize(savepoint.log_records);
+  _after_commit.resize(savepoint.after_commit);
 }
 
 tl::expected<void, std::string> Storage::commit_transaction() {
-  return _db.execute("COMMIT");
+  if (!_savepoints.empty()) {
+    // Changes of the nested transaction now belong to the outer one
+    auto result = _db.execute("RELEASE nested");
+    if (result) {
+      _savepoints.pop_back();
+    }
+    return result;
+  }
+
+  // Order book changes go to the same commit as the funds and items changes they belong to.
+  // On failure they are kept, so `rollback_transaction` can revert them in the book
+  auto result = flush_order_writes().and_then([&]() { return delete_emptied_user_items(); }).and_then([&]() {
+    return _db.execute("COMMIT");
+  });
+  if (result) {
+    _pending_order_writes.clear();
+    _pending_item_ids.clear();
+    _pending_user_ids.clear();
+    _in_transaction = false;
+    if (_transaction_log) {
+      for (auto const & record : _pending_log_records) {
+        _transaction_log->save(record);
+      }
+    }
+    trim_log_outbox();
+    _pending_log_records.clear();
+    for (auto & f : std::exchange(_after_commit, {})) {
+      f();
+    }
+    // Other shards rely on the parts of cross-shard transactions, so unlike other commits they must survive a power
+    // loss, see `Storage::open` for what synchronous=NORMAL may lose. The setting can't be changed within a
+    // transaction, so the WAL is synced right after the commit instead, which is what synchronous=FULL would do
+    if (std::exchange(_durable_commit, false)) {
+      result = _db.sync_wal().map_error(
+          [](auto && error) { return fmt::format("Committed, but may be lost in a power loss: {}", error); });
+    }
+  }
+  return result;
+}
+
+void Storage::trim_log_outbox() {
+  if (_last_log_seq < _log_outbox_trimmed_at_seq + kLogOutboxTrimInterval) {
+    return;
+  }
+  _log_outbox_trimmed_at_seq = _last_log_seq;
+  // Without a log nothing waits for the records, so the table doesn't grow all the same
+  uint64_t const written_seq = _transaction_log ? _transaction_log->last_seq() : _last_log_seq;
+  // Failure isn't a problem, the records will be trimmed next time
+  _db.execute("DELETE FROM transaction_log_outbox WHERE seq < ?1", static_cast<int64_t>(written_seq));
 }
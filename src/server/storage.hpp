@@ -1,24 +1,99 @@
 #pragma once
 
+#include "name_dictionary.hpp"
+#include "order_book.hpp"
 #include "sqlite3.hpp"
+#include "transaction_log.hpp"
+#include "transaction_log_record.hpp"
 #include "types.hpp"
 
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
 #include <string_view>
+#include <vector>
 
 // Wrapper around sqlite3 database with core business logic
 class Storage final {
   Sqlite3 _db;
   int _funds_item_id;
+  // Users (with their items and sell orders) this database is responsible for, see `ShardId`
+  ShardId _shard;
+
+  // Authoritative hot copy of the `sell_orders` table. All reads are served from it, while changes are written to
+  // the table in the same order they were made, as one batch right before the enclosing transaction commits
+  OrderBook _book;
+
+  // A change in the order book that is not yet written to the `sell_orders` table.
+  // - no `before` - a new order
+  // - no `after` - a deleted order
+  // - both - an updated order
+  struct PendingOrderWrite {
+    std::optional<OrderBook::Order> before;
+    std::optional<OrderBook::Order> after;
+  };
+  std::vector<PendingOrderWrite> _pending_order_writes;
+  bool _in_transaction = false;
+
+  // Transactions begun within a transaction are SAVEPOINTs. Each of them remembers how many in-memory changes were
+  // made before it, so rolling it back reverts only its own changes
+  struct Savepoint {
+    std::size_t order_writes;
+    std::size_t item_ids;
+    std::size_t user_ids;
+    std::size_t emptied_user_items;
+    std::size_t log_records;
+    std::size_t after_commit;
+  };
+  std::vector<Savepoint> _savepoints;
+  // Called once the outermost transaction commits, see `after_commit`
+  std::vector<std::function<void()>> _after_commit;
+  // The current transaction prepares or finishes a cross-shard transaction, so its commit is synced, see
+  // `commit_transaction`
+  bool _durable_commit = false;
+
+  // Names of all items and users. Rows are never renamed or deleted, so all name lookups are served from memory,
+  // while ids of the rows created by the current transaction are kept to forget them on rollback
+  NameDictionary _items;
+  NameDictionary _users;
+  std::vector<int> _pending_item_ids;
+  std::vector<UserId> _pending_user_ids;
+
+  // Items that were debited to zero by the current transaction. They may be credited again before the commit, so
+  // they are deleted only if they are still empty then
+  std::vector<std::pair<UserId, int>> _emptied_user_items;
+
+  // Every change of user items is described by a log record, that is stored in the `transaction_log_outbox` table
+  // in the same transaction and is handed over to the transaction log once the transaction commits.
+  // The outbox is trimmed to the records the log may still miss, see `attach_transaction_log`
+  std::optional<TransactionLog> _transaction_log;
+  uint64_t _last_log_seq;
+  uint64_t _log_outbox_trimmed_at_seq = 0;
+  std::vector<LogRecord> _pending_log_records;
 
   // Store funds as an item for simplicity in `deposit` and `withdraw` operations
   static constexpr std::string_view FUNDS_ITEM_NAME = "funds";
 
   // constructor is private, use `open` instead
-  Storage(Sqlite3 && db, int funds_item_id) noexcept : _db(std::move(db)), _funds_item_id(funds_item_id) {}
+  Storage(Sqlite3 && db, int funds_item_id, ShardId shard, OrderBook && book, NameDictionary && items,
+          NameDictionary && users, uint64_t last_log_seq) noexcept
+      : _db(std::move(db)),
+        _funds_item_id(funds_item_id),
+        _shard(shard),
+        _book(std::move(book)),
+        _items(std::move(items)),
+        _users(std::move(users)),
+        _last_log_seq(last_log_seq) {}
 
 public:
-  // Opens a database file. If the file doesn't exist, it will be created
-  tl::expected<Storage, std::string> static open(std::string_view path);
+  // Opens a database file. If the file doesn't exist, it will be created.
+  // `cache_statements` is exposed mostly for benchmarks, see `Sqlite3::open` for details.
+  // A database remembers the shard it was created for and can't be opened as another one. Without `shard` it's
+  // opened as whatever it was created for, and a new one is created as the only shard
+  tl::expected<Storage, std::string> static open(std::string_view path, bool cache_statements = true,
+                                                 std::optional<ShardId> shard = std::nullopt);
   ~Storage() = default;
 
   // This class cannot be copied, but can be moved
@@ -27,23 +102,59 @@ public:
   Storage(Storage &&) = default;
   Storage & operator=(Storage &&) = default;
 
+  // From now on records of committed transactions are written to the `log`. Records that were committed before,
+  // but didn't make it to the log (e.g. the server crashed right after the commit), are written first.
+  // Returns the number of such records. Fails if the log and the database diverged, e.g. one of them was restored
+  // from a backup, or if the log may drop records, see `LogOverflowPolicy::Drop`
+  tl::expected<std::size_t, std::string> attach_transaction_log(TransactionLog log);
+
+  // Describes a change of user items made by the current transaction. The record gets the next sequence number and
+  // the current time. It's written to the transaction log once the transaction commits, and is forgotten on rollback
+  tl::expected<void, std::string> log(LogRecord record);
+
+  // Sequence number of the last committed log record, 0 if there is none
+  uint64_t last_log_seq() const { return _last_log_seq; }
+
+  // Committed log records with greater sequence numbers that are still kept in the database, in order
+  tl::expected<std::vector<LogRecord>, std::string> log_records_after(uint64_t seq);
+
   // Funds are stored in a special item with the given name
-  std::string_view funds_item_name() const { return FUNDS_ITEM_NAME; }
+  static constexpr std::string_view funds_item_name() { return FUNDS_ITEM_NAME; }
   int funds_item_id() const { return _funds_item_id; }
 
+  ShardId shard() const { return _shard; }
+  // Whether the user (together with their items and sell orders) lives in this database
+  bool owns_user(UserId user_id) const { return _shard.owns(user_id); }
+
+  // Hits and misses of the prepared statements cache
+  Sqlite3::StatementCacheStats statement_cache_stats() const { return _db.statement_cache_stats(); }
+
+  // Per-statement execution time and rows, see `Sqlite3::enable_profiling`
+  tl::expected<void, std::string> enable_sql_profiling(Sqlite3::ProfilingOptions options) {
+    return _db.enable_profiling(std::move(options));
+  }
+  std::vector<Sqlite3::StatementProfile> sql_profiles() const { return _db.statement_profiles(); }
+
   // Returns the user id by username if exists. std::nullopt otherwise
   std::optional<UserId> get_user_id(std::string_view username);
 
   // Creates a new user with the given username. Returns the user id if the user was created successfully
   tl::expected<UserId, std::string> create_user(std::string_view username);
+  // Adds a user from another shard, so sell orders of this database can refer to them as the highest bidder.
+  // Does nothing if the user is already known
+  tl::expected<void, std::string> add_foreign_user(User const & user);
 
   // Creates a new item with the given name. Returns the item id if the item was created successfully
   tl::expected<int, std::string> create_item(std::string_view item_name);
 
   // Returns the item id by name if exists
   tl::expected<int, std::string> get_item_id(std::string_view item_name);
+  // Returns the item name by id if exists. Item ids are local to the database, so items are passed to other shards
+  // by name
+  std::optional<std::string_view> get_item_name(int item_id) const { return _items.find_name(item_id); }
 
-  // Add or subtract the quantity of the item for the user
+  // Add or subtract the quantity of the item for the user. Subtraction is a single guarded UPDATE, that fails if the
+  // user doesn't have enough. Items (but not funds) that run out are deleted right before the transaction commits
   tl::expected<void, std::string> add_user_item(UserId user_id, int item_id, int quantity);
   tl::expected<void, std::string> sub_user_item(UserId user_id, int item_id, int quantity);
 
@@ -52,6 +163,21 @@ public:
 
   // List all user items
   tl::expected<std::vector<UserItemInfo>, std::string> view_user_items(UserId user_id);
+  // Same, but without copying item names: `callback` is called for every item right from the SQLite row
+  tl::expected<void, std::string> view_user_items(
+      UserId user_id, std::function<void(std::string_view item_name, int quantity)> const & callback);
+  // Same, but reads from another connection to the database, e.g. a read-only one from `ReadPool`. Such connection
+  // sees only committed transactions
+  static tl::expected<void, std::string> view_user_items(
+      Sqlite3 & db, UserId user_id, std::function<void(std::string_view item_name, int quantity)> const & callback);
+
+  struct UserItem {
+    UserId user_id;
+    int item_id;
+    int quantity;
+  };
+  // All rows of the `user_items` table, to check them against the transaction log
+  tl::expected<std::vector<UserItem>, std::string> all_user_items();
 
   struct SellOrder {
     UserId seller_id;
@@ -65,9 +191,12 @@ public:
     // - For auction orders, buyer_id is null untill someone places a bid
     std::optional<UserId> buyer_id;
   };
-  tl::expected<void, std::string> create_sell_order(SellOrder order);
+  // Returns the id of the created order
+  tl::expected<int, std::string> create_sell_order(SellOrder order);
 
   tl::expected<void, std::string> delete_sell_order(int order_id);
+  // Same, but returns the deleted order, so it can be restored, see `PreparedChange::Kind::RestoreOrder`
+  tl::expected<OrderBook::Order, std::string> take_sell_order(int order_id);
 
   tl::expected<void, std::string> update_sell_order_buyer(int order_id, UserId buyer_id, int price);
 
@@ -83,11 +212,65 @@ public:
   };
   std::optional<SellOrderInnerInfo> get_sell_order_info(int sell_order_id);
 
-  // View all sell orders
-  tl::expected<std::vector<SellOrderInfo>, std::string> view_sell_orders();
+  // A page of sell orders that match the query. Served from the order book, see `OrderBook::page` for its cost
+  tl::expected<SellOrdersPage, std::string> view_sell_orders(SellOrdersQuery const & query = {});
+  // Same, but calls `callback` for every order instead of collecting them. The order is reused for the next one, so
+  // it is valid only until `callback` returns. Returns the cursor of the next page
+  tl::expected<std::optional<SellOrdersCursor>, std::string> view_sell_orders(
+      SellOrdersQuery const & query, std::function<void(SellOrderInfo const &)> const & callback);
+
+  struct ExpiredSellOrders {
+    // Orders taken out of the book, including the ones that are only prepared to be settled
+    std::size_t settled = 0;
+    // Auction orders among them that were won by somebody
+    std::vector<SellOrderExecutionInfo> executed;
+  };
+  // Settles sell orders with expiration time <= `unix_now`, the earliest first: returns items to the seller or, for
+  // auction orders with a bid, gives items to the buyer and funds to the seller.
+  // Stops after `max_orders` orders or once `time_budget` is spent (but settles at least one), so a large backlog
+  // can be settled in chunks, each in its own transaction.
+  // Auctions won by users of other shards are only prepared as a part of the cross-shard transaction
+  // `cross_shard_transaction_id`, which the caller has to finish, see `CrossShardCoordinator::settle`
+  tl::expected<ExpiredSellOrders, std::string> process_expired_sell_orders(
+      int64_t unix_now, std::size_t max_orders = SIZE_MAX,
+      std::chrono::microseconds time_budget = std::chrono::microseconds::max(),
+      int64_t cross_shard_transaction_id = 0);
 
-  // Cancel expired sell orders
-  tl::expected<std::vector<SellOrderExecutionInfo>, std::string> process_expired_sell_orders(int64_t unix_now);
+  // Number of sell orders with expiration time <= `unix_now`, that are waiting to be settled
+  std::size_t expired_sell_orders_count(int64_t unix_now) const { return _book.count_expired(unix_now); }
+
+  // The earliest expiration time among active sell orders, std::nullopt if there are none
+  std::optional<int64_t> next_expiration_time() const { return _book.next_expiration_time(); }
+
+  // A change that completes a cross-shard transaction once it is committed, or undoes what it has done in this
+  // database once it is aborted, see `CrossShardCoordinator`
+  struct PreparedChange {
+    // Values are stored in the database, so they must never change
+    enum class Kind : int {
+      // Gives `quantity` of `item_name` to `user_id`, logged as `TransferredIn` of `order_id`
+      Credit = 1,
+      // Puts the sell order `order_id` of `user_id` back to the book, e.g. once a bid on it is committed
+      RestoreOrder = 2,
+    };
+    Kind kind;
+    UserId user_id;
+    std::string item_name;
+    int quantity;
+    int order_id;
+    // Only for `RestoreOrder`
+    int price = 0;
+    int64_t unix_expiration_time = 0;
+    std::optional<UserId> buyer_id = std::nullopt;
+  };
+  // The first phase of a cross-shard transaction: the caller makes the changes that may fail (e.g. takes funds or
+  // an order) right away, and remembers here what to do once the transaction is committed (`on_commit`) or aborted.
+  // Must be called within a transaction, so the changes and the plan are committed together
+  tl::expected<void, std::string> prepare(int64_t transaction_id, PreparedChange change, bool on_commit);
+  // The second phase: applies the changes remembered for the outcome and forgets the transaction. Does nothing if
+  // the transaction isn't prepared here (e.g. it's already finished), so it can be repeated after a crash
+  tl::expected<void, std::string> finish_prepared(int64_t transaction_id, bool committed);
+  // Ids of the transactions that are prepared, but not finished yet, in ascending order
+  tl::expected<std::vector<int64_t>, std::string> prepared_transactions();
 
   // RAII wrapper for transaction that will execute Storage::rollback_transaction() on destruction if
   // TransactionGuard::commit() wasn't called
@@ -126,10 +309,29 @@ public:
     }
   };
 
-  // Begins a transaction. If TransactionGuard is destroyed without calling `commit`, the transaction is rolled back
+  // Begins a transaction. If TransactionGuard is destroyed without calling `commit`, the transaction is rolled back.
+  // Within another transaction it begins a nested one: its commit only merges it into the outer transaction, while
+  // its rollback leaves the changes made by the outer transaction before it intact
   tl::expected<TransactionGuard, std::string> begin_transaction();
 
+  // Calls `f` once the current transaction and all transactions it is nested into are committed, or right away if
+  // there is no transaction. Dropped if any of them is rolled back
+  void after_commit(std::function<void()> f);
+
 private:
   void rollback_transaction();
   tl::expected<void, std::string> commit_transaction();
+
+  // Remembers the order book change and writes it right away if there is no active transaction
+  tl::expected<void, std::string> record_order_write(std::optional<OrderBook::Order> before,
+                                                     std::optional<OrderBook::Order> after);
+  // Writes all pending order book changes to the `sell_orders` table, preserving their order
+  tl::expected<void, std::string> flush_order_writes();
+  // Reverts pending order book changes in the book itself, starting from the `from`-th one
+  void undo_order_writes(std::size_t from = 0);
+  // Deletes items from `_emptied_user_items` that are still empty
+  tl::expected<void, std::string> delete_emptied_user_items();
+  // Deletes log records that are already written to the transaction log (all of them if there is no log), except the
+  // last one
+  void trim_log_outbox();
 };
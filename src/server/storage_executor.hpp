@@ -0,0 +1,31 @@
+#pragma once
+
+#include <asio/any_io_executor.hpp>
+#include <asio/awaitable.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include <type_traits>
+#include <utility>
+
+// Executor of the dedicated storage thread. All `Storage`, `AuctionService` and `UserService` calls (together with
+// the transaction log writes that follow them) run there, so a slow SQLite commit never blocks the network thread.
+// Requests are posted to the storage `io_context`, whose handler queue works as a MPSC queue. With several shards
+// each of them has its own strand there, so shards run in parallel, but each of them on one thread at a time
+class StorageExecutor final {
+  asio::any_io_executor executor;
+
+public:
+  explicit StorageExecutor(asio::any_io_executor executor) : executor(std::move(executor)) {}
+
+  asio::any_io_executor const & get() const { return executor; }
+
+  // Runs `f` on the storage thread and resumes the awaiting coroutine on its own executor with the result.
+  // Exceptions thrown by `f` are rethrown in the awaiting coroutine
+  template <typename F>
+  asio::awaitable<std::invoke_result_t<F &>> run(F f) const {
+    using Result = std::invoke_result_t<F &>;
+    return asio::co_spawn(
+        executor, [f = std::move(f)]() mutable -> asio::awaitable<Result> { co_return f(); }, asio::use_awaitable);
+  }
+};
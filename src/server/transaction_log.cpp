@@ -1,43 +1,428 @@
 #include "transaction_log.hpp"
+#include "mpsc_ring.hpp"
+#include "transaction_log_index.hpp"
+#include "transaction_log_record.hpp"
 
 #include <fmt/format.h>
 #include <tl/expected.hpp>
 
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
 
-tl::expected<TransactionLog, std::string> TransactionLog::open(std::string_view path) {
-  // todo: ensure that there is a `\0` at the end of the string
-  std::FILE * file = std::fopen(path.data(), "a");
+namespace {
+int64_t unix_now_ms() {
+  namespace ch = std::chrono;
+  return ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
+}
+
+// Returns up to `size` first bytes of the file, empty if the file doesn't exist
+std::string read_file_prefix(std::string_view path, std::size_t size) {
+  std::string prefix(size, '\0');
+  std::FILE * file = std::fopen(path.data(), "rb");
   if (!file) {
-    return tl::make_unexpected(fmt::format("failed to open transaction log '{}'", path));
+    return {};
   }
-  return TransactionLog(file);
+  prefix.resize(std::fread(prefix.data(), 1, size, file));
+  std::fclose(file);
+  return prefix;
 }
 
-TransactionLog::~TransactionLog() {
-  if (file) {
+// Text lines are short, so the last numbered one is always near the end, even if a few `Dropped` lines follow it
+constexpr std::size_t kTextTailSize = 64 * 1024;
+
+// Returns the sequence number of the last record in the file, std::nullopt if there are no numbered records.
+// A record that was cut short by a crash is removed, so new records don't get glued to it
+tl::expected<std::optional<uint64_t>, std::string> recover_last_seq(std::string const & path, bool binary) {
+  std::error_code ec;
+  auto const size = std::filesystem::file_size(path, ec);
+  if (ec) {
+    return std::nullopt;  // doesn't exist yet
+  }
+  std::FILE * file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    return tl::make_unexpected(fmt::format("failed to open transaction log '{}'", path));
+  }
+
+  std::optional<uint64_t> seq;
+  std::vector<char> data;
+  if (binary) {
+    uint64_t const records =
+        size < kBinaryLogHeader.size() ? 0 : (size - kBinaryLogHeader.size()) / kBinaryLogRecordSize;
+    uint64_t const records_end = kBinaryLogHeader.size() + records * kBinaryLogRecordSize;
+    data.resize(kBinaryLogRecordSize);
+    for (uint64_t i = records; i > 0 && !seq; --i) {
+      std::fseek(file, static_cast<long>(kBinaryLogHeader.size() + (i - 1) * kBinaryLogRecordSize), SEEK_SET);
+      auto const record = std::fread(data.data(), 1, data.size(), file) == data.size()
+                              ? decode_record(data.data())
+                              : std::nullopt;
+      if (!record) {
+        std::fclose(file);
+        return tl::make_unexpected(fmt::format("unknown record at the end of transaction log '{}'", path));
+      }
+      if (record->kind != LogRecord::Kind::Dropped) {
+        seq = record->seq;
+      }
+    }
     std::fclose(file);
+    if (records_end < size && size > kBinaryLogHeader.size()) {
+      fmt::println("Removed incomplete record of {} bytes at the end of transaction log '{}'", size - records_end,
+                   path);
+      std::filesystem::resize_file(path, records_end, ec);
+    }
+    return seq;
+  }
+
+  uint64_t const tail = std::min<uint64_t>(size, kTextTailSize);
+  data.resize(tail);
+  std::fseek(file, static_cast<long>(size - tail), SEEK_SET);
+  data.resize(std::fread(data.data(), 1, data.size(), file));
+  std::fclose(file);
+  std::string_view text(data.data(), data.size());
+  if (!text.empty() && !text.ends_with('\n')) {
+    // The incomplete line is left as is, but the next record starts on its own line
+    std::FILE * append = std::fopen(path.c_str(), "a");
+    if (append) {
+      std::fputc('\n', append);
+      std::fclose(append);
+    }
+    text = text.substr(0, text.rfind('\n') + 1);
+  }
+  while (!text.empty() && !seq) {
+    text.remove_suffix(1);  // the trailing '\n'
+    std::size_t const line_start = text.rfind('\n') + 1;
+    seq = parse_text_record_seq(text.substr(line_start));
+    text = text.substr(0, line_start);
   }
+  return seq;
 }
+}  // namespace
 
-void TransactionLog::log(int user_id, std::string_view message) {
-  namespace ch = std::chrono;
-  int64_t const unix_now_ms = ch::duration_cast<ch::milliseconds>(ch::system_clock::now().time_since_epoch()).count();
-  auto const timestamp = static_cast<double>(unix_now_ms) / 1000.0;
+// Owns the file and the thread that writes to it. Producers push records into the ring, and the thread takes
+// everything that has been queued since the previous write, so under load many entries share one write (and
+// one `fdatasync`), while with a single producer each entry is written right away
+class TransactionLog::Writer final {
+  std::string path;
+  TransactionLogOptions options;
+  bool rotating;
+  std::FILE * file;
+  // Size of the active segment, including the header, and time of its first record
+  uint64_t segment_bytes;
+  std::optional<int64_t> segment_started_ms;
+  uint64_t next_segment_number;
+  // Index of the active segment, only for the binary log with rotation
+  LogIndexBuilder index;
+  // Writes the indexes of rotated segments, so the writer thread never waits for them. Started by the first rotation
+  std::mutex index_mutex;
+  std::condition_variable index_ready;
+  std::deque<std::pair<std::string, std::vector<LogIndexBlock>>> pending_indexes;
+  bool index_stopping = false;
+  std::thread index_writer;
+
+  MpscRing<LogRecord> queue;
+  // Set by the writer thread before it goes to sleep on an empty queue, so producers know they have to wake it
+  std::atomic<bool> sleeping = false;
+  std::atomic<bool> stopping = false;
+  std::atomic<uint64_t> dropped = 0;
+  // Sequence number of the last record in the buffer and of the last record that is written
+  uint64_t appended_seq;
+  std::atomic<uint64_t> written_seq;
+  // Started last, when everything else is initialized
+  std::thread thread;
+
+public:
+  Writer(std::string path, TransactionLogOptions options, std::FILE * file, uint64_t segment_bytes,
+         uint64_t next_segment_number, std::vector<LogIndexBlock> index_blocks, uint64_t last_seq)
+      : path(std::move(path)),
+        options(options),
+        rotating(options.segment_size > 0 || options.segment_duration.count() > 0),
+        file(file),
+        segment_bytes(segment_bytes),
+        segment_started_ms(index_blocks.empty() ? std::nullopt : std::optional(index_blocks.front().min_unix_time_ms)),
+        next_segment_number(next_segment_number),
+        index(std::move(index_blocks)),
+        queue(options.queue_capacity),
+        appended_seq(last_seq),
+        written_seq(last_seq),
+        thread([this]() { run(); }) {}
+
+  ~Writer() {
+    stopping.store(true);
+    wake();
+    thread.join();
+    if (index_writer.joinable()) {
+      {
+        std::lock_guard lock(index_mutex);
+        index_stopping = true;
+      }
+      index_ready.notify_one();
+      index_writer.join();  // after it has written everything that is queued
+    }
+    std::fclose(file);
+  }
+
+  void push(LogRecord const & record) {
+    while (!queue.try_push(record)) {
+      if (options.overflow == LogOverflowPolicy::Drop) {
+        dropped.fetch_add(1, std::memory_order_relaxed);
+        return;
+      }
+      wake();
+      std::this_thread::yield();
+    }
+    wake();
+  }
+
+  uint64_t last_seq() const { return written_seq.load(std::memory_order_acquire); }
+
+  LogOverflowPolicy overflow() const { return options.overflow; }
+
+private:
+  void wake() {
+    // Pairs with the fence in `run()`: either the writer sees the new record, or we see that it sleeps
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false)) {
+      sleeping.notify_one();
+    }
+  }
+
+  void run() {
+    fmt::memory_buffer buffer;
+    uint64_t reported_dropped = 0;
+    for (;;) {
+      // Bounded, so a writer that can't keep up doesn't accumulate an unbounded buffer
+      for (std::size_t i = 0; i < queue.capacity(); ++i) {
+        auto const record = queue.try_pop();
+        if (!record) {
+          break;
+        }
+        append(buffer, *record);
+      }
+      if (uint64_t const total_dropped = dropped.load(std::memory_order_relaxed); total_dropped != reported_dropped) {
+        append(buffer, LogRecord{
+                           .kind = LogRecord::Kind::Dropped,
+                           .unix_time_ms = unix_now_ms(),
+                           .quantity = static_cast<int>(total_dropped - reported_dropped),
+                       });
+        reported_dropped = total_dropped;
+      }
+
+      if (buffer.size() > 0) {
+        write(buffer);
+        buffer.clear();
+        continue;
+      }
+      if (stopping.load()) {
+        break;  // the queue is empty and nothing will be pushed anymore
+      }
+
+      sleeping.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (queue.empty() && !stopping.load(std::memory_order_relaxed)) {
+        sleeping.wait(true);
+      }
+      sleeping.store(false, std::memory_order_relaxed);
+    }
+  }
+
+  void append(fmt::memory_buffer & buffer, LogRecord const & record) {
+    if (should_rotate(buffer, record)) {
+      write(buffer);
+      buffer.clear();
+      rotate();
+    }
+    if (!segment_started_ms) {
+      segment_started_ms = record.unix_time_ms;
+    }
+    appended_seq = std::max(appended_seq, record.seq);
+
+    if (options.format == LogFormat::Text) {
+      format_record_text(buffer, record);
+      return;
+    }
+    std::size_t const size = buffer.size();
+    if (rotating) {
+      index.add(record, segment_bytes + size);
+    }
+    buffer.resize(size + kBinaryLogRecordSize);
+    encode_record(record, buffer.data() + size);
+  }
+
+  void write(fmt::memory_buffer const & buffer) {
+    std::fwrite(buffer.data(), 1, buffer.size(), file);
+    segment_bytes += buffer.size();
+    if (options.durability != LogDurability::None) {
+      std::fflush(file);
+    }
+    if (options.durability == LogDurability::Fsync) {
+      sync();
+    }
+    written_seq.store(appended_seq, std::memory_order_release);
+  }
+
+  void sync() {
+#ifdef _WIN32
+    ::_commit(::_fileno(file));
+#else
+    ::fdatasync(::fileno(file));
+#endif
+  }
+
+  bool should_rotate(fmt::memory_buffer const & buffer, LogRecord const & record) const {
+    if (!rotating || !segment_started_ms) {
+      return false;  // never leave an empty segment behind
+    }
+    bool const too_big = options.segment_size > 0 && segment_bytes + buffer.size() >= options.segment_size;
+    bool const too_old = options.segment_duration.count() > 0 &&
+                         record.unix_time_ms - *segment_started_ms >=
+                             std::chrono::duration_cast<std::chrono::milliseconds>(options.segment_duration).count();
+    return too_big || too_old;
+  }
+
+  // Closes the active segment, renames it to `<path>.<n>` and starts a new one. The file is closed before the rename,
+  // as an open file can't be renamed on Windows, but everything is already written, so it's cheap
+  void rotate() {
+    if (options.durability == LogDurability::Fsync) {
+      sync();
+    }
+    std::fclose(file);
+
+    std::string const segment_path = log_segment_path(path, next_segment_number);
+    std::error_code ec;
+    std::filesystem::rename(path, segment_path, ec);
+    bool const binary = options.format == LogFormat::Binary;
+    file = std::fopen(path.c_str(), binary ? "ab" : "a");
+    if (!file) {
+      // Losing entries silently is worse than stopping the server
+      fmt::println("Failed to reopen transaction log '{}'", path);
+      std::abort();
+    }
+    if (ec) {
+      fmt::println("Failed to rotate transaction log '{}', rotation is disabled: {}", path, ec.message());
+      rotating = false;
+      return;
+    }
+
+    next_segment_number++;
+    segment_bytes = 0;
+    segment_started_ms = std::nullopt;
+    if (binary) {
+      std::fwrite(kBinaryLogHeader.data(), 1, kBinaryLogHeader.size(), file);
+      segment_bytes = kBinaryLogHeader.size();
+
+      {
+        std::lock_guard lock(index_mutex);
+        pending_indexes.emplace_back(segment_path, index.finish());
+      }
+      index_ready.notify_one();
+      if (!index_writer.joinable()) {
+        index_writer = std::thread([this]() { write_indexes(); });
+      }
+    }
+  }
+
+  void write_indexes() {
+    std::unique_lock lock(index_mutex);
+    for (;;) {
+      index_ready.wait(lock, [this]() { return index_stopping || !pending_indexes.empty(); });
+      if (pending_indexes.empty()) {
+        return;  // stopping, and all indexes are written
+      }
+      auto [segment_path, blocks] = std::move(pending_indexes.front());
+      pending_indexes.pop_front();
+      lock.unlock();
+      std::ofstream(segment_path + ".idx", std::ios::binary) << encode_index(blocks);
+      lock.lock();
+    }
+  }
+};
+
+TransactionLog::TransactionLog(std::unique_ptr<Writer> writer) : writer(std::move(writer)) {}
+TransactionLog::~TransactionLog() = default;
+TransactionLog::TransactionLog(TransactionLog && other) noexcept = default;
+TransactionLog & TransactionLog::operator=(TransactionLog && other) noexcept = default;
+
+tl::expected<TransactionLog, std::string> TransactionLog::open(std::string_view path, TransactionLogOptions options) {
+  // todo: ensure that there is a `\0` at the end of the string
+  // Appending records of one format to a file in another one would make it unreadable
+  std::string const prefix = read_file_prefix(path, kBinaryLogHeader.size());
+  bool const is_binary = prefix == kBinaryLogHeader;
+  bool const binary = options.format == LogFormat::Binary;
+  if (!is_binary && prefix.size() == kBinaryLogHeader.size() &&
+      prefix.starts_with(kBinaryLogHeader.substr(0, kBinaryLogHeader.size() - 1))) {
+    return tl::make_unexpected(
+        fmt::format("transaction log '{}' is written in an older version of the binary format", path));
+  }
+  if (binary && !prefix.empty() && !is_binary) {
+    return tl::make_unexpected(fmt::format("transaction log '{}' is not in the binary format", path));
+  }
+  if (!binary && is_binary) {
+    return tl::make_unexpected(fmt::format("transaction log '{}' is in the binary format", path));
+  }
+
+  auto const segments = list_log_segments(path);
+  uint64_t const next_segment_number = segments.empty() ? 1 : segments.back().first + 1;
+
+  // The active segment may have no records yet, if it was just rotated
+  auto last_seq = recover_last_seq(std::string(path), binary);
+  for (auto it = segments.rbegin(); last_seq && !*last_seq && it != segments.rend(); ++it) {
+    last_seq = recover_last_seq(it->second, binary);
+  }
+  if (!last_seq) {
+    return tl::make_unexpected(last_seq.error());
+  }
+
+  bool const rotating = options.segment_size > 0 || options.segment_duration.count() > 0;
+  std::vector<LogIndexBlock> index_blocks;
+  if (binary && rotating && !prefix.empty()) {
+    auto blocks = build_index(std::string(path));
+    if (!blocks) {
+      return tl::make_unexpected(blocks.error());
+    }
+    index_blocks = std::move(*blocks);
+  }
+
+  std::FILE * file = std::fopen(path.data(), binary ? "ab" : "a");
+  if (!file) {
+    return tl::make_unexpected(fmt::format("failed to open transaction log '{}'", path));
+  }
+  if (binary && prefix.empty()) {
+    std::fwrite(kBinaryLogHeader.data(), 1, kBinaryLogHeader.size(), file);
+    std::fflush(file);
+  }
+  std::error_code ec;
+  auto const segment_bytes = static_cast<uint64_t>(std::filesystem::file_size(path, ec));
+  return TransactionLog(std::make_unique<Writer>(std::string(path), options, file, ec ? 0 : segment_bytes,
+                                                 next_segment_number, std::move(index_blocks),
+                                                 last_seq->value_or(0)));
+}
 
-  auto log_entry = fmt::format("{}: user{{.id={}}} {}\n", timestamp, user_id, message);
-  std::fwrite(log_entry.data(), 1, log_entry.size(), file);
-  std::fflush(file);
+void TransactionLog::save(LogRecord const & record) {
+  writer->push(record);
 }
 
-void TransactionLog::save(UserId user_id, std::string_view operation_name, ItemOperationInfo operation_info) {
-  log(user_id,
-      fmt::format("{} .item_id={} .quantity={}", operation_name, operation_info.item_id, operation_info.quantity));
+uint64_t TransactionLog::last_seq() const {
+  return writer->last_seq();
 }
 
-void TransactionLog::save(SellOrderExecutionInfo const & order_info) {
-  log(order_info.seller_id, fmt::format("sold .item_id={} .quantity={} .price={} .order_id={}", order_info.item_id,
-                                        order_info.quantity, order_info.price, order_info.id));
-  log(order_info.buyer_id, fmt::format("bought .item_id={} .quantity={} .price={} .order_id={}", order_info.item_id,
-                                       order_info.quantity, order_info.price, order_info.id));
+LogOverflowPolicy TransactionLog::overflow() const {
+  return writer->overflow();
 }
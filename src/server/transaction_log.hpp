@@ -1,41 +1,105 @@
 #pragma once
 
-#include "types.hpp"
-
 #include <tl/expected.hpp>
 
-#include <cstdio>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
 #include <string_view>
-#include <utility>
 
-// Stateless wrapper around C-style file api, that performs append-only writes,
-// so it is safe to use from multiple threads.
+// How log entries are stored in the file
+enum class LogFormat {
+  // Human-readable lines
+  Text,
+  // Compact fixed-width records, see `transaction_log_record.hpp`. Use `txlog-dump` to read them
+  Binary,
+};
+
+inline std::optional<LogFormat> parse_LogFormat(std::string_view str) {
+  if (str == "text") {
+    return LogFormat::Text;
+  } else if (str == "binary") {
+    return LogFormat::Binary;
+  }
+  return std::nullopt;
+}
+
+// When log entries are considered written
+enum class LogDurability {
+  // Left in the stdio buffer, so they are lost on a crash
+  None,
+  // Handed over to the OS after each batch, so they survive a crash of the server but not of the OS
+  Flush,
+  // Flushed and `fdatasync`ed after each batch
+  Fsync,
+};
+
+inline std::optional<LogDurability> parse_LogDurability(std::string_view str) {
+  if (str == "none") {
+    return LogDurability::None;
+  } else if (str == "flush") {
+    return LogDurability::Flush;
+  } else if (str == "fsync") {
+    return LogDurability::Fsync;
+  }
+  return std::nullopt;
+}
+
+// What to do when the writer can't keep up and the queue of entries is full
+enum class LogOverflowPolicy {
+  // Wait until the writer frees some space
+  Block,
+  // Drop the entry. The number of dropped entries is written to the log. Not for the log of a database, as the
+  // database relies on every record being written, see `Storage::attach_transaction_log`
+  Drop,
+};
+
+struct TransactionLogOptions {
+  LogFormat format = LogFormat::Text;
+  LogDurability durability = LogDurability::Flush;
+  LogOverflowPolicy overflow = LogOverflowPolicy::Block;
+  // Max number of entries waiting to be written
+  std::size_t queue_capacity = 64 * 1024;
+  // The active segment is renamed to `<path>.<n>` and a new one is started once it reaches this size (in bytes)
+  // or age. Rotated segments of the binary log get an index, see `transaction_log_index.hpp`. 0 means no limit
+  std::size_t segment_size = 0;
+  std::chrono::seconds segment_duration{ 0 };
+};
+
+struct LogRecord;
+
+// Append-only transaction log. `save()` only puts a small fixed-size record into a lock-free queue, while
+// a background thread formats records and writes them in batches, so it is safe to use from multiple threads
 class TransactionLog final {
-  std::FILE * file;
+  class Writer;
+  std::unique_ptr<Writer> writer;
 
   // private constructor, use `open` instead
-  TransactionLog(std::FILE * file) : file(file) {}
+  TransactionLog(std::unique_ptr<Writer> writer);
 
 public:
-  // Opens a transaction log file in the 'append only' mode. If the file doesn't exist, it will be created
-  static tl::expected<TransactionLog, std::string> open(std::string_view path);
+  // Opens a transaction log file in the 'append only' mode. If the file doesn't exist, it will be created.
+  // Fails if the existing file is in another format
+  static tl::expected<TransactionLog, std::string> open(std::string_view path, TransactionLogOptions options = {});
+  // Writes all queued entries before closing the file
   ~TransactionLog();
 
   // This class cannot be copied, but can be moved
   TransactionLog(TransactionLog const &) = delete;
   TransactionLog & operator=(TransactionLog const &) = delete;
-  TransactionLog(TransactionLog && other) noexcept : file(other.file) { other.file = nullptr; }
-  TransactionLog & operator=(TransactionLog && other) noexcept {
-    // move and swap idiom via local varialbe
-    TransactionLog local = std::move(other);
-    std::swap(file, local.file);
-    return *this;
-  }
+  TransactionLog(TransactionLog && other) noexcept;
+  TransactionLog & operator=(TransactionLog && other) noexcept;
 
-  // sales, deposits and withdrawals
-  void log(int user_id, std::string_view message);
+  // Records are expected in the order of their sequence numbers, see `Storage::log`
+  void save(LogRecord const & record);
 
-  void save(UserId user_id, std::string_view operation_name, ItemOperationInfo operation_info);
+  // Sequence number of the last record that is written (handed over to the OS, unless the durability is
+  // `LogDurability::None`), 0 if there is none. Right after `open` it's the last record in the existing log
+  uint64_t last_seq() const;
 
-  void save(SellOrderExecutionInfo const & sell_order_execution_info);
+  // What `save` does when the queue is full, see `TransactionLogOptions::overflow`
+  LogOverflowPolicy overflow() const;
 };
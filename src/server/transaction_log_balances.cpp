@@ -0,0 +1,35 @@
+#include "transaction_log_balances.hpp"
+
+void LogBalances::apply(LogRecord const & record) {
+  if (record.kind == LogRecord::Kind::Dropped) {
+    return;  // the gap in the sequence tells the same
+  }
+  if (record.seq <= last_seq) {
+    out_of_order++;
+    return;
+  }
+  missing += record.seq - last_seq - 1;
+  last_seq = record.seq;
+
+  switch (record.kind) {
+  case LogRecord::Kind::Deposited: add(record.user_id, record.item_id, record.quantity); break;
+  case LogRecord::Kind::Withdrawn:
+  case LogRecord::Kind::PayedFee:
+  case LogRecord::Kind::SellOrderPlaced:
+  case LogRecord::Kind::TransferredOut: add(record.user_id, record.item_id, -int64_t{ record.quantity }); break;
+  case LogRecord::Kind::SellOrderExecuted:
+    add(record.buyer_id, funds_item_id, -int64_t{ record.price });
+    add(record.buyer_id, record.item_id, record.quantity);
+    add(record.user_id, funds_item_id, record.price);
+    break;
+  case LogRecord::Kind::BidPlaced: add(record.user_id, funds_item_id, -int64_t{ record.price }); break;
+  case LogRecord::Kind::BidRefunded: add(record.user_id, funds_item_id, record.price); break;
+  case LogRecord::Kind::AuctionSettled:
+    add(record.buyer_id, record.item_id, record.quantity);
+    add(record.user_id, funds_item_id, record.price);
+    break;
+  case LogRecord::Kind::SellOrderExpired:
+  case LogRecord::Kind::TransferredIn: add(record.user_id, record.item_id, record.quantity); break;
+  case LogRecord::Kind::Dropped: break;
+  }
+}
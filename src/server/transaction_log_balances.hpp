@@ -0,0 +1,52 @@
+#pragma once
+
+#include "transaction_log_record.hpp"
+#include "types.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+
+// Items and funds of every user folded from transaction log records. As every change of `user_items` is logged,
+// folding the whole log gives exactly that table, which is how `txlog-dump --verify` checks the database
+class LogBalances final {
+  int funds_item_id;
+  // Keyed by `key(user_id, item_id)`, which is much faster to hash than a pair
+  std::unordered_map<uint64_t, int64_t> balances;
+  uint64_t last_seq = 0;
+  uint64_t missing = 0;
+  uint64_t out_of_order = 0;
+
+  void add(UserId user_id, int item_id, int64_t quantity) { balances[key(user_id, item_id)] += quantity; }
+
+public:
+  // Packs a user item into one integer
+  static uint64_t key(UserId user_id, int item_id) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(user_id)) << 32) | static_cast<uint32_t>(item_id);
+  }
+
+  // Funds are not mentioned in sell order records, so their item id has to be known
+  explicit LogBalances(int funds_item_id) : funds_item_id(funds_item_id) {}
+
+  // Records are expected in the order of their sequence numbers. Gaps in the sequence are counted as missing records
+  // and records that go back in the sequence are ignored
+  void apply(LogRecord const & record);
+
+  int64_t get(UserId user_id, int item_id) const {
+    auto const it = balances.find(key(user_id, item_id));
+    return it != balances.end() ? it->second : 0;
+  }
+
+  // Calls `f(user_id, item_id, quantity)` for every user item that was ever mentioned
+  template <typename F>
+  void for_each(F && f) const {
+    for (auto const & [key, quantity] : balances) {
+      f(static_cast<UserId>(key >> 32), static_cast<int>(key & 0xffffffff), quantity);
+    }
+  }
+
+  // Sequence number of the last applied record
+  uint64_t last_applied_seq() const { return last_seq; }
+  // Number of sequence numbers that were skipped, e.g. dropped by the log writer
+  uint64_t missing_records() const { return missing; }
+  uint64_t out_of_order_records() const { return out_of_order; }
+};
@@ -0,0 +1,167 @@
+#include "transaction_log_index.hpp"
+
+#include <fmt/format.h>
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+
+namespace {
+void finish_block(LogIndexBlock & block) {
+  std::sort(block.user_ids.begin(), block.user_ids.end());
+  block.user_ids.erase(std::unique(block.user_ids.begin(), block.user_ids.end()), block.user_ids.end());
+}
+
+constexpr std::size_t kEncodedBlockSize = 8 + 8 + 8 + 8 + 4;
+}  // namespace
+
+bool LogIndexBlock::mentions(UserId user_id) const {
+  return std::binary_search(user_ids.begin(), user_ids.end(), user_id);
+}
+
+void LogIndexBuilder::add(LogRecord const & record, uint64_t offset) {
+  if (blocks.empty() || records_in_block == kLogIndexBlockRecords) {
+    if (!blocks.empty()) {
+      finish_block(blocks.back());
+    }
+    blocks.push_back(LogIndexBlock{
+        .min_unix_time_ms = record.unix_time_ms,
+        .max_unix_time_ms = record.unix_time_ms,
+        .offset = offset,
+        .size = 0,
+        .user_ids = {},
+    });
+    records_in_block = 0;
+  }
+
+  auto & block = blocks.back();
+  // Timestamps are taken by producers, so they are not strictly ordered
+  block.min_unix_time_ms = std::min(block.min_unix_time_ms, record.unix_time_ms);
+  block.max_unix_time_ms = std::max(block.max_unix_time_ms, record.unix_time_ms);
+  block.size = offset + kBinaryLogRecordSize - block.offset;
+  if (record.kind != LogRecord::Kind::Dropped) {
+    block.user_ids.push_back(record.user_id);
+  }
+  if (record.kind == LogRecord::Kind::SellOrderExecuted) {
+    block.user_ids.push_back(record.buyer_id);
+  }
+  records_in_block++;
+}
+
+std::vector<LogIndexBlock> LogIndexBuilder::finish() {
+  if (!blocks.empty()) {
+    finish_block(blocks.back());
+  }
+  records_in_block = 0;
+  return std::exchange(blocks, {});
+}
+
+std::string encode_index(std::vector<LogIndexBlock> const & blocks) {
+  std::string data(kLogIndexHeader);
+  for (auto const & block : blocks) {
+    std::size_t pos = data.size();
+    data.resize(pos + kEncodedBlockSize + block.user_ids.size() * 4);
+    put_le(data.data() + pos, block.min_unix_time_ms);
+    put_le(data.data() + pos + 8, block.max_unix_time_ms);
+    put_le(data.data() + pos + 16, block.offset);
+    put_le(data.data() + pos + 24, block.size);
+    put_le(data.data() + pos + 32, static_cast<uint32_t>(block.user_ids.size()));
+    pos += kEncodedBlockSize;
+    for (UserId const user_id : block.user_ids) {
+      put_le(data.data() + pos, user_id);
+      pos += 4;
+    }
+  }
+  return data;
+}
+
+tl::expected<std::vector<LogIndexBlock>, std::string> decode_index(std::string_view data) {
+  if (!data.starts_with(kLogIndexHeader)) {
+    return tl::make_unexpected("not a transaction log index");
+  }
+  data.remove_prefix(kLogIndexHeader.size());
+
+  std::vector<LogIndexBlock> blocks;
+  while (!data.empty()) {
+    if (data.size() < kEncodedBlockSize) {
+      return tl::make_unexpected("truncated index block");
+    }
+    auto const users = get_le<uint32_t>(data.data() + 32);
+    if (data.size() < kEncodedBlockSize + std::size_t(users) * 4) {
+      return tl::make_unexpected("truncated index block");
+    }
+    LogIndexBlock block{
+      .min_unix_time_ms = get_le<int64_t>(data.data()),
+      .max_unix_time_ms = get_le<int64_t>(data.data() + 8),
+      .offset = get_le<uint64_t>(data.data() + 16),
+      .size = get_le<uint64_t>(data.data() + 24),
+      .user_ids = std::vector<UserId>(users),
+    };
+    for (uint32_t i = 0; i < users; ++i) {
+      block.user_ids[i] = get_le<int32_t>(data.data() + kEncodedBlockSize + i * 4);
+    }
+    data.remove_prefix(kEncodedBlockSize + std::size_t(users) * 4);
+    blocks.push_back(std::move(block));
+  }
+  return blocks;
+}
+
+tl::expected<std::vector<LogIndexBlock>, std::string> build_index(std::string const & segment_path) {
+  std::ifstream file(segment_path, std::ios::binary);
+  if (!file) {
+    return tl::make_unexpected(fmt::format("failed to open '{}'", segment_path));
+  }
+  char header[kBinaryLogHeader.size()];
+  if (!file.read(header, sizeof(header)) || std::string_view(header, sizeof(header)) != kBinaryLogHeader) {
+    return tl::make_unexpected(fmt::format("'{}' is not a binary transaction log", segment_path));
+  }
+
+  LogIndexBuilder builder;
+  std::vector<char> chunk(kLogIndexBlockRecords * kBinaryLogRecordSize);
+  uint64_t offset = sizeof(header);
+  while (file) {
+    file.read(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+    // An incomplete record at the end is being written right now (or was never finished), so it's skipped
+    auto const records = static_cast<std::size_t>(file.gcount()) / kBinaryLogRecordSize;
+    for (std::size_t i = 0; i < records; ++i) {
+      auto const record = decode_record(chunk.data() + i * kBinaryLogRecordSize);
+      if (!record) {
+        return tl::make_unexpected(fmt::format("unknown record at offset {} in '{}'", offset, segment_path));
+      }
+      builder.add(*record, offset);
+      offset += kBinaryLogRecordSize;
+    }
+  }
+  return builder.finish();
+}
+
+std::string log_segment_path(std::string_view path, uint64_t number) {
+  return fmt::format("{}.{:06}", path, number);
+}
+
+std::vector<std::pair<uint64_t, std::string>> list_log_segments(std::string_view path) {
+  namespace fs = std::filesystem;
+  fs::path const log_path(path);
+  std::string const prefix = log_path.filename().string() + ".";
+  fs::path const directory = log_path.has_parent_path() ? log_path.parent_path() : fs::path(".");
+
+  std::vector<std::pair<uint64_t, std::string>> segments;
+  std::error_code ec;
+  for (auto const & entry : fs::directory_iterator(directory, ec)) {
+    std::string const name = entry.path().filename().string();
+    if (!name.starts_with(prefix)) {
+      continue;
+    }
+    // Only `<path>.<n>`, but not `<path>.<n>.idx`
+    std::string_view const suffix = std::string_view(name).substr(prefix.size());
+    uint64_t number;
+    auto const [ptr, err] = std::from_chars(suffix.data(), suffix.data() + suffix.size(), number);
+    if (err == std::errc() && ptr == suffix.data() + suffix.size()) {
+      segments.emplace_back(number, log_segment_path(path, number));
+    }
+  }
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "transaction_log_record.hpp"
+#include "types.hpp"
+
+#include <tl/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Sparse index of a binary transaction log segment. The segment is split into blocks of consecutive records, and
+// for each block the index keeps its time range and the ids of all users it mentions, so a reader only has to
+// read blocks that may contain matching records. It is stored next to the segment as `<segment>.idx`
+struct LogIndexBlock {
+  int64_t min_unix_time_ms;
+  int64_t max_unix_time_ms;
+  // Position of the block in the segment, in bytes
+  uint64_t offset;
+  uint64_t size;
+  // Sorted and unique
+  std::vector<UserId> user_ids;
+
+  bool overlaps(int64_t from_unix_time_ms, int64_t to_unix_time_ms) const {
+    return min_unix_time_ms <= to_unix_time_ms && from_unix_time_ms <= max_unix_time_ms;
+  }
+  bool mentions(UserId user_id) const;
+};
+
+// Records per index block. Smaller blocks make reads more precise, but the index larger
+constexpr std::size_t kLogIndexBlockRecords = 2048;
+
+constexpr std::string_view kLogIndexHeader = "AHTXIDX1";
+
+class LogIndexBuilder final {
+  std::vector<LogIndexBlock> blocks;
+  std::size_t records_in_block;
+
+public:
+  // Continues the existing index with new blocks
+  explicit LogIndexBuilder(std::vector<LogIndexBlock> blocks = {})
+      : blocks(std::move(blocks)), records_in_block(kLogIndexBlockRecords) {}
+
+  // `offset` is the position of the record in the segment
+  void add(LogRecord const & record, uint64_t offset);
+  // Returns the index of all records added so far and starts a new one
+  std::vector<LogIndexBlock> finish();
+};
+
+// Index file is `kLogIndexHeader` followed by blocks, all integers are little-endian:
+//   i64 min_unix_time_ms, i64 max_unix_time_ms, u64 offset, u64 size, u32 users count, users count * i32 user_id
+std::string encode_index(std::vector<LogIndexBlock> const & blocks);
+tl::expected<std::vector<LogIndexBlock>, std::string> decode_index(std::string_view data);
+
+// Builds the index by reading the whole segment. Used for the active segment and for segments whose index
+// wasn't written, e.g. because the server was killed
+tl::expected<std::vector<LogIndexBlock>, std::string> build_index(std::string const & segment_path);
+
+// The active segment is always written to the log path itself, and rotated segments are renamed to `<path>.<n>`
+std::string log_segment_path(std::string_view path, uint64_t number);
+// Rotated segments of the log with their numbers, in the order they were written
+std::vector<std::pair<uint64_t, std::string>> list_log_segments(std::string_view path);
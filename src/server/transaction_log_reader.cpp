@@ -0,0 +1,83 @@
+#include "transaction_log_reader.hpp"
+
+#include <fmt/format.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+namespace {
+tl::expected<std::vector<LogIndexBlock>, std::string> load_index(std::string const & segment_path) {
+  std::ifstream file(segment_path + ".idx", std::ios::binary);
+  if (!file) {
+    return build_index(segment_path);
+  }
+  std::string const data{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+  return decode_index(data).map_error(
+      [&](auto && err) { return fmt::format("failed to read index of '{}': {}", segment_path, err); });
+}
+}  // namespace
+
+tl::expected<TransactionLogReader, std::string> TransactionLogReader::open(std::string_view path) {
+  std::vector<std::string> paths;
+  for (auto const & [number, segment_path] : list_log_segments(path)) {
+    paths.push_back(segment_path);
+  }
+  if (std::filesystem::exists(path)) {
+    paths.emplace_back(path);
+  }
+  if (paths.empty()) {
+    return tl::make_unexpected(fmt::format("transaction log '{}' doesn't exist", path));
+  }
+
+  std::vector<Segment> segments;
+  for (auto & segment_path : paths) {
+    auto blocks = load_index(segment_path);
+    if (!blocks) {
+      return tl::make_unexpected(blocks.error());
+    }
+    segments.push_back(Segment{ .path = std::move(segment_path), .blocks = std::move(*blocks) });
+  }
+  return TransactionLogReader(std::move(segments));
+}
+
+tl::expected<std::size_t, std::string> TransactionLogReader::read(
+    LogQuery const & query, std::function<void(LogRecord const &)> const & callback) const {
+  std::size_t decoded = 0;
+  std::vector<char> data;
+  for (auto const & segment : segments) {
+    std::ifstream file;
+    for (auto const & block : segment.blocks) {
+      if (!block.overlaps(query.from_unix_time_ms, query.to_unix_time_ms) ||
+          (query.user_id && !block.mentions(*query.user_id))) {
+        continue;
+      }
+      // Opened lazily, as most segments are usually skipped
+      if (!file.is_open()) {
+        file.open(segment.path, std::ios::binary);
+        if (!file) {
+          return tl::make_unexpected(fmt::format("failed to open '{}'", segment.path));
+        }
+      }
+
+      data.resize(block.size);
+      file.seekg(static_cast<std::streamoff>(block.offset));
+      if (!file.read(data.data(), static_cast<std::streamsize>(block.size))) {
+        return tl::make_unexpected(fmt::format("failed to read {} bytes at offset {} of '{}'", block.size,
+                                               block.offset, segment.path));
+      }
+      for (std::size_t pos = 0; pos + kBinaryLogRecordSize <= data.size(); pos += kBinaryLogRecordSize) {
+        auto const record = decode_record(data.data() + pos);
+        if (!record) {
+          return tl::make_unexpected(
+              fmt::format("unknown record at offset {} of '{}'", block.offset + pos, segment.path));
+        }
+        decoded++;
+        if (query.matches(*record)) {
+          callback(*record);
+        }
+      }
+    }
+  }
+  return decoded;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "transaction_log_index.hpp"
+#include "transaction_log_record.hpp"
+#include "types.hpp"
+
+#include <tl/expected.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Records to read from the transaction log
+struct LogQuery {
+  // Inclusive time range
+  int64_t from_unix_time_ms = std::numeric_limits<int64_t>::min();
+  int64_t to_unix_time_ms = std::numeric_limits<int64_t>::max();
+  // Only records that mention the user, as either side of a trade
+  std::optional<UserId> user_id;
+
+  bool matches(LogRecord const & record) const {
+    return from_unix_time_ms <= record.unix_time_ms && record.unix_time_ms <= to_unix_time_ms &&
+           (!user_id || record.mentions(*user_id));
+  }
+};
+
+// Reader of a binary transaction log together with its rotated segments. Segment indexes are loaded once on open,
+// so each read only touches blocks that may contain matching records
+class TransactionLogReader final {
+  struct Segment {
+    std::string path;
+    std::vector<LogIndexBlock> blocks;
+  };
+  // Rotated segments in the order they were written, followed by the active one
+  std::vector<Segment> segments;
+
+  // private constructor, use `open` instead
+  TransactionLogReader(std::vector<Segment> segments) : segments(std::move(segments)) {}
+
+public:
+  // `path` is the path the server writes the log to
+  static tl::expected<TransactionLogReader, std::string> open(std::string_view path);
+
+  // Calls `callback` for every matching record in the order they were written. Returns the number of records
+  // that had to be decoded, which is what the read costs
+  tl::expected<std::size_t, std::string> read(LogQuery const & query,
+                                              std::function<void(LogRecord const &)> const & callback) const;
+};
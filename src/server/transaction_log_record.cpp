@@ -0,0 +1,99 @@
+#include "transaction_log_record.hpp"
+
+#include <charconv>
+#include <iterator>
+
+void encode_record(LogRecord const & record, char * out) {
+  out[0] = static_cast<char>(record.kind);
+  out[1] = out[2] = out[3] = 0;
+  put_le(out + 4, record.seq);
+  put_le(out + 12, record.unix_time_ms);
+  put_le(out + 20, record.user_id);
+  put_le(out + 24, record.buyer_id);
+  put_le(out + 28, record.item_id);
+  put_le(out + 32, record.quantity);
+  put_le(out + 36, record.price);
+  put_le(out + 40, record.order_id);
+}
+
+std::optional<LogRecord> decode_record(char const * data) {
+  auto const kind = static_cast<LogRecord::Kind>(static_cast<unsigned char>(data[0]));
+  if (kind < LogRecord::Kind::Deposited || kind > LogRecord::Kind::TransferredIn) {
+    return std::nullopt;
+  }
+  return LogRecord{
+    .kind = kind,
+    .seq = get_le<uint64_t>(data + 4),
+    .unix_time_ms = get_le<int64_t>(data + 12),
+    .user_id = get_le<int32_t>(data + 20),
+    .buyer_id = get_le<int32_t>(data + 24),
+    .item_id = get_le<int32_t>(data + 28),
+    .quantity = get_le<int32_t>(data + 32),
+    .price = get_le<int32_t>(data + 36),
+    .order_id = get_le<int32_t>(data + 40),
+  };
+}
+
+void format_record_text(fmt::memory_buffer & buffer, LogRecord const & record) {
+  auto const timestamp = static_cast<double>(record.unix_time_ms) / 1000.0;
+  auto const out = std::back_inserter(buffer);
+  switch (record.kind) {
+  case LogRecord::Kind::Deposited:
+  case LogRecord::Kind::Withdrawn:
+  case LogRecord::Kind::PayedFee: {
+    std::string_view const operation_name = record.kind == LogRecord::Kind::Deposited   ? "deposited"
+                                            : record.kind == LogRecord::Kind::Withdrawn ? "withdrawn"
+                                                                                        : "payed fee";
+    fmt::format_to(out, "#{} {}: user{{.id={}}} {} .item_id={} .quantity={}\n", record.seq, timestamp, record.user_id,
+                   operation_name, record.item_id, record.quantity);
+    break;
+  }
+  case LogRecord::Kind::SellOrderExecuted:
+  case LogRecord::Kind::AuctionSettled: {
+    bool const auction = record.kind == LogRecord::Kind::AuctionSettled;
+    fmt::format_to(out, "#{} {}: user{{.id={}}} {} .item_id={} .quantity={} .price={} .order_id={}\n", record.seq,
+                   timestamp, record.user_id, auction ? "sold at auction" : "sold", record.item_id, record.quantity,
+                   record.price, record.order_id);
+    fmt::format_to(out, "#{} {}: user{{.id={}}} {} .item_id={} .quantity={} .price={} .order_id={}\n", record.seq,
+                   timestamp, record.buyer_id, auction ? "won auction" : "bought", record.item_id, record.quantity,
+                   record.price, record.order_id);
+    break;
+  }
+  case LogRecord::Kind::SellOrderPlaced:
+    fmt::format_to(out, "#{} {}: user{{.id={}}} placed sell order .item_id={} .quantity={} .price={} .order_id={}\n",
+                   record.seq, timestamp, record.user_id, record.item_id, record.quantity, record.price,
+                   record.order_id);
+    break;
+  case LogRecord::Kind::BidPlaced:
+  case LogRecord::Kind::BidRefunded:
+    fmt::format_to(out, "#{} {}: user{{.id={}}} {} .price={} .order_id={}\n", record.seq, timestamp, record.user_id,
+                   record.kind == LogRecord::Kind::BidPlaced ? "placed bid" : "got bid back", record.price,
+                   record.order_id);
+    break;
+  case LogRecord::Kind::SellOrderExpired:
+    fmt::format_to(out, "#{} {}: user{{.id={}}} got back expired .item_id={} .quantity={} .order_id={}\n", record.seq,
+                   timestamp, record.user_id, record.item_id, record.quantity, record.order_id);
+    break;
+  case LogRecord::Kind::TransferredOut:
+  case LogRecord::Kind::TransferredIn:
+    fmt::format_to(out, "#{} {}: user{{.id={}}} {} .item_id={} .quantity={} .order_id={}\n", record.seq, timestamp,
+                   record.user_id, record.kind == LogRecord::Kind::TransferredOut ? "transferred" : "received",
+                   record.item_id, record.quantity, record.order_id);
+    break;
+  case LogRecord::Kind::Dropped:
+    fmt::format_to(out, "{}: {} entries were dropped, as the log couldn't keep up\n", timestamp, record.quantity);
+    break;
+  }
+}
+
+std::optional<uint64_t> parse_text_record_seq(std::string_view line) {
+  if (!line.starts_with('#')) {
+    return std::nullopt;
+  }
+  uint64_t seq = 0;
+  auto const [ptr, ec] = std::from_chars(line.data() + 1, line.data() + line.size(), seq);
+  if (ec != std::errc() || ptr == line.data() + line.size() || *ptr != ' ') {
+    return std::nullopt;
+  }
+  return seq;
+}
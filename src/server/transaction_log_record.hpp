@@ -0,0 +1,106 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <fmt/format.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <type_traits>
+
+// A single transaction log entry. Every change of `user_items` is logged, so folding all records gives exactly
+// the items and funds of every user, see `LogBalances`
+struct LogRecord {
+  // Values are a part of the binary format, so they must never change
+  enum class Kind : uint8_t {
+    Deposited = 1,
+    Withdrawn = 2,
+    // `quantity` funds (`item_id`) for placing `order_id`
+    PayedFee = 3,
+    // Both sides of an immediate sell order: `user_id` sold to `buyer_id`, who payed `price`
+    SellOrderExecuted = 4,
+    // `quantity` entries were dropped, as the log writer couldn't keep up. The only record without `seq`
+    Dropped = 5,
+    // `quantity` items are taken from `user_id` until the order is executed or expires
+    SellOrderPlaced = 6,
+    // `price` funds are taken from `user_id` until the auction is over or somebody outbids them
+    BidPlaced = 7,
+    // `price` funds are returned to `user_id`, as somebody outbid them
+    BidRefunded = 8,
+    // Both sides of an auction: `user_id` sold to `buyer_id`, whose bid was taken already
+    AuctionSettled = 9,
+    // `quantity` items are returned to `user_id`, as nobody bought them
+    SellOrderExpired = 10,
+    // `quantity` of `item_id` are taken from `user_id` by a trade of `order_id` with a user from another shard, see
+    // `CrossShardCoordinator`. Each shard logs only the changes of its own users, so such trades are logged as
+    // transfers in the logs of both shards
+    TransferredOut = 11,
+    // `quantity` of `item_id` are given to `user_id` by a trade of `order_id` with a user from another shard, or
+    // returned to them if the trade is aborted
+    TransferredIn = 12,
+  };
+
+  Kind kind;
+  // Sequence number of the record, without gaps. The same number is stored in the database together with
+  // the change, so the log can be checked and completed against it
+  uint64_t seq = 0;
+  int64_t unix_time_ms = 0;
+  // seller for sell orders
+  UserId user_id = 0;
+  // only for executed sell orders
+  UserId buyer_id = 0;
+  int item_id = 0;
+  int quantity = 0;
+  int price = 0;
+  int order_id = 0;
+
+  bool mentions(UserId id) const {
+    return user_id == id || ((kind == Kind::SellOrderExecuted || kind == Kind::AuctionSettled) && buyer_id == id);
+  }
+};
+
+// Binary log is a header followed by fixed-width little-endian records:
+//   offset size field
+//   0      1    kind
+//   1      3    reserved, zero
+//   4      8    seq
+//   12     8    unix_time_ms
+//   20     4    user_id
+//   24     4    buyer_id
+//   28     4    item_id
+//   32     4    quantity
+//   36     4    price
+//   40     4    order_id
+// The last header byte is the format version
+constexpr std::string_view kBinaryLogHeader = "AHTXLOG2";
+constexpr std::size_t kBinaryLogRecordSize = 44;
+
+// Little-endian integers for the binary formats
+template <typename T>
+void put_le(char * out, T value) {
+  auto const bits = static_cast<std::make_unsigned_t<T>>(value);
+  for (std::size_t i = 0; i < sizeof(T); ++i) {
+    out[i] = static_cast<char>((bits >> (8 * i)) & 0xff);
+  }
+}
+
+template <typename T>
+T get_le(char const * data) {
+  std::make_unsigned_t<T> bits = 0;
+  for (std::size_t i = 0; i < sizeof(T); ++i) {
+    bits |= static_cast<std::make_unsigned_t<T>>(static_cast<unsigned char>(data[i])) << (8 * i);
+  }
+  return static_cast<T>(bits);
+}
+
+// Writes exactly `kBinaryLogRecordSize` bytes to `out`
+void encode_record(LogRecord const & record, char * out);
+// Reads a record from exactly `kBinaryLogRecordSize` bytes. Returns std::nullopt if the record kind is unknown
+std::optional<LogRecord> decode_record(char const * data);
+
+// Appends the human-readable form of the record, one line per event. Lines start with `#<seq> `
+void format_record_text(fmt::memory_buffer & buffer, LogRecord const & record);
+// Returns the sequence number of a line written by `format_record_text`, std::nullopt if the line has none
+std::optional<uint64_t> parse_text_record_seq(std::string_view line);
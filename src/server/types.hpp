@@ -1,10 +1,28 @@
 #pragma once
 
+#include <compare>
+#include <cstddef>
+#include <cstdint>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 using UserId = int;
 
+// Position of a database among the shards, see `Shard`. Users live in the shard `(id - 1) % count` together with
+// their items and sell orders, so every id a shard allocates (for users and orders) is `index + 1 + k * count`
+struct ShardId {
+  int index = 0;
+  int count = 1;
+
+  auto operator<=>(ShardId const &) const = default;
+
+  static std::size_t of(int id, std::size_t count) { return static_cast<std::size_t>(id - 1) % count; }
+  bool owns(int id) const { return of(id, static_cast<std::size_t>(count)) == static_cast<std::size_t>(index); }
+  int first_id() const { return index + 1; }
+};
+
 struct User {
   UserId id;
   std::string username;
@@ -64,4 +82,39 @@ struct SellOrderInfo {
   int price;
   std::string expiration_time;
   SellOrderType type;
+  // Same as `expiration_time`, to sort orders from different shards
+  int64_t unix_expiration_time = 0;
+};
+
+enum class SellOrdersSortKey {
+  Id,
+  Price,
+  ExpirationTime,
+};
+
+// Position of the last order of a page: its sort key (id, price or expiration time) and id. The next page starts
+// right after it, so pages stay consistent while orders are placed and executed
+struct SellOrdersCursor {
+  int64_t key;
+  int id;
+
+  auto operator<=>(SellOrdersCursor const &) const = default;
+};
+
+// Filters, order and page of `view_sell_orders`. Orders are sorted in ascending order of the sort key and id
+struct SellOrdersQuery {
+  std::optional<std::string_view> item_name = std::nullopt;
+  std::optional<std::string_view> seller_name = std::nullopt;
+  std::optional<SellOrderType> type = std::nullopt;
+  std::optional<int> min_price = std::nullopt;
+  std::optional<int> max_price = std::nullopt;
+  SellOrdersSortKey sort_by = SellOrdersSortKey::Id;
+  std::optional<SellOrdersCursor> after = std::nullopt;
+  std::size_t limit = SIZE_MAX;
+};
+
+struct SellOrdersPage {
+  std::vector<SellOrderInfo> orders;
+  // Cursor of the next page, std::nullopt if this page is the last one
+  std::optional<SellOrdersCursor> next;
 };
@@ -0,0 +1,81 @@
+#include "write_queue.hpp"
+
+#include <asio/buffer.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/error_code.hpp>
+#include <asio/use_awaitable.hpp>
+#include <asio/write.hpp>
+
+#include <chrono>
+#include <stdexcept>
+#include <utility>
+
+WriteQueue::WriteQueue(asio::ip::tcp::socket socket, std::size_t high_water_mark, std::shared_ptr<CommandStats> stats)
+    : socket(std::move(socket)), high_water_mark(high_water_mark), stats(std::move(stats)),
+      written(this->socket.get_executor()) {}
+
+void WriteQueue::push(std::string message, uint32_t commands) {
+  if (failed || message.empty()) {
+    return;
+  }
+  unsent_bytes += message.size();
+  pending.push_back(Message{ .data = std::move(message),
+                             .commands = commands,
+                             .queued_at = stats && commands != 0 ? std::chrono::steady_clock::now()
+                                                                 : std::chrono::steady_clock::time_point() });
+  if (!writing) {
+    writing = true;
+    asio::co_spawn(socket.get_executor(), flush(shared_from_this()), asio::detached);
+  }
+}
+
+asio::awaitable<void> WriteQueue::wait_for_space() {
+  while (!failed && unsent_bytes > high_water_mark) {
+    written.expires_at(std::chrono::steady_clock::time_point::max());
+    try {
+      co_await written.async_wait(asio::use_awaitable);
+    } catch (std::exception &) {
+      // Cancelled by `flush()`, so the condition has to be checked again
+    }
+  }
+  if (failed) {
+    throw std::runtime_error("Failed to send data to the client");
+  }
+}
+
+asio::awaitable<void> WriteQueue::flush(std::shared_ptr<WriteQueue> self) {
+  std::vector<Message> batch;
+  std::vector<asio::const_buffer> buffers;
+  try {
+    while (!self->pending.empty()) {
+      // New messages are queued into the empty `pending` while the batch is being written
+      batch.swap(self->pending);
+      buffers.clear();
+      for (auto const & message : batch) {
+        buffers.push_back(asio::buffer(message.data));
+      }
+      std::size_t const n = co_await asio::async_write(self->socket, buffers, asio::use_awaitable);
+      self->unsent_bytes -= n;
+      if (self->stats) {
+        auto const now = std::chrono::steady_clock::now();
+        for (auto const & message : batch) {
+          if (message.commands != 0) {
+            self->stats->record_write(message.commands, now - message.queued_at);
+          }
+        }
+      }
+      batch.clear();
+      self->written.cancel();
+    }
+  } catch (std::exception &) {
+    // The reading side will fail as well once the socket is closed
+    self->failed = true;
+    self->pending.clear();
+    self->unsent_bytes = 0;
+    self->written.cancel();
+    asio::error_code ignored;
+    self->socket.close(ignored);
+  }
+  self->writing = false;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "command_stats.hpp"
+
+#include <asio/awaitable.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Outbound messages of a single connection. Command responses and notifications all go through the queue, so they
+// never interleave, and everything queued while a write is in progress is sent with a single gathered write.
+// Must be used only from the connection's strand, which the socket belongs to
+class WriteQueue final : public std::enable_shared_from_this<WriteQueue> {
+  struct Message {
+    std::string data;
+    // `CommandStats` mask of the commands this message responds to
+    uint32_t commands;
+    std::chrono::steady_clock::time_point queued_at;
+  };
+
+  asio::ip::tcp::socket socket;
+  // Max amount of unsent data before `wait_for_space()` starts to wait
+  std::size_t high_water_mark;
+  // Records how long responses to commands wait to be written, may be null
+  std::shared_ptr<CommandStats> stats;
+  // Messages queued since the current write was started
+  std::vector<Message> pending;
+  // Queued but not yet written bytes, including the ones being written right now
+  std::size_t unsent_bytes = 0;
+  bool writing = false;
+  bool failed = false;
+  // Wakes up `wait_for_space()` once some data is written
+  asio::steady_timer written;
+
+public:
+  WriteQueue(asio::ip::tcp::socket socket, std::size_t high_water_mark, std::shared_ptr<CommandStats> stats = nullptr);
+
+  // For reading, as all writes must go through the queue
+  asio::ip::tcp::socket & get_socket() { return socket; }
+
+  // Queues the message and starts writing, unless it's already in progress. Messages are silently dropped
+  // once the connection is broken, the reading side will find it out anyway. `commands` is the `CommandStats` mask
+  // of the commands the message responds to, zero for notifications
+  void push(std::string message, uint32_t commands = 0);
+
+  // Waits while the amount of unsent data is above the high-water mark, so a client that doesn't read responses
+  // is not served until it does. Throws if the connection is broken
+  asio::awaitable<void> wait_for_space();
+
+private:
+  // Writes pending messages until there are none. Takes `self` to keep the queue alive while writing
+  static asio::awaitable<void> flush(std::shared_ptr<WriteQueue> self);
+};
@@ -0,0 +1,365 @@
+#include "sqlite3.hpp"
+#include "storage.hpp"
+#include "transaction_log_balances.hpp"
+#include "transaction_log_index.hpp"
+#include "transaction_log_reader.hpp"
+#include "transaction_log_record.hpp"
+
+#include <fmt/format.h>
+
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+enum class OutputFormat {
+  Text,
+  Csv,
+};
+
+constexpr std::size_t kRecordsPerRead = 64 * 1024;
+constexpr std::size_t kOutputFlushSize = 1024 * 1024;
+
+constexpr std::string_view kUsage =
+    "Usage: txlog-dump <path_to_binary_transaction_log> [options]\n"
+    "Options:\n"
+    "  --format=<text|csv>  output format, text by default\n"
+    "  --from=<unix_time_ms>, --to=<unix_time_ms>  only records in the time range (inclusive)\n"
+    "  --user=<user_id>  only records that mention the user\n"
+    "  --verify=<path_to_db>  instead of printing records, fold the whole log and compare the result with items\n"
+    "                         and funds of all users in the database. Run it while the server is stopped\n"
+    "Rotated segments (<path>.<n>) are read as well. With filters only the blocks that may contain matching\n"
+    "records are read, according to the segment indexes\n"
+    "Example: txlog-dump transaction.log --format=csv --user=42 > transactions.csv";
+
+struct Args {
+  std::string_view path;
+  OutputFormat format = OutputFormat::Text;
+  LogQuery query;
+  bool filtered = false;
+  std::optional<std::string_view> verify_db_path;
+};
+
+template <typename T>
+std::optional<T> parse_number(std::string_view str) {
+  T value;
+  auto const [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (ec != std::errc() || ptr != str.data() + str.size()) {
+    return std::nullopt;
+  }
+  return value;
+}
+
+std::optional<Args> parse_args(int argc, char * argv[]) {
+  if (argc < 2) {
+    return std::nullopt;
+  }
+  Args args;
+  args.path = argv[1];
+  for (int i = 2; i < argc; ++i) {
+    std::string_view const arg = argv[i];
+    if (arg == "--format=text") {
+      args.format = OutputFormat::Text;
+    } else if (arg == "--format=csv") {
+      args.format = OutputFormat::Csv;
+    } else if (arg.starts_with("--from=")) {
+      auto const value = parse_number<int64_t>(arg.substr(7));
+      if (!value) {
+        return std::nullopt;
+      }
+      args.query.from_unix_time_ms = *value;
+      args.filtered = true;
+    } else if (arg.starts_with("--to=")) {
+      auto const value = parse_number<int64_t>(arg.substr(5));
+      if (!value) {
+        return std::nullopt;
+      }
+      args.query.to_unix_time_ms = *value;
+      args.filtered = true;
+    } else if (arg.starts_with("--user=")) {
+      args.query.user_id = parse_number<UserId>(arg.substr(7));
+      if (!args.query.user_id) {
+        return std::nullopt;
+      }
+      args.filtered = true;
+    } else if (arg.starts_with("--verify=")) {
+      args.verify_db_path = arg.substr(9);
+    } else {
+      return std::nullopt;
+    }
+  }
+  return args;
+}
+
+void format_record_csv(fmt::memory_buffer & buffer, LogRecord const & record) {
+  auto const out = std::back_inserter(buffer);
+  switch (record.kind) {
+  case LogRecord::Kind::Deposited:
+  case LogRecord::Kind::Withdrawn:
+  case LogRecord::Kind::PayedFee:
+  case LogRecord::Kind::SellOrderExpired:
+  case LogRecord::Kind::TransferredOut:
+  case LogRecord::Kind::TransferredIn: {
+    std::string_view const operation_name = record.kind == LogRecord::Kind::Deposited        ? "deposited"
+                                            : record.kind == LogRecord::Kind::Withdrawn      ? "withdrawn"
+                                            : record.kind == LogRecord::Kind::PayedFee       ? "payed fee"
+                                            : record.kind == LogRecord::Kind::TransferredOut ? "transferred"
+                                            : record.kind == LogRecord::Kind::TransferredIn  ? "received"
+                                                                                             : "expired";
+    fmt::format_to(out, "{},{},{},{},{},{},,{}\n", record.seq, record.unix_time_ms, record.user_id, operation_name,
+                   record.item_id, record.quantity, record.order_id);
+    break;
+  }
+  case LogRecord::Kind::SellOrderExecuted:
+  case LogRecord::Kind::AuctionSettled: {
+    bool const auction = record.kind == LogRecord::Kind::AuctionSettled;
+    fmt::format_to(out, "{},{},{},{},{},{},{},{}\n", record.seq, record.unix_time_ms, record.user_id,
+                   auction ? "sold at auction" : "sold", record.item_id, record.quantity, record.price,
+                   record.order_id);
+    fmt::format_to(out, "{},{},{},{},{},{},{},{}\n", record.seq, record.unix_time_ms, record.buyer_id,
+                   auction ? "won auction" : "bought", record.item_id, record.quantity, record.price,
+                   record.order_id);
+    break;
+  }
+  case LogRecord::Kind::SellOrderPlaced:
+    fmt::format_to(out, "{},{},{},placed sell order,{},{},{},{}\n", record.seq, record.unix_time_ms, record.user_id,
+                   record.item_id, record.quantity, record.price, record.order_id);
+    break;
+  case LogRecord::Kind::BidPlaced:
+  case LogRecord::Kind::BidRefunded:
+    fmt::format_to(out, "{},{},{},{},,,{},{}\n", record.seq, record.unix_time_ms, record.user_id,
+                   record.kind == LogRecord::Kind::BidPlaced ? "placed bid" : "bid refunded", record.price,
+                   record.order_id);
+    break;
+  case LogRecord::Kind::Dropped:
+    fmt::format_to(out, ",{},,dropped,,{},,\n", record.unix_time_ms, record.quantity);
+    break;
+  }
+}
+
+void format_record(fmt::memory_buffer & buffer, LogRecord const & record, OutputFormat format) {
+  if (format == OutputFormat::Text) {
+    format_record_text(buffer, record);
+  } else {
+    format_record_csv(buffer, record);
+  }
+}
+
+// Decodes the whole file chunk by chunk, so memory usage doesn't depend on the file size
+int dump(std::FILE * file, fmt::memory_buffer & output, OutputFormat format) {
+  char header[kBinaryLogHeader.size()];
+  if (std::fread(header, 1, sizeof(header), file) != sizeof(header) ||
+      std::string_view(header, sizeof(header)) != kBinaryLogHeader) {
+    fmt::print(stderr, "Not a binary transaction log\n");
+    return 1;
+  }
+
+  std::vector<char> chunk(kRecordsPerRead * kBinaryLogRecordSize);
+  std::size_t offset = sizeof(header);
+  for (;;) {
+    std::size_t const n = std::fread(chunk.data(), 1, chunk.size(), file);
+    std::size_t const records = n / kBinaryLogRecordSize;
+    for (std::size_t i = 0; i < records; ++i) {
+      auto const record = decode_record(chunk.data() + i * kBinaryLogRecordSize);
+      if (!record) {
+        std::fwrite(output.data(), 1, output.size(), stdout);
+        fmt::print(stderr, "Unknown record at offset {}\n", offset + i * kBinaryLogRecordSize);
+        return 1;
+      }
+      format_record(output, *record, format);
+      if (output.size() >= kOutputFlushSize) {
+        std::fwrite(output.data(), 1, output.size(), stdout);
+        output.clear();
+      }
+    }
+    offset += records * kBinaryLogRecordSize;
+
+    if (n < chunk.size()) {
+      if (n % kBinaryLogRecordSize != 0) {
+        // The server was killed in the middle of a write
+        fmt::print(stderr, "Ignored incomplete record of {} bytes at offset {}\n", n % kBinaryLogRecordSize, offset);
+      }
+      return 0;
+    }
+  }
+}
+
+int dump_file(std::string const & path, fmt::memory_buffer & output, OutputFormat format) {
+  std::FILE * file = std::fopen(path.c_str(), "rb");
+  if (!file) {
+    fmt::print(stderr, "Failed to open '{}'\n", path);
+    return 1;
+  }
+  int const result = dump(file, output, format);
+  std::fclose(file);
+  return result;
+}
+// Folds the whole log and compares balances with the `user_items` table. Records that were committed, but didn't make
+// it to the log before a crash, are taken from the outbox, just like the server does on start. The database is opened
+// read-only and queried directly, as `Storage::open` would create a missing database or migrate an existing one
+int verify(std::string_view log_path, std::string_view db_path) {
+  auto db = Sqlite3::open_read_only(std::string(db_path).c_str());
+  if (!db) {
+    fmt::print(stderr, "Failed to open database '{}': {}\n", db_path, db.error());
+    return 1;
+  }
+  auto reader = TransactionLogReader::open(log_path);
+  if (!reader) {
+    fmt::print(stderr, "Failed to open transaction log: {}\n", reader.error());
+    return 1;
+  }
+
+  std::optional<int> funds_item_id;
+  auto const funds_found =
+      db->query("SELECT id FROM items WHERE name = ?1", Storage::funds_item_name()).and_then([&](auto select) {
+        return select.template for_each_row<int>([&](int id) { funds_item_id = id; });
+      });
+  if (!funds_found || !funds_item_id) {
+    fmt::print(stderr, "Failed to get '{}' item id: {}\n", Storage::funds_item_name(),
+               funds_found ? "there is no such item" : funds_found.error());
+    return 1;
+  }
+
+  auto const started = std::chrono::steady_clock::now();
+  LogBalances balances(*funds_item_id);
+  auto const decoded = reader->read({}, [&](LogRecord const & record) { balances.apply(record); });
+  if (!decoded) {
+    fmt::print(stderr, "Failed to read transaction log: {}\n", decoded.error());
+    return 1;
+  }
+  // Encoded the same way as in the binary log
+  std::size_t from_outbox = 0;
+  bool outbox_decoded = true;
+  auto const outbox_read =
+      db->query("SELECT record FROM transaction_log_outbox WHERE seq > ?1 ORDER BY seq",
+                static_cast<int64_t>(balances.last_applied_seq()))
+          .and_then([&](auto select) {
+            return select.template for_each_row<std::string_view>([&](std::string_view blob) {
+              auto const record = blob.size() == kBinaryLogRecordSize ? decode_record(blob.data()) : std::nullopt;
+              if (!record) {
+                outbox_decoded = false;
+                return;
+              }
+              balances.apply(*record);
+              from_outbox++;
+            });
+          });
+  if (!outbox_read || !outbox_decoded) {
+    fmt::print(stderr, "Failed to read log records from the database: {}\n",
+               outbox_read ? "a record can't be decoded" : outbox_read.error());
+    return 1;
+  }
+  double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  fmt::println("Folded {} records ({} more from the database) in {:.3f}s, {:.1f}M records/s", *decoded, from_outbox,
+               seconds, static_cast<double>(*decoded) / seconds / 1e6);
+
+  // The outbox is trimmed only up to the last record in the log, so its last record is the last committed one
+  int64_t last_log_seq = 0;
+  auto const seq_found =
+      db->query("SELECT IFNULL(MAX(seq), 0) FROM transaction_log_outbox").and_then([&](auto select) {
+        return select.template for_each_row<int64_t>([&](int64_t seq) { last_log_seq = seq; });
+      });
+  if (!seq_found) {
+    fmt::print(stderr, "Failed to get the last log record from the database: {}\n", seq_found.error());
+    return 1;
+  }
+
+  std::size_t user_items = 0;
+  std::size_t mismatches = 0;
+  std::unordered_set<uint64_t> in_database;
+  auto const items_read =
+      db->query("SELECT user_id, item_id, quantity FROM user_items").and_then([&](auto select) {
+        return select.template for_each_row<UserId, int, int64_t>([&](UserId user_id, int item_id, int64_t quantity) {
+          user_items++;
+          in_database.insert(LogBalances::key(user_id, item_id));
+          if (int64_t const folded = balances.get(user_id, item_id); folded != quantity) {
+            fmt::println("user{{.id={}}} .item_id={}: {} in the database, {} in the log", user_id, item_id, quantity,
+                         folded);
+            mismatches++;
+          }
+        });
+      });
+  if (!items_read) {
+    fmt::print(stderr, "Failed to read user items: {}\n", items_read.error());
+    return 1;
+  }
+  balances.for_each([&](UserId user_id, int item_id, int64_t quantity) {
+    if (quantity != 0 && !in_database.contains(LogBalances::key(user_id, item_id))) {
+      fmt::println("user{{.id={}}} .item_id={}: none in the database, {} in the log", user_id, item_id, quantity);
+      mismatches++;
+    }
+  });
+
+  bool const seq_matches = balances.last_applied_seq() == static_cast<uint64_t>(last_log_seq);
+  if (!seq_matches) {
+    fmt::println("The log ends with record #{}, but the database with #{}", balances.last_applied_seq(), last_log_seq);
+  }
+  if (balances.missing_records() > 0 || balances.out_of_order_records() > 0) {
+    fmt::println("{} records are missing and {} are out of order", balances.missing_records(),
+                 balances.out_of_order_records());
+  }
+  fmt::println("{} user items don't match, {} are in the database", mismatches, user_items);
+  bool const ok =
+      mismatches == 0 && balances.missing_records() == 0 && balances.out_of_order_records() == 0 && seq_matches;
+  return ok ? 0 : 1;
+}
+}  // namespace
+
+int main(int argc, char * argv[]) {
+  auto const args = parse_args(argc, argv);
+  if (!args) {
+    fmt::println("{}", kUsage);
+    return 1;
+  }
+
+  if (args->verify_db_path) {
+    return verify(args->path, *args->verify_db_path);
+  }
+
+  fmt::memory_buffer output;
+  if (args->format == OutputFormat::Csv) {
+    fmt::format_to(std::back_inserter(output), "seq,unix_time_ms,user_id,operation,item_id,quantity,price,order_id\n");
+  }
+
+  if (args->filtered) {
+    auto reader = TransactionLogReader::open(args->path);
+    if (!reader) {
+      fmt::print(stderr, "Failed to open transaction log: {}\n", reader.error());
+      return 1;
+    }
+    auto const result = reader->read(args->query, [&](LogRecord const & record) {
+      format_record(output, record, args->format);
+      if (output.size() >= kOutputFlushSize) {
+        std::fwrite(output.data(), 1, output.size(), stdout);
+        output.clear();
+      }
+    });
+    std::fwrite(output.data(), 1, output.size(), stdout);
+    if (!result) {
+      fmt::print(stderr, "Failed to read transaction log: {}\n", result.error());
+      return 1;
+    }
+    return 0;
+  }
+
+  // Without filters everything is read anyway, so the files are just streamed one after another
+  std::vector<std::string> paths;
+  for (auto const & [number, segment_path] : list_log_segments(args->path)) {
+    paths.push_back(segment_path);
+  }
+  paths.emplace_back(args->path);
+  for (auto const & path : paths) {
+    if (int const result = dump_file(path, output, args->format); result != 0) {
+      std::fwrite(output.data(), 1, output.size(), stdout);
+      return result;
+    }
+  }
+  std::fwrite(output.data(), 1, output.size(), stdout);
+  return 0;
+}
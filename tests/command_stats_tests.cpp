@@ -0,0 +1,149 @@
+#include "command_stats.hpp"
+#include "log_linear_buckets.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace {
+// Every value falls into exactly one bucket, and buckets are no wider than 1/2^SubBucketBits of their values
+template <typename Buckets>
+void expect_contiguous_buckets(uint64_t max_relative_width) {
+  EXPECT_EQ(Buckets::bucket_of(0), 0);
+  for (std::size_t bucket = 1; bucket < Buckets::kCount; ++bucket) {
+    uint64_t const lower = Buckets::upper_bound(bucket - 1) + 1;
+    uint64_t const upper = Buckets::upper_bound(bucket);
+    ASSERT_LE(lower, upper) << bucket;
+    ASSERT_EQ(Buckets::bucket_of(lower), bucket) << lower;
+    ASSERT_EQ(Buckets::bucket_of(upper), bucket) << upper;
+    ASSERT_LE(upper - lower, lower / max_relative_width) << bucket;
+  }
+}
+}  // namespace
+
+TEST(LogLinearBuckets, bucket_boundaries) {
+  using Buckets = LogLinearBuckets<2, 8>;
+  // Exact below 8, then 4 buckets per power of two
+  EXPECT_EQ(Buckets::kCount, 8 + 5 * 4);
+  EXPECT_EQ(Buckets::bucket_of(7), 7);
+  EXPECT_EQ(Buckets::bucket_of(8), 8);
+  EXPECT_EQ(Buckets::bucket_of(9), 8);
+  EXPECT_EQ(Buckets::upper_bound(8), 9);
+  EXPECT_EQ(Buckets::bucket_of(10), 9);
+  EXPECT_EQ(Buckets::bucket_of(15), 11);
+  EXPECT_EQ(Buckets::bucket_of(16), 12);
+  EXPECT_EQ(Buckets::upper_bound(12), 19);
+  EXPECT_EQ(Buckets::upper_bound(Buckets::kCount - 1), 255);
+  // Wider values don't fit into the range
+  EXPECT_EQ(Buckets::bucket_of(256), Buckets::kCount - 1);
+  EXPECT_EQ(Buckets::bucket_of(UINT64_MAX), Buckets::kCount - 1);
+
+  expect_contiguous_buckets<Buckets>(4);
+  expect_contiguous_buckets<AtomicHistogram::Buckets>(32);
+  // The configuration of `LatencyHistogram`, which covers all of `uint64_t`
+  expect_contiguous_buckets<LogLinearBuckets<7>>(128);
+  EXPECT_EQ(LogLinearBuckets<7>::upper_bound(LogLinearBuckets<7>::kCount - 1), UINT64_MAX);
+}
+
+TEST(LogLinearBuckets, percentile) {
+  using Buckets = LogLinearBuckets<2, 8>;
+  std::vector<uint64_t> counts(Buckets::kCount, 0);
+  EXPECT_EQ(Buckets::percentile(counts, 0, 0.5, 0), 0);
+
+  // 1, 2, 2 and 9
+  counts[1] = 1;
+  counts[2] = 2;
+  counts[Buckets::bucket_of(9)] = 1;
+  EXPECT_EQ(Buckets::percentile(counts, 4, 0.0, 9), 1);
+  EXPECT_EQ(Buckets::percentile(counts, 4, 0.25, 9), 1);
+  EXPECT_EQ(Buckets::percentile(counts, 4, 0.5, 9), 2);
+  EXPECT_EQ(Buckets::percentile(counts, 4, 0.75, 9), 2);
+  EXPECT_EQ(Buckets::percentile(counts, 4, 1.0, 9), 9);
+  // The bucket of 8 and 9 is rounded up to its boundary, but not above the maximum
+  EXPECT_EQ(Buckets::percentile(counts, 4, 1.0, 8), 8);
+}
+
+TEST(AtomicHistogram, empty) {
+  AtomicHistogram histogram;
+  EXPECT_EQ(histogram.count(), 0);
+  EXPECT_EQ(histogram.mean(), 0ns);
+  EXPECT_EQ(histogram.max(), 0ns);
+  EXPECT_EQ(histogram.percentiles({ 0.5, 0.99 }), std::vector({ 0ns, 0ns }));
+}
+
+TEST(AtomicHistogram, small_values_are_exact) {
+  AtomicHistogram histogram;
+  for (int i = 1; i <= 60; ++i) {
+    histogram.record(std::chrono::nanoseconds(i));
+  }
+  EXPECT_EQ(histogram.count(), 60);
+  EXPECT_EQ(histogram.max(), 60ns);
+  EXPECT_EQ(histogram.percentiles({ 0.0, 0.5, 0.9, 1.0 }), std::vector({ 1ns, 30ns, 54ns, 60ns }));
+}
+
+TEST(AtomicHistogram, percentiles_are_rounded_up_to_the_bucket) {
+  AtomicHistogram histogram;
+  // Both fall into the bucket [64, 65]
+  histogram.record(64ns);
+  histogram.record(64ns);
+  histogram.record(100ns);
+  auto const values = histogram.percentiles({ 0.5, 1.0 });
+  EXPECT_EQ(values[0], 65ns);
+  // The exact maximum is known, so the last bucket doesn't overestimate it
+  EXPECT_EQ(values[1], 100ns);
+}
+
+TEST(AtomicHistogram, percentiles_within_bucket_error) {
+  AtomicHistogram histogram;
+  // 1us, 2us, ..., 10ms
+  for (int i = 1; i <= 10'000; ++i) {
+    histogram.record(std::chrono::microseconds(i));
+  }
+  auto const values = histogram.percentiles({ 0.5, 0.99, 0.999, 1.0 });
+  auto const expect_near = [&](std::chrono::nanoseconds actual, std::chrono::microseconds expected) {
+    EXPECT_GE(actual, expected);
+    EXPECT_LE(actual.count(), expected.count() * 1000 * 33 / 32);
+  };
+  expect_near(values[0], 5'000us);
+  expect_near(values[1], 9'900us);
+  expect_near(values[2], 9'990us);
+  EXPECT_EQ(values[3], 10ms);
+  EXPECT_EQ(histogram.mean(), 5'000'500ns);
+}
+
+TEST(AtomicHistogram, values_beyond_the_range_share_the_last_bucket) {
+  AtomicHistogram histogram;
+  histogram.record(100s);
+  histogram.record(-1s);  // clock went backwards
+  EXPECT_EQ(histogram.max(), 100s);
+  auto const values = histogram.percentiles({ 0.5, 1.0 });
+  EXPECT_EQ(values[0], 0ns);
+  EXPECT_EQ(values[1], std::chrono::nanoseconds(AtomicHistogram::Buckets::upper_bound(AtomicHistogram::kBuckets - 1)));
+}
+
+TEST(AtomicHistogram, records_from_many_threads) {
+  AtomicHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int t = 1; t <= 4; ++t) {
+    threads.emplace_back([&histogram, t]() {
+      for (int i = 0; i < 10'000; ++i) {
+        histogram.record(std::chrono::microseconds(t));
+      }
+    });
+  }
+  for (auto & thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(histogram.count(), 40'000);
+  EXPECT_EQ(histogram.max(), 4us);
+  EXPECT_EQ(histogram.mean(), 2'500ns);
+  auto const values = histogram.percentiles({ 0.25, 1.0 });
+  EXPECT_GE(values[0], 1us);
+  EXPECT_LE(values[0].count(), 1'000 * 33 / 32);
+  EXPECT_EQ(values[1], 4us);
+}
@@ -1,8 +1,14 @@
+#include "command_stats.hpp"
 #include "commands.hpp"
+#include "response_writer.hpp"
 #include "storage.hpp"
 
+#include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <string>
+#include <vector>
+
 TEST(Ping, Smoke) {
   // arg is ignored
   auto result = commands::Ping::parse({});
@@ -121,9 +127,54 @@ TEST(ViewItems, Parse) {
 }
 
 TEST(ViewSellOrders, Parse) {
-  // arg is ignored
   auto result = commands::ViewSellOrders::parse({});
   ASSERT_TRUE(result);
+  ASSERT_FALSE(result->query.item_name);
+  ASSERT_EQ(result->query.sort_by, SellOrdersSortKey::Id);
+  ASSERT_EQ(result->query.limit, commands::ViewSellOrders::kDefaultPageSize);
+
+  // values may contain spaces
+  result = commands::ViewSellOrders::parse("item=holy  sword seller=bob type=auction sort=price limit=10");
+  ASSERT_TRUE(result);
+  ASSERT_EQ(result->query.item_name, "holy  sword");
+  ASSERT_EQ(result->query.seller_name, "bob");
+  ASSERT_EQ(result->query.type, SellOrderType::Auction);
+  ASSERT_EQ(result->query.sort_by, SellOrdersSortKey::Price);
+  ASSERT_EQ(result->query.limit, 10u);
+
+  result = commands::ViewSellOrders::parse("min_price=5 max_price=100 sort=expiration after=1609459200:42");
+  ASSERT_TRUE(result);
+  ASSERT_EQ(result->query.min_price, 5);
+  ASSERT_EQ(result->query.max_price, 100);
+  ASSERT_EQ(result->query.sort_by, SellOrdersSortKey::ExpirationTime);
+  ASSERT_EQ(result->query.after, (SellOrdersCursor{ .key = 1609459200, .id = 42 }));
+
+  // invalid args
+  ASSERT_FALSE(commands::ViewSellOrders::parse("sword"));
+  ASSERT_FALSE(commands::ViewSellOrders::parse("color=red"));
+  ASSERT_FALSE(commands::ViewSellOrders::parse("sort=name"));
+  ASSERT_FALSE(commands::ViewSellOrders::parse("type=any"));
+  ASSERT_FALSE(commands::ViewSellOrders::parse("min_price=5x"));
+  ASSERT_FALSE(commands::ViewSellOrders::parse("limit=0"));
+  ASSERT_FALSE(commands::ViewSellOrders::parse("limit=100000"));
+  ASSERT_FALSE(commands::ViewSellOrders::parse("after=42"));
+}
+
+TEST(ResponseWriter, Chunks) {
+  std::vector<std::string> chunks;
+  ResponseWriter output([&](std::string chunk) { chunks.push_back(std::move(chunk)); }, 8);
+  output.write("Items:");
+  for (int i = 0; i < 5; ++i) {
+    output.print(" {}", i * 111);
+  }
+  // chunks are flushed only before writing more, so the rest is never empty
+  EXPECT_THAT(chunks, testing::ElementsAre("Items: 0", " 111 222"));
+  EXPECT_EQ(output.take(), " 333 444");
+
+  ResponseWriter unbounded;
+  unbounded.write("Items:");
+  unbounded.print(" {}", 42);
+  EXPECT_EQ(unbounded.take(), "Items: 42");
 }
 
 TEST(Sell, Parse) {
@@ -196,3 +247,21 @@ TEST(Buy, Parse) {
   ASSERT_EQ(result->sell_order_id, -123);
   ASSERT_EQ(*result->bid, -10);
 }
+
+TEST(Stats, Format) {
+  CommandStats stats({ "ping", "deposit" });
+  stats.record(1, CommandStats::Stage::Parse, std::chrono::microseconds(2));
+  stats.record(1, CommandStats::Stage::Execute, std::chrono::microseconds(100));
+  stats.count(1, false);
+  stats.count(1, true);
+  stats.count(stats.unknown_command(), true);
+  stats.record_write(CommandStats::mask(1) | CommandStats::mask(stats.unknown_command()), std::chrono::microseconds(7));
+
+  auto const output = stats.format();
+  // commands that were never requested are not listed
+  ASSERT_EQ(output.find("- ping"), std::string::npos);
+  ASSERT_NE(output.find("- deposit: 2 requests, 1 errors, parse 2.0/2.0/2.0/2.0, execute 100.0/100.0/100.0/100.0, "
+                        "write 7.0/7.0/7.0/7.0\n"),
+            std::string::npos);
+  ASSERT_NE(output.find("- <unknown>: 1 requests, 1 errors, write 7.0/7.0/7.0/7.0\n"), std::string::npos);
+}
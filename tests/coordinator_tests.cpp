@@ -0,0 +1,307 @@
+#include "coordinator.hpp"
+#include "shard.hpp"
+#include "sqlite3.hpp"
+#include "storage.hpp"
+#include "temp_database.hpp"
+
+#include <asio/co_spawn.hpp>
+#include <asio/io_context.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/strand.hpp>
+#include <asio/this_coro.hpp>
+#include <asio/use_awaitable.hpp>
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+int64_t constexpr expiration_time = 1609459200;
+int64_t constexpr far_expiration_time = 2'000'000'000;
+
+template <typename T>
+asio::awaitable<void> await_into(asio::awaitable<T> awaitable, std::optional<T> & result) {
+  result = co_await std::move(awaitable);
+}
+
+// Step of a transaction that completes after `delay` with `result`, or throws it as an exception if `throws`
+asio::awaitable<tl::expected<void, std::string>> step(std::chrono::milliseconds delay,
+                                                      tl::expected<void, std::string> result, int & finished,
+                                                      bool throws = false) {
+  asio::steady_timer timer(co_await asio::this_coro::executor, delay);
+  co_await timer.async_wait(asio::use_awaitable);
+  finished++;
+  if (throws) {
+    throw std::runtime_error(result.error());
+  }
+  co_return result;
+}
+
+class CoordinatorTest : public ::testing::Test {
+protected:
+  // Decisions are on disk, so they can be looked at from another connection
+  TempDatabase database{ "auction_house_coordinator_test.sqlite" };
+  asio::io_context context;
+  std::vector<std::shared_ptr<Shard>> shards;
+  std::shared_ptr<CrossShardCoordinator> coordinator;
+
+  void SetUp() override {
+    for (int i = 0; i < 2; ++i) {
+      auto opened = Storage::open(":memory:", true, ShardId{ .index = i, .count = 2 });
+      ASSERT_TRUE(opened) << opened.error();
+      auto storage = std::make_shared<Storage>(std::move(*opened));
+      asio::any_io_executor const executor = asio::make_strand(context);
+      // Constructed in place, as `Shard` can't be moved
+      shards.push_back(std::shared_ptr<Shard>(new Shard{
+          .storage_executor = StorageExecutor(executor),
+          .storage = storage,
+          .group_commit = GroupCommit(executor, storage, {}),
+          .auction_service = AuctionService(storage),
+          .user_service = UserService(storage),
+          .expiry_timer = ExpiryTimer(executor),
+      }));
+    }
+    auto opened = CrossShardCoordinator::open(database.path, shards, context.get_executor());
+    ASSERT_TRUE(opened) << opened.error();
+    coordinator = std::move(*opened);
+  }
+
+  // Runs the coroutine till the end, as the server would, and returns its result
+  template <typename T>
+  T run(asio::awaitable<T> awaitable) {
+    std::optional<T> result;
+    asio::co_spawn(context, await_into(std::move(awaitable), result), [](std::exception_ptr e) {
+      if (e) {
+        std::rethrow_exception(e);
+      }
+    });
+    context.restart();
+    context.run();
+    return std::move(*result);
+  }
+
+  User login(std::size_t shard, std::string_view username) { return *shards[shard]->user_service.login(username); }
+
+  int quantity(std::size_t shard, UserId user_id, std::string_view item_name) {
+    auto const items = shards[shard]->storage->view_user_items(user_id);
+    for (auto const & item : *items) {
+      if (item.item_name == item_name) {
+        return item.quantity;
+      }
+    }
+    return 0;
+  }
+
+  int funds(std::size_t shard, UserId user_id) { return quantity(shard, user_id, Storage::funds_item_name()); }
+
+  int place_sell_order(SellOrderType type, User const & seller, int price, int64_t unix_expiration_time) {
+    Shard & shard = *shards[ShardId::of(seller.id, shards.size())];
+    EXPECT_TRUE(shard.auction_service.deposit(seller.id, "funds", 10));
+    EXPECT_TRUE(shard.auction_service.deposit(seller.id, "item1", 1));
+    EXPECT_TRUE(shard.auction_service.place_sell_order(type, seller.id, "item1", 1, price, unix_expiration_time));
+    // Ids grow, so the new order has the largest one
+    int order_id = 0;
+    auto const orders = shard.storage->view_sell_orders()->orders;
+    for (auto const & order : orders) {
+      order_id = std::max(order_id, order.id);
+    }
+    return order_id;
+  }
+
+  bool nothing_is_prepared() {
+    for (auto const & shard : shards) {
+      if (!shard->storage->prepared_transactions()->empty()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Commit decisions the coordinator still keeps
+  std::vector<int64_t> committed_transactions() {
+    std::vector<int64_t> ids;
+    auto db = Sqlite3::open(database.path.c_str());
+    EXPECT_TRUE(db) << db.error();
+    auto const result = db->query("SELECT id FROM committed_transactions ORDER BY id").and_then([&](auto select) {
+      return select.template for_each_row<int64_t>([&](int64_t id) { ids.push_back(id); });
+    });
+    EXPECT_TRUE(result) << result.error();
+    return ids;
+  }
+};
+}  // namespace
+
+TEST_F(CoordinatorTest, recover_finishes_prepared_transactions_by_their_decisions) {
+  auto const user = login(1, "user");
+  auto const other = login(0, "other");
+  using Change = Storage::PreparedChange;
+  auto const prepare = [&](std::size_t shard, UserId user_id, int64_t transaction_id, int on_commit, int on_abort) {
+    Storage & storage = *shards[shard]->storage;
+    auto transaction = storage.begin_transaction();
+    ASSERT_TRUE(transaction);
+    ASSERT_TRUE(storage.prepare(transaction_id,
+                                Change{ .kind = Change::Kind::Credit, .user_id = user_id, .item_name = "funds",
+                                        .quantity = on_commit, .order_id = 1 },
+                                true));
+    ASSERT_TRUE(storage.prepare(transaction_id,
+                                Change{ .kind = Change::Kind::Credit, .user_id = user_id, .item_name = "funds",
+                                        .quantity = on_abort, .order_id = 1 },
+                                false));
+    ASSERT_TRUE(transaction->commit());
+  };
+  prepare(1, user.id, 1, 10, 100);
+  prepare(0, other.id, 1, 5, 50);
+  prepare(1, user.id, 2, 20, 40);
+  // Only the first one was decided before the crash
+  {
+    auto db = Sqlite3::open(database.path.c_str());
+    ASSERT_TRUE(db && db->execute("INSERT INTO committed_transactions (id) VALUES (1)"));
+  }
+
+  auto const recovered = coordinator->recover();
+  ASSERT_TRUE(recovered) << recovered.error();
+  EXPECT_EQ(*recovered, 3);
+  EXPECT_EQ(funds(1, user.id), 10 + 40);
+  EXPECT_EQ(funds(0, other.id), 5);
+  EXPECT_TRUE(nothing_is_prepared());
+  // Every shard has finished everything, so no decision is needed anymore
+  EXPECT_TRUE(committed_transactions().empty());
+}
+
+TEST_F(CoordinatorTest, buy_without_funds_puts_the_order_back) {
+  auto const seller = login(0, "seller");
+  auto const buyer = login(1, "buyer");
+  int const order_id = place_sell_order(SellOrderType::Immediate, seller, 30, far_expiration_time);
+  int const seller_funds = funds(0, seller.id);
+
+  auto const result = run(coordinator->buy(buyer.id, order_id));
+  ASSERT_FALSE(result);
+  EXPECT_EQ(result.error(), "Not enough funds to buy");
+  auto const order = shards[0]->storage->get_sell_order_info(order_id);
+  ASSERT_TRUE(order);
+  EXPECT_EQ(order->type(), SellOrderType::Immediate);
+  EXPECT_EQ(funds(0, seller.id), seller_funds);
+  EXPECT_EQ(quantity(1, buyer.id, "item1"), 0);
+  EXPECT_TRUE(nothing_is_prepared());
+  EXPECT_TRUE(committed_transactions().empty());
+}
+
+TEST_F(CoordinatorTest, bid_refunds_the_previous_bidder) {
+  auto const seller = login(0, "seller");
+  auto const first = login(1, "first");
+  auto const second = login(0, "second");
+  ASSERT_TRUE(shards[1]->auction_service.deposit(first.id, "funds", 100));
+  ASSERT_TRUE(shards[0]->auction_service.deposit(second.id, "funds", 100));
+  int const order_id = place_sell_order(SellOrderType::Auction, seller, 10, far_expiration_time);
+
+  auto result = run(coordinator->bid(first, order_id, 20));
+  ASSERT_TRUE(result) << result.error();
+  EXPECT_EQ(funds(1, first.id), 80);
+
+  // The first bidder is refunded by their own shard
+  result = run(coordinator->bid(second, order_id, 30));
+  ASSERT_TRUE(result) << result.error();
+  EXPECT_EQ(funds(1, first.id), 100);
+  EXPECT_EQ(funds(0, second.id), 70);
+  auto const order = shards[0]->storage->get_sell_order_info(order_id);
+  ASSERT_TRUE(order);
+  EXPECT_EQ(order->buyer_id, second.id);
+  EXPECT_EQ(order->price, 30);
+  EXPECT_TRUE(nothing_is_prepared());
+}
+
+TEST_F(CoordinatorTest, settle_credits_items_on_the_winners_shard) {
+  auto const seller = login(0, "seller");
+  auto const winner = login(1, "winner");
+  ASSERT_TRUE(shards[1]->auction_service.deposit(winner.id, "funds", 100));
+  int const order_id = place_sell_order(SellOrderType::Auction, seller, 10, expiration_time);
+  auto const bid = run(coordinator->bid(winner, order_id, 20));
+  ASSERT_TRUE(bid) << bid.error();
+  int const seller_funds = funds(0, seller.id);
+
+  // The seller's shard takes the order out of the book and leaves the items to the winner's shard
+  int64_t const transaction_id = coordinator->next_transaction_id();
+  auto const expired = shards[0]->storage->process_expired_sell_orders(
+      expiration_time, SIZE_MAX, std::chrono::microseconds::max(), transaction_id);
+  ASSERT_TRUE(expired) << expired.error();
+  ASSERT_EQ(expired->executed.size(), 1);
+  EXPECT_EQ(quantity(1, winner.id, "item1"), 0);
+
+  std::vector<CrossShardCoordinator::Settlement> settlements{
+    { .buyer_id = winner.id, .item_name = "item1", .quantity = 1, .order_id = order_id },
+  };
+  auto const settled = run(coordinator->settle(transaction_id, 0, std::move(settlements)));
+  ASSERT_TRUE(settled) << settled.error();
+  EXPECT_EQ(quantity(1, winner.id, "item1"), 1);
+  EXPECT_EQ(funds(1, winner.id), 80);
+  EXPECT_EQ(funds(0, seller.id), seller_funds + 20);
+  EXPECT_FALSE(shards[0]->storage->get_sell_order_info(order_id));
+  EXPECT_TRUE(nothing_is_prepared());
+}
+
+TEST_F(CoordinatorTest, decisions_are_trimmed_once_finished_everywhere) {
+  auto const seller = login(0, "seller");
+  auto const buyer = login(1, "buyer");
+  ASSERT_TRUE(shards[1]->auction_service.deposit(buyer.id, "funds", 100));
+  int const first_order_id = place_sell_order(SellOrderType::Immediate, seller, 10, far_expiration_time);
+  int const second_order_id = place_sell_order(SellOrderType::Immediate, seller, 10, far_expiration_time);
+
+  auto result = run(coordinator->buy(buyer.id, first_order_id));
+  ASSERT_TRUE(result) << result.error();
+  EXPECT_EQ(committed_transactions(), std::vector<int64_t>({ 1 }));
+
+  // The first transaction is finished by both shards, so its decision goes away with the next one
+  result = run(coordinator->buy(buyer.id, second_order_id));
+  ASSERT_TRUE(result) << result.error();
+  EXPECT_EQ(committed_transactions(), std::vector<int64_t>({ 2 }));
+  EXPECT_EQ(quantity(1, buyer.id, "item1"), 2);
+  EXPECT_TRUE(nothing_is_prepared());
+}
+
+TEST_F(CoordinatorTest, run_concurrently_returns_the_first_error) {
+  using namespace std::chrono_literals;
+  int finished = 0;
+  std::vector<asio::awaitable<tl::expected<void, std::string>>> steps;
+  steps.push_back(step(20ms, tl::make_unexpected("late"), finished));
+  steps.push_back(step(0ms, {}, finished));
+  steps.push_back(step(10ms, tl::make_unexpected("early"), finished));
+  steps.push_back(step(30ms, {}, finished));
+
+  auto const result = run(run_concurrently(std::move(steps)));
+  ASSERT_FALSE(result);
+  EXPECT_EQ(result.error(), "early");
+  // Once all steps are done, even the ones after the error
+  EXPECT_EQ(finished, 4);
+}
+
+TEST_F(CoordinatorTest, run_concurrently_rethrows_exceptions) {
+  using namespace std::chrono_literals;
+  int finished = 0;
+  std::vector<asio::awaitable<tl::expected<void, std::string>>> steps;
+  steps.push_back(step(0ms, tl::make_unexpected("error"), finished));
+  steps.push_back(step(10ms, tl::make_unexpected("first exception"), finished, true));
+  steps.push_back(step(20ms, tl::make_unexpected("second exception"), finished, true));
+  steps.push_back(step(30ms, {}, finished));
+
+  // An exception wins over errors
+  EXPECT_THROW(
+      {
+        try {
+          run(run_concurrently(std::move(steps)));
+        } catch (std::runtime_error const & e) {
+          EXPECT_STREQ(e.what(), "first exception");
+          throw;
+        }
+      },
+      std::runtime_error);
+  EXPECT_EQ(finished, 4);
+}
@@ -0,0 +1,70 @@
+#include "expiry_timer.hpp"
+
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/io_context.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+namespace {
+// Waits that are shorter are not delayed
+constexpr auto kHalfRetryDelay = std::chrono::milliseconds(ExpiryTimer::kRetryDelay) / 2;
+
+// How long `wait_until` takes to complete
+std::chrono::steady_clock::duration wait_duration(ExpiryTimer & timer, asio::io_context & context,
+                                                  std::optional<int64_t> unix_time) {
+  auto const start = std::chrono::steady_clock::now();
+  bool done = false;
+  asio::co_spawn(
+      context,
+      [&]() -> asio::awaitable<void> {
+        co_await timer.wait_until(unix_time);
+        done = true;
+      },
+      asio::detached);
+  context.restart();
+  context.run();
+  EXPECT_TRUE(done);
+  return std::chrono::steady_clock::now() - start;
+}
+
+int64_t unix_now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+}  // namespace
+
+TEST(ExpiryTimer, expired_deadline_completes_right_away) {
+  asio::io_context context;
+  ExpiryTimer timer(context.get_executor());
+  EXPECT_LT(wait_duration(timer, context, unix_now() - 10), kHalfRetryDelay);
+}
+
+TEST(ExpiryTimer, schedule_interrupts_the_wait) {
+  asio::io_context context;
+  ExpiryTimer timer(context.get_executor());
+  bool woken_up = false;
+  // Nothing to wait for, so only `schedule` wakes it up
+  asio::co_spawn(
+      context,
+      [&]() -> asio::awaitable<void> {
+        co_await timer.wait_until(std::nullopt);
+        woken_up = true;
+      },
+      asio::detached);
+  asio::co_spawn(
+      context, [&]() -> asio::awaitable<void> { co_return timer.schedule(unix_now() - 1); }, asio::detached);
+  context.run();
+  EXPECT_TRUE(woken_up);
+}
+
+TEST(ExpiryTimer, retry_later_delays_expired_deadlines) {
+  asio::io_context context;
+  ExpiryTimer timer(context.get_executor());
+  timer.retry_later();
+  EXPECT_GE(wait_duration(timer, context, unix_now() - 10), kHalfRetryDelay);
+  // The delay is over, so the next wait isn't delayed
+  EXPECT_LT(wait_duration(timer, context, unix_now() - 10), kHalfRetryDelay);
+}
@@ -0,0 +1,208 @@
+#include "auction_service.hpp"
+#include "group_commit.hpp"
+#include "sqlite3.hpp"
+#include "storage.hpp"
+#include "temp_database.hpp"
+#include "user_service.hpp"
+
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/io_context.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace {
+template <typename F>
+using CommandResult = tl::expected<std::invoke_result_t<F &>, std::string>;
+
+template <typename F>
+asio::awaitable<void> run_command(GroupCommit & group_commit, F f, std::optional<CommandResult<F>> & result) {
+  result = co_await group_commit.run(std::move(f));
+}
+
+class GroupCommitTest : public ::testing::Test {
+protected:
+  // On disk, so another connection can change it in the middle of a batch
+  TempDatabase database{ "auction_house_group_commit_test.sqlite" };
+  asio::io_context context;
+  std::shared_ptr<Storage> storage;
+  std::optional<AuctionService> auction_service;
+  UserId user_id = 0;
+  // Commands started by `spawn_counted`, and the number of them that had run when the batch of each one was committed
+  int executed = 0;
+  std::vector<int> committed_after;
+  // Results of these commands, alive until the coroutines that set them are done
+  std::vector<std::shared_ptr<void>> counted_results;
+
+  void SetUp() override {
+    auto opened = Storage::open(database.path);
+    ASSERT_TRUE(opened) << opened.error();
+    storage = std::make_shared<Storage>(std::move(*opened));
+    auction_service.emplace(storage);
+    user_id = UserService(storage).login("user")->id;
+  }
+
+  GroupCommit group_commit(GroupCommit::Options options) {
+    return GroupCommit(context.get_executor(), storage, options);
+  }
+
+  // Runs `f` as a part of a batch. The result is set once the awaiting coroutine is resumed
+  template <typename F>
+  std::shared_ptr<std::optional<CommandResult<F>>> spawn(GroupCommit & group_commit, F f) {
+    auto result = std::make_shared<std::optional<CommandResult<F>>>();
+    asio::co_spawn(context, run_command(group_commit, std::move(f), *result), asio::detached);
+    return result;
+  }
+
+  // Command that remembers how many commands had run when its batch was committed, see `committed_after`
+  void spawn_counted(GroupCommit & group_commit) {
+    std::size_t const index = committed_after.size();
+    committed_after.push_back(0);
+    counted_results.push_back(spawn(group_commit, [this, index]() {
+      executed++;
+      storage->after_commit([this, index]() { committed_after[index] = executed; });
+      return index;
+    }));
+  }
+
+  int funds() {
+    auto const items = storage->view_user_items(user_id);
+    for (auto const & item : *items) {
+      if (item.item_name == storage->funds_item_name()) {
+        return item.quantity;
+      }
+    }
+    return 0;
+  }
+};
+}  // namespace
+
+TEST_F(GroupCommitTest, failed_command_does_not_affect_others) {
+  auto group = group_commit({});
+  auto const first = spawn(group, [&]() { return auction_service->deposit(user_id, "funds", 10); });
+  auto const failed = spawn(group, [&]() { return auction_service->withdraw(user_id, "funds", 1000); });
+  auto const last = spawn(group, [&]() { return auction_service->deposit(user_id, "funds", 5); });
+  context.run();
+
+  // The batch is committed, only the failed command is rolled back
+  ASSERT_TRUE(*first && **first);
+  ASSERT_TRUE(*failed && **failed);
+  ASSERT_TRUE(*last && **last);
+  EXPECT_TRUE(***first);
+  EXPECT_FALSE(***failed);
+  EXPECT_TRUE(***last);
+  EXPECT_EQ(funds(), 15);
+}
+
+TEST_F(GroupCommitTest, failed_commit_fails_every_command) {
+  ASSERT_TRUE(auction_service->deposit(user_id, "funds", 10));
+  ASSERT_TRUE(auction_service->deposit(user_id, "item1", 1));
+  ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Immediate, user_id, "item1", 1, 10, 2'000'000'000));
+  int const order_id = storage->view_sell_orders()->orders.front().id;
+
+  auto group = group_commit({});
+  // Starts the read snapshot of the batch transaction
+  auto const read = spawn(group, [&]() { return storage->all_user_items().has_value(); });
+  // Makes the snapshot stale, so the batch can't write anymore
+  auto const concurrent_write = spawn(group, [&]() {
+    auto db = Sqlite3::open(database.path.c_str());
+    return db && db->execute("INSERT INTO items (name) VALUES ('item2')");
+  });
+  // Order writes are deferred till the commit, so the command itself succeeds
+  auto const deleted = spawn(group, [&]() { return storage->delete_sell_order(order_id); });
+  context.run();
+
+  ASSERT_TRUE(*read && *concurrent_write && *deleted);
+  EXPECT_FALSE(**read);
+  EXPECT_FALSE(**concurrent_write);
+  EXPECT_FALSE(**deleted);
+  EXPECT_EQ((*read)->error(), (*deleted)->error());
+  // The deleted order is back in the book
+  EXPECT_TRUE(storage->get_sell_order_info(order_id));
+  EXPECT_EQ(storage->view_sell_orders()->orders.size(), 1);
+}
+
+TEST_F(GroupCommitTest, batches_are_cut_at_max_size) {
+  auto group = group_commit({ .max_batch_size = 2 });
+  for (int i = 0; i < 5; ++i) {
+    spawn_counted(group);
+  }
+  context.run();
+  EXPECT_EQ(committed_after, std::vector({ 2, 2, 4, 4, 5 }));
+}
+
+TEST_F(GroupCommitTest, commands_join_the_batch_within_the_window) {
+  auto const window = std::chrono::milliseconds(50);
+  auto group = group_commit({ .window = window });
+  auto const started = std::chrono::steady_clock::now();
+  spawn_counted(group);
+  context.run_for(window / 5);
+  EXPECT_EQ(executed, 0);
+
+  spawn_counted(group);
+  context.run();
+  EXPECT_GE(std::chrono::steady_clock::now() - started, window);
+  EXPECT_EQ(committed_after, std::vector({ 2, 2 }));
+}
+
+TEST_F(GroupCommitTest, without_window_only_queued_commands_join) {
+  auto group = group_commit({});
+  spawn_counted(group);
+  spawn_counted(group);
+  context.run();
+  // The storage thread is idle, so the next command doesn't wait for others
+  spawn_counted(group);
+  context.restart();
+  context.run();
+  EXPECT_EQ(committed_after, std::vector({ 2, 2, 3 }));
+}
+
+TEST_F(GroupCommitTest, single_command_commits_on_its_own) {
+  auto group = group_commit({});
+  bool committed_right_away = false;
+  auto const result = spawn(group, [&]() {
+    executed++;
+    committed_after.push_back(0);
+    // There is no outer transaction, so it runs right away
+    storage->after_commit([&]() { committed_after[0] = executed; });
+    committed_right_away = committed_after[0] != 0;
+    return auction_service->deposit(user_id, "funds", 10);
+  });
+  context.run();
+
+  ASSERT_TRUE(*result && **result);
+  EXPECT_TRUE(***result);
+  EXPECT_TRUE(committed_right_away);
+  EXPECT_EQ(funds(), 10);
+}
+
+TEST_F(GroupCommitTest, exceptions_are_rethrown_in_the_awaiting_coroutine) {
+  auto group = group_commit({});
+  std::optional<std::string> thrown;
+  asio::co_spawn(
+      context,
+      [&]() -> asio::awaitable<void> {
+        try {
+          co_await group.run([]() -> int { throw std::runtime_error("command failed"); });
+        } catch (std::runtime_error const & e) {
+          thrown = e.what();
+        }
+      },
+      asio::detached);
+  auto const other = spawn(group, [&]() { return auction_service->deposit(user_id, "funds", 10); });
+  context.run();
+
+  EXPECT_EQ(thrown, "command failed");
+  // The other command of the batch is committed
+  ASSERT_TRUE(*other && **other);
+  EXPECT_TRUE(***other);
+  EXPECT_EQ(funds(), 10);
+}
@@ -0,0 +1,61 @@
+#include "latency_histogram.hpp"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+
+using namespace std::chrono_literals;
+
+TEST(LatencyHistogram, empty) {
+  LatencyHistogram histogram;
+  EXPECT_EQ(histogram.count(), 0);
+  EXPECT_EQ(histogram.min(), 0ns);
+  EXPECT_EQ(histogram.mean(), 0ns);
+  EXPECT_EQ(histogram.percentile(0.99), 0ns);
+}
+
+TEST(LatencyHistogram, small_values_are_exact) {
+  LatencyHistogram histogram;
+  for (int i = 1; i <= 100; ++i) {
+    histogram.record(std::chrono::nanoseconds(i));
+  }
+  EXPECT_EQ(histogram.count(), 100);
+  EXPECT_EQ(histogram.min(), 1ns);
+  EXPECT_EQ(histogram.max(), 100ns);
+  EXPECT_EQ(histogram.percentile(0.5), 50ns);
+  EXPECT_EQ(histogram.percentile(0.99), 99ns);
+  EXPECT_EQ(histogram.percentile(1.0), 100ns);
+}
+
+TEST(LatencyHistogram, percentiles_within_one_percent) {
+  LatencyHistogram histogram;
+  // 1us, 2us, ..., 10ms
+  for (int i = 1; i <= 10'000; ++i) {
+    histogram.record(std::chrono::microseconds(i));
+  }
+  auto const expect_near = [&](double quantile, std::chrono::microseconds expected) {
+    auto const actual = histogram.percentile(quantile);
+    EXPECT_GE(actual, expected) << quantile;
+    EXPECT_LE(actual.count(), expected.count() * 1000 * 101 / 100) << quantile;
+  };
+  expect_near(0.5, 5'000us);
+  expect_near(0.99, 9'900us);
+  expect_near(0.999, 9'990us);
+  EXPECT_EQ(histogram.percentile(1.0), 10ms);
+  EXPECT_EQ(histogram.mean(), 5'000'500ns);
+}
+
+TEST(LatencyHistogram, merge) {
+  LatencyHistogram fast;
+  LatencyHistogram slow;
+  for (int i = 0; i < 99; ++i) {
+    fast.record(100us);
+  }
+  slow.record(1s);
+  fast.merge(slow);
+  EXPECT_EQ(fast.count(), 100);
+  EXPECT_EQ(fast.min(), 100us);
+  EXPECT_EQ(fast.max(), 1s);
+  EXPECT_LE(fast.percentile(0.99), 101us);
+  EXPECT_EQ(fast.percentile(0.999), 1s);
+}
@@ -0,0 +1,81 @@
+#include "line_framer.hpp"
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <string_view>
+
+namespace {
+// Emulates a single read from the socket
+void receive(LineFramer & framer, std::string_view data) {
+  auto const area = framer.prepare(data.size());
+  ASSERT_GE(area.size(), data.size());
+  std::copy(data.begin(), data.end(), area.begin());
+  framer.commit(data.size());
+}
+}  // namespace
+
+TEST(LineFramer, single_line) {
+  LineFramer framer(100);
+  receive(framer, "ping\n");
+  EXPECT_EQ(framer.next_line(), "ping");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+}
+
+TEST(LineFramer, crlf) {
+  LineFramer framer(100);
+  receive(framer, "ping\r\nwhoami\r\n");
+  EXPECT_EQ(framer.next_line(), "ping");
+  EXPECT_EQ(framer.next_line(), "whoami");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+}
+
+TEST(LineFramer, pipelined) {
+  LineFramer framer(100);
+  receive(framer, "deposit funds 100\nsell Sword 1 10\nbuy 1\n\nview_items\n");
+  EXPECT_EQ(framer.next_line(), "deposit funds 100");
+  EXPECT_EQ(framer.next_line(), "sell Sword 1 10");
+  EXPECT_EQ(framer.next_line(), "buy 1");
+  // empty lines are still lines
+  EXPECT_EQ(framer.next_line(), "");
+  EXPECT_EQ(framer.next_line(), "view_items");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+}
+
+TEST(LineFramer, split_across_reads) {
+  LineFramer framer(100);
+  receive(framer, "deposit my amazing ");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+  receive(framer, "sword 5\r");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+  receive(framer, "\nping");
+  EXPECT_EQ(framer.next_line(), "deposit my amazing sword 5");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+  receive(framer, "\n");
+  EXPECT_EQ(framer.next_line(), "ping");
+}
+
+TEST(LineFramer, long_lines) {
+  LineFramer framer(1000);
+  std::string const long_name(900, 'x');
+  // many small reads, so the buffer grows and compacts a few times
+  for (int i = 0; i < 10; ++i) {
+    for (std::size_t pos = 0; pos < long_name.size(); pos += 64) {
+      receive(framer, std::string_view(long_name).substr(pos, 64));
+      EXPECT_FALSE(framer.overflowed());
+    }
+    receive(framer, "\n");
+    EXPECT_EQ(framer.next_line(), long_name);
+    EXPECT_EQ(framer.next_line(), std::nullopt);
+  }
+}
+
+TEST(LineFramer, overflow) {
+  LineFramer framer(10);
+  receive(framer, "0123456789");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+  EXPECT_FALSE(framer.overflowed());
+  receive(framer, "a");
+  EXPECT_EQ(framer.next_line(), std::nullopt);
+  EXPECT_TRUE(framer.overflowed());
+}
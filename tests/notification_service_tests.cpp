@@ -0,0 +1,108 @@
+#include "notification_service.hpp"
+#include "socket_pair.hpp"
+#include "write_queue.hpp"
+
+#include <asio/io_context.hpp>
+#include <asio/strand.hpp>
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+namespace {
+// A logged in user, whose connection reads what the service sends to them
+struct Client {
+  SocketPair sockets;
+  std::shared_ptr<WriteQueue> output;
+  Connection connection;
+
+  explicit Client(asio::io_context & context)
+      : sockets(context),
+        output(std::make_shared<WriteQueue>(std::move(sockets.server), 1024)),
+        connection{ .output = output, .executor = asio::make_strand(context) } {}
+};
+
+class NotificationServiceTest : public ::testing::Test {
+protected:
+  asio::io_context context;
+  NotificationService notifications;
+
+  std::string receive(Client & client, std::size_t size) { return client.sockets.receive(context, size); }
+  // Nothing arrives within a short time
+  bool nothing_arrives(Client & client) {
+    return client.sockets.receive(context, 1, std::chrono::milliseconds(100)).empty();
+  }
+};
+}  // namespace
+
+TEST_F(NotificationServiceTest, notifications_are_delivered_to_their_users) {
+  Client first(context);
+  Client second(context);
+  notifications.connect(1, first.connection);
+  notifications.connect(2, second.connection);
+
+  // Pushed before the delivery runs, so they are sent together in the order they were pushed
+  notifications.push(1, { .order_id = 10, .price = 100 });
+  notifications.push(2, { .order_id = 20, .price = 200 });
+  notifications.push(1, { .order_id = 11, .price = 110 });
+
+  std::string const first_expected =
+      "Your sell order #10 was executed for 100\n"
+      "Your sell order #11 was executed for 110\n";
+  EXPECT_EQ(receive(first, first_expected.size()), first_expected);
+  std::string const second_expected = "Your sell order #20 was executed for 200\n";
+  EXPECT_EQ(receive(second, second_expected.size()), second_expected);
+
+  // Another delivery is scheduled once the previous one is done
+  notifications.push(2, { .order_id = 21, .price = 210 });
+  std::string const next_expected = "Your sell order #21 was executed for 210\n";
+  EXPECT_EQ(receive(second, next_expected.size()), next_expected);
+}
+
+TEST_F(NotificationServiceTest, notifications_are_pushed_from_any_thread) {
+  Client client(context);
+  notifications.connect(1, client.connection);
+
+  // Like the storage thread does, while the delivery runs on the connection's strand
+  std::thread storage_thread([&]() {
+    for (int i = 0; i < 100; ++i) {
+      notifications.push(1, { .order_id = i, .price = 1 });
+    }
+  });
+  std::string expected;
+  for (int i = 0; i < 100; ++i) {
+    expected += fmt::format("Your sell order #{} was executed for 1\n", i);
+  }
+  std::string const received = receive(client, expected.size());
+  storage_thread.join();
+  EXPECT_EQ(received, expected);
+}
+
+TEST_F(NotificationServiceTest, notifications_are_dropped_after_disconnect) {
+  Client client(context);
+  // Not connected yet
+  notifications.push(1, { .order_id = 1, .price = 1 });
+
+  notifications.connect(1, client.connection);
+  notifications.disconnect(1, client.output);
+  notifications.push(1, { .order_id = 2, .price = 2 });
+  EXPECT_TRUE(nothing_arrives(client));
+}
+
+TEST_F(NotificationServiceTest, disconnect_keeps_newer_connection) {
+  Client old_client(context);
+  Client new_client(context);
+  notifications.connect(1, old_client.connection);
+  // The user has reconnected before the old connection was closed
+  notifications.connect(1, new_client.connection);
+  notifications.disconnect(1, old_client.output);
+
+  notifications.push(1, { .order_id = 1, .price = 1 });
+  std::string const expected = "Your sell order #1 was executed for 1\n";
+  EXPECT_EQ(receive(new_client, expected.size()), expected);
+  EXPECT_TRUE(nothing_arrives(old_client));
+}
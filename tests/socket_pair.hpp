@@ -0,0 +1,57 @@
+#pragma once
+
+#include <asio/buffer.hpp>
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/io_context.hpp>
+#include <asio/ip/tcp.hpp>
+#include <asio/read.hpp>
+#include <asio/use_awaitable.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <string>
+
+// Connected pair of loopback sockets: `server` is the side under test, `client` reads what it sends
+struct SocketPair {
+  asio::ip::tcp::socket client;
+  asio::ip::tcp::socket server;
+
+  explicit SocketPair(asio::io_context & context) : client(context), server(context) {
+    asio::ip::tcp::acceptor acceptor(context, { asio::ip::address_v4::loopback(), 0 });
+    client.connect(acceptor.local_endpoint());
+    acceptor.accept(server);
+  }
+
+  // Runs `context` until exactly `size` bytes are read on the client side. Returns them, or an empty string if they
+  // don't arrive while there are events within `timeout`
+  std::string receive(asio::io_context & context, std::size_t size,
+                      std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+    std::string data(size, '\0');
+    bool done = false;
+    asio::co_spawn(
+        context,
+        [&]() -> asio::awaitable<void> {
+          try {
+            co_await asio::async_read(client, asio::buffer(data), asio::use_awaitable);
+          } catch (std::exception &) {
+            data.clear();
+          }
+          done = true;
+        },
+        asio::detached);
+    // It's stopped once it runs out of work
+    context.restart();
+    while (!done && context.run_one_for(timeout) > 0) {
+    }
+    if (!done) {
+      data.clear();
+      // The read must not outlive `data`
+      client.cancel();
+      while (!done && context.run_one() > 0) {
+      }
+    }
+    return data;
+  }
+};
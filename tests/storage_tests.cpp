@@ -1,12 +1,21 @@
 #include "auction_service.hpp"
+#include "read_pool.hpp"
 #include "storage.hpp"
+#include "temp_database.hpp"
+#include "transaction_log_balances.hpp"
+#include "transaction_log_reader.hpp"
 #include "user_service.hpp"
 
+#include <asio/io_context.hpp>
 #include <fmt/format.h>
 #include <gmock/gmock-matchers.h>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <memory>
 #include <ostream>
 
@@ -152,6 +161,26 @@ TEST_F(StorageTest, items) {
   ASSERT_FALSE(auction_service->withdraw(100, "item1", 10));
 }
 
+TEST_F(StorageTest, items_run_out_in_transaction) {
+  auto user = *user_service->login("user1");
+  ASSERT_TRUE(auction_service->deposit(user.id, "item1", 10));
+  ASSERT_TRUE(auction_service->deposit(user.id, "item2", 10));
+  int const item1 = *storage->get_item_id("item1");
+  int const item2 = *storage->get_item_id("item2");
+
+  auto transaction = storage->begin_transaction();
+  ASSERT_TRUE(transaction);
+  ASSERT_TRUE(storage->sub_user_item(user.id, item1, 10));
+  ASSERT_TRUE(storage->sub_user_item(user.id, item2, 10));
+  ASSERT_FALSE(storage->sub_user_item(user.id, item2, 1));
+  // credited again before the commit, so the row has to survive it
+  ASSERT_TRUE(storage->add_user_item(user.id, item2, 3));
+  ASSERT_TRUE(transaction->commit());
+
+  EXPECT_THAT(*storage->view_user_items(user.id),
+              testing::ElementsAre(UserItemInfo{ "funds", 0 }, UserItemInfo{ "item2", 3 }));
+}
+
 bool operator==(SellOrderInfo const & lhs, SellOrderInfo const & rhs) {
   return lhs.id == rhs.id && lhs.seller_name == rhs.seller_name && lhs.item_name == rhs.item_name &&
          lhs.quantity == rhs.quantity && lhs.price == rhs.price && lhs.expiration_time == rhs.expiration_time &&
@@ -178,7 +207,7 @@ TEST_P(GeneralSellOrderTest, negative) {
   EXPECT_THAT(
       *storage->view_user_items(user.id),
       testing::ElementsAre(UserItemInfo{ "funds", 100 }, UserItemInfo{ "item1", 10 }, UserItemInfo{ "item2", 20 }));
-  EXPECT_THAT(*storage->view_sell_orders(), testing::IsEmpty());
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::IsEmpty());
 
   // try to sell more than we have
   ASSERT_FALSE(auction_service->place_sell_order(order_type, user.id, "item1", 110, 10, expiration_time));
@@ -199,7 +228,7 @@ TEST_P(GeneralSellOrderTest, negative) {
   ASSERT_FALSE(auction_service->place_sell_order(order_type, user.id, "funds", 10, 10, expiration_time));
 
   // Finally, nothing should be changed
-  EXPECT_THAT(*storage->view_sell_orders(), testing::IsEmpty());
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::IsEmpty());
 }
 
 TEST_P(GeneralSellOrderTest, auction_house_fee) {
@@ -218,7 +247,7 @@ TEST_P(GeneralSellOrderTest, auction_house_fee) {
   ASSERT_THAT(
       *storage->view_user_items(user.id),
       testing::ElementsAre(UserItemInfo{ "funds", 0 }, UserItemInfo{ "item1", 10 }, UserItemInfo{ "item2", 20 }));
-  EXPECT_THAT(*storage->view_sell_orders(), testing::IsEmpty());
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::IsEmpty());
 
   // Now with enough funds
   ASSERT_TRUE(auction_service->deposit(user.id, "funds", 100));
@@ -266,7 +295,7 @@ TEST_P(GeneralSellOrderTest, positive) {
   EXPECT_THAT(*storage->view_user_items(user.id),
               testing::ElementsAre(UserItemInfo{ "funds", 79 }, UserItemInfo{ "item1", 1 }));
 
-  EXPECT_THAT(*storage->view_sell_orders(), testing::ElementsAre(
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::ElementsAre(
                                                 SellOrderInfo{
                                                     .id = 1,
                                                     .seller_name = "user",
@@ -370,7 +399,7 @@ TEST_P(GeneralSellOrderTest, positive) {
   // cancel expired orders
   auto cancel_result = storage->process_expired_sell_orders(expiration_time);
   ASSERT_TRUE(cancel_result) << cancel_result.error();
-  EXPECT_THAT(*storage->view_sell_orders(), testing::ElementsAre(SellOrderInfo{
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::ElementsAre(SellOrderInfo{
                                                 .id = 11,
                                                 .seller_name = "user",
                                                 .item_name = "item2",
@@ -389,7 +418,34 @@ TEST_P(GeneralSellOrderTest, positive) {
   EXPECT_THAT(
       *storage->view_user_items(user.id),
       testing::ElementsAre(UserItemInfo{ "funds", 79 }, UserItemInfo{ "item1", 10 }, UserItemInfo{ "item2", 20 }));
-  EXPECT_THAT(*storage->view_sell_orders(), testing::IsEmpty());
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::IsEmpty());
+}
+
+TEST_F(StorageTest, expired_sell_orders_in_chunks) {
+  auto user = *user_service->login("user");
+  ASSERT_TRUE(auction_service->deposit(user.id, "funds", 100));
+  ASSERT_TRUE(auction_service->deposit(user.id, "item1", 5));
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(
+        auction_service->place_sell_order(SellOrderType::Immediate, user.id, "item1", 1, 10, expiration_time + i));
+  }
+  EXPECT_EQ(storage->expired_sell_orders_count(expiration_time + 3), 4);
+
+  // the earliest orders are settled first
+  auto chunk = storage->process_expired_sell_orders(expiration_time + 3, 3);
+  ASSERT_TRUE(chunk) << chunk.error();
+  EXPECT_EQ(chunk->settled, 3);
+  EXPECT_EQ(storage->expired_sell_orders_count(expiration_time + 3), 1);
+  EXPECT_EQ(storage->next_expiration_time(), expiration_time + 3);
+
+  // at least one order is settled even if the budget is already spent
+  chunk = storage->process_expired_sell_orders(expiration_time + 3, 3, std::chrono::microseconds(0));
+  ASSERT_TRUE(chunk) << chunk.error();
+  EXPECT_EQ(chunk->settled, 1);
+  EXPECT_EQ(storage->expired_sell_orders_count(expiration_time + 3), 0);
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::SizeIs(1));
+  EXPECT_THAT(*storage->view_user_items(user.id),
+              testing::ElementsAre(UserItemInfo{ "funds", 95 }, UserItemInfo{ "item1", 4 }));
 }
 
 INSTANTIATE_TEST_SUITE_P(GeneralSellOrderTest, GeneralSellOrderTest,
@@ -401,7 +457,7 @@ TEST_F(StorageTest, execute_immediate_sell_order_error) {
   ASSERT_TRUE(auction_service->deposit(seller.id, "item1", 10));
   ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Immediate, seller.id, "item1", 7, 10, expiration_time));
   ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Auction, seller.id, "item1", 3, 11, expiration_time));
-  EXPECT_THAT(*storage->view_sell_orders(), testing::ElementsAre(
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::ElementsAre(
                                                 SellOrderInfo{
                                                     .id = 1,
                                                     .seller_name = "seller",
@@ -454,7 +510,7 @@ TEST_F(StorageTest, place_bid_on_auction_sell_order) {
   ASSERT_TRUE(auction_service->deposit(seller.id, "item1", 10));
   ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Immediate, seller.id, "item1", 7, 10, expiration_time));
   ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Auction, seller.id, "item1", 3, 11, expiration_time));
-  EXPECT_THAT(*storage->view_sell_orders(), testing::ElementsAre(
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::ElementsAre(
                                                 SellOrderInfo{
                                                     .id = 1,
                                                     .seller_name = "seller",
@@ -502,7 +558,7 @@ TEST_F(StorageTest, place_bid_on_auction_sell_order) {
   EXPECT_THAT(*storage->view_user_items(buyer.id), testing::ElementsAre(UserItemInfo{ "funds", 80 }));
 
   // check that bid is placed
-  EXPECT_THAT(*storage->view_sell_orders(), testing::ElementsAre(
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::ElementsAre(
                                                 SellOrderInfo{
                                                     .id = 1,
                                                     .seller_name = "seller",
@@ -589,3 +645,536 @@ TEST_F(StorageTest, execute_immediate_sell_order_ok) {
               testing::ElementsAre(UserItemInfo{ "funds", 16 }, UserItemInfo{ "item1", 1 }));
   EXPECT_THAT(*storage->view_user_items(seller.id), testing::ElementsAre(UserItemInfo{ "funds", 97 }));
 }
+
+TEST_F(StorageTest, statement_cache) {
+  auto user = *user_service->login("user");
+  ASSERT_TRUE(auction_service->deposit(user.id, "funds", 1));
+
+  // all statements used by `deposit` are already compiled, so further calls should only hit the cache
+  auto const before = storage->statement_cache_stats();
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(auction_service->deposit(user.id, "funds", 1));
+  }
+  auto const after = storage->statement_cache_stats();
+  EXPECT_EQ(after.misses, before.misses);
+  EXPECT_GE(after.hits - before.hits, 10u);
+
+  // reused statements are properly reset and rebound
+  EXPECT_THAT(*storage->view_user_items(user.id), testing::ElementsAre(UserItemInfo{ "funds", 11 }));
+  ASSERT_TRUE(auction_service->withdraw(user.id, "funds", 11));
+  EXPECT_THAT(*storage->view_user_items(user.id), testing::ElementsAre(UserItemInfo{ "funds", 0 }));
+}
+
+TEST_F(StorageTest, sql_profiling) {
+  auto const slow_log_path = std::filesystem::temp_directory_path() / "auction_house_storage_slow_sql_test.log";
+  std::filesystem::remove(slow_log_path);
+
+  auto user = *user_service->login("user");
+  // every statement is slow with zero threshold
+  ASSERT_TRUE(storage->enable_sql_profiling({ .slow_threshold = std::chrono::microseconds(0),
+                                              .slow_log_path = slow_log_path.string() }));
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(auction_service->deposit(user.id, "funds", 1));
+  }
+  ASSERT_TRUE(storage->view_user_items(user.id));
+
+  auto const profiles = storage->sql_profiles();
+  ASSERT_FALSE(profiles.empty());
+  for (std::size_t i = 1; i < profiles.size(); ++i) {
+    EXPECT_GE(profiles[i - 1].total_time, profiles[i].total_time);
+  }
+  auto const commit = std::find_if(profiles.begin(), profiles.end(), [](auto const & p) { return p.sql == "COMMIT"; });
+  ASSERT_NE(commit, profiles.end());
+  EXPECT_EQ(commit->calls, 3u);
+
+  // multiline SQL is collapsed into a single line
+  auto const view = std::find_if(profiles.begin(), profiles.end(), [](auto const & p) {
+    return p.sql.starts_with("SELECT items.name, user_items.quantity");
+  });
+  ASSERT_NE(view, profiles.end());
+  EXPECT_EQ(view->calls, 1u);
+  EXPECT_EQ(view->rows, 1u);
+  EXPECT_THAT(view->query_plan, testing::HasSubstr("user_items"));
+
+  std::ifstream slow_log(slow_log_path);
+  std::string const content((std::istreambuf_iterator<char>(slow_log)), std::istreambuf_iterator<char>());
+  EXPECT_THAT(content, testing::HasSubstr("query plan of SELECT items.name, user_items.quantity"));
+  // statements are logged with their parameters
+  EXPECT_THAT(content, testing::HasSubstr("slow statement took"));
+  EXPECT_THAT(content, testing::HasSubstr(fmt::format("WHERE user_items.user_id = {}", user.id)));
+  slow_log.close();
+  std::filesystem::remove(slow_log_path);
+}
+
+TEST_F(StorageTest, view_sell_orders_pages) {
+  auto seller1 = *user_service->login("seller1");
+  auto seller2 = *user_service->login("seller2");
+  auto buyer = *user_service->login("buyer");
+  ASSERT_TRUE(auction_service->deposit(seller1.id, "funds", 100));
+  ASSERT_TRUE(auction_service->deposit(seller1.id, "item1", 10));
+  ASSERT_TRUE(auction_service->deposit(seller1.id, "item2", 10));
+  ASSERT_TRUE(auction_service->deposit(seller2.id, "funds", 100));
+  ASSERT_TRUE(auction_service->deposit(seller2.id, "item1", 10));
+  ASSERT_TRUE(auction_service->deposit(buyer.id, "funds", 100));
+
+  auto const immediate = SellOrderType::Immediate;
+  ASSERT_TRUE(auction_service->place_sell_order(immediate, seller1.id, "item1", 1, 30, expiration_time));
+  ASSERT_TRUE(auction_service->place_sell_order(immediate, seller1.id, "item1", 1, 10, expiration_time));
+  ASSERT_TRUE(auction_service->place_sell_order(immediate, seller1.id, "item1", 1, 20, expiration_time));
+  ASSERT_TRUE(auction_service->place_sell_order(immediate, seller1.id, "item2", 1, 15, expiration_time));
+  ASSERT_TRUE(
+      auction_service->place_sell_order(SellOrderType::Auction, seller2.id, "item1", 1, 10, expiration_time + 1));
+  ASSERT_TRUE(auction_service->place_sell_order(immediate, seller2.id, "item1", 1, 25, expiration_time));
+  // the bid changes the price of #5, so it moves in the price order
+  ASSERT_TRUE(auction_service->place_bid_on_auction_sell_order(buyer.id, 5, 40));
+
+  // ids of all orders, collected page by page
+  auto const ids = [&](SellOrdersQuery query) {
+    query.limit = 2;
+    std::vector<int> ids;
+    while (true) {
+      auto page = storage->view_sell_orders(query);
+      EXPECT_TRUE(page) << page.error();
+      EXPECT_LE(page->orders.size(), 2u);
+      for (auto const & order : page->orders) {
+        ids.push_back(order.id);
+      }
+      if (!page->next) {
+        return ids;
+      }
+      EXPECT_EQ(page->orders.size(), 2u);
+      query.after = page->next;
+    }
+  };
+  auto const by_price = SellOrdersSortKey::Price;
+
+  EXPECT_THAT(ids({}), testing::ElementsAre(1, 2, 3, 4, 5, 6));
+  EXPECT_THAT(ids({ .sort_by = by_price }), testing::ElementsAre(2, 4, 3, 6, 1, 5));
+  EXPECT_THAT(ids({ .sort_by = SellOrdersSortKey::ExpirationTime }), testing::ElementsAre(1, 2, 3, 4, 6, 5));
+  EXPECT_THAT(ids({ .item_name = "item1", .sort_by = by_price }), testing::ElementsAre(2, 3, 6, 1, 5));
+  EXPECT_THAT(ids({ .item_name = "item1", .min_price = 15, .max_price = 30, .sort_by = by_price }),
+              testing::ElementsAre(3, 6, 1));
+  EXPECT_THAT(ids({ .min_price = 15, .max_price = 25, .sort_by = by_price }), testing::ElementsAre(4, 3, 6));
+  EXPECT_THAT(ids({ .item_name = "item1", .seller_name = "seller1" }), testing::ElementsAre(1, 2, 3));
+  // no index for these, so orders of the seller are sorted
+  EXPECT_THAT(ids({ .seller_name = "seller2", .sort_by = by_price }), testing::ElementsAre(6, 5));
+  EXPECT_THAT(ids({ .seller_name = "seller1", .max_price = 20, .sort_by = by_price }), testing::ElementsAre(2, 4, 3));
+  EXPECT_THAT(ids({ .type = SellOrderType::Auction }), testing::ElementsAre(5));
+  EXPECT_THAT(ids({ .item_name = "unknown" }), testing::IsEmpty());
+  EXPECT_THAT(ids({ .seller_name = "buyer" }), testing::IsEmpty());
+
+  // the cursor stays valid after the order it points to is gone
+  auto const first_page = storage->view_sell_orders({ .sort_by = by_price, .limit = 2 });
+  ASSERT_TRUE(first_page);
+  ASSERT_TRUE(auction_service->execute_immediate_sell_order(buyer.id, 4));
+  auto const second_page = storage->view_sell_orders({ .sort_by = by_price, .after = first_page->next, .limit = 2 });
+  ASSERT_TRUE(second_page);
+  ASSERT_THAT(second_page->orders, testing::SizeIs(2));
+  EXPECT_EQ(second_page->orders[0].id, 3);
+  EXPECT_EQ(second_page->orders[1].id, 6);
+}
+
+TEST_F(StorageTest, names_are_cached_until_rollback) {
+  auto user = *user_service->login("user");
+  EXPECT_EQ(storage->get_user_id("user"), user.id);
+  EXPECT_FALSE(storage->get_user_id("nobody"));
+  EXPECT_EQ(*storage->get_item_id("funds"), storage->funds_item_id());
+
+  int rolled_back_id = 0;
+  {
+    auto transaction = storage->begin_transaction();
+    ASSERT_TRUE(transaction);
+    auto const item_id = storage->create_item("ghost");
+    ASSERT_TRUE(item_id);
+    EXPECT_EQ(*storage->get_item_id("ghost"), *item_id);
+    rolled_back_id = *item_id;
+    // not committed
+  }
+  EXPECT_FALSE(storage->get_item_id("ghost"));
+
+  // SQLite reuses the id of the rolled back row
+  ASSERT_TRUE(auction_service->deposit(user.id, "ghost", 1));
+  EXPECT_EQ(*storage->get_item_id("ghost"), rolled_back_id);
+  ASSERT_TRUE(auction_service->deposit(user.id, "funds", 100));
+  ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Immediate, user.id, "ghost", 1, 10, expiration_time));
+  auto const orders = storage->view_sell_orders()->orders;
+  ASSERT_THAT(orders, testing::SizeIs(1));
+  EXPECT_EQ(orders[0].item_name, "ghost");
+  EXPECT_EQ(orders[0].seller_name, "user");
+}
+
+TEST_F(StorageTest, nested_transactions) {
+  auto user = *user_service->login("user");
+  ASSERT_TRUE(auction_service->deposit(user.id, "funds", 100));
+  ASSERT_TRUE(auction_service->deposit(user.id, "item1", 2));
+  uint64_t const last_log_seq = storage->last_log_seq();
+
+  std::vector<int> committed;
+  auto batch = storage->begin_transaction();
+  ASSERT_TRUE(batch);
+  // each operation commits its own nested transaction
+  ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Immediate, user.id, "item1", 1, 10, expiration_time));
+  storage->after_commit([&]() { committed.push_back(1); });
+  ASSERT_FALSE(auction_service->withdraw(user.id, "funds", 1000));
+  {
+    auto nested = storage->begin_transaction();
+    ASSERT_TRUE(nested);
+    ASSERT_TRUE(storage->create_item("ghost"));
+    ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Auction, user.id, "item1", 1, 10, expiration_time));
+    storage->after_commit([&]() { committed.push_back(2); });
+    // not committed
+  }
+  EXPECT_FALSE(storage->get_item_id("ghost"));
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::SizeIs(1));
+  EXPECT_EQ(storage->last_log_seq(), last_log_seq + 2);
+  EXPECT_THAT(committed, testing::IsEmpty());
+
+  ASSERT_TRUE(batch->commit());
+  EXPECT_THAT(committed, testing::ElementsAre(1));
+  EXPECT_THAT(*storage->view_user_items(user.id),
+              testing::ElementsAre(UserItemInfo{ "funds", 99 }, UserItemInfo{ "item1", 1 }));
+  auto const orders = storage->view_sell_orders()->orders;
+  ASSERT_THAT(orders, testing::SizeIs(1));
+  EXPECT_EQ(orders[0].type, SellOrderType::Immediate);
+}
+
+TEST_F(StorageTest, sell_order_rollback) {
+  auto seller = *user_service->login("seller");
+  ASSERT_TRUE(auction_service->deposit(seller.id, "item1", 10));
+  int const item_id = *storage->get_item_id("item1");
+
+  {
+    auto transaction_guard = storage->begin_transaction();
+    ASSERT_TRUE(transaction_guard);
+    auto order_id = storage->create_sell_order(Storage::SellOrder{
+        .seller_id = seller.id,
+        .item_id = item_id,
+        .quantity = 1,
+        .price = 10,
+        .unix_expiration_time = expiration_time,
+        .buyer_id = seller.id,
+    });
+    ASSERT_TRUE(order_id) << order_id.error();
+    // visible within the transaction
+    EXPECT_THAT(storage->view_sell_orders()->orders, testing::SizeIs(1));
+    EXPECT_TRUE(storage->get_sell_order_info(*order_id));
+    // but the transaction is not committed
+  }
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::IsEmpty());
+  EXPECT_FALSE(storage->get_sell_order_info(1));
+
+  // the id of rolled back order is free again
+  ASSERT_TRUE(auction_service->deposit(seller.id, "funds", 100));
+  ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Immediate, seller.id, "item1", 1, 10, expiration_time));
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::ElementsAre(SellOrderInfo{
+                                                .id = 1,
+                                                .seller_name = "seller",
+                                                .item_name = "item1",
+                                                .quantity = 1,
+                                                .price = 10,
+                                                .expiration_time = "2021-01-01 00:00:00",
+                                                .type = SellOrderType::Immediate,
+                                            }));
+}
+
+TEST_F(StorageTest, prepared_changes_are_applied_once_finished) {
+  auto seller = *user_service->login("seller");
+  auto buyer = *user_service->login("buyer");
+  ASSERT_TRUE(auction_service->deposit(seller.id, "funds", 10));
+  ASSERT_TRUE(auction_service->deposit(seller.id, "item1", 5));
+  ASSERT_TRUE(auction_service->place_sell_order(SellOrderType::Immediate, seller.id, "item1", 2, 30, expiration_time));
+
+  using Change = Storage::PreparedChange;
+  EXPECT_FALSE(storage->prepare(1, Change{ .kind = Change::Kind::Credit, .user_id = buyer.id, .item_name = "gem",
+                                           .quantity = 1, .order_id = 1 },
+                                true));
+  // The seller's part of a sale to a user from another shard: the order is out of the book until it's finished
+  auto const prepare_sale = [&](int64_t transaction_id) {
+    auto transaction = storage->begin_transaction();
+    ASSERT_TRUE(transaction);
+    auto order = storage->take_sell_order(1);
+    ASSERT_TRUE(order) << order.error();
+    ASSERT_TRUE(storage->prepare(transaction_id,
+                                 Change{ .kind = Change::Kind::RestoreOrder,
+                                         .user_id = order->seller_id,
+                                         .item_name = order->item_name,
+                                         .quantity = order->quantity,
+                                         .order_id = order->id,
+                                         .price = order->price,
+                                         .unix_expiration_time = order->unix_expiration_time,
+                                         .buyer_id = order->buyer_id },
+                                 false));
+    ASSERT_TRUE(storage->prepare(transaction_id,
+                                 Change{ .kind = Change::Kind::Credit, .user_id = seller.id, .item_name = "funds",
+                                         .quantity = order->price, .order_id = order->id },
+                                 true));
+    // An item this database hasn't seen yet
+    ASSERT_TRUE(storage->prepare(transaction_id,
+                                 Change{ .kind = Change::Kind::Credit, .user_id = buyer.id, .item_name = "gem",
+                                         .quantity = 1, .order_id = order->id },
+                                 true));
+    ASSERT_TRUE(transaction->commit());
+    EXPECT_THAT(storage->view_sell_orders()->orders, testing::IsEmpty());
+    EXPECT_THAT(*storage->prepared_transactions(), testing::ElementsAre(transaction_id));
+  };
+
+  prepare_sale(1);
+  ASSERT_TRUE(storage->finish_prepared(1, false));
+  EXPECT_THAT(*storage->prepared_transactions(), testing::IsEmpty());
+  ASSERT_THAT(storage->view_sell_orders()->orders, testing::SizeIs(1));
+  EXPECT_EQ(storage->view_sell_orders()->orders.front().id, 1);
+  EXPECT_THAT(*storage->view_user_items(seller.id),
+              testing::ElementsAre(UserItemInfo{ "funds", 8 }, UserItemInfo{ "item1", 3 }));
+
+  prepare_sale(2);
+  ASSERT_TRUE(storage->finish_prepared(2, true));
+  // Finishing again does nothing, as after a crash between the decision and forgetting it
+  ASSERT_TRUE(storage->finish_prepared(2, true));
+  EXPECT_THAT(*storage->prepared_transactions(), testing::IsEmpty());
+  EXPECT_THAT(storage->view_sell_orders()->orders, testing::IsEmpty());
+  EXPECT_THAT(*storage->view_user_items(seller.id),
+              testing::ElementsAre(UserItemInfo{ "funds", 38 }, UserItemInfo{ "item1", 3 }));
+  EXPECT_THAT(*storage->view_user_items(buyer.id),
+              testing::ElementsAre(UserItemInfo{ "funds", 0 }, UserItemInfo{ "gem", 1 }));
+}
+
+TEST(StorageShardTest, orders_won_in_other_shards_count_towards_the_chunk_budget) {
+  auto storage = std::make_shared<Storage>(*Storage::open(":memory:", true, ShardId{ .index = 0, .count = 2 }));
+  auto auction_service = AuctionService(storage);
+  auto seller = *UserService(storage).login("seller");
+  ASSERT_TRUE(storage->add_foreign_user(User{ .id = 2, .username = "foreign" }));
+  ASSERT_TRUE(auction_service.deposit(seller.id, "funds", 100));
+  ASSERT_TRUE(auction_service.deposit(seller.id, "item1", 3));
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Auction, seller.id, "item1", 1, 10, expiration_time));
+  }
+  // Bids of users from other shards are placed by the coordinator
+  auto const orders = storage->view_sell_orders()->orders;
+  for (auto const & order : orders) {
+    ASSERT_TRUE(storage->update_sell_order_buyer(order.id, 2, 20));
+  }
+
+  // None of them is settled in this shard, but they are taken out of the book within the budget all the same
+  auto const chunk = storage->process_expired_sell_orders(expiration_time, 3, std::chrono::microseconds(0), 1);
+  ASSERT_TRUE(chunk) << chunk.error();
+  EXPECT_EQ(chunk->settled, 1);
+  EXPECT_THAT(chunk->executed, testing::SizeIs(1));
+  EXPECT_EQ(storage->expired_sell_orders_count(expiration_time), 2);
+}
+
+TEST(StorageReopenTest, sell_orders_are_restored) {
+  TempDatabase const database("auction_house_storage_reopen_test.sqlite");
+
+  std::vector<SellOrderInfo> orders;
+  {
+    auto storage = std::make_shared<Storage>(*Storage::open(database.path));
+    auto user_service = UserService(storage);
+    auto auction_service = AuctionService(storage);
+
+    auto seller = *user_service.login("seller");
+    auto buyer = *user_service.login("buyer");
+    ASSERT_TRUE(auction_service.deposit(seller.id, "funds", 100));
+    ASSERT_TRUE(auction_service.deposit(seller.id, "item1", 10));
+    ASSERT_TRUE(auction_service.deposit(buyer.id, "funds", 100));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Immediate, seller.id, "item1", 1, 10, expiration_time));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Immediate, seller.id, "item1", 2, 10, expiration_time));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Auction, seller.id, "item1", 3, 10, expiration_time));
+    ASSERT_TRUE(auction_service.execute_immediate_sell_order(buyer.id, 2));
+    ASSERT_TRUE(auction_service.place_bid_on_auction_sell_order(buyer.id, 3, 20));
+    orders = storage->view_sell_orders()->orders;
+    ASSERT_THAT(orders, testing::SizeIs(2));
+  }
+
+  auto storage = std::make_shared<Storage>(*Storage::open(database.path));
+  EXPECT_EQ(storage->view_sell_orders()->orders, orders);
+  auto const auction_order = storage->get_sell_order_info(3);
+  ASSERT_TRUE(auction_order);
+  EXPECT_EQ(auction_order->type(), SellOrderType::Auction);
+  EXPECT_EQ(auction_order->buyer_id, 2);
+  EXPECT_EQ(auction_order->price, 20);
+
+  // ids of deleted orders are not reused after restart
+  auto seller = *UserService(storage).login("seller");
+  ASSERT_TRUE(
+      AuctionService(storage).place_sell_order(SellOrderType::Immediate, seller.id, "item1", 1, 10, expiration_time));
+  EXPECT_EQ(storage->view_sell_orders()->orders.back().id, 4);
+}
+
+TEST(StorageShardTest, ids_are_allocated_by_the_shard) {
+  TempDatabase const database("auction_house_storage_shard_test.sqlite");
+  ShardId const shard{ .index = 1, .count = 3 };
+  {
+    auto storage = std::make_shared<Storage>(*Storage::open(database.path, true, shard));
+    auto user_service = UserService(storage);
+    auto auction_service = AuctionService(storage);
+
+    auto first = *user_service.login("first");
+    auto second = *user_service.login("second");
+    EXPECT_EQ(first.id, 2);
+    EXPECT_EQ(second.id, 5);
+    EXPECT_TRUE(storage->owns_user(second.id));
+    EXPECT_FALSE(storage->owns_user(3));
+
+    ASSERT_TRUE(auction_service.deposit(first.id, "funds", 10));
+    ASSERT_TRUE(auction_service.deposit(first.id, "item1", 2));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Immediate, first.id, "item1", 1, 1, expiration_time));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Auction, first.id, "item1", 1, 1, expiration_time));
+    auto const orders = storage->view_sell_orders()->orders;
+    ASSERT_THAT(orders, testing::SizeIs(2));
+    EXPECT_EQ(orders[0].id, 2);
+    EXPECT_EQ(orders[1].id, 5);
+  }
+
+  // The database can't be opened as another shard, as its ids wouldn't belong to it
+  EXPECT_FALSE(Storage::open(database.path, true, ShardId{ .index = 0, .count = 3 }));
+  EXPECT_FALSE(Storage::open(database.path, true, ShardId{}));
+  auto storage = Storage::open(database.path);
+  ASSERT_TRUE(storage) << storage.error();
+  EXPECT_EQ(storage->shard(), shard);
+  // Bidders from other shards are remembered with their own ids, that don't affect ids of this shard
+  EXPECT_FALSE(storage->add_foreign_user(User{ .id = 8, .username = "third" }));
+  ASSERT_TRUE(storage->add_foreign_user(User{ .id = 9, .username = "foreign" }));
+  EXPECT_EQ(UserService(std::make_shared<Storage>(std::move(*storage))).login("third")->id, 8);
+}
+
+TEST(StorageReadPoolTest, sees_only_committed_changes) {
+  TempDatabase const database("auction_house_storage_read_pool_test.sqlite");
+  auto storage = std::make_shared<Storage>(*Storage::open(database.path));
+  auto user = *UserService(storage).login("user");
+  ASSERT_TRUE(AuctionService(storage).deposit(user.id, "funds", 10));
+
+  // The executor is not used by `with_connection`
+  asio::io_context context;
+  auto pool = ReadPool::open(database.path, 2, context.get_executor());
+  ASSERT_TRUE(pool) << pool.error();
+  auto const view_user_items = [&]() {
+    std::vector<UserItemInfo> items;
+    auto result = (*pool)->with_connection([&](Sqlite3 & db) {
+      return Storage::view_user_items(db, user.id, [&](std::string_view item_name, int quantity) {
+        items.push_back(UserItemInfo{ .item_name = std::string(item_name), .quantity = quantity });
+      });
+    });
+    EXPECT_TRUE(result) << result.error();
+    return items;
+  };
+  EXPECT_THAT(view_user_items(), testing::ElementsAre(UserItemInfo{ "funds", 10 }));
+
+  {
+    auto transaction = storage->begin_transaction();
+    ASSERT_TRUE(transaction);
+    ASSERT_TRUE(storage->add_user_item(user.id, storage->funds_item_id(), 5));
+    // the pool doesn't see the transaction until it commits
+    EXPECT_THAT(view_user_items(), testing::ElementsAre(UserItemInfo{ "funds", 10 }));
+    ASSERT_TRUE(transaction->commit());
+  }
+  EXPECT_THAT(view_user_items(), testing::ElementsAre(UserItemInfo{ "funds", 15 }));
+
+  EXPECT_FALSE((*pool)->with_connection([](Sqlite3 & db) { return db.execute("DELETE FROM user_items"); }));
+  EXPECT_FALSE(ReadPool::open(":memory:", 1, context.get_executor()));
+}
+
+TEST_F(StorageTest, log_outbox_is_trimmed_without_log) {
+  auto user = *user_service->login("user");
+  for (int i = 0; i < 5000; ++i) {
+    ASSERT_TRUE(auction_service->deposit(user.id, "funds", 1));
+  }
+  EXPECT_EQ(storage->last_log_seq(), 5000);
+  // Trimmed once per 4096 records, so only the ones since then and the last one before are kept
+  auto const records = storage->log_records_after(0);
+  ASSERT_TRUE(records) << records.error();
+  ASSERT_EQ(records->size(), 5000 - 4096 + 1);
+  EXPECT_EQ(records->front().seq, 4096);
+}
+
+TEST(StorageLogTest, log_that_drops_records_is_refused) {
+  TempDatabase const database("auction_house_storage_log_drop_test.sqlite");
+  auto const log_path = std::filesystem::temp_directory_path() / "auction_house_storage_log_drop_test.log";
+  std::filesystem::remove(log_path);
+
+  {
+    auto storage = std::make_shared<Storage>(*Storage::open(database.path));
+    // A queue of a single record overflows right away, so records would be skipped in the log and in the outbox
+    auto log = TransactionLog::open(log_path.string(), { .overflow = LogOverflowPolicy::Drop, .queue_capacity = 1 });
+    ASSERT_TRUE(log) << log.error();
+    EXPECT_FALSE(storage->attach_transaction_log(std::move(*log)));
+
+    auto user = *UserService(storage).login("user");
+    auto auction_service = AuctionService(storage);
+    for (int i = 0; i < 10; ++i) {
+      ASSERT_TRUE(auction_service.deposit(user.id, "funds", 10));
+    }
+  }
+
+  // After a restart with a log that keeps every record nothing is missing
+  auto storage = std::make_shared<Storage>(*Storage::open(database.path));
+  {
+    auto log = TransactionLog::open(log_path.string());
+    ASSERT_TRUE(log) << log.error();
+    EXPECT_EQ(storage->attach_transaction_log(std::move(*log)), 10);
+  }
+  storage.reset();
+  auto log = TransactionLog::open(log_path.string());
+  ASSERT_TRUE(log) << log.error();
+  EXPECT_EQ(log->last_seq(), 10);
+}
+
+TEST(StorageLogTest, lost_records_are_recovered_and_log_folds_into_user_items) {
+  TempDatabase const database("auction_house_storage_log_test.sqlite");
+  auto const log_path = std::filesystem::temp_directory_path() / "auction_house_storage_log_test.log";
+  std::filesystem::remove(log_path);
+  TransactionLogOptions const options{ .format = LogFormat::Binary };
+
+  {
+    auto storage = std::make_shared<Storage>(*Storage::open(database.path));
+    ASSERT_EQ(storage->attach_transaction_log(*TransactionLog::open(log_path.string(), options)), 0);
+    auto user_service = UserService(storage);
+    auto auction_service = AuctionService(storage);
+
+    auto seller = *user_service.login("seller");
+    auto buyer = *user_service.login("buyer");
+    auto bidder = *user_service.login("bidder");
+    ASSERT_TRUE(auction_service.deposit(seller.id, "funds", 100));
+    ASSERT_TRUE(auction_service.deposit(seller.id, "item1", 10));
+    ASSERT_TRUE(auction_service.deposit(buyer.id, "funds", 100));
+    ASSERT_TRUE(auction_service.deposit(bidder.id, "funds", 100));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Immediate, seller.id, "item1", 1, 10, expiration_time));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Immediate, seller.id, "item1", 2, 10, expiration_time));
+    ASSERT_TRUE(auction_service.place_sell_order(SellOrderType::Auction, seller.id, "item1", 3, 10, expiration_time));
+    ASSERT_TRUE(auction_service.execute_immediate_sell_order(buyer.id, 2));
+    ASSERT_TRUE(auction_service.place_bid_on_auction_sell_order(buyer.id, 3, 20));
+    ASSERT_TRUE(auction_service.place_bid_on_auction_sell_order(bidder.id, 3, 30));
+    // failed operations are not logged
+    ASSERT_FALSE(auction_service.withdraw(buyer.id, "funds", 1000));
+    ASSERT_TRUE(storage->process_expired_sell_orders(expiration_time));
+    ASSERT_TRUE(auction_service.withdraw(bidder.id, "item1", 1));
+    EXPECT_EQ(storage->last_log_seq(), 17);
+  }
+
+  // The server crashed right after commits, so the last records didn't make it to the log
+  std::filesystem::resize_file(log_path, kBinaryLogHeader.size() + 5 * kBinaryLogRecordSize);
+  auto storage = std::make_shared<Storage>(*Storage::open(database.path));
+  {
+    auto log = TransactionLog::open(log_path.string(), options);
+    ASSERT_TRUE(log) << log.error();
+    EXPECT_EQ(log->last_seq(), 5);
+    EXPECT_EQ(storage->attach_transaction_log(std::move(*log)), 12);
+  }
+  // The log is written, so the storage can be closed
+  storage.reset();
+  storage = std::make_shared<Storage>(*Storage::open(database.path));
+
+  auto reader = TransactionLogReader::open(log_path.string());
+  ASSERT_TRUE(reader) << reader.error();
+  LogBalances balances(storage->funds_item_id());
+  ASSERT_TRUE(reader->read({}, [&](LogRecord const & record) { balances.apply(record); }));
+  EXPECT_EQ(balances.last_applied_seq(), 17);
+  EXPECT_EQ(balances.missing_records(), 0);
+
+  auto const user_items = *storage->all_user_items();
+  for (auto const & item : user_items) {
+    EXPECT_EQ(balances.get(item.user_id, item.item_id), item.quantity) << item.user_id << " " << item.item_id;
+  }
+  // bidder: 100 deposited - 30 bid, 3 won and 1 withdrawn
+  EXPECT_EQ(balances.get(3, storage->funds_item_id()), 70);
+  EXPECT_EQ(balances.get(3, 2), 2);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+// Database file in the temp directory. Whatever a previous run left there is removed first, and the file together
+// with its WAL files is removed on destruction, so close the database before that
+struct TempDatabase {
+  std::string const path;
+
+  explicit TempDatabase(std::string_view name) : path((std::filesystem::temp_directory_path() / name).string()) {
+    remove();
+  }
+  ~TempDatabase() { remove(); }
+
+  TempDatabase(TempDatabase const &) = delete;
+  TempDatabase & operator=(TempDatabase const &) = delete;
+
+private:
+  void remove() const {
+    for (auto const * suffix : { "", "-wal", "-shm" }) {
+      std::error_code ec;  // nothing to remove is fine
+      std::filesystem::remove(path + suffix, ec);
+    }
+  }
+};
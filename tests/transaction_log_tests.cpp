@@ -0,0 +1,223 @@
+#include "transaction_log.hpp"
+#include "transaction_log_reader.hpp"
+#include "transaction_log_record.hpp"
+
+#include <fmt/format.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+std::filesystem::path temp_log_path(std::string_view name) {
+  auto const path = std::filesystem::temp_directory_path() / name;
+  std::filesystem::remove(path);
+  return path;
+}
+
+std::vector<std::string> read_lines(std::filesystem::path const & path) {
+  std::vector<std::string> lines;
+  std::ifstream file(path);
+  for (std::string line; std::getline(file, line);) {
+    lines.push_back(std::move(line));
+  }
+  return lines;
+}
+}  // namespace
+
+TEST(TransactionLog, entries_from_many_threads) {
+  auto const path = temp_log_path("auction_house_transaction_log_test.log");
+  int constexpr kThreads = 4;
+  int constexpr kEntriesPerThread = 10000;
+  {
+    // Small queue, so producers have to wait for the writer
+    auto log = TransactionLog::open(path.string(), { .queue_capacity = 16 });
+    ASSERT_TRUE(log) << log.error();
+
+    std::vector<std::thread> threads;
+    for (int user_id = 1; user_id <= kThreads; ++user_id) {
+      threads.emplace_back([&log, user_id]() {
+        for (int i = 0; i < kEntriesPerThread; ++i) {
+          log->save(LogRecord{ .kind = LogRecord::Kind::Deposited, .user_id = user_id, .item_id = 1, .quantity = i });
+        }
+      });
+    }
+    for (auto & thread : threads) {
+      thread.join();
+    }
+    log->save(LogRecord{ .kind = LogRecord::Kind::SellOrderExecuted,
+                         .seq = 8,
+                         .user_id = 1,
+                         .buyer_id = 2,
+                         .item_id = 3,
+                         .quantity = 4,
+                         .price = 5,
+                         .order_id = 7 });
+  }
+
+  auto const lines = read_lines(path);
+  ASSERT_EQ(lines.size(), kThreads * kEntriesPerThread + 2);
+  // Entries of each thread are written in the order they were saved
+  std::vector<int> next_quantity(kThreads + 1, 0);
+  for (std::size_t i = 0; i < lines.size() - 2; ++i) {
+    int const user_id = lines[i][lines[i].find(".id=") + 4] - '0';
+    ASSERT_NE(lines[i].find(fmt::format("deposited .item_id=1 .quantity={}", next_quantity[user_id]++)),
+              std::string::npos)
+        << lines[i];
+  }
+  EXPECT_TRUE(lines[lines.size() - 2].starts_with("#8 "));
+  EXPECT_NE(lines[lines.size() - 2].find("user{.id=1} sold .item_id=3 .quantity=4 .price=5 .order_id=7"),
+            std::string::npos);
+  EXPECT_NE(lines[lines.size() - 1].find("user{.id=2} bought .item_id=3 .quantity=4 .price=5 .order_id=7"),
+            std::string::npos);
+  // The sequence continues from the last numbered line
+  auto log = TransactionLog::open(path.string());
+  ASSERT_TRUE(log) << log.error();
+  EXPECT_EQ(log->last_seq(), 8);
+}
+
+TEST(TransactionLog, dropped_entries_are_counted) {
+  auto const path = temp_log_path("auction_house_transaction_log_drop_test.log");
+  int constexpr kEntries = 100000;
+  {
+    auto log = TransactionLog::open(
+        path.string(), { .durability = LogDurability::None, .overflow = LogOverflowPolicy::Drop, .queue_capacity = 2 });
+    ASSERT_TRUE(log) << log.error();
+    for (int i = 0; i < kEntries; ++i) {
+      log->save(LogRecord{ .kind = LogRecord::Kind::Withdrawn,
+                           .seq = static_cast<uint64_t>(i) + 1,
+                           .user_id = 1,
+                           .item_id = 1,
+                           .quantity = i });
+    }
+  }
+
+  int written = 0;
+  int dropped = 0;
+  for (auto const & line : read_lines(path)) {
+    if (line.find("withdrawn") != std::string::npos) {
+      written++;
+    } else {
+      dropped += std::stoi(line.substr(line.find(": ") + 2));
+    }
+  }
+  EXPECT_EQ(written + dropped, kEntries);
+}
+
+TEST(TransactionLog, binary_format) {
+  auto const path = temp_log_path("auction_house_transaction_log_binary_test.log");
+  // Reopening appends records after the existing ones
+  for (int i = 0; i < 2; ++i) {
+    auto log = TransactionLog::open(path.string(), { .format = LogFormat::Binary });
+    ASSERT_TRUE(log) << log.error();
+    EXPECT_EQ(log->last_seq(), 2 * i);
+    log->save(LogRecord{ .kind = LogRecord::Kind::PayedFee,
+                         .seq = 2 * static_cast<uint64_t>(i) + 1,
+                         .unix_time_ms = 1'700'000'000'000,
+                         .user_id = 1,
+                         .item_id = 2,
+                         .quantity = -3 });
+    log->save(LogRecord{ .kind = LogRecord::Kind::SellOrderExecuted,
+                         .seq = 2 * static_cast<uint64_t>(i) + 2,
+                         .user_id = 1,
+                         .buyer_id = 2,
+                         .item_id = 3,
+                         .quantity = 4,
+                         .price = 1'000'000'000,
+                         .order_id = 7 });
+  }
+  // Text records can't be appended to the binary log
+  EXPECT_FALSE(TransactionLog::open(path.string(), { .format = LogFormat::Text }));
+
+  std::ifstream file(path, std::ios::binary);
+  std::string const data{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+  ASSERT_EQ(data.size(), kBinaryLogHeader.size() + 4 * kBinaryLogRecordSize);
+  ASSERT_EQ(data.substr(0, kBinaryLogHeader.size()), kBinaryLogHeader);
+
+  for (int i = 0; i < 2; ++i) {
+    char const * records = data.data() + kBinaryLogHeader.size() + 2 * i * kBinaryLogRecordSize;
+    auto const fee = decode_record(records);
+    ASSERT_TRUE(fee);
+    EXPECT_EQ(fee->kind, LogRecord::Kind::PayedFee);
+    EXPECT_EQ(fee->seq, 2 * i + 1);
+    EXPECT_EQ(fee->user_id, 1);
+    EXPECT_EQ(fee->item_id, 2);
+    EXPECT_EQ(fee->quantity, -3);
+    EXPECT_EQ(fee->unix_time_ms, 1'700'000'000'000);
+
+    auto const sale = decode_record(records + kBinaryLogRecordSize);
+    ASSERT_TRUE(sale);
+    EXPECT_EQ(sale->kind, LogRecord::Kind::SellOrderExecuted);
+    EXPECT_EQ(sale->user_id, 1);
+    EXPECT_EQ(sale->buyer_id, 2);
+    EXPECT_EQ(sale->item_id, 3);
+    EXPECT_EQ(sale->quantity, 4);
+    EXPECT_EQ(sale->price, 1'000'000'000);
+    EXPECT_EQ(sale->order_id, 7);
+  }
+}
+
+TEST(TransactionLog, segments_and_reader) {
+  auto const path = temp_log_path("auction_house_transaction_log_segments_test.log");
+  for (auto const & [number, segment_path] : list_log_segments(path.string())) {
+    std::filesystem::remove(segment_path);
+    std::filesystem::remove(segment_path + ".idx");
+  }
+
+  int constexpr kRecords = 20000;
+  int64_t constexpr kStartMs = 1'700'000'000'000;
+  // Each record is 1ms later than the previous one
+  int64_t constexpr kBoundaryMs = kStartMs + kRecords - 100;
+  {
+    // ~1000 records per segment
+    auto log = TransactionLog::open(path.string(),
+                                    { .format = LogFormat::Binary, .segment_size = 1000 * kBinaryLogRecordSize });
+    ASSERT_TRUE(log) << log.error();
+    for (int i = 0; i < kRecords; ++i) {
+      // user 42 appears only at the very end
+      UserId const user_id = i < kRecords - 100 ? i % 10 : 42;
+      log->save(LogRecord{ .kind = LogRecord::Kind::Deposited,
+                           .seq = static_cast<uint64_t>(i) + 1,
+                           .unix_time_ms = kStartMs + i,
+                           .user_id = user_id,
+                           .item_id = 1,
+                           .quantity = i });
+    }
+  }
+  auto const segments = list_log_segments(path.string());
+  ASSERT_GE(segments.size(), 15);
+  for (auto const & [number, segment_path] : segments) {
+    EXPECT_TRUE(std::filesystem::exists(segment_path + ".idx")) << segment_path;
+  }
+
+  auto reader = TransactionLogReader::open(path.string());
+  ASSERT_TRUE(reader) << reader.error();
+
+  // Everything is there, in order
+  int next_quantity = 0;
+  auto const decoded_all = reader->read({}, [&](LogRecord const & record) {
+    EXPECT_EQ(record.quantity, next_quantity++);
+  });
+  ASSERT_TRUE(decoded_all) << decoded_all.error();
+  EXPECT_EQ(next_quantity, kRecords);
+
+  // Only blocks with the user are read
+  int user_records = 0;
+  auto const decoded_for_user =
+      reader->read({ .user_id = 42 }, [&](LogRecord const & record) { user_records += record.user_id == 42; });
+  ASSERT_TRUE(decoded_for_user) << decoded_for_user.error();
+  EXPECT_EQ(user_records, 100);
+  EXPECT_LT(*decoded_for_user, 2 * 1000);
+
+  // Only blocks in the time range are read
+  int records_in_range = 0;
+  auto const decoded_in_range =
+      reader->read({ .from_unix_time_ms = kBoundaryMs }, [&](LogRecord const &) { records_in_range++; });
+  ASSERT_TRUE(decoded_in_range) << decoded_in_range.error();
+  EXPECT_EQ(records_in_range, 100);
+  EXPECT_LT(*decoded_in_range, 2 * 1000);
+}
@@ -0,0 +1,90 @@
+#include "socket_pair.hpp"
+#include "write_queue.hpp"
+
+#include <asio/co_spawn.hpp>
+#include <asio/detached.hpp>
+#include <asio/io_context.hpp>
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+
+namespace {
+class WriteQueueTest : public ::testing::Test {
+protected:
+  asio::io_context context;
+  SocketPair sockets{ context };
+
+  std::string receive(std::size_t size) { return sockets.receive(context, size); }
+};
+}  // namespace
+
+TEST_F(WriteQueueTest, messages_arrive_in_order) {
+  auto queue = std::make_shared<WriteQueue>(std::move(sockets.server), 1024);
+  // Queued before the first write starts, so they are sent together
+  queue->push("first\n");
+  queue->push("");
+  queue->push("second\n");
+  queue->push("third\n");
+  EXPECT_EQ(receive(19), "first\nsecond\nthird\n");
+
+  // And the ones queued after it are sent as well
+  queue->push("fourth\n");
+  EXPECT_EQ(receive(7), "fourth\n");
+}
+
+TEST_F(WriteQueueTest, waits_for_space_until_the_peer_reads) {
+  std::size_t const high_water_mark = 1024;
+  auto queue = std::make_shared<WriteQueue>(std::move(sockets.server), high_water_mark);
+
+  // Much more than the socket buffers can take, so most of it stays in the queue until the client reads it
+  std::size_t const chunk_size = 64 * 1024;
+  std::size_t const chunks = 256;
+  for (std::size_t i = 0; i < chunks; ++i) {
+    queue->push(std::string(chunk_size, static_cast<char>('a' + i % 26)));
+  }
+
+  bool has_space = false;
+  asio::co_spawn(
+      context,
+      [&]() -> asio::awaitable<void> {
+        co_await queue->wait_for_space();
+        has_space = true;
+      },
+      asio::detached);
+  context.run_for(std::chrono::milliseconds(100));
+  EXPECT_FALSE(has_space);
+
+  // Chunks arrive whole and in the order they were queued
+  for (std::size_t i = 0; i < chunks; ++i) {
+    ASSERT_EQ(receive(chunk_size), std::string(chunk_size, static_cast<char>('a' + i % 26))) << "chunk " << i;
+  }
+  context.run_for(std::chrono::milliseconds(100));
+  EXPECT_TRUE(has_space);
+}
+
+TEST_F(WriteQueueTest, wait_for_space_throws_once_the_connection_is_broken) {
+  auto queue = std::make_shared<WriteQueue>(std::move(sockets.server), 0);
+  sockets.client.close();
+
+  bool thrown = false;
+  asio::co_spawn(
+      context,
+      [&]() -> asio::awaitable<void> {
+        try {
+          // Writes fail sooner or later, as nobody reads them
+          for (int i = 0; i < 1000; ++i) {
+            queue->push(std::string(64 * 1024, 'x'));
+            co_await queue->wait_for_space();
+          }
+        } catch (std::exception &) {
+          thrown = true;
+        }
+      },
+      asio::detached);
+  context.run_for(std::chrono::seconds(5));
+  EXPECT_TRUE(thrown);
+}